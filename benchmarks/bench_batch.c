@@ -0,0 +1,116 @@
+#include <time.h>
+#include "../libs/batch.h"
+
+/*
+    Batched register benchmark.
+
+    Runs a parameter sweep of a small hardware efficient ansatz, layers of
+    RY on every qubit with one angle per sweep point followed by a CNOT
+    ladder, once as a loop over separate registers and once as a single
+    batch. Reports both times and the largest difference of <Z0> between
+    the two.
+
+    Build: gcc -O2 -o bench_batch benchmarks/bench_batch.c -lm
+    Usage: ./bench_batch [qubits] [batch] [layers]
+*/
+
+double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+double angle(size_t b, int layer, int q)
+{
+    return 0.001 * b + 0.1 * layer + 0.05 * q;
+}
+
+void ansatz_qreg(qreg *reg, size_t b, int layers)
+{
+    int n = reg->size;
+    for (int l=0; l<layers; l++)
+    {
+        for (int q=0; q<n; q++)
+        {
+            RY(reg, &q, 1, angle(b, l, q));
+        }
+        for (int q=0; q<n-1; q++)
+        {
+            int t = q + 1;
+            CNOT(reg, q, &t, 1);
+        }
+    }
+}
+
+void ansatz_batch(qreg_batch *batch, int layers)
+{
+    int n = batch->size;
+    double *theta = (double*) malloc(batch->count * sizeof(double));
+
+    for (int l=0; l<layers; l++)
+    {
+        for (int q=0; q<n; q++)
+        {
+            for (size_t b=0; b<batch->count; b++)
+            {
+                theta[b] = angle(b, l, q);
+            }
+            batch_RY(batch, q, theta);
+        }
+        for (int q=0; q<n-1; q++)
+        {
+            batch_CNOT(batch, q, q + 1);
+        }
+    }
+    free(theta);
+}
+
+int main(int argc, char *argv[])
+{
+    int n = argc > 1 ? atoi(argv[1]) : 12;
+    size_t count = argc > 2 ? atol(argv[2]) : 1024;
+    int layers = argc > 3 ? atoi(argv[3]) : 4;
+    double *z_loop = (double*) malloc(count * sizeof(double));
+    double *z_batch = (double*) malloc(count * sizeof(double));
+
+    double start = now_seconds();
+    for (size_t b=0; b<count; b++)
+    {
+        qreg *reg = initQuRegister(n);
+        set_recording(reg, false);
+        ansatz_qreg(reg, b, layers);
+
+        z_loop[b] = 0;
+        for (size_t i=0; i<reg_states(reg); i++)
+        {
+            double p = cabs(reg->matrix[i]) * cabs(reg->matrix[i]);
+            z_loop[b] += (i & 1) ? -p : p;
+        }
+        free_qreg(reg);
+    }
+    double loop = now_seconds() - start;
+
+    start = now_seconds();
+    qreg_batch *batch = initBatchRegister(n, count);
+    ansatz_batch(batch, layers);
+    batch_expectation_z(batch, 0, z_batch);
+    double batched = now_seconds() - start;
+
+    double diff = 0;
+    for (size_t b=0; b<count; b++)
+    {
+        diff = fmax(diff, fabs(z_loop[b] - z_batch[b]));
+    }
+
+    printf("%d qubits, %zu sweep points, %d layers (%s)\n", n, count, layers, soa_isa_name());
+    printf("%-10s%12s%16s\n", "run", "time (s)", "points/s");
+    printf("%-10s%12.4f%16.0f\n", "loop", loop, count / loop);
+    printf("%-10s%12.4f%16.0f\n", "batch", batched, count / batched);
+    printf("speedup %.1fx, max |<Z0> difference| %.2e\n", loop / batched, diff);
+
+    free_batch(batch);
+    free(z_loop);
+    free(z_batch);
+    return 0;
+}
@@ -0,0 +1,91 @@
+#include <time.h>
+#include "../libs/fusion.h"
+
+/*
+    Cache blocked flush benchmark.
+
+    Runs a long layered circuit gate by gate, deferred without blocking
+    (tile as wide as the register) and deferred with tiles of 2^tile
+    amplitudes, reporting full sweeps over the state vector, run time and
+    the largest amplitude difference from the gate by gate run.
+
+    The saving is in memory traffic, so build with vectorized kernels (or
+    -fopenmp on several cores), otherwise the arithmetic hides it.
+
+    Build: gcc -O3 -march=native -o bench_blocking benchmarks/bench_blocking.c -lm
+    Usage: ./bench_blocking [qubits] [tile] [layers]
+*/
+
+double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+    Rotation layers with a CNOT ladder in between, touching every qubit
+    including the ones above the tile.
+*/
+void layered_circuit(qreg *reg, int layers)
+{
+    int n = reg->size;
+
+    for (int layer=0; layer<layers; layer++)
+    {
+        for (int q=0; q<n; q++)
+        {
+            int idx[] = {q};
+            RY(reg, idx, 1, 0.1 * (q + layer));
+            H(reg, idx, 1);
+            RZ(reg, idx, 1, 0.2 * (q + layer));
+        }
+        for (int q=layer % 2; q<n-1; q+=2)
+        {
+            int idx[] = {q + 1};
+            CNOT(reg, q, idx, 1);
+        }
+    }
+}
+
+void report(const char *name, unsigned int passes, double seconds, double diff)
+{
+    printf("%-14s%10u%12.4f%12.2e\n", name, passes, seconds, diff);
+}
+
+int main(int argc, char **argv)
+{
+    int n = argc > 1 ? atoi(argv[1]) : 24;
+    int tile = argc > 2 ? atoi(argv[2]) : TILE_QUBITS;
+    int layers = argc > 3 ? atoi(argv[3]) : 10;
+
+    printf("%d qubits, tile of %d qubits, %d layers\n", n, tile, layers);
+    printf("%-14s%10s%12s%12s\n", "mode", "passes", "seconds", "max diff");
+
+    qreg *immediate = initQuRegister(n);
+    double start = now_seconds();
+    layered_circuit(immediate, layers);
+    report("immediate", history_count(immediate), now_seconds() - start, 0);
+
+    for (int blocked=0; blocked<2; blocked++)
+    {
+        qreg *reg = initQuRegister(n);
+        set_deferred(reg, true);
+        set_tile_qubits(reg, blocked ? tile : n);
+        layered_circuit(reg, layers);
+
+        start = now_seconds();
+        fusion_stats stats = flush_operations(reg);
+        double elapsed = now_seconds() - start;
+
+        double diff = 0;
+        for (size_t i = 0; i < reg_states(reg); i++)
+        {
+            diff = fmax(diff, cabs(get_amplitude(reg, i) - get_amplitude(immediate, i)));
+        }
+        report(blocked ? "blocked" : "fused", stats.passes_after, elapsed, diff);
+        free_qreg(reg);
+    }
+    free_qreg(immediate);
+    return 0;
+}
@@ -0,0 +1,102 @@
+#include <time.h>
+#include "../libs/checkpoint.h"
+
+/*
+    Checkpoint benchmark.
+
+    Runs layers of rotations and CNOTs on a register mapped to a state file,
+    checkpointing after every layer, then compares with save_state of a heap
+    register and with restoring the mapped file.
+
+    Build: gcc -O2 -o bench_checkpoint benchmarks/bench_checkpoint.c -lm
+    Usage: ./bench_checkpoint [qubits] [directory]
+*/
+
+double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void layer(qreg *reg, int l)
+{
+    int n = reg->size;
+    for (int q=0; q<n; q++)
+    {
+        RY(reg, &q, 1, 0.1 * (q + l) + 0.3);
+    }
+    for (int q=0; q+1<n; q++)
+    {
+        int t = q + 1;
+        CNOT(reg, q, &t, 1);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int n = argc > 1 ? atoi(argv[1]) : 24;
+    const char *dir = argc > 2 ? argv[2] : ".";
+    char mapped_path[4096], heap_path[4096];
+    snprintf(mapped_path, sizeof(mapped_path), "%s/bench_mapped.qst", dir);
+    snprintf(heap_path, sizeof(heap_path), "%s/bench_heap.qst", dir);
+
+    double mb = ((size_t)1 << n) * sizeof(amplitude) / 1048576.0;
+    printf("%d qubits, %.0f MB of amplitudes\n", n, mb);
+    printf("%-22s%12s%12s\n", "step", "time (s)", "MB/s");
+
+    qreg *mapped = initMappedRegister(n, mapped_path);
+    qreg *heap = initQuRegister(n);
+    if (mapped == NULL || heap == NULL)
+    {
+        return 1;
+    }
+    set_recording(mapped, false);
+    set_recording(heap, false);
+
+    double gates = 0, heap_gates = 0, sync = 0, save = 0;
+    for (int l=0; l<4; l++)
+    {
+        double start = now_seconds();
+        layer(mapped, l);
+        gates += now_seconds() - start;
+
+        start = now_seconds();
+        checkpoint(mapped);
+        sync += now_seconds() - start;
+
+        start = now_seconds();
+        layer(heap, l);
+        heap_gates += now_seconds() - start;
+
+        start = now_seconds();
+        save_state(heap, heap_path);
+        save += now_seconds() - start;
+    }
+    printf("%-22s%12.4f%12s\n", "layer (heap)", heap_gates / 4, "-");
+    printf("%-22s%12.4f%12s\n", "layer (mapped)", gates / 4, "-");
+    printf("%-22s%12.4f%12.0f\n", "checkpoint (msync)", sync / 4, mb * 4 / sync);
+    printf("%-22s%12.4f%12.0f\n", "save_state (write)", save / 4, mb * 4 / save);
+    free_qreg(mapped);
+
+    double start = now_seconds();
+    qreg *restored = restore_register(mapped_path);
+    double restore = now_seconds() - start;
+    printf("%-22s%12.6f%12s\n", "restore (mmap)", restore, "-");
+
+    //Touch every page, which is when a mapped restore actually reads.
+    start = now_seconds();
+    double total = 0;
+    for (size_t i=0; i<reg_states(restored); i++)
+    {
+        total += AMP_RE(restored->matrix[i]) * AMP_RE(restored->matrix[i]) + AMP_IM(restored->matrix[i]) * AMP_IM(restored->matrix[i]);
+    }
+    double first_read = now_seconds() - start;
+    printf("%-22s%12.4f%12.0f   (norm %.6f)\n", "first read", first_read, mb / first_read, total);
+
+    free_qreg(restored);
+    free_qreg(heap);
+    remove(mapped_path);
+    remove(heap_path);
+    return 0;
+}
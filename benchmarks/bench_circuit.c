@@ -0,0 +1,93 @@
+#include <time.h>
+#include "../libs/fusion.h"
+
+/*
+    Circuit file benchmark.
+
+    Records a random circuit of the given number of gates on a deferred
+    register, writes it with save_circuit, maps it back with load_circuit
+    and replays it onto a second deferred register, so only encoding and
+    decoding are timed and no amplitudes are touched.
+
+    Build: gcc -O2 -o bench_circuit benchmarks/bench_circuit.c -lm
+    Usage: ./bench_circuit [gates] [file]
+*/
+
+double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+    Mix of fixed, parametrized, two qubit and controlled gates.
+*/
+void random_circuit(qreg *reg, long gates)
+{
+    int n = reg->size;
+    srand(1);
+
+    for (long g=0; g<gates; g++)
+    {
+        int q = rand() % n;
+        int r = (q + 1 + rand() % (n - 1)) % n;
+
+        switch (g % 8)
+        {
+            case 0: H(reg, &q, 1); break;
+            case 1: CNOT(reg, q, &r, 1); break;
+            case 2: RZ(reg, &q, 1, 0.001 * g); break;
+            case 3: T(reg, &q, 1); break;
+            case 4: CP(reg, q, &r, 1, 0.25); break;
+            case 5: U3(reg, &q, 1, 0.1, 0.2, 0.3); break;
+            case 6: X(reg, &q, 1); break;
+            default: SWAP(reg, q, r); break;
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    long gates = argc > 1 ? atol(argv[1]) : 10000000;
+    const char *path = argc > 2 ? argv[2] : "bench_circuit.qsc";
+    int n = 24;
+
+    qreg *source = initSparseRegister(n);
+    set_deferred(source, true);
+    random_circuit(source, gates);
+
+    double start = now_seconds();
+    if (!save_circuit(source, path))
+    {
+        return 1;
+    }
+    double save = now_seconds() - start;
+
+    start = now_seconds();
+    circuit_file *circuit = load_circuit(path);
+    if (circuit == NULL)
+    {
+        return 1;
+    }
+    double load = now_seconds() - start;
+
+    qreg *target = initSparseRegister(n);
+    set_deferred(target, true);
+    start = now_seconds();
+    bool ok = replay_circuit(target, circuit);
+    double replay = now_seconds() - start;
+
+    printf("%ld gates, %zu bytes (%.2f per gate)\n", gates, circuit->length, (double)circuit->length / gates);
+    printf("%-10s%12s%16s\n", "step", "time (s)", "Mgates/s");
+    printf("%-10s%12.4f%16.1f\n", "save", save, gates / save * 1e-6);
+    printf("%-10s%12.6f%16s\n", "load", load, "-");
+    printf("%-10s%12.4f%16.1f\n", "replay", replay, gates / replay * 1e-6);
+    printf("replayed %u operations%s\n", history_count(target), ok ? "" : " (failed)");
+
+    free_circuit(circuit);
+    free_qreg(source);
+    free_qreg(target);
+    remove(path);
+    return 0;
+}
@@ -0,0 +1,88 @@
+#include <time.h>
+#include "../libs/density.h"
+
+/*
+    Density matrix benchmark.
+
+    Runs a layered circuit (H, RZ and a CNOT chain per layer) with
+    depolarizing noise and amplitude damping after every gate, exactly with
+    run_density and sampled with run_trajectories. Reports both times and
+    the largest difference between the exact probabilities and the sampled
+    frequencies.
+
+    Build: gcc -O2 -fopenmp -o bench_density benchmarks/bench_density.c -lm
+    Usage: ./bench_density [qubits] [layers] [trajectories]
+*/
+
+double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char *argv[])
+{
+    int n = argc > 1 ? atoi(argv[1]) : 10;
+    int layers = argc > 2 ? atoi(argv[2]) : 5;
+    unsigned long trajectories = argc > 3 ? atol(argv[3]) : 10000;
+    size_t states = (size_t)1 << n;
+
+    qreg *circuit = initSparseRegister(n);
+    set_deferred(circuit, true);
+    for (int l=0; l<layers; l++)
+    {
+        for (int q=0; q<n; q++)
+        {
+            H(circuit, &q, 1);
+            RZ(circuit, &q, 1, 0.1 * (l + 1) * (q + 1));
+        }
+        for (int q=0; q<n-1; q++)
+        {
+            int t = q + 1;
+            CNOT(circuit, q, &t, 1);
+        }
+    }
+
+    noise_model noise = {0};
+    noise.depolarizing = 1e-3;
+    noise.amplitude_damping = 1e-3;
+
+    double start = now_seconds();
+    qdensity *dm = run_density(circuit, &noise);
+    if (dm == NULL)
+    {
+        return 1;
+    }
+    double exact = now_seconds() - start;
+    double *p = (double*) malloc(states * sizeof(double));
+    density_probabilities(dm, 0, p);
+
+    unsigned long long *outcomes = (unsigned long long*) malloc(trajectories * sizeof(unsigned long long));
+    start = now_seconds();
+    run_trajectories(circuit, &noise, trajectories, 1, outcomes);
+    double sampled = now_seconds() - start;
+
+    double *freq = (double*) calloc(states, sizeof(double));
+    for (unsigned long t=0; t<trajectories; t++)
+    {
+        freq[outcomes[t]] += 1.0 / trajectories;
+    }
+    double diff = 0;
+    for (size_t i=0; i<states; i++)
+    {
+        diff = fmax(diff, fabs(freq[i] - p[i]));
+    }
+
+    printf("%d qubits, %u gates, purity %.4f\n", n, history_count(circuit), density_purity(dm));
+    printf("%-14s%12s%20s\n", "method", "time (s)", "max |p - exact|");
+    printf("%-14s%12.3f%20s\n", "density", exact, "0");
+    printf("%-14s%12.3f%20.2e\n", "trajectories", sampled, diff);
+
+    free_density(dm);
+    free_qreg(circuit);
+    free(p);
+    free(freq);
+    free(outcomes);
+    return 0;
+}
@@ -0,0 +1,144 @@
+#include <time.h>
+#include "../libs/diagonal.h"
+
+/*
+    Diagonal gate benchmark.
+
+    A QAOA cost layer (RZZ on every edge of a ring plus random chords, RZ on
+    every qubit) is applied gate by gate, each RZZ as a CP between two RZ,
+    and as one diag_accumulator sweep. A Grover oracle marking one basis
+    state is applied as an X sandwiched multi-controlled Z and with
+    phase_oracle. Z on every qubit compares one call on all targets with
+    one call per target.
+
+    Build: gcc -O2 -fopenmp -o bench_diagonal benchmarks/bench_diagonal.c -lm
+    Usage: ./bench_diagonal [qubits] [edges] [repetitions]
+*/
+
+double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+bool marked(unsigned long long index, void *context)
+{
+    return index == *(unsigned long long*) context;
+}
+
+void report(const char *name, double gates, double sweep, int gate_passes)
+{
+    printf("%-14s%12.4f%12.4f%10.1fx%10d\n", name, gates, sweep, gates / sweep, gate_passes);
+}
+
+int main(int argc, char *argv[])
+{
+    int n = argc > 1 ? atoi(argv[1]) : 22;
+    int edges = argc > 2 ? atoi(argv[2]) : 2 * n;
+    int reps = argc > 3 ? atoi(argv[3]) : 3;
+    double gamma = 0.4;
+
+    qreg *reg = initQuRegister(n);
+    set_recording(reg, false);
+    int all[64];
+    for (int q = 0; q < n; q++)
+    {
+        all[q] = q;
+    }
+    H(reg, all, n);
+
+    int *first = (int*) malloc(edges * sizeof(int));
+    int *second = (int*) malloc(edges * sizeof(int));
+    srand(1);
+    for (int e = 0; e < edges; e++)
+    {
+        first[e] = e < n ? e : rand() % n;
+        second[e] = e < n ? (e + 1) % n : (first[e] + 1 + rand() % (n - 1)) % n;
+    }
+
+    printf("%d qubits, %d edges, seconds per layer\n", n, edges);
+    printf("%-14s%12s%12s%11s%10s\n", "layer", "gates", "one sweep", "speedup", "passes");
+
+    //QAOA cost layer, RZZ(g) = CP(-2g) RZ(g) RZ(g) up to a global phase.
+    double start = now_seconds();
+    for (int r = 0; r < reps; r++)
+    {
+        for (int e = 0; e < edges; e++)
+        {
+            int a = first[e], b = second[e];
+            RZ(reg, &a, 1, gamma);
+            RZ(reg, &b, 1, gamma);
+            CP(reg, a, &b, 1, -2 * gamma);
+        }
+        RZ(reg, all, n, gamma);
+    }
+    double gates = (now_seconds() - start) / reps;
+
+    diag_accumulator *acc = new_diagonal(n);
+    for (int e = 0; e < edges; e++)
+    {
+        diagonal_RZZ(acc, first[e], second[e], gamma);
+    }
+    for (int q = 0; q < n; q++)
+    {
+        diagonal_RZ(acc, q, gamma);
+    }
+    start = now_seconds();
+    for (int r = 0; r < reps; r++)
+    {
+        apply_diagonal(reg, acc);
+    }
+    report("QAOA cost", gates, (now_seconds() - start) / reps, 3 * edges + 1);
+
+    //Grover oracle marking the index with every other bit set.
+    unsigned long long target = 0;
+    int zeros[64], count = 0;
+    for (int q = 0; q < n; q++)
+    {
+        if (q % 2)
+        {
+            target |= 1ULL << q;
+        }
+        else
+        {
+            zeros[count++] = q;
+        }
+    }
+    start = now_seconds();
+    for (int r = 0; r < reps; r++)
+    {
+        X(reg, zeros, count);
+        MCZ(reg, all, n - 1, n - 1);
+        X(reg, zeros, count);
+    }
+    gates = (now_seconds() - start) / reps;
+    start = now_seconds();
+    for (int r = 0; r < reps; r++)
+    {
+        phase_oracle(reg, marked, &target);
+    }
+    report("Grover oracle", gates, (now_seconds() - start) / reps, 2 * count + 1);
+
+    start = now_seconds();
+    for (int r = 0; r < reps; r++)
+    {
+        for (int q = 0; q < n; q++)
+        {
+            Z(reg, &all[q], 1);
+        }
+    }
+    gates = (now_seconds() - start) / reps;
+    start = now_seconds();
+    for (int r = 0; r < reps; r++)
+    {
+        Z(reg, all, n);
+    }
+    report("Z layer", gates, (now_seconds() - start) / reps, n);
+
+    free_diagonal(acc);
+    free_qreg(reg);
+    free(first);
+    free(second);
+    return 0;
+}
@@ -0,0 +1,93 @@
+#include <time.h>
+#include "../libs/distributed.h"
+
+/*
+    Distributed register benchmark.
+
+    Runs a layered circuit (H, RX and RZ on every qubit and a CNOT chain per
+    layer) on a single register and on a register split over a number of
+    ranks on this machine. Gates on the top qubits are global in the
+    distributed run, so the report shows how many remaps they took and the
+    bytes moved between ranks. The gathered state is checked against the
+    single register.
+
+    Build: gcc -O2 -fopenmp -o bench_distributed benchmarks/bench_distributed.c -lm
+    Usage: ./bench_distributed [qubits] [ranks] [layers]
+*/
+
+double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char *argv[])
+{
+    int n = argc > 1 ? atoi(argv[1]) : 22;
+    int procs = argc > 2 ? atoi(argv[2]) : 4;
+    int layers = argc > 3 ? atoi(argv[3]) : 4;
+
+    qreg *circuit = initQuRegister(n);
+    for (int l = 0; l < layers; l++)
+    {
+        for (int q = 0; q < n; q++)
+        {
+            H(circuit, &q, 1);
+            RX(circuit, &q, 1, 0.1 * (q + l));
+            RZ(circuit, &q, 1, 0.3 * (q + 1));
+        }
+        for (int q = 0; q + 1 < n; q++)
+        {
+            int t = q + 1;
+            CNOT(circuit, q, &t, 1);
+        }
+    }
+
+    //The single register reruns the history so that both times cover the same gates.
+    qreg *single = initQuRegister(n);
+    set_recording(single, false);
+    double start = now_seconds();
+    for (unsigned int i = 0; i < circuit->history_size; i++)
+    {
+        execute_indexed(single, &circuit->history[i], op_indexes(circuit, &circuit->history[i]));
+    }
+    double single_time = now_seconds() - start;
+
+    dist_reg *reg = initDistRegister(n, procs);
+    if (reg == NULL)
+    {
+        return 1;
+    }
+    start = now_seconds();
+    run_distributed(reg, circuit);
+    dist_allreduce(reg, 0);
+    double dist_time = now_seconds() - start;
+    unsigned long long bytes = dist_comm_bytes(reg);
+    double remaps = dist_allreduce(reg, reg->remaps) / procs;
+
+    amplitude *state = reg->rank == 0 ? (amplitude*) malloc(((size_t)1 << n) * sizeof(amplitude)) : NULL;
+    dist_gather(reg, state);
+    if (reg->rank == 0)
+    {
+        double err = 0;
+        for (size_t i = 0; i < ((size_t)1 << n); i++)
+        {
+            err = fmax(err, cabs(state[i] - single->matrix[i]));
+        }
+
+        printf("%d qubits on %d ranks, %u gates\n", n, procs, circuit->history_size);
+        printf("%-14s%12s\n", "register", "time (s)");
+        printf("%-14s%12.3f\n", "single", single_time);
+        printf("%-14s%12.3f\n", "distributed", dist_time);
+        printf("remaps %.0f, %.1f MB sent in total, %.2f MB per remap and rank\n",
+            remaps, bytes / 1e6, remaps > 0 ? bytes / 1e6 / remaps / procs : 0);
+        printf("largest difference %.2e\n", err);
+        free(state);
+    }
+
+    free_qreg(single);
+    free_qreg(circuit);
+    free_dist_reg(reg);
+    return 0;
+}
@@ -0,0 +1,115 @@
+#include <time.h>
+#include "../libs/fusion.h"
+
+/*
+    Gate fusion benchmark.
+
+    Runs each circuit once gate by gate and once deferred with fusion widths
+    1 to FUSION_MAX_QUBITS, reporting the sweeps over the state vector saved
+    by flush_operations, the resulting run time and the largest amplitude
+    difference from the gate by gate run.
+
+    Build: gcc -O2 -o bench_fusion benchmarks/bench_fusion.c -lm
+           (add -DFUSION_PASS_COST=4 to see dense blocks on a single core)
+    Usage: ./bench_fusion [qubits]
+*/
+
+double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+    The Deutsch-Jozsa circuit of examples/deutsch-josza.c widened to n qubits.
+*/
+void deutsch_jozsa(qreg *reg)
+{
+    int n = reg->size;
+    int inputs[n], balanced[n];
+    int out[] = {n - 1};
+    int all[n];
+
+    for (int q=0; q<n; q++)
+    {
+        all[q] = q;
+        inputs[q] = q;
+        balanced[q / 2] = q;
+    }
+
+    X(reg, out, 1);
+    H(reg, all, n);
+    X(reg, balanced, (n - 1) / 2);
+    CNOT(reg, n - 1, inputs, n - 1);
+    X(reg, balanced, (n - 1) / 2);
+    H(reg, all, n);
+}
+
+/*
+    Layers of single qubit rotations followed by a CNOT ladder.
+*/
+void rotation_layers(qreg *reg)
+{
+    int n = reg->size;
+
+    for (int layer=0; layer<4; layer++)
+    {
+        for (int q=0; q<n; q++)
+        {
+            int idx[] = {q};
+            RY(reg, idx, 1, 0.1 * (q + layer));
+            RZ(reg, idx, 1, 0.2 * (q + layer));
+        }
+        for (int q=0; q<n-1; q++)
+        {
+            int idx[] = {q + 1};
+            CNOT(reg, q, idx, 1);
+        }
+    }
+}
+
+void bench(const char *name, void (*circuit)(qreg*), int n)
+{
+    qreg *reg = initQuRegister(n);
+    double start = now_seconds();
+    circuit(reg);
+    double immediate = now_seconds() - start;
+
+    printf("%s, %d qubits\n", name, n);
+    printf("%-10s%10s%10s%10s%12s%12s\n", "fusion", "gates", "passes", "saved", "seconds", "max diff");
+    printf("%-10s%10s%10s%10s%12.4f%12s\n", "none", "-", "-", "-", immediate, "0");
+
+    for (int k=1; k<=FUSION_MAX_QUBITS; k++)
+    {
+        qreg *deferred = initQuRegister(n);
+        set_deferred(deferred, true);
+        set_fusion_qubits(deferred, k);
+        circuit(deferred);
+
+        start = now_seconds();
+        fusion_stats stats = flush_operations(deferred);
+        double elapsed = now_seconds() - start;
+
+        double diff = 0;
+        for (size_t i = 0; i < reg_states(reg); i++)
+        {
+            diff = fmax(diff, cabs(get_amplitude(deferred, i) - get_amplitude(reg, i)));
+        }
+
+        printf("%-10d%10u%10u%10u%12.4f%12.2e\n", k, stats.gates, stats.passes_after,
+            stats.passes_before - stats.passes_after, elapsed, diff);
+        free_qreg(deferred);
+    }
+    printf("\n");
+    free_qreg(reg);
+}
+
+int main(int argc, char **argv)
+{
+    int n = argc > 1 ? atoi(argv[1]) : 20;
+
+    bench("Deutsch-Jozsa", deutsch_jozsa, n);
+    bench("Rotation layers", rotation_layers, n);
+    return 0;
+}
@@ -0,0 +1,81 @@
+#include <time.h>
+#include "../libs/operations.h"
+
+/*
+    Gate throughput benchmark.
+
+    For every register size in [min, max] each gate is applied once to every
+    qubit of the register (SWAP pairs each qubit with the one half a register
+    away, CNOT and Toffoli take the next qubits as controls) and the rate
+    is reported in gates per second.
+
+    Build: gcc -O2 -o bench_gates benchmarks/bench_gates.c -lm
+    Usage: ./bench_gates [min_qubits] [max_qubits]
+*/
+
+typedef enum { GATE_H, GATE_X, GATE_Y, GATE_Z, GATE_SWAP, GATE_CNOT, GATE_TOFFOLI } bench_gate;
+
+static const char *gate_names[] = {"H", "X", "Y", "Z", "SWAP", "CNOT", "Toffoli"};
+
+double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+double bench(qreg *reg, bench_gate gate)
+{
+    int n = reg->size;
+    double start = now_seconds();
+
+    for (int q=0; q<n; q++)
+    {
+        int idx[] = {q};
+        switch (gate)
+        {
+            case GATE_H: H(reg, idx, 1); break;
+            case GATE_X: X(reg, idx, 1); break;
+            case GATE_Y: Y(reg, idx, 1); break;
+            case GATE_Z: Z(reg, idx, 1); break;
+            case GATE_SWAP: SWAP(reg, q, (q + n/2) % n); break;
+            case GATE_CNOT: CNOT(reg, (q + 1) % n, idx, 1); break;
+            case GATE_TOFFOLI: Toffoli(reg, (q + 1) % n, (q + 2) % n, q); break;
+        }
+    }
+
+    return n / (now_seconds() - start);
+}
+
+int main(int argc, char **argv)
+{
+    int min = argc > 1 ? atoi(argv[1]) : 10;
+    int max = argc > 2 ? atoi(argv[2]) : 22;
+
+    printf("%-8s", "qubits");
+    for (int g=GATE_H; g<=GATE_TOFFOLI; g++)
+    {
+        printf("%14s", gate_names[g]);
+    }
+    printf("   (gates/sec)\n");
+
+    for (int n=min; n<=max; n++)
+    {
+        qreg *reg = initQuRegister(n);
+        double rates[GATE_TOFFOLI + 1];
+
+        for (int g=GATE_H; g<=GATE_TOFFOLI; g++)
+        {
+            rates[g] = bench(reg, g);
+        }
+
+        printf("%-8d", n);
+        for (int g=GATE_H; g<=GATE_TOFFOLI; g++)
+        {
+            printf("%14.1f", rates[g]);
+        }
+        printf("\n");
+    }
+
+    return 0;
+}
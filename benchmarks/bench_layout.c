@@ -0,0 +1,82 @@
+#include <time.h>
+#include "../libs/measure.h"
+
+/*
+    Qubit layout benchmark.
+
+    A brick of SWAPs between neighbouring qubits, the routing pattern of a
+    linear device, alternates with a rotation on qubit 0. The SWAPs run
+    once as kernel_swap passes over the state and once through SWAP, which
+    only relabels the qubits and moves the amplitudes in one bulk
+    permutation when the register is read at the end. Reports the seconds
+    per circuit and the largest amplitude difference.
+
+    Build: gcc -O2 -fopenmp -o bench_layout benchmarks/bench_layout.c -lm
+    Usage: ./bench_layout [qubits] [layers]
+*/
+
+double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void run_layers(qreg *reg, int layers, bool relabel)
+{
+    int n = reg->size;
+    for (int q = 0; q < n; q++)
+    {
+        RY(reg, &q, 1, 0.1 * (q + 1));
+    }
+    for (int l = 0; l < layers; l++)
+    {
+        int first = 0;
+        RY(reg, &first, 1, 0.1 * (l + 1));
+        for (int q = l % 2; q + 1 < n; q += 2)
+        {
+            if (relabel)
+            {
+                SWAP(reg, q, q + 1);
+            }
+            else
+            {
+                kernel_swap(reg, q, q + 1);
+            }
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int n = argc > 1 ? atoi(argv[1]) : 22;
+    int layers = argc > 2 ? atoi(argv[2]) : 10;
+
+    qreg *physical = initQuRegister(n), *relabeled = initQuRegister(n);
+    set_recording(physical, false);
+    set_recording(relabeled, false);
+
+    double start = now_seconds();
+    run_layers(physical, layers, false);
+    double moved = now_seconds() - start;
+
+    start = now_seconds();
+    run_layers(relabeled, layers, true);
+    settle_layout(relabeled);
+    double settled = now_seconds() - start;
+
+    double diff = 0;
+    for (size_t i = 0; i < reg_states(physical); i++)
+    {
+        diff = fmax(diff, cabs(get_amplitude(physical, i) - get_amplitude(relabeled, i)));
+    }
+
+    printf("%d qubits, %d layers, %d SWAPs\n", n, layers, layers * (n - 1) / 2);
+    printf("%-14s%12s%11s%14s\n", "SWAP as", "time (s)", "speedup", "max diff");
+    printf("%-14s%12.4f%10.1fx%14s\n", "kernel_swap", moved, 1.0, "0");
+    printf("%-14s%12.4f%10.1fx%14.2e\n", "relabel", settled, moved / settled, diff);
+
+    free_qreg(physical);
+    free_qreg(relabeled);
+    return 0;
+}
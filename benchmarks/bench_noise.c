@@ -0,0 +1,78 @@
+#include <time.h>
+#include "../libs/noise.h"
+
+/*
+    Noisy trajectory benchmark.
+
+    Runs trajectories of a layered circuit (H, RZ and a ring of CNOTs per
+    layer) under depolarizing noise, then under depolarizing noise with
+    amplitude damping, and reports the trajectory rate. Pauli errors are
+    fused into the circuit, amplitude damping flushes the register each time
+    it is applied.
+
+    Build: gcc -O2 -fopenmp -o bench_noise benchmarks/bench_noise.c -lm
+    Usage: ./bench_noise [qubits] [layers] [trajectories]
+*/
+
+double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void layered_circuit(qreg *reg, int layers)
+{
+    int n = reg->size;
+    for (int l=0; l<layers; l++)
+    {
+        for (int q=0; q<n; q++)
+        {
+            H(reg, &q, 1);
+            RZ(reg, &q, 1, 0.1 * (l + 1) * (q + 1));
+        }
+        for (int q=0; q<n; q++)
+        {
+            int t = (q + 1) % n;
+            CNOT(reg, q, &t, 1);
+        }
+    }
+}
+
+void run(qreg *circuit, const char *name, const noise_model *noise, unsigned long trajectories)
+{
+    unsigned long long *outcomes = (unsigned long long*) malloc(trajectories * sizeof(unsigned long long));
+
+    double start = now_seconds();
+    run_trajectories(circuit, noise, trajectories, 1, outcomes);
+    double elapsed = now_seconds() - start;
+
+    printf("%-22s%12.3f%16.1f%16.0f\n", name, elapsed, trajectories / elapsed, 60 * trajectories / elapsed);
+    free(outcomes);
+}
+
+int main(int argc, char *argv[])
+{
+    int n = argc > 1 ? atoi(argv[1]) : 20;
+    int layers = argc > 2 ? atoi(argv[2]) : 10;
+    unsigned long trajectories = argc > 3 ? atol(argv[3]) : 50;
+
+    //The circuit is only recorded, never applied.
+    qreg *circuit = initSparseRegister(n);
+    set_deferred(circuit, true);
+    layered_circuit(circuit, layers);
+
+    noise_model pauli = {0};
+    pauli.depolarizing = 1e-3;
+    pauli.readout = 1e-2;
+    noise_model damping = pauli;
+    damping.amplitude_damping = 1e-3;
+
+    printf("%d qubits, %d layers, %u gates, %d threads\n", n, layers, history_count(circuit), circuit->num_threads);
+    printf("%-22s%12s%16s%16s\n", "noise", "time (s)", "traj/s", "traj/min");
+    run(circuit, "depolarizing", &pauli, trajectories);
+    run(circuit, "+ amplitude damping", &damping, trajectories);
+
+    free_qreg(circuit);
+    return 0;
+}
@@ -0,0 +1,113 @@
+#include <time.h>
+#include "../libs/pauli.h"
+
+/*
+    Pauli sum expectation benchmark.
+
+    Builds a Hamiltonian of random Pauli strings whose X parts come from a
+    smaller pool, as with Jordan-Wigner terms sharing their hopping qubits,
+    and evaluates it on a random state with expectation. For comparison a
+    few terms are evaluated the way the gate API allows: copy the register,
+    apply X, Y and Z, take the inner product.
+
+    Build: gcc -O2 -fopenmp -o bench_pauli benchmarks/bench_pauli.c -lm
+    Usage: ./bench_pauli [qubits] [terms] [x masks]
+*/
+
+double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+unsigned long long random_mask(int n)
+{
+    return (((unsigned long long)rand() << 31) ^ rand()) & ((1ULL << n) - 1);
+}
+
+/*
+    <psi|P|psi> on a copy of the register.
+*/
+double copy_expectation(qreg *reg, qreg *copy, unsigned long long x_mask, unsigned long long z_mask)
+{
+    size_t size = reg_states(reg);
+    memcpy(copy->matrix, reg->matrix, size * sizeof(amplitude));
+
+    for (int q=0; q<(int)reg->size; q++)
+    {
+        bool x = (x_mask >> q) & 1, z = (z_mask >> q) & 1;
+        if (x && z) Y(copy, &q, 1);
+        else if (x) X(copy, &q, 1);
+        else if (z) Z(copy, &q, 1);
+    }
+
+    double complex sum = 0;
+    for (size_t i=0; i<size; i++)
+    {
+        sum += conj(reg->matrix[i]) * copy->matrix[i];
+    }
+    return creal(sum);
+}
+
+int main(int argc, char *argv[])
+{
+    int n = argc > 1 ? atoi(argv[1]) : 20;
+    int terms = argc > 2 ? atoi(argv[2]) : 2000;
+    int masks = argc > 3 ? atoi(argv[3]) : 250;
+
+    qreg *reg = initQuRegister(n);
+    set_recording(reg, false);
+    for (int l=0; l<3; l++)
+    {
+        for (int q=0; q<n; q++)
+        {
+            U3(reg, &q, 1, 0.3 * q + l, 0.2 * l, 0.7 * q);
+            int t = (q + 1) % n;
+            CNOT(reg, q, &t, 1);
+        }
+    }
+
+    srand(1);
+    unsigned long long *pool = (unsigned long long*) malloc(masks * sizeof(unsigned long long));
+    for (int m=0; m<masks; m++)
+    {
+        pool[m] = m == 0 ? 0 : random_mask(n);
+    }
+    pauli_sum *h = new_pauli_sum(n);
+    for (int t=0; t<terms; t++)
+    {
+        add_pauli_masks(h, rand() / (double)RAND_MAX - 0.5, pool[rand() % masks], random_mask(n));
+    }
+
+    double start = now_seconds();
+    double value = expectation(reg, h);
+    double grouped = now_seconds() - start;
+
+    //A handful of terms is enough to time the copy approach.
+    int sampled = terms < 20 ? terms : 20;
+    qreg *copy = initQuRegister(n);
+    set_recording(copy, false);
+    double partial = 0, exact = 0;
+    start = now_seconds();
+    for (int t=0; t<sampled; t++)
+    {
+        partial += h->terms[t].coeff * copy_expectation(reg, copy, h->terms[t].x_mask, h->terms[t].z_mask);
+    }
+    double per_term = (now_seconds() - start) / sampled;
+
+    pauli_sum first = {n, h->terms, sampled, sampled};
+    exact = expectation(reg, &first);
+
+    printf("%d qubits, %d terms, %d x masks, <H> = %.10f\n", n, terms, masks, value);
+    printf("%-12s%12s%16s\n", "method", "time (s)", "terms/s");
+    printf("%-12s%12.4f%16.0f\n", "grouped", grouped, terms / grouped);
+    printf("%-12s%12.4f%16.0f   (extrapolated from %d terms)\n", "copy", per_term * terms, 1 / per_term, sampled);
+    printf("difference on the sampled terms %.2e\n", fabs(partial - exact));
+
+    free_pauli_sum(h);
+    free_qreg(reg);
+    free_qreg(copy);
+    free(pool);
+    return 0;
+}
@@ -0,0 +1,110 @@
+#include <time.h>
+#include "../libs/operations.h"
+
+/*
+    Precision benchmark, build it once per precision and compare the output.
+
+    Runs the example circuits widened to n qubits and reports run time next
+    to the error against the exact result:
+    - hadamard: two Hadamard layers, the state must return to |0...0>.
+    - deutsch-jozsa: the example's X/CNOT/X wrapped oracle, made balanced by
+      a parity of the even inputs, the input register must never read 0.
+    - echo: layers of rotations and CNOTs followed by their exact inverse,
+      the error is 1 - |<0|psi>|^2.
+    The norm drift |1 - sum |a|^2| is reported for each circuit.
+
+    Build: gcc -O2 -o bench_precision benchmarks/bench_precision.c -lm
+           gcc -O2 -DQSIM_FLOAT -o bench_precision_float benchmarks/bench_precision.c -lm
+    Usage: ./bench_precision [qubits] [echo layers]
+*/
+
+double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+double norm_drift(qreg *reg)
+{
+    double total = 0;
+    for (size_t i=0; i<reg_states(reg); i++)
+    {
+        total += mag(reg, i) / 100;
+    }
+    return fabs(1 - total);
+}
+
+void report(const char *name, qreg *reg, double seconds, double error)
+{
+    printf("%-16s%12.4f%14.3e%14.3e\n", name, seconds, fabs(error), norm_drift(reg));
+    free_qreg(reg);
+}
+
+int main(int argc, char **argv)
+{
+    int n = argc > 1 ? atoi(argv[1]) : 22;
+    int layers = argc > 2 ? atoi(argv[2]) : 5;
+    int idx[n];
+    for (int q=0; q<n; q++)
+    {
+        idx[q] = q;
+    }
+
+    printf("%s precision, %zu bytes per amplitude, %d qubits\n",
+        sizeof(amp_real) == sizeof(float) ? "single" : "double", sizeof(amplitude), n);
+    printf("%-16s%12s%14s%14s\n", "circuit", "seconds", "error", "norm drift");
+
+    qreg *reg = initQuRegister(n);
+    double start = now_seconds();
+    H(reg, idx, n);
+    H(reg, idx, n);
+    double elapsed = now_seconds() - start;
+    report("hadamard", reg, elapsed, 1 - mag(reg, 0) / 100);
+
+    //Output qubit n - 1, the oracle flips it when the even inputs have odd parity.
+    reg = initQuRegister(n);
+    int out[] = {n - 1};
+    int balanced[n];
+    int count = 0;
+    for (int q=0; q<n-1; q+=2)
+    {
+        balanced[count++] = q;
+    }
+    start = now_seconds();
+    X(reg, out, 1);
+    H(reg, idx, n);
+    X(reg, balanced, count);
+    for (int i=0; i<count; i++)
+    {
+        CNOT(reg, balanced[i], out, 1);
+    }
+    X(reg, balanced, count);
+    H(reg, idx, n - 1);
+    elapsed = now_seconds() - start;
+    report("deutsch-jozsa", reg, elapsed, (mag(reg, 0) + mag(reg, (size_t)1 << (n - 1))) / 100);
+
+    reg = initQuRegister(n);
+    start = now_seconds();
+    for (int layer=0; layer<layers; layer++)
+    {
+        RY(reg, idx, n, 0.1 * (layer + 1));
+        RZ(reg, idx, n, 0.2 * (layer + 1));
+        for (int q=0; q<n-1; q++)
+        {
+            CNOT(reg, q, idx + q + 1, 1);
+        }
+    }
+    for (int layer=layers-1; layer>=0; layer--)
+    {
+        for (int q=n-2; q>=0; q--)
+        {
+            CNOT(reg, q, idx + q + 1, 1);
+        }
+        RZ(reg, idx, n, -0.2 * (layer + 1));
+        RY(reg, idx, n, -0.1 * (layer + 1));
+    }
+    elapsed = now_seconds() - start;
+    report("echo", reg, elapsed, 1 - mag(reg, 0) / 100);
+    return 0;
+}
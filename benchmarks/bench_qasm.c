@@ -0,0 +1,83 @@
+#include <time.h>
+#include "../libs/qasm.h"
+
+/*
+    OpenQASM parser benchmark.
+
+    Generates a program of the given size in memory, a mix of fixed gates,
+    parametrized rotations with pi expressions, two qubit gates, a gate
+    definition and register wide statements on 20 qubits, then times
+    parse_qasm on it. No amplitudes are allocated.
+
+    Build: gcc -O2 -o bench_qasm benchmarks/bench_qasm.c -lm
+    Usage: ./bench_qasm [megabytes]
+*/
+
+double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+    Random program of about bytes characters.
+*/
+char* generate_program(size_t bytes, size_t *length)
+{
+    char *text = (char*) malloc(bytes + 256);
+    size_t used = 0;
+    int n = 20;
+    srand(1);
+
+    used += sprintf(text, "OPENQASM 2.0;\ninclude \"qelib1.inc\";\n"
+        "gate zz(theta) a,b { cx a,b; rz(theta) b; cx a,b; }\n"
+        "qreg q[%d];\ncreg c[%d];\n", n, n);
+
+    for (long g = 0; used < bytes; g++)
+    {
+        int a = rand() % n;
+        int b = (a + 1 + rand() % (n - 1)) % n;
+        char *out = text + used;
+
+        switch (g % 10)
+        {
+            case 0: used += sprintf(out, "h q[%d];\n", a); break;
+            case 1: used += sprintf(out, "cx q[%d],q[%d];\n", a, b); break;
+            case 2: used += sprintf(out, "rz(%.12f) q[%d];\n", rand() / (double)RAND_MAX, a); break;
+            case 3: used += sprintf(out, "u3(pi/2,-pi/4,%d*pi/8) q[%d];\n", rand() % 16, a); break;
+            case 4: used += sprintf(out, "t q[%d];\n", a); break;
+            case 5: used += sprintf(out, "cu1(pi/%d) q[%d],q[%d];\n", 1 + rand() % 32, a, b); break;
+            case 6: used += sprintf(out, "zz(0.125) q[%d],q[%d];\n", a, b); break;
+            case 7: used += sprintf(out, "sdg q[%d];\n", a); break;
+            case 8: used += sprintf(out, "ccx q[%d],q[%d],q[%d];\n", a, b, (b + 1) % n == a ? (b + 2) % n : (b + 1) % n); break;
+            default: used += sprintf(out, "// layer %ld\nbarrier q;\nry(0.5) q;\n", g); break;
+        }
+    }
+    used += sprintf(text + used, "measure q -> c;\n");
+    *length = used;
+    return text;
+}
+
+int main(int argc, char *argv[])
+{
+    double megabytes = argc > 1 ? atof(argv[1]) : 16;
+    size_t length;
+    char *text = generate_program(megabytes * 1048576, &length);
+
+    double start = now_seconds();
+    qasm_program *program = parse_qasm(text, length);
+    double elapsed = now_seconds() - start;
+    if (program == NULL)
+    {
+        return 1;
+    }
+
+    unsigned int gates = history_count(program->circuit);
+    printf("%.1f MB, %u operations\n", length / 1048576.0, gates);
+    printf("parse %.4f s, %.1f MB/s, %.1f Mgates/s\n", elapsed, length / 1048576.0 / elapsed, gates / elapsed * 1e-6);
+
+    free_qasm(program);
+    free(text);
+    return 0;
+}
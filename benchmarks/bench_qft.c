@@ -0,0 +1,84 @@
+#include <time.h>
+#include "../libs/qft.h"
+
+/*
+    Quantum Fourier transform benchmark.
+
+    The transform over every qubit is built from the gate API (a Hadamard
+    and controlled phases per qubit, then SWAPs reversing the qubits) and
+    compared with the FFT of QFT, followed by the inverse transform.
+    Reports the seconds per transform and the largest amplitude difference
+    between the two results.
+
+    Build: gcc -O2 -fopenmp -o bench_qft benchmarks/bench_qft.c -lm
+    Usage: ./bench_qft [qubits]
+*/
+
+double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+qreg* prepared(int n)
+{
+    qreg *reg = initQuRegister(n);
+    set_recording(reg, false);
+    for (int q = 0; q < n; q++)
+    {
+        RY(reg, &q, 1, 0.1 * (q + 1));
+    }
+    return reg;
+}
+
+int main(int argc, char *argv[])
+{
+    int n = argc > 1 ? atoi(argv[1]) : 20;
+    int all[64];
+    for (int q = 0; q < n; q++)
+    {
+        all[q] = q;
+    }
+
+    qreg *gates = prepared(n), *fft = prepared(n);
+
+    double start = now_seconds();
+    for (int s = n - 1; s >= 0; s--)
+    {
+        H(gates, &s, 1);
+        for (int m = s - 1; m >= 0; m--)
+        {
+            CP(gates, m, &s, 1, M_PI / ((size_t)1 << (s - m)));
+        }
+    }
+    for (int s = 0; s < n / 2; s++)
+    {
+        SWAP(gates, s, n - 1 - s);
+    }
+    double circuit = now_seconds() - start;
+
+    start = now_seconds();
+    QFT(fft, all, n, false);
+    double transform = now_seconds() - start;
+
+    double diff = 0;
+    for (size_t i = 0; i < reg_states(fft); i++)
+    {
+        diff = fmax(diff, cabs(get_amplitude(gates, i) - get_amplitude(fft, i)));
+    }
+
+    start = now_seconds();
+    QFT(fft, all, n, true);
+    double inverse = now_seconds() - start;
+
+    printf("%d qubits, %d gates in the circuit\n", n, n * (n + 1) / 2 + n / 2);
+    printf("%-14s%12s%11s%14s\n", "method", "time (s)", "speedup", "max diff");
+    printf("%-14s%12.4f%10.1fx%14s\n", "gates", circuit, 1.0, "0");
+    printf("%-14s%12.4f%10.1fx%14.2e\n", "QFT", transform, circuit / transform, diff);
+    printf("%-14s%12.4f%10.1fx%14s\n", "inverse QFT", inverse, circuit / inverse, "");
+
+    free_qreg(gates);
+    free_qreg(fft);
+    return 0;
+}
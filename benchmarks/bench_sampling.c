@@ -0,0 +1,52 @@
+#include <time.h>
+#include "../libs/measure.h"
+
+/*
+    Sampling benchmark.
+
+    Prepares a superposition over every qubit and draws shots outcomes
+    with sample, then times single qubit measurement with collapse.
+
+    Build: gcc -O2 -o bench_sampling benchmarks/bench_sampling.c -lm
+    Usage: ./bench_sampling [qubits] [shots]
+*/
+
+double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv)
+{
+    int n = argc > 1 ? atoi(argv[1]) : 25;
+    unsigned long shots = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+    qreg *reg = initQuRegister(n);
+    int idx[n];
+
+    for (int q=0; q<n; q++)
+    {
+        idx[q] = q;
+    }
+    H(reg, idx, n);
+    RY(reg, idx, n / 2, 0.3);
+
+    unsigned int *counts = (unsigned int*) calloc(reg_states(reg), sizeof(unsigned int));
+    double start = now_seconds();
+    sample(reg, shots, counts);
+    double elapsed = now_seconds() - start;
+    printf("sample: %d qubits, %lu shots in %.4f s (%.2e shots/s)\n", n, shots, elapsed, shots / elapsed);
+
+    start = now_seconds();
+    for (int q=0; q<n; q++)
+    {
+        measure(reg, q);
+    }
+    elapsed = now_seconds() - start;
+    printf("measure: %d qubits collapsed in %.4f s\n", n, elapsed);
+
+    free(counts);
+    free_qreg(reg);
+    return 0;
+}
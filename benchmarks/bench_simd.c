@@ -0,0 +1,146 @@
+#include <time.h>
+#include "../libs/simd.h"
+
+/*
+    Split storage (SoA) kernel benchmark.
+
+    Sweeps H, RZ and CNOT over every qubit of an n qubit register, first with
+    the interleaved double complex kernels of qreg and then with the split
+    storage kernels for every instruction set the CPU supports. Every split
+    storage sweep starts from the state the qreg sweep started from, and a
+    second table gives the largest amplitude difference of its result from
+    apply_1q and apply_controlled_1q.
+
+    Build: gcc -O2 -o bench_simd benchmarks/bench_simd.c -lm
+    Usage: ./bench_simd [qubits]
+*/
+
+typedef enum { SWEEP_H, SWEEP_RZ, SWEEP_CNOT } bench_sweep;
+
+static const char *sweep_names[] = {"H", "RZ", "CNOT"};
+
+double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+double sweep_qreg(qreg *reg, bench_sweep sweep, const double complex h[2][2], const double complex rz[2][2])
+{
+    int n = reg->size;
+    double start = now_seconds();
+
+    for (int q=0; q<n; q++)
+    {
+        switch (sweep)
+        {
+            case SWEEP_H: apply_1q(reg, q, h); break;
+            case SWEEP_RZ: apply_1q(reg, q, rz); break;
+            case SWEEP_CNOT: apply_controlled_1q(reg, 1ULL << ((q + 1) % n), q, X_matrix); break;
+        }
+    }
+    return now_seconds() - start;
+}
+
+double sweep_soa(qreg_soa *soa, bench_sweep sweep, const double complex h[2][2], const double complex rz[2][2])
+{
+    int n = soa->size;
+    double start = now_seconds();
+
+    for (int q=0; q<n; q++)
+    {
+        switch (sweep)
+        {
+            case SWEEP_H: soa_apply_1q(soa, q, h); break;
+            case SWEEP_RZ: soa_apply_1q(soa, q, rz); break;
+            case SWEEP_CNOT: soa_apply_controlled_1q(soa, 1ULL << ((q + 1) % n), q, X_matrix); break;
+        }
+    }
+    return now_seconds() - start;
+}
+
+/*
+    Copy the amplitudes of reg into soa, both of the same size.
+*/
+void load_soa(qreg_soa *soa, qreg *reg)
+{
+    for (size_t i = 0; i < reg_states(reg); i++)
+    {
+        soa->re[i] = creal(reg->matrix[i]);
+        soa->im[i] = cimag(reg->matrix[i]);
+    }
+}
+
+double soa_difference(qreg_soa *soa, qreg *reg)
+{
+    double diff = 0;
+    for (size_t i = 0; i < reg_states(reg); i++)
+    {
+        diff = fmax(diff, cabs(soa->re[i] + soa->im[i] * j - reg->matrix[i]));
+    }
+    return diff;
+}
+
+int main(int argc, char **argv)
+{
+    int n = argc > 1 ? atoi(argv[1]) : 24;
+    double complex h[2][2] = {{M_SQRT1_2, M_SQRT1_2}, {M_SQRT1_2, -M_SQRT1_2}};
+    double complex rz[2][2];
+    rotation_matrix(rz, 2, 0.3);
+
+    qreg *reg = initQuRegister(n), *start = initQuRegister(n);
+    qreg_soa *soa = initSoaRegister(n);
+    simd_isa best = soa_detect_isa();
+    double diff[SWEEP_CNOT + 1][SIMD_AVX512 + 1];
+
+    printf("%d qubits, seconds per sweep over all qubits\n", n);
+    printf("%-8s%14s", "gate", "qreg");
+    for (simd_isa isa=SIMD_SCALAR; isa<=best; isa++)
+    {
+        soa_set_isa(isa);
+        printf("%14s", soa_isa_name());
+    }
+    printf("%12s\n", "speedup");
+
+    for (bench_sweep s=SWEEP_H; s<=SWEEP_CNOT; s++)
+    {
+        memcpy(start->matrix, reg->matrix, reg_states(reg) * sizeof(amplitude));
+        double base = sweep_qreg(reg, s, h, rz);
+        double last = base;
+
+        printf("%-8s%14.4f", sweep_names[s], base);
+        for (simd_isa isa=SIMD_SCALAR; isa<=best; isa++)
+        {
+            soa_set_isa(isa);
+            load_soa(soa, start);
+            last = sweep_soa(soa, s, h, rz);
+            diff[s][isa] = soa_difference(soa, reg);
+            printf("%14.4f", last);
+        }
+        printf("%12.2f\n", base / last);
+    }
+
+    printf("\nlargest amplitude difference from qreg\n");
+    printf("%-8s", "gate");
+    for (simd_isa isa=SIMD_SCALAR; isa<=best; isa++)
+    {
+        soa_set_isa(isa);
+        printf("%14s", soa_isa_name());
+    }
+    printf("\n");
+    for (bench_sweep s=SWEEP_H; s<=SWEEP_CNOT; s++)
+    {
+        printf("%-8s", sweep_names[s]);
+        for (simd_isa isa=SIMD_SCALAR; isa<=best; isa++)
+        {
+            printf("%14.2e", diff[s][isa]);
+        }
+        printf("\n");
+    }
+
+    free_qreg(start);
+    free_qreg(reg);
+    free_soa(soa);
+    return 0;
+}
@@ -0,0 +1,73 @@
+#include <time.h>
+#include "../libs/measure.h"
+
+/*
+    Sparse register benchmark.
+
+    Runs a reversible ripple carry adder (CNOT and Toffoli gates on basis
+    states) on a sparse register of 3 * bits + 1 qubits, then a dense
+    register of the same circuit where it still fits in memory.
+
+    Build: gcc -O2 -o bench_sparse benchmarks/bench_sparse.c -lm
+    Usage: ./bench_sparse [bits] [superposed inputs]
+*/
+
+double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+    Cuccaro style adder, b += a with a in qubits [0, bits), b in
+    [bits, 2 * bits), carries in [2 * bits, 3 * bits] and the first
+    inputs qubits of a put in superposition.
+*/
+unsigned int adder(qreg *reg, int bits, int inputs)
+{
+    int a[bits];
+    for (int i=0; i<bits; i++)
+    {
+        a[i] = i;
+    }
+    int b_ones[] = {bits, bits + 2};
+    X(reg, a, bits);
+    X(reg, b_ones, 2);
+    H(reg, a, inputs);
+
+    for (int i=0; i<bits; i++)
+    {
+        int carry = 2 * bits + i;
+        Toffoli(reg, i, bits + i, carry + 1);
+        int target[] = {bits + i};
+        CNOT(reg, i, target, 1);
+        Toffoli(reg, carry, bits + i, carry + 1);
+        CNOT(reg, carry, target, 1);
+    }
+    return 4 * bits;
+}
+
+int main(int argc, char **argv)
+{
+    int bits = argc > 1 ? atoi(argv[1]) : 20;
+    int inputs = argc > 2 ? atoi(argv[2]) : 4;
+    int n = 3 * bits + 1;
+
+    qreg *reg = initSparseRegister(n);
+    double start = now_seconds();
+    unsigned int gates = adder(reg, bits, inputs);
+    double elapsed = now_seconds() - start;
+    printf("sparse: %d qubits, %u gates, %zu amplitudes stored, %.4f s\n",
+        n, gates, reg->sparse->count, elapsed);
+
+    if (n <= 28)
+    {
+        reg = initQuRegister(n);
+        start = now_seconds();
+        adder(reg, bits, inputs);
+        printf("dense:  %d qubits, %u gates, %.4f s\n", n, gates, now_seconds() - start);
+        free_qreg(reg);
+    }
+    return 0;
+}
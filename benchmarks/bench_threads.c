@@ -0,0 +1,84 @@
+#include <time.h>
+#include "../libs/operations.h"
+
+/*
+    Thread scaling benchmark.
+
+    For every register size in [min, max] a layer of H, a CNOT ladder and a
+    layer of RZ gates is applied with 1, 2, 4, ... up to the available
+    threads. The register is created with the thread count under test, so
+    the first-touch placement matches the kernel partition.
+
+    Build: gcc -O2 -fopenmp -o bench_threads benchmarks/bench_threads.c -lm
+    Usage: ./bench_threads [min_qubits] [max_qubits] [max_threads]
+*/
+
+double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+double run_layers(qreg *reg)
+{
+    int n = reg->size;
+    double start = now_seconds();
+
+    for (int q=0; q<n; q++)
+    {
+        int idx[] = {q};
+        H(reg, idx, 1);
+    }
+    for (int q=0; q<n-1; q++)
+    {
+        int idx[] = {q + 1};
+        CNOT(reg, q, idx, 1);
+    }
+    for (int q=0; q<n; q++)
+    {
+        int idx[] = {q};
+        RZ(reg, idx, 1, 0.1 * q);
+    }
+
+    return now_seconds() - start;
+}
+
+int main(int argc, char **argv)
+{
+    int min = argc > 1 ? atoi(argv[1]) : 20;
+    int max = argc > 2 ? atoi(argv[2]) : 26;
+#ifdef _OPENMP
+    int max_threads = argc > 3 ? atoi(argv[3]) : omp_get_max_threads();
+#else
+    int max_threads = 1;
+    printf("Built without OpenMP, only the single thread case is measured.\n");
+#endif
+
+    printf("%-8s%-10s%14s%12s\n", "qubits", "threads", "seconds", "speedup");
+
+    for (int n=min; n<=max; n++)
+    {
+        double single = 0;
+
+        for (int t=1; t<=max_threads; t*=2)
+        {
+#ifdef _OPENMP
+            omp_set_num_threads(t);
+#endif
+            qreg *reg = initQuRegister(n);
+            set_threads(reg, t);
+
+            double elapsed = run_layers(reg);
+            if (t == 1)
+            {
+                single = elapsed;
+            }
+
+            printf("%-8d%-10d%14.4f%12.2f\n", n, t, elapsed, single / elapsed);
+            free_qreg(reg);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,96 @@
+#include <time.h>
+#include "../libs/measure.h"
+
+/*
+    Walsh-Hadamard benchmark.
+
+    A Hadamard layer on every qubit is applied one qubit per call, as a
+    single H call on all qubits (one Walsh-Hadamard transform) and as a
+    deferred layer that flush_operations hands to the same transform.
+    Reports the seconds per layer and the largest amplitude difference
+    against the per-qubit layer.
+
+    Build: gcc -O2 -fopenmp -o bench_walsh benchmarks/bench_walsh.c -lm
+    Usage: ./bench_walsh [qubits] [repetitions]
+*/
+
+double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+qreg* prepared(int n)
+{
+    qreg *reg = initQuRegister(n);
+    set_recording(reg, false);
+    for (int q = 0; q < n; q++)
+    {
+        RY(reg, &q, 1, 0.1 * (q + 1));
+    }
+    return reg;
+}
+
+double max_diff(qreg *a, qreg *b)
+{
+    double diff = 0;
+    for (size_t i = 0; i < reg_states(a); i++)
+    {
+        diff = fmax(diff, cabs(get_amplitude(a, i) - get_amplitude(b, i)));
+    }
+    return diff;
+}
+
+int main(int argc, char *argv[])
+{
+    int n = argc > 1 ? atoi(argv[1]) : 22;
+    int reps = argc > 2 ? atoi(argv[2]) : 3;
+    int all[64];
+    for (int q = 0; q < n; q++)
+    {
+        all[q] = q;
+    }
+
+    qreg *single = prepared(n), *layer = prepared(n), *deferred = prepared(n);
+
+    double start = now_seconds();
+    for (int r = 0; r < reps; r++)
+    {
+        for (int q = 0; q < n; q++)
+        {
+            H(single, &q, 1);
+        }
+    }
+    double per_qubit = (now_seconds() - start) / reps;
+
+    start = now_seconds();
+    for (int r = 0; r < reps; r++)
+    {
+        H(layer, all, n);
+    }
+    double transform = (now_seconds() - start) / reps;
+
+    set_deferred(deferred, true);
+    start = now_seconds();
+    for (int r = 0; r < reps; r++)
+    {
+        for (int q = 0; q < n; q++)
+        {
+            H(deferred, &q, 1);
+        }
+        flush_operations(deferred);
+    }
+    double flushed = (now_seconds() - start) / reps;
+
+    printf("%d qubits, seconds per Hadamard layer\n", n);
+    printf("%-14s%12s%11s%14s\n", "method", "time (s)", "speedup", "max diff");
+    printf("%-14s%12.4f%10.1fx%14s\n", "per qubit", per_qubit, 1.0, "0");
+    printf("%-14s%12.4f%10.1fx%14.2e\n", "one H call", transform, per_qubit / transform, max_diff(single, layer));
+    printf("%-14s%12.4f%10.1fx%14.2e\n", "deferred", flushed, per_qubit / flushed, max_diff(single, deferred));
+
+    free_qreg(single);
+    free_qreg(layer);
+    free_qreg(deferred);
+    return 0;
+}
@@ -0,0 +1,690 @@
+#pragma once
+#include "simd.h"
+
+/*
+    Batched registers.
+
+    A batch holds count independent registers of the same n qubits, e.g. the
+    points of a parameter sweep. The registers are stored in tiles of width
+    lanes: a tile is a split storage register like qreg_soa whose every
+    amplitude is a row of width doubles, one per register, so amplitude i of
+    the register in lane l of tile t sits at t * 2^n * width + i * width + l
+    of re and im. Within a tile a gate shared by all registers is exactly the
+    soa_pairs kernel of simd.h over rows, and a gate with a parameter per
+    register reads one matrix per lane with the *_each kernels below.
+
+    Gates are queued, not applied. batch_flush, called by every function
+    reading amplitudes and whenever BATCH_QUEUE_LIMIT gates are waiting,
+    runs the whole queue on one tile before moving to the next. The width
+    is picked so a tile fits in BATCH_TILE_BYTES, so the queue runs from
+    cache instead of streaming the full batch through memory for each gate,
+    and the threads split the tiles between them.
+
+    Amplitudes are double precision like simd.h whatever QSIM_FLOAT says.
+*/
+
+//Lanes of a tile are a multiple of this, the widest vector.
+#define BATCH_ALIGN 8
+
+//Tiles are at most this large where the qubit count allows.
+#define BATCH_TILE_BYTES ((size_t)512 << 10)
+
+//Queued gates that trigger a flush.
+#define BATCH_QUEUE_LIMIT 256
+
+/*
+    A queued gate, coef holds per lane coefficients for gates with a matrix
+    per register and is NULL for a shared matrix m.
+*/
+typedef struct batch_gate{
+    int target;
+    bool diagonal;
+    unsigned long long ctrl_mask;
+    double complex m[2][2];
+    double *coef;
+}batch_gate;
+
+typedef struct qreg_batch{
+    unsigned int size;
+    unsigned int count;
+    size_t width;
+    size_t tiles;
+    int num_threads;
+    double *re;
+    double *im;
+    batch_gate *pending;
+    unsigned int pending_size;
+    unsigned int pending_capacity;
+}qreg_batch;
+
+/*
+    Initialize count registers of n qubits, all in state |0..0>. Returns
+    NULL with a message on stderr when the amplitudes cannot be allocated.
+*/
+qreg_batch* initBatchRegister(size_t n, size_t count);
+
+/*
+    Release the amplitude arrays, the queue and the batch.
+*/
+void free_batch(qreg_batch *batch);
+
+/*
+    Apply the queued gates.
+*/
+void batch_flush(qreg_batch *batch);
+
+/*
+    Apply the same 2x2 unitary to the target qubit of every register,
+    same semantics as apply_1q.
+*/
+void batch_apply_1q(qreg_batch *batch, int target, const double complex m[2][2]);
+
+/*
+    Same as batch_apply_1q where all qubits in ctrl_mask are |1>. A target
+    in ctrl_mask or qubits out of range are refused with a message on
+    stderr before the gate is queued.
+*/
+void batch_apply_controlled_1q(qreg_batch *batch, unsigned long long ctrl_mask, int target, const double complex m[2][2]);
+
+/*
+    Apply m[b] to the target qubit of register b, m holds count matrices.
+    Returns false with a message on stderr, nothing queued, when the
+    coefficients cannot be allocated or the target is out of range.
+*/
+bool batch_apply_1q_each(qreg_batch *batch, int target, const double complex (*m)[2][2]);
+
+/*
+    Fixed gates on every register.
+*/
+void batch_X(qreg_batch *batch, int target);
+void batch_H(qreg_batch *batch, int target);
+void batch_CNOT(qreg_batch *batch, int control, int target);
+void batch_CZ(qreg_batch *batch, int control, int target);
+
+/*
+    Rotations and phase shift with one angle per register, the arrays hold
+    count values. Same matrices as RX, RY, RZ and P, and the same failures
+    as batch_apply_1q_each.
+*/
+bool batch_RX(qreg_batch *batch, int target, const double *theta);
+bool batch_RY(qreg_batch *batch, int target, const double *theta);
+bool batch_RZ(qreg_batch *batch, int target, const double *theta);
+bool batch_P(qreg_batch *batch, int target, const double *lambda);
+
+/*
+    Amplitude of basis state i in register b.
+*/
+double complex batch_amplitude(qreg_batch *batch, size_t b, unsigned long long i);
+
+/*
+    Expectation value of Z on the given qubit for every register,
+    out receives count values.
+*/
+void batch_expectation_z(qreg_batch *batch, int qubit, double *out);
+
+/*
+    Copy register b into a register of the same number of qubits,
+    e.g. to measure it.
+*/
+void batch_to_qreg(qreg_batch *batch, size_t b, qreg *reg);
+
+/*
+    Per lane kernels over rows consecutive row pairs of width lanes, the
+    first pair at k and k + stride. coef points at the tile's first lane
+    in eight arrays pitch apart, the real and imaginary parts of m00, m01,
+    m10 and m11. scale_each multiplies rows consecutive rows at k by the
+    factor in coef, real and imaginary part pitch apart.
+*/
+typedef void (*batch_pairs_run)(double *re, double *im, size_t k, size_t stride, size_t rows, size_t width, const double *coef, size_t pitch);
+typedef void (*batch_scale_run)(double *re, double *im, size_t k, size_t rows, size_t width, const double *coef, size_t pitch);
+
+void batch_pairs_scalar(double *re, double *im, size_t k, size_t stride, size_t rows, size_t width, const double *coef, size_t pitch)
+{
+    const double *ar = coef, *ai = coef + pitch, *br = coef + 2 * pitch, *bi = coef + 3 * pitch;
+    const double *cr = coef + 4 * pitch, *ci = coef + 5 * pitch, *dr = coef + 6 * pitch, *di = coef + 7 * pitch;
+
+    for (size_t x = k; x < k + rows * width; x += width)
+    {
+        size_t y = x + stride;
+        for (size_t l = 0; l < width; l++)
+        {
+            double xr = re[x + l], xi = im[x + l];
+            double yr = re[y + l], yi = im[y + l];
+
+            re[x + l] = ar[l]*xr - ai[l]*xi + br[l]*yr - bi[l]*yi;
+            im[x + l] = ar[l]*xi + ai[l]*xr + br[l]*yi + bi[l]*yr;
+            re[y + l] = cr[l]*xr - ci[l]*xi + dr[l]*yr - di[l]*yi;
+            im[y + l] = cr[l]*xi + ci[l]*xr + dr[l]*yi + di[l]*yr;
+        }
+    }
+}
+
+void batch_scale_scalar(double *re, double *im, size_t k, size_t rows, size_t width, const double *coef, size_t pitch)
+{
+    const double *cr = coef, *ci = coef + pitch;
+
+    for (size_t x = k; x < k + rows * width; x += width)
+    {
+        for (size_t l = 0; l < width; l++)
+        {
+            double xr = re[x + l], xi = im[x + l];
+            re[x + l] = cr[l]*xr - ci[l]*xi;
+            im[x + l] = cr[l]*xi + ci[l]*xr;
+        }
+    }
+}
+
+#ifdef SIMD_X86
+
+__attribute__((target("avx2,fma")))
+void batch_pairs_avx2(double *re, double *im, size_t k, size_t stride, size_t rows, size_t width, const double *coef, size_t pitch)
+{
+    for (size_t l = 0; l < width; l += 4)
+    {
+        __m256d ar = _mm256_load_pd(coef + l), ai = _mm256_load_pd(coef + pitch + l);
+        __m256d br = _mm256_load_pd(coef + 2 * pitch + l), bi = _mm256_load_pd(coef + 3 * pitch + l);
+        __m256d cr = _mm256_load_pd(coef + 4 * pitch + l), ci = _mm256_load_pd(coef + 5 * pitch + l);
+        __m256d dr = _mm256_load_pd(coef + 6 * pitch + l), di = _mm256_load_pd(coef + 7 * pitch + l);
+
+        for (size_t x = k + l; x < k + rows * width; x += width)
+        {
+            size_t y = x + stride;
+            __m256d xr = _mm256_load_pd(re + x), xi = _mm256_load_pd(im + x);
+            __m256d yr = _mm256_load_pd(re + y), yi = _mm256_load_pd(im + y);
+
+            __m256d ur = _mm256_fmsub_pd(ar, xr, _mm256_mul_pd(ai, xi));
+            ur = _mm256_fmadd_pd(br, yr, ur);
+            ur = _mm256_fnmadd_pd(bi, yi, ur);
+            __m256d ui = _mm256_fmadd_pd(ar, xi, _mm256_mul_pd(ai, xr));
+            ui = _mm256_fmadd_pd(br, yi, ui);
+            ui = _mm256_fmadd_pd(bi, yr, ui);
+
+            __m256d vr = _mm256_fmsub_pd(cr, xr, _mm256_mul_pd(ci, xi));
+            vr = _mm256_fmadd_pd(dr, yr, vr);
+            vr = _mm256_fnmadd_pd(di, yi, vr);
+            __m256d vi = _mm256_fmadd_pd(cr, xi, _mm256_mul_pd(ci, xr));
+            vi = _mm256_fmadd_pd(dr, yi, vi);
+            vi = _mm256_fmadd_pd(di, yr, vi);
+
+            _mm256_store_pd(re + x, ur);
+            _mm256_store_pd(im + x, ui);
+            _mm256_store_pd(re + y, vr);
+            _mm256_store_pd(im + y, vi);
+        }
+    }
+}
+
+__attribute__((target("avx2,fma")))
+void batch_scale_avx2(double *re, double *im, size_t k, size_t rows, size_t width, const double *coef, size_t pitch)
+{
+    for (size_t l = 0; l < width; l += 4)
+    {
+        __m256d cr = _mm256_load_pd(coef + l), ci = _mm256_load_pd(coef + pitch + l);
+
+        for (size_t x = k + l; x < k + rows * width; x += width)
+        {
+            __m256d xr = _mm256_load_pd(re + x), xi = _mm256_load_pd(im + x);
+            _mm256_store_pd(re + x, _mm256_fmsub_pd(cr, xr, _mm256_mul_pd(ci, xi)));
+            _mm256_store_pd(im + x, _mm256_fmadd_pd(cr, xi, _mm256_mul_pd(ci, xr)));
+        }
+    }
+}
+
+__attribute__((target("avx512f")))
+void batch_pairs_avx512(double *re, double *im, size_t k, size_t stride, size_t rows, size_t width, const double *coef, size_t pitch)
+{
+    for (size_t l = 0; l < width; l += 8)
+    {
+        __m512d ar = _mm512_load_pd(coef + l), ai = _mm512_load_pd(coef + pitch + l);
+        __m512d br = _mm512_load_pd(coef + 2 * pitch + l), bi = _mm512_load_pd(coef + 3 * pitch + l);
+        __m512d cr = _mm512_load_pd(coef + 4 * pitch + l), ci = _mm512_load_pd(coef + 5 * pitch + l);
+        __m512d dr = _mm512_load_pd(coef + 6 * pitch + l), di = _mm512_load_pd(coef + 7 * pitch + l);
+
+        for (size_t x = k + l; x < k + rows * width; x += width)
+        {
+            size_t y = x + stride;
+            __m512d xr = _mm512_load_pd(re + x), xi = _mm512_load_pd(im + x);
+            __m512d yr = _mm512_load_pd(re + y), yi = _mm512_load_pd(im + y);
+
+            __m512d ur = _mm512_fmsub_pd(ar, xr, _mm512_mul_pd(ai, xi));
+            ur = _mm512_fmadd_pd(br, yr, ur);
+            ur = _mm512_fnmadd_pd(bi, yi, ur);
+            __m512d ui = _mm512_fmadd_pd(ar, xi, _mm512_mul_pd(ai, xr));
+            ui = _mm512_fmadd_pd(br, yi, ui);
+            ui = _mm512_fmadd_pd(bi, yr, ui);
+
+            __m512d vr = _mm512_fmsub_pd(cr, xr, _mm512_mul_pd(ci, xi));
+            vr = _mm512_fmadd_pd(dr, yr, vr);
+            vr = _mm512_fnmadd_pd(di, yi, vr);
+            __m512d vi = _mm512_fmadd_pd(cr, xi, _mm512_mul_pd(ci, xr));
+            vi = _mm512_fmadd_pd(dr, yi, vi);
+            vi = _mm512_fmadd_pd(di, yr, vi);
+
+            _mm512_store_pd(re + x, ur);
+            _mm512_store_pd(im + x, ui);
+            _mm512_store_pd(re + y, vr);
+            _mm512_store_pd(im + y, vi);
+        }
+    }
+}
+
+__attribute__((target("avx512f")))
+void batch_scale_avx512(double *re, double *im, size_t k, size_t rows, size_t width, const double *coef, size_t pitch)
+{
+    for (size_t l = 0; l < width; l += 8)
+    {
+        __m512d cr = _mm512_load_pd(coef + l), ci = _mm512_load_pd(coef + pitch + l);
+
+        for (size_t x = k + l; x < k + rows * width; x += width)
+        {
+            __m512d xr = _mm512_load_pd(re + x), xi = _mm512_load_pd(im + x);
+            _mm512_store_pd(re + x, _mm512_fmsub_pd(cr, xr, _mm512_mul_pd(ci, xi)));
+            _mm512_store_pd(im + x, _mm512_fmadd_pd(cr, xi, _mm512_mul_pd(ci, xr)));
+        }
+    }
+}
+
+#endif
+
+/*
+    Per lane kernels of the instruction set the soa kernels use.
+*/
+batch_pairs_run batch_pairs_kernel(void)
+{
+    if (!soa_isa_selected)
+    {
+        soa_set_isa(soa_detect_isa());
+    }
+#ifdef SIMD_X86
+    if (soa_isa == SIMD_AVX512)
+    {
+        return batch_pairs_avx512;
+    }
+    if (soa_isa == SIMD_AVX2)
+    {
+        return batch_pairs_avx2;
+    }
+#endif
+    return batch_pairs_scalar;
+}
+
+batch_scale_run batch_scale_kernel(void)
+{
+    if (!soa_isa_selected)
+    {
+        soa_set_isa(soa_detect_isa());
+    }
+#ifdef SIMD_X86
+    if (soa_isa == SIMD_AVX512)
+    {
+        return batch_scale_avx512;
+    }
+    if (soa_isa == SIMD_AVX2)
+    {
+        return batch_scale_avx2;
+    }
+#endif
+    return batch_scale_scalar;
+}
+
+/*
+    Doubles in one tile and index of amplitude i of register b.
+*/
+size_t batch_tile_size(qreg_batch *batch)
+{
+    return ((size_t)1 << batch->size) * batch->width;
+}
+
+size_t batch_index(qreg_batch *batch, size_t b, unsigned long long i)
+{
+    return (b / batch->width) * batch_tile_size(batch) + i * batch->width + b % batch->width;
+}
+
+qreg_batch* initBatchRegister(size_t n, size_t count)
+{
+    qreg_batch *batch = (qreg_batch*) malloc(sizeof(qreg_batch));
+    size_t row_bytes = ((size_t)2 << n) * sizeof(double);
+    size_t width = BATCH_TILE_BYTES / row_bytes / BATCH_ALIGN * BATCH_ALIGN;
+    size_t padded = (count + BATCH_ALIGN - 1) / BATCH_ALIGN * BATCH_ALIGN;
+
+    width = width < BATCH_ALIGN ? BATCH_ALIGN : width;
+    width = width > padded ? padded : width;
+
+    batch->size = n;
+    batch->count = count;
+    batch->width = width;
+    batch->tiles = (count + width - 1) / width;
+#ifdef _OPENMP
+    batch->num_threads = omp_get_max_threads();
+#else
+    batch->num_threads = 1;
+#endif
+    batch->pending = NULL;
+    batch->pending_size = 0;
+    batch->pending_capacity = 0;
+
+    size_t tile_size = batch_tile_size(batch);
+    size_t total = batch->tiles * tile_size;
+    batch->re = soa_alloc(total);
+    batch->im = batch->re != NULL ? soa_alloc(total) : NULL;
+    if (batch->im == NULL)
+    {
+        free(batch->re);
+        free(batch);
+        return NULL;
+    }
+
+    //First touch by the thread that will run the tile.
+    double *re = batch->re, *im = batch->im;
+    PARALLEL_FOR(batch, total, 1)
+    for (size_t t = 0; t < batch->tiles; t++)
+    {
+        memset(re + t * tile_size, 0, tile_size * sizeof(double));
+        memset(im + t * tile_size, 0, tile_size * sizeof(double));
+    }
+    for (size_t b = 0; b < count; b++)
+    {
+        re[batch_index(batch, b, 0)] = 1;
+    }
+    return batch;
+}
+
+void free_batch(qreg_batch *batch)
+{
+    for (unsigned int g = 0; g < batch->pending_size; g++)
+    {
+        free(batch->pending[g].coef);
+    }
+    free(batch->pending);
+    free(batch->re);
+    free(batch->im);
+    free(batch);
+}
+
+/*
+    Run one queued gate on the tile starting at base.
+*/
+void batch_run_gate(qreg_batch *batch, const batch_gate *gate, size_t tile, size_t base)
+{
+    size_t width = batch->width;
+    size_t half = ((size_t)1 << gate->target) * width;
+    size_t blocks = ((size_t)1 << batch->size) >> (gate->target + 1);
+    double *re = batch->re, *im = batch->im;
+
+    //Matrix per lane, the rows below the target stride of a block in one call.
+    if (gate->coef != NULL)
+    {
+        size_t pitch = batch->tiles * width;
+        const double *coef = gate->coef + tile * width;
+        size_t rows = (size_t)1 << gate->target;
+
+        if (gate->diagonal)
+        {
+            batch_scale_run scale = batch_scale_kernel();
+            for (size_t b = 0; b < blocks; b++)
+            {
+                scale(re, im, base + 2 * b * half, rows, width, coef, pitch);
+                scale(re, im, base + 2 * b * half + half, rows, width, coef + 6 * pitch, pitch);
+            }
+            return;
+        }
+
+        batch_pairs_run pairs = batch_pairs_kernel();
+        for (size_t b = 0; b < blocks; b++)
+        {
+            pairs(re, im, base + 2 * b * half, half, rows, width, coef, pitch);
+        }
+        return;
+    }
+
+    int fixed[64];
+    int count = 0;
+    unsigned long long mask = gate->ctrl_mask | ((unsigned long long)1 << gate->target);
+    for (int q = 0; q < (int)batch->size; q++)
+    {
+        if (mask & ((unsigned long long)1 << q))
+        {
+            fixed[count++] = q;
+        }
+    }
+
+    //Shared matrix, the runs of consecutive basis states with the controls
+    //set are contiguous rows, as in soa_apply_controlled_1q.
+    size_t run = (size_t)1 << __builtin_ctzll(mask);
+    size_t chunks = ((size_t)1 << (batch->size - count)) / run;
+    size_t len = run * width;
+    soa_pair_run pair_run = soa_pairs_for(len);
+    soa_scale_run scale_run = soa_scale_for(len);
+
+    for (size_t c = 0; c < chunks; c++)
+    {
+        size_t k = base + (deposit_bits(c * run, fixed, count) | gate->ctrl_mask) * width;
+
+        if (!gate->diagonal)
+        {
+            pair_run(re, im, k, half, len, gate->m);
+            continue;
+        }
+        if (gate->m[0][0] != 1)
+        {
+            scale_run(re, im, k, len, gate->m[0][0]);
+        }
+        if (gate->m[1][1] != 1)
+        {
+            scale_run(re, im, k + half, len, gate->m[1][1]);
+        }
+    }
+}
+
+void batch_flush(qreg_batch *batch)
+{
+    if (batch->pending_size == 0)
+    {
+        return;
+    }
+
+    size_t tile_size = batch_tile_size(batch);
+    PARALLEL_FOR(batch, batch->tiles * tile_size, 1)
+    for (size_t t = 0; t < batch->tiles; t++)
+    {
+        for (unsigned int g = 0; g < batch->pending_size; g++)
+        {
+            batch_run_gate(batch, &batch->pending[g], t, t * tile_size);
+        }
+    }
+
+    for (unsigned int g = 0; g < batch->pending_size; g++)
+    {
+        free(batch->pending[g].coef);
+    }
+    batch->pending_size = 0;
+}
+
+/*
+    Append a gate to the queue, growing it geometrically like the history.
+    Returns false, with coef released, when the gate is refused.
+*/
+bool batch_queue(qreg_batch *batch, int target, unsigned long long ctrl_mask, const double complex m[2][2], double *coef, bool diagonal)
+{
+    //Same check as valid_controlled, a target among its controls never runs.
+    if (target < 0 || target >= (int)batch->size || ((ctrl_mask >> target) & 1)
+        || (batch->size < 64 && (ctrl_mask >> batch->size) != 0))
+    {
+        fprintf(stderr, "Batch gate on qubit %d with controls %llx is out of range or controls its own target.\n", target, ctrl_mask);
+        free(coef);
+        return false;
+    }
+
+    if (batch->pending_size == batch->pending_capacity)
+    {
+        batch->pending_capacity = batch->pending_capacity ? 2 * batch->pending_capacity : 16;
+        batch->pending = (batch_gate*) realloc(batch->pending, batch->pending_capacity * sizeof(batch_gate));
+    }
+
+    batch_gate *gate = &batch->pending[batch->pending_size++];
+    gate->target = target;
+    gate->diagonal = diagonal;
+    gate->ctrl_mask = ctrl_mask;
+    gate->coef = coef;
+    if (m != NULL)
+    {
+        memcpy(gate->m, m, sizeof(gate->m));
+    }
+
+    if (batch->pending_size >= BATCH_QUEUE_LIMIT)
+    {
+        batch_flush(batch);
+    }
+    return true;
+}
+
+void batch_apply_1q(qreg_batch *batch, int target, const double complex m[2][2])
+{
+    batch_queue(batch, target, 0, m, NULL, m[0][1] == 0 && m[1][0] == 0);
+}
+
+void batch_apply_controlled_1q(qreg_batch *batch, unsigned long long ctrl_mask, int target, const double complex m[2][2])
+{
+    batch_queue(batch, target, ctrl_mask, m, NULL, m[0][1] == 0 && m[1][0] == 0);
+}
+
+bool batch_apply_1q_each(qreg_batch *batch, int target, const double complex (*m)[2][2])
+{
+    size_t pitch = batch->tiles * batch->width;
+    double *coef = soa_alloc(8 * pitch);
+    if (coef == NULL)
+    {
+        return false;
+    }
+    bool diagonal = true;
+
+    //Padding lanes get the identity.
+    for (size_t l = 0; l < pitch; l++)
+    {
+        for (int e = 0; e < 4; e++)
+        {
+            double complex value = l < batch->count ? m[l][e / 2][e % 2] : (e == 0 || e == 3);
+            coef[2 * e * pitch + l] = creal(value);
+            coef[(2 * e + 1) * pitch + l] = cimag(value);
+        }
+        diagonal = diagonal && (l >= batch->count || (m[l][0][1] == 0 && m[l][1][0] == 0));
+    }
+    return batch_queue(batch, target, 0, NULL, coef, diagonal);
+}
+
+void batch_X(qreg_batch *batch, int target)
+{
+    batch_apply_1q(batch, target, X_matrix);
+}
+
+void batch_H(qreg_batch *batch, int target)
+{
+    const double complex h[2][2] = {{M_SQRT1_2, M_SQRT1_2}, {M_SQRT1_2, -M_SQRT1_2}};
+    batch_apply_1q(batch, target, h);
+}
+
+void batch_CNOT(qreg_batch *batch, int control, int target)
+{
+    if (control < 0 || control >= (int)batch->size)
+    {
+        fprintf(stderr, "Control qubit %d is out of range.\n", control);
+        return;
+    }
+    batch_apply_controlled_1q(batch, (unsigned long long)1 << control, target, X_matrix);
+}
+
+void batch_CZ(qreg_batch *batch, int control, int target)
+{
+    if (control < 0 || control >= (int)batch->size)
+    {
+        fprintf(stderr, "Control qubit %d is out of range.\n", control);
+        return;
+    }
+    batch_apply_controlled_1q(batch, (unsigned long long)1 << control, target, Z_matrix);
+}
+
+/*
+    Build one matrix per register from its angle and queue them,
+    axis -1 is the phase shift.
+*/
+bool batch_rotation(qreg_batch *batch, int target, const double *angle, int axis)
+{
+    double complex (*m)[2][2] = (double complex (*)[2][2]) malloc(batch->count * sizeof(*m));
+
+    for (size_t b = 0; b < batch->count; b++)
+    {
+        if (axis < 0)
+        {
+            phase_matrix(m[b], angle[b]);
+        }
+        else
+        {
+            rotation_matrix(m[b], axis, angle[b]);
+        }
+    }
+    bool queued = batch_apply_1q_each(batch, target, (const double complex (*)[2][2]) m);
+    free(m);
+    return queued;
+}
+
+bool batch_RX(qreg_batch *batch, int target, const double *theta)
+{
+    return batch_rotation(batch, target, theta, 0);
+}
+
+bool batch_RY(qreg_batch *batch, int target, const double *theta)
+{
+    return batch_rotation(batch, target, theta, 1);
+}
+
+bool batch_RZ(qreg_batch *batch, int target, const double *theta)
+{
+    return batch_rotation(batch, target, theta, 2);
+}
+
+bool batch_P(qreg_batch *batch, int target, const double *lambda)
+{
+    return batch_rotation(batch, target, lambda, -1);
+}
+
+double complex batch_amplitude(qreg_batch *batch, size_t b, unsigned long long i)
+{
+    batch_flush(batch);
+    size_t k = batch_index(batch, b, i);
+    return batch->re[k] + batch->im[k]*j;
+}
+
+void batch_expectation_z(qreg_batch *batch, int qubit, double *out)
+{
+    batch_flush(batch);
+    size_t size = (size_t)1 << batch->size;
+
+    //Rows are summed lane by lane, the sign set by the qubit of the row.
+    for (size_t b = 0; b < batch->count; b++)
+    {
+        const double *re = batch->re + batch_index(batch, b, 0);
+        const double *im = batch->im + batch_index(batch, b, 0);
+        double sum = 0;
+
+        for (size_t i = 0; i < size; i++)
+        {
+            double p = re[i * batch->width] * re[i * batch->width] + im[i * batch->width] * im[i * batch->width];
+            sum += (i >> qubit) & 1 ? -p : p;
+        }
+        out[b] = sum;
+    }
+}
+
+void batch_to_qreg(qreg_batch *batch, size_t b, qreg *reg)
+{
+    batch_flush(batch);
+    make_dense(reg);
+    settle_layout(reg);
+    mark_dirty(reg);
+    size_t size = reg_states(reg);
+
+    for (size_t i = 0; i < size; i++)
+    {
+        reg->matrix[i] = batch_amplitude(batch, b, i);
+    }
+}
@@ -0,0 +1,283 @@
+#pragma once
+#include "measure.h"
+
+/*
+    Register state files.
+
+    A state file is a STATE_HEADER_SIZE byte header followed by the 2^n
+    amplitudes exactly as they sit in memory, in the byte order and
+    precision of the machine that wrote them. The header records the qubit
+    count, the size of an amplitude, the position in the circuit (reg->applied)
+    and the random generator state, so a run can be resumed mid-circuit.
+
+    initMappedRegister puts the amplitudes of a new register straight into
+    such a file with a shared mapping. checkpoint then only has to msync the
+    pages dirtied since the last one, and restore_register maps the file back
+    instead of reading it into a copy. Registers on the heap are written
+    with large sequential writes by save_state.
+
+    The header carries a clean flag: set by checkpoint, cleared and synced
+    by mark_dirty before the first amplitude is written afterwards, whether
+    by a gate, a measurement or any other operation on the state. The mapped
+    amplitudes keep changing between checkpoints, so a run killed there
+    leaves a dirty file that restore_register refuses. Alternating
+    save_state files covers that case.
+*/
+
+#define STATE_MAGIC "QSIMSTAT"
+#define STATE_VERSION 1
+
+//The amplitudes start on a page boundary of the file.
+#define STATE_HEADER_SIZE 4096
+
+//Writes of save_state.
+#define STATE_WRITE_CHUNK ((size_t)64 << 20)
+
+typedef struct state_header{
+    char magic[8];
+    unsigned int version;
+    unsigned int qubits;
+    unsigned int amplitude_size;
+    unsigned int clean;
+    unsigned long long position;
+    unsigned long long rng_state;
+}state_header;
+
+/*
+    Initialize a register of n qubits in state |0...0> whose amplitudes live
+    in the state file at path, created or truncated. Returns NULL with a
+    message on stderr when the file cannot be created or mapped.
+*/
+qreg* initMappedRegister(size_t n, const char *path);
+
+/*
+    Run pending deferred gates, then flush the amplitudes of a mapped
+    register to its file and mark it clean at the current position.
+    Returns false with a message on stderr when the register is not mapped
+    or the sync fails.
+*/
+bool checkpoint(qreg *reg);
+
+/*
+    Write the state of a dense register to a new state file at path.
+    The file is written next to path and renamed over it once complete,
+    so an interrupted save leaves the previous file intact.
+*/
+bool save_state(qreg *reg, const char *path);
+
+/*
+    Map a clean state file back as a register. reg->applied is set to the
+    checkpointed position, replay_circuit_from continues from there.
+    Later checkpoints update the same file. Returns NULL with a message on
+    stderr for dirty, foreign or unreadable files.
+*/
+qreg* restore_register(const char *path);
+
+void fill_state_header(qreg *reg, state_header *header, unsigned int clean)
+{
+    memset(header, 0, sizeof(state_header));
+    memcpy(header->magic, STATE_MAGIC, 8);
+    header->version = STATE_VERSION;
+    header->qubits = reg->size;
+    header->amplitude_size = sizeof(amplitude);
+    header->clean = clean;
+    header->position = reg->applied;
+    header->rng_state = reg->rng_state;
+}
+
+/*
+    Map a state file of the given size read-write and shared.
+*/
+void* map_state_file(int fd, size_t bytes, const char *path)
+{
+    void *mapping = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        fprintf(stderr, "Failed to map the state file %s.\n", path);
+        return NULL;
+    }
+    return mapping;
+}
+
+qreg* initMappedRegister(size_t n, const char *path)
+{
+    if (n > MAX_DENSE_QUBITS)
+    {
+        fprintf(stderr, "A dense register holds at most %d qubits, %zu requested.\n", MAX_DENSE_QUBITS, n);
+        return NULL;
+    }
+
+    size_t bytes = STATE_HEADER_SIZE + ((size_t)1 << n) * sizeof(amplitude);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    //The new file reads as zeros, so only the first amplitude is written.
+    if (fd < 0 || ftruncate(fd, bytes) != 0)
+    {
+        fprintf(stderr, "Failed to create the state file %s.\n", path);
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return NULL;
+    }
+    unsigned char *mapping = (unsigned char*) map_state_file(fd, bytes, path);
+    if (mapping == NULL)
+    {
+        return NULL;
+    }
+
+    qreg *reg = initRegisterFields(n);
+    reg->mapping = mapping;
+    reg->mapping_size = bytes;
+    reg->matrix = (amplitude*)(mapping + STATE_HEADER_SIZE);
+    reg->matrix[0] = 1;
+
+    state_header *header = (state_header*) mapping;
+    fill_state_header(reg, header, 0);
+    return reg;
+}
+
+bool checkpoint(qreg *reg)
+{
+    if (reg->mapping == NULL)
+    {
+        fprintf(stderr, "Only registers made by initMappedRegister or restore_register can be checkpointed, use save_state.\n");
+        return false;
+    }
+    flush_pending(reg);
+
+    state_header *header = (state_header*) reg->mapping;
+    fill_state_header(reg, header, 0);
+
+    //Amplitudes first, the header only turns clean once they are on disk.
+    if (msync(reg->mapping, reg->mapping_size, MS_SYNC) != 0)
+    {
+        fprintf(stderr, "Failed to sync the state file.\n");
+        return false;
+    }
+    header->clean = 1;
+    if (msync(reg->mapping, STATE_HEADER_SIZE, MS_SYNC) != 0)
+    {
+        fprintf(stderr, "Failed to sync the state file.\n");
+        return false;
+    }
+    reg->clean_flag = &header->clean;
+    return true;
+}
+
+/*
+    write() all of bytes, which may take several calls.
+*/
+bool write_all(int fd, const void *data, size_t bytes)
+{
+    const unsigned char *p = (const unsigned char*) data;
+    while (bytes > 0)
+    {
+        ssize_t done = write(fd, p, bytes < STATE_WRITE_CHUNK ? bytes : STATE_WRITE_CHUNK);
+        if (done <= 0)
+        {
+            return false;
+        }
+        p += done;
+        bytes -= done;
+    }
+    return true;
+}
+
+bool save_state(qreg *reg, const char *path)
+{
+    flush_pending(reg);
+    if (reg->sparse != NULL)
+    {
+        fprintf(stderr, "Sparse registers have no state file, call make_dense first.\n");
+        return false;
+    }
+
+    char temp[strlen(path) + 5];
+    sprintf(temp, "%s.tmp", path);
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Failed to create the state file %s.\n", temp);
+        return false;
+    }
+
+    unsigned char header[STATE_HEADER_SIZE];
+    memset(header, 0, sizeof(header));
+    fill_state_header(reg, (state_header*) header, 1);
+
+    bool ok = write_all(fd, header, sizeof(header)) &&
+        write_all(fd, reg->matrix, reg_states(reg) * sizeof(amplitude)) &&
+        fsync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+
+    if (!ok || rename(temp, path) != 0)
+    {
+        fprintf(stderr, "Failed to write the state file %s.\n", path);
+        unlink(temp);
+        return false;
+    }
+    return true;
+}
+
+qreg* restore_register(const char *path)
+{
+    int fd = open(path, O_RDWR);
+    state_header header;
+    if (fd < 0 || read(fd, &header, sizeof(header)) != sizeof(header))
+    {
+        fprintf(stderr, "Failed to read the state file %s.\n", path);
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    const char *problem = NULL;
+    if (memcmp(header.magic, STATE_MAGIC, 8) != 0 || header.version != STATE_VERSION)
+    {
+        problem = "is not a state file";
+    }
+    else if (header.amplitude_size != sizeof(amplitude))
+    {
+        problem = "was written with a different amplitude precision";
+    }
+    else if (header.qubits > MAX_DENSE_QUBITS)
+    {
+        problem = "has too many qubits";
+    }
+    else if (!header.clean)
+    {
+        problem = "was modified after its last checkpoint";
+    }
+
+    size_t bytes = STATE_HEADER_SIZE + ((size_t)1 << header.qubits) * sizeof(amplitude);
+    struct stat st;
+    if (problem == NULL && (fstat(fd, &st) != 0 || (size_t)st.st_size < bytes))
+    {
+        problem = "is truncated";
+    }
+    if (problem != NULL)
+    {
+        fprintf(stderr, "%s %s.\n", path, problem);
+        close(fd);
+        return NULL;
+    }
+
+    unsigned char *mapping = (unsigned char*) map_state_file(fd, bytes, path);
+    if (mapping == NULL)
+    {
+        return NULL;
+    }
+
+    qreg *reg = initRegisterFields(header.qubits);
+    reg->mapping = mapping;
+    reg->mapping_size = bytes;
+    reg->matrix = (amplitude*)(mapping + STATE_HEADER_SIZE);
+    reg->applied = header.position;
+    reg->rng_state = header.rng_state;
+    reg->clean_flag = &((state_header*) mapping)->clean;
+    return reg;
+}
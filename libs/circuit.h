@@ -0,0 +1,532 @@
+#pragma once
+#include "kernels.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+
+/*
+    Binary circuit files.
+
+    A circuit file holds the operations of a register in the order they were
+    applied, so a circuit built by one program can be simulated by another
+    without rerunning it. The layout is
+
+        header  "QSIMCIRC", version, qubit count and operation count,
+                little-endian, CIRCUIT_HEADER_SIZE bytes
+        records one per stored_op, back to back
+
+    A record starts with the operation character of stored_op, with the top
+    bit set when a control mask follows. Qubit indexes, counts and the mask
+    are LEB128 varints, so a gate on a low qubit takes three bytes:
+
+        'x'             first and second qubit
+        '+'             control qubit, count, targets
+        anything else   [ctrl_mask], count, targets, then the parameters:
+                        U theta, phi, lambda as doubles
+                        R theta as a double and the axis as a varint
+                        P lambda as a double
+
+    Records are streamed to the file while gates are applied
+    (open_circuit_stream) or written from the history at once (save_circuit).
+    load_circuit maps the file read-only and replay_circuit decodes records
+    straight out of the mapping, nothing is copied or parsed ahead.
+*/
+
+#define CIRCUIT_MAGIC "QSIMCIRC"
+#define CIRCUIT_VERSION 1
+#define CIRCUIT_HEADER_SIZE 24
+
+//Bytes encoded before the stream hands them to the file.
+#define CIRCUIT_BUFFER ((size_t)1 << 20)
+
+//Flag of the operation byte telling that a control mask follows.
+#define CIRCUIT_CTRL 0x80
+
+struct circuit_stream{
+    FILE *file;
+    unsigned char *buffer;
+    size_t used;
+    unsigned long long count;
+    bool failed;
+};
+
+/*
+    Circuit file mapped into memory by load_circuit.
+*/
+typedef struct circuit_file{
+    const unsigned char *data;
+    size_t length;
+    unsigned int qubits;
+    unsigned long long count;
+}circuit_file;
+
+/*
+    Start writing every operation applied to the register to a circuit
+    file at path, on top of the history. Returns NULL with a message on
+    stderr when the file cannot be created.
+*/
+circuit_stream* open_circuit_stream(qreg *reg, const char *path);
+
+/*
+    Finish the circuit file of the register and detach it.
+    Does nothing when no stream is open.
+*/
+void close_circuit_stream(qreg *reg);
+
+/*
+    Write the recorded history of the register to a circuit file.
+    Returns false with a message on stderr when the file cannot be written.
+*/
+bool save_circuit(qreg *reg, const char *path);
+
+/*
+    Map a circuit file into memory. Returns NULL with a message on stderr
+    when the file cannot be opened or is not a circuit file.
+*/
+circuit_file* load_circuit(const char *path);
+
+/*
+    Apply the operations of a circuit file to the register, recording them
+    like the gate functions do. Deferred registers only record them until
+    flush_operations. Returns false with a message on stderr when the circuit
+    does not fit the register or the file is corrupt, the operations before
+    the faulty one stay applied.
+*/
+bool replay_circuit(qreg *reg, const circuit_file *circuit);
+
+/*
+    Same as replay_circuit, skipping the first operations of the file.
+    Used to resume a register restored from a checkpoint, with
+    first = reg->applied.
+*/
+bool replay_circuit_from(qreg *reg, const circuit_file *circuit, unsigned long long first);
+
+/*
+    Unmap a circuit file.
+*/
+void free_circuit(circuit_file *circuit);
+
+void execute_indexed(qreg *reg, const stored_op *op, const int *indexes);
+
+/*
+    Write the buffered records to the file.
+*/
+void stream_drain(circuit_stream *stream)
+{
+    if (stream->used > 0 && fwrite(stream->buffer, 1, stream->used, stream->file) != stream->used)
+    {
+        if (!stream->failed)
+        {
+            fprintf(stderr, "Failed to write the circuit file.\n");
+        }
+        stream->failed = true;
+    }
+    stream->used = 0;
+}
+
+/*
+    Make room for bytes more bytes in the buffer.
+*/
+void stream_reserve(circuit_stream *stream, size_t bytes)
+{
+    if (stream->used + bytes > CIRCUIT_BUFFER)
+    {
+        stream_drain(stream);
+    }
+}
+
+void put_varint(circuit_stream *stream, unsigned long long value)
+{
+    stream_reserve(stream, 10);
+    while (value >= 0x80)
+    {
+        stream->buffer[stream->used++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    stream->buffer[stream->used++] = (unsigned char)value;
+}
+
+void put_le64(unsigned char *out, unsigned long long value)
+{
+    for (int b = 0; b < 8; b++)
+    {
+        out[b] = (unsigned char)(value >> (8 * b));
+    }
+}
+
+unsigned long long get_le64(const unsigned char *in)
+{
+    unsigned long long value = 0;
+    for (int b = 0; b < 8; b++)
+    {
+        value |= (unsigned long long)in[b] << (8 * b);
+    }
+    return value;
+}
+
+void put_double(circuit_stream *stream, double value)
+{
+    unsigned long long bits;
+    memcpy(&bits, &value, sizeof(bits));
+    stream_reserve(stream, 8);
+    put_le64(stream->buffer + stream->used, bits);
+    stream->used += 8;
+}
+
+void stream_operation(circuit_stream *stream, const stored_op *op, const int *indexes)
+{
+    stream_reserve(stream, 1);
+    stream->buffer[stream->used++] = (unsigned char)op->operation | (op->ctrl_mask != 0 ? CIRCUIT_CTRL : 0);
+    stream->count++;
+
+    if (op->operation == 'x')
+    {
+        put_varint(stream, op->control_idx);
+        put_varint(stream, op->target_idx);
+        return;
+    }
+
+    if (op->operation == '+')
+    {
+        put_varint(stream, op->control_idx);
+    }
+    if (op->ctrl_mask != 0)
+    {
+        put_varint(stream, op->ctrl_mask);
+    }
+    put_varint(stream, op->qbit_buffSize);
+    for (int i = 0; i < op->qbit_buffSize; i++)
+    {
+        put_varint(stream, indexes[i]);
+    }
+
+    switch (op->operation)
+    {
+        case 'U':
+            put_double(stream, op->params[0]);
+            put_double(stream, op->params[1]);
+            put_double(stream, op->params[2]);
+            break;
+        case 'R':
+            put_double(stream, op->params[0]);
+            put_varint(stream, (unsigned long long)op->params[1]);
+            break;
+        case 'P':
+            put_double(stream, op->params[0]);
+            break;
+    }
+}
+
+/*
+    Create a circuit file with a header for qubits, the operation count is
+    filled in by stream_close.
+*/
+circuit_stream* stream_open(const char *path, unsigned int qubits)
+{
+    FILE *file = fopen(path, "wb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Failed to create the circuit file %s.\n", path);
+        return NULL;
+    }
+
+    circuit_stream *stream = (circuit_stream*) malloc(sizeof(circuit_stream));
+    stream->file = file;
+    stream->buffer = (unsigned char*) malloc(CIRCUIT_BUFFER);
+    stream->used = CIRCUIT_HEADER_SIZE;
+    stream->count = 0;
+    stream->failed = false;
+
+    memcpy(stream->buffer, CIRCUIT_MAGIC, 8);
+    for (int b = 0; b < 4; b++)
+    {
+        stream->buffer[8 + b] = (unsigned char)(CIRCUIT_VERSION >> (8 * b));
+        stream->buffer[12 + b] = (unsigned char)(qubits >> (8 * b));
+    }
+    put_le64(stream->buffer + 16, 0);
+    return stream;
+}
+
+/*
+    Write what is left, patch the operation count into the header and close
+    the file. Returns false if any write failed.
+*/
+bool stream_close(circuit_stream *stream)
+{
+    unsigned char count[8];
+    stream_drain(stream);
+    put_le64(count, stream->count);
+
+    if (fseek(stream->file, 16, SEEK_SET) != 0 || fwrite(count, 1, 8, stream->file) != 8)
+    {
+        stream->failed = true;
+    }
+    if (fclose(stream->file) != 0 || stream->failed)
+    {
+        fprintf(stderr, "The circuit file was not completely written.\n");
+        stream->failed = true;
+    }
+
+    bool ok = !stream->failed;
+    free(stream->buffer);
+    free(stream);
+    return ok;
+}
+
+circuit_stream* open_circuit_stream(qreg *reg, const char *path)
+{
+    close_circuit_stream(reg);
+    reg->stream = stream_open(path, reg->size);
+    return reg->stream;
+}
+
+void close_circuit_stream(qreg *reg)
+{
+    if (reg->stream != NULL)
+    {
+        stream_close(reg->stream);
+        reg->stream = NULL;
+    }
+}
+
+bool save_circuit(qreg *reg, const char *path)
+{
+    circuit_stream *stream = stream_open(path, reg->size);
+    if (stream == NULL)
+    {
+        return false;
+    }
+
+    for (unsigned int i = 0; i < history_count(reg); i++)
+    {
+        stream_operation(stream, &(reg->history[i]), op_indexes(reg, &(reg->history[i])));
+    }
+    return stream_close(stream);
+}
+
+circuit_file* load_circuit(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Failed to open the circuit file %s.\n", path);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < CIRCUIT_HEADER_SIZE)
+    {
+        fprintf(stderr, "%s is not a circuit file.\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        fprintf(stderr, "Failed to map the circuit file %s.\n", path);
+        return NULL;
+    }
+
+    const unsigned char *bytes = (const unsigned char*) data;
+    unsigned int version = 0, qubits = 0;
+    for (int b = 0; b < 4; b++)
+    {
+        version |= (unsigned int)bytes[8 + b] << (8 * b);
+        qubits |= (unsigned int)bytes[12 + b] << (8 * b);
+    }
+    if (memcmp(bytes, CIRCUIT_MAGIC, 8) != 0 || version != CIRCUIT_VERSION)
+    {
+        fprintf(stderr, "%s is not a version %d circuit file.\n", path, CIRCUIT_VERSION);
+        munmap(data, st.st_size);
+        return NULL;
+    }
+
+    //Records are read once front to back.
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    circuit_file *circuit = (circuit_file*) malloc(sizeof(circuit_file));
+    circuit->data = bytes;
+    circuit->length = st.st_size;
+    circuit->qubits = qubits;
+    circuit->count = get_le64(bytes + 16);
+    return circuit;
+}
+
+void free_circuit(circuit_file *circuit)
+{
+    if (circuit == NULL)
+    {
+        return;
+    }
+    munmap((void*) circuit->data, circuit->length);
+    free(circuit);
+}
+
+/*
+    Read a varint at *pos, false if it runs past end or 64 bits.
+*/
+bool get_varint(const unsigned char *data, size_t end, size_t *pos, unsigned long long *value)
+{
+    unsigned long long v = 0;
+    for (int shift = 0; shift < 64 && *pos < end; shift += 7)
+    {
+        unsigned char byte = data[(*pos)++];
+        v |= (unsigned long long)(byte & 0x7f) << shift;
+        if (byte < 0x80)
+        {
+            *value = v;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool get_double(const unsigned char *data, size_t end, size_t *pos, double *value)
+{
+    if (*pos + 8 > end)
+    {
+        return false;
+    }
+    unsigned long long bits = get_le64(data + *pos);
+    memcpy(value, &bits, sizeof(bits));
+    *pos += 8;
+    return true;
+}
+
+/*
+    Decode the record at *pos into op and indexes, which must hold 65535
+    entries. Returns false when the record is malformed, names a qubit
+    outside the register or has a target among its controls.
+*/
+bool decode_operation(const circuit_file *circuit, size_t *pos, unsigned int qubits, stored_op *op, int *indexes)
+{
+    const unsigned char *data = circuit->data;
+    size_t end = circuit->length;
+    unsigned long long v, n;
+
+    unsigned char code = data[(*pos)++];
+    op->operation = code & ~CIRCUIT_CTRL;
+    op->control_idx = 0;
+    op->target_idx = 0;
+    op->qbit_buffSize = 0;
+    op->qbit_offset = 0;
+    op->params[0] = op->params[1] = op->params[2] = 0;
+    op->ctrl_mask = 0;
+
+    if (op->operation == 'x')
+    {
+        unsigned long long first, second;
+        if (!get_varint(data, end, pos, &first) || !get_varint(data, end, pos, &second) ||
+            first >= qubits || second >= qubits)
+        {
+            return false;
+        }
+        op->control_idx = first;
+        op->target_idx = second;
+        return true;
+    }
+
+    if (strchr("+XYZHSTURP", op->operation) == NULL || op->operation == 0)
+    {
+        return false;
+    }
+    if (op->operation == '+')
+    {
+        if (!get_varint(data, end, pos, &v) || v >= qubits)
+        {
+            return false;
+        }
+        op->control_idx = v;
+    }
+    if (code & CIRCUIT_CTRL)
+    {
+        if (!get_varint(data, end, pos, &v) || (qubits < 64 && (v >> qubits) != 0))
+        {
+            return false;
+        }
+        op->ctrl_mask = v;
+    }
+
+    if (!get_varint(data, end, pos, &n) || n > 0xffff)
+    {
+        return false;
+    }
+    op->qbit_buffSize = n;
+    for (unsigned long long i = 0; i < n; i++)
+    {
+        //A target that is also a control would run the kernel past the state.
+        if (!get_varint(data, end, pos, &v) || v >= qubits || ((op->ctrl_mask >> v) & 1) ||
+            (op->operation == '+' && v == (unsigned long long)op->control_idx))
+        {
+            return false;
+        }
+        indexes[i] = v;
+    }
+
+    switch (op->operation)
+    {
+        case 'U':
+            return get_double(data, end, pos, &op->params[0]) &&
+                get_double(data, end, pos, &op->params[1]) &&
+                get_double(data, end, pos, &op->params[2]);
+        case 'R':
+            if (!get_double(data, end, pos, &op->params[0]) || !get_varint(data, end, pos, &v) || v > 2)
+            {
+                return false;
+            }
+            op->params[1] = v;
+            return true;
+        case 'P':
+            return get_double(data, end, pos, &op->params[0]);
+    }
+    return true;
+}
+
+bool replay_circuit(qreg *reg, const circuit_file *circuit)
+{
+    return replay_circuit_from(reg, circuit, 0);
+}
+
+bool replay_circuit_from(qreg *reg, const circuit_file *circuit, unsigned long long first)
+{
+    if (circuit->qubits > reg->size)
+    {
+        fprintf(stderr, "The circuit needs %u qubits, the register holds %u.\n", circuit->qubits, reg->size);
+        return false;
+    }
+
+    int *indexes = (int*) malloc(0x10000 * sizeof(int));
+    size_t pos = CIRCUIT_HEADER_SIZE;
+    unsigned long long done = 0;
+    stored_op op;
+
+    while (pos < circuit->length)
+    {
+        if (!decode_operation(circuit, &pos, circuit->qubits, &op, indexes))
+        {
+            fprintf(stderr, "Corrupt circuit record %llu at byte %zu.\n", done, pos);
+            free(indexes);
+            return false;
+        }
+
+        if (done++ < first)
+        {
+            continue;
+        }
+        if (!reg->deferred)
+        {
+            execute_indexed(reg, &op, indexes);
+        }
+        record_operation(reg, op.operation, indexes, op.qbit_buffSize, op.control_idx, op.target_idx, op.params, op.ctrl_mask);
+    }
+    free(indexes);
+
+    //A writer that did not finish leaves the count at zero.
+    if (circuit->count != 0 && done != circuit->count)
+    {
+        fprintf(stderr, "The circuit file holds %llu of its %llu operations.\n", done, circuit->count);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,466 @@
+#pragma once
+#include "noise.h"
+
+/*
+    Density matrix registers.
+
+    The 2^n x 2^n density matrix rho of n qubits is stored vectorized as the
+    state vector of a 2n qubit register: entry (r, c) sits at index
+    r | c << n, so qubit q of the rows is qubit q of that register and
+    qubit q of the columns is qubit q + n. A gate U on qubit q, rho ->
+    U rho U^dagger, is then the 4x4 superoperator U (x) conj(U) on the pair
+    (q, q + n), which apply_kq runs in one sweep. Kraus channels are the sum
+    of such superoperators, so a whole channel also costs one sweep.
+    Controlled gates act on the row and the column qubits separately, each
+    pass only touching the subspace where the controls are set.
+
+    The register holds 4^n amplitudes, DENSITY_MAX_QUBITS keeps that at
+    4 GiB in double precision.
+*/
+
+#define DENSITY_MAX_QUBITS 14
+
+typedef enum noise_channel{
+    CHANNEL_DEPOLARIZING,
+    CHANNEL_BIT_FLIP,
+    CHANNEL_PHASE_FLIP,
+    CHANNEL_AMPLITUDE_DAMPING
+}noise_channel;
+
+typedef struct qdensity{
+    unsigned int size;
+    qreg *vec;
+}qdensity;
+
+/*
+    Initialize an n qubit density matrix in the pure state |0..0><0..0|.
+    Returns NULL with a message on stderr above DENSITY_MAX_QUBITS or when
+    the memory cannot be allocated.
+*/
+qdensity* initDensityRegister(size_t n);
+
+/*
+    Release the density matrix.
+*/
+void free_density(qdensity *dm);
+
+/*
+    rho -> U rho U^dagger for a 2x2 unitary on the target qubit.
+*/
+void density_apply_1q(qdensity *dm, int target, const double complex m[2][2]);
+
+/*
+    Same as density_apply_1q where all qubits in ctrl_mask are |1>.
+*/
+void density_apply_controlled_1q(qdensity *dm, unsigned long long ctrl_mask, int target, const double complex m[2][2]);
+
+/*
+    rho -> sum_k K_k rho K_k^dagger for count 2x2 Kraus operators on the
+    target qubit, in one sweep.
+*/
+void density_apply_kraus(qdensity *dm, int target, const double complex (*kraus)[2][2], int count);
+
+/*
+    Same gates as X, Y, Z, H, CNOT and SWAP of operations.h.
+*/
+void density_X(qdensity *dm, int *buff, int n);
+void density_Y(qdensity *dm, int *buff, int n);
+void density_Z(qdensity *dm, int *buff, int n);
+void density_H(qdensity *dm, int *buff, int n);
+void density_CNOT(qdensity *dm, int control_idx, int *buff, int n);
+void density_SWAP(qdensity *dm, int first_idx, int second_idx);
+
+/*
+    The channels of noise.h applied exactly: depolarizing, bit flip and
+    phase flip with error probability p, amplitude damping with decay
+    probability gamma.
+*/
+void density_depolarize(qdensity *dm, int qubit, double p);
+void density_bit_flip(qdensity *dm, int qubit, double p);
+void density_phase_flip(qdensity *dm, int qubit, double p);
+void density_amplitude_damp(qdensity *dm, int qubit, double gamma);
+
+/*
+    Apply an operation recorded in the history of circuit.
+*/
+void density_execute(qdensity *dm, qreg *circuit, const stored_op *op);
+
+/*
+    Exact counterpart of run_trajectories: the circuit recorded in circuit
+    with the channels of noise after every gate, on a new density matrix.
+    The readout error is left to density_probabilities.
+*/
+qdensity* run_density(qreg *circuit, const noise_model *noise);
+
+/*
+    Entry (r, c) of the density matrix.
+*/
+double complex density_element(qdensity *dm, unsigned long long r, unsigned long long c);
+
+/*
+    Measurement probabilities of every basis state, the diagonal of rho,
+    with every bit read wrong with probability readout. out holds 2^n values.
+*/
+void density_probabilities(qdensity *dm, double readout, double *out);
+
+/*
+    Purity tr(rho^2), 1 for pure states.
+*/
+double density_purity(qdensity *dm);
+
+qdensity* initDensityRegister(size_t n)
+{
+    if (n > DENSITY_MAX_QUBITS)
+    {
+        fprintf(stderr, "A density matrix holds at most %d qubits, %zu requested.\n", DENSITY_MAX_QUBITS, n);
+        return NULL;
+    }
+
+    //|0..0><0..0| is the first entry, which initQuRegister already sets.
+    qreg *vec = initQuRegister(2 * n);
+    if (vec == NULL)
+    {
+        return NULL;
+    }
+    set_recording(vec, false);
+
+    qdensity *dm = (qdensity*) malloc(sizeof(qdensity));
+    dm->size = n;
+    dm->vec = vec;
+    return dm;
+}
+
+void free_density(qdensity *dm)
+{
+    if (dm == NULL)
+    {
+        return;
+    }
+    free_qreg(dm->vec);
+    free(dm);
+}
+
+/*
+    Superoperator sum_k K_k (x) conj(K_k) on (row qubit, column qubit),
+    bit 0 of its indexes is the row qubit as apply_kq expects.
+*/
+void kraus_superoperator(const double complex (*kraus)[2][2], int count, double complex s[16])
+{
+    for (int out = 0; out < 4; out++)
+    {
+        for (int in = 0; in < 4; in++)
+        {
+            double complex sum = 0;
+            for (int k = 0; k < count; k++)
+            {
+                sum += kraus[k][out & 1][in & 1] * conj(kraus[k][out >> 1][in >> 1]);
+            }
+            s[out * 4 + in] = sum;
+        }
+    }
+}
+
+void density_apply_kraus(qdensity *dm, int target, const double complex (*kraus)[2][2], int count)
+{
+    double complex s[16];
+    int qubits[2] = {target, target + (int)dm->size};
+
+    kraus_superoperator(kraus, count, s);
+    apply_kq(dm->vec, qubits, 2, s);
+}
+
+void density_apply_1q(qdensity *dm, int target, const double complex m[2][2])
+{
+    density_apply_kraus(dm, target, (const double complex (*)[2][2]) m, 1);
+}
+
+void density_apply_controlled_1q(qdensity *dm, unsigned long long ctrl_mask, int target, const double complex m[2][2])
+{
+    double complex conj_m[2][2] = {{conj(m[0][0]), conj(m[0][1])}, {conj(m[1][0]), conj(m[1][1])}};
+
+    apply_controlled_1q(dm->vec, ctrl_mask, target, m);
+    apply_controlled_1q(dm->vec, ctrl_mask << dm->size, target + dm->size, conj_m);
+}
+
+void density_X(qdensity *dm, int *buff, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        density_apply_1q(dm, buff[i], X_matrix);
+    }
+}
+
+void density_Y(qdensity *dm, int *buff, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        density_apply_1q(dm, buff[i], Y_matrix);
+    }
+}
+
+void density_Z(qdensity *dm, int *buff, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        density_apply_1q(dm, buff[i], Z_matrix);
+    }
+}
+
+void density_H(qdensity *dm, int *buff, int n)
+{
+    const double complex h[2][2] = {{M_SQRT1_2, M_SQRT1_2}, {M_SQRT1_2, -M_SQRT1_2}};
+    for (int i = 0; i < n; i++)
+    {
+        density_apply_1q(dm, buff[i], h);
+    }
+}
+
+void density_CNOT(qdensity *dm, int control_idx, int *buff, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        density_apply_controlled_1q(dm, 1ULL << control_idx, buff[i], X_matrix);
+    }
+}
+
+void density_SWAP(qdensity *dm, int first_idx, int second_idx)
+{
+    //Rows and columns are swapped in the same sweep.
+    int a[2] = {first_idx, first_idx + (int)dm->size};
+    int b[2] = {second_idx, second_idx + (int)dm->size};
+    kernel_swap_bits(dm->vec, a, b, 2);
+}
+
+/*
+    Kraus operators of a channel of noise.h with rate p, returns their count.
+*/
+int channel_kraus(noise_channel channel, double p, double complex kraus[4][2][2])
+{
+    double keep = sqrt(1 - p);
+    memset(kraus, 0, 4 * sizeof(kraus[0]));
+    kraus[0][0][0] = kraus[0][1][1] = keep;
+
+    switch (channel)
+    {
+        case CHANNEL_DEPOLARIZING:
+        {
+            double flip = sqrt(p / 3);
+            kraus[1][0][1] = kraus[1][1][0] = flip;
+            kraus[2][0][1] = -flip*j;
+            kraus[2][1][0] = flip*j;
+            kraus[3][0][0] = flip;
+            kraus[3][1][1] = -flip;
+            return 4;
+        }
+        case CHANNEL_BIT_FLIP:
+            kraus[1][0][1] = kraus[1][1][0] = sqrt(p);
+            return 2;
+        case CHANNEL_PHASE_FLIP:
+            kraus[1][0][0] = sqrt(p);
+            kraus[1][1][1] = -sqrt(p);
+            return 2;
+        default:
+            kraus[0][0][0] = 1;
+            kraus[1][0][1] = sqrt(p);
+            return 2;
+    }
+}
+
+void density_channel(qdensity *dm, int qubit, noise_channel channel, double p)
+{
+    double complex kraus[4][2][2];
+    int count = channel_kraus(channel, p, kraus);
+    density_apply_kraus(dm, qubit, (const double complex (*)[2][2]) kraus, count);
+}
+
+void density_depolarize(qdensity *dm, int qubit, double p)
+{
+    density_channel(dm, qubit, CHANNEL_DEPOLARIZING, p);
+}
+
+void density_bit_flip(qdensity *dm, int qubit, double p)
+{
+    density_channel(dm, qubit, CHANNEL_BIT_FLIP, p);
+}
+
+void density_phase_flip(qdensity *dm, int qubit, double p)
+{
+    density_channel(dm, qubit, CHANNEL_PHASE_FLIP, p);
+}
+
+void density_amplitude_damp(qdensity *dm, int qubit, double gamma)
+{
+    density_channel(dm, qubit, CHANNEL_AMPLITUDE_DAMPING, gamma);
+}
+
+void density_execute(qdensity *dm, qreg *circuit, const stored_op *op)
+{
+    const int *indexes = op_indexes(circuit, op);
+    double complex m[2][2];
+
+    switch (op->operation)
+    {
+        case 'x':
+            density_SWAP(dm, op->control_idx, op->target_idx);
+            return;
+        case '+':
+            density_CNOT(dm, op->control_idx, (int*) indexes, op->qbit_buffSize);
+            return;
+    }
+
+    operation_matrix(op, m);
+    for (int i = 0; i < op->qbit_buffSize; i++)
+    {
+        if (op->ctrl_mask != 0)
+        {
+            density_apply_controlled_1q(dm, op->ctrl_mask, indexes[i], m);
+        }
+        else
+        {
+            density_apply_1q(dm, indexes[i], m);
+        }
+    }
+}
+
+/*
+    out = a * b for 4x4 superoperators, out may alias neither.
+*/
+void superoperator_product(const double complex a[16], const double complex b[16], double complex out[16])
+{
+    for (int r = 0; r < 4; r++)
+    {
+        for (int c = 0; c < 4; c++)
+        {
+            double complex sum = 0;
+            for (int k = 0; k < 4; k++)
+            {
+                sum += a[r * 4 + k] * b[k * 4 + c];
+            }
+            out[r * 4 + c] = sum;
+        }
+    }
+}
+
+/*
+    Superoperator of the single qubit channels of a noise model, in the
+    order apply_noise samples them.
+*/
+void noise_superoperator(const noise_model *noise, double complex s[16])
+{
+    double complex kraus[4][2][2], step[16], next[16];
+    const double rates[4] = {noise->depolarizing, noise->bit_flip, noise->phase_flip, noise->amplitude_damping};
+
+    memset(s, 0, 16 * sizeof(double complex));
+    for (int d = 0; d < 4; d++)
+    {
+        s[d * 5] = 1;
+    }
+
+    for (int c = 0; c < 4; c++)
+    {
+        if (rates[c] > 0)
+        {
+            int count = channel_kraus((noise_channel) c, rates[c], kraus);
+            kraus_superoperator((const double complex (*)[2][2]) kraus, count, step);
+            superoperator_product(step, s, next);
+            memcpy(s, next, sizeof(next));
+        }
+    }
+}
+
+qdensity* run_density(qreg *circuit, const noise_model *noise)
+{
+    qdensity *dm = initDensityRegister(circuit->size);
+    if (dm == NULL)
+    {
+        return NULL;
+    }
+    set_threads(dm->vec, circuit->num_threads);
+
+    double complex channel[16], gate[16], fused[16];
+    noise_superoperator(noise, channel);
+    bool noisy = noise->depolarizing > 0 || noise->bit_flip > 0 || noise->phase_flip > 0 || noise->amplitude_damping > 0;
+
+    for (unsigned int i = 0; i < circuit->history_size; i++)
+    {
+        const stored_op *op = &(circuit->history[i]);
+        const int *indexes = op_indexes(circuit, op);
+
+        //Single qubit gates and their noise are one superoperator, one sweep.
+        if (op->operation != 'x' && op->operation != '+' && op->ctrl_mask == 0)
+        {
+            double complex m[2][2];
+            operation_matrix(op, m);
+            kraus_superoperator((const double complex (*)[2][2]) m, 1, gate);
+            superoperator_product(channel, gate, fused);
+
+            for (int t = 0; t < op->qbit_buffSize; t++)
+            {
+                int qubits[2] = {indexes[t], indexes[t] + (int)dm->size};
+                apply_kq(dm->vec, qubits, 2, fused);
+            }
+            continue;
+        }
+
+        density_execute(dm, circuit, op);
+        unsigned long long mask = operation_qubits(circuit, op);
+        for (int q = 0; noisy && mask != 0; q++, mask >>= 1)
+        {
+            if (mask & 1)
+            {
+                int qubits[2] = {q, q + (int)dm->size};
+                apply_kq(dm->vec, qubits, 2, channel);
+            }
+        }
+    }
+    return dm;
+}
+
+double complex density_element(qdensity *dm, unsigned long long r, unsigned long long c)
+{
+    return dm->vec->matrix[r | c << dm->size];
+}
+
+void density_probabilities(qdensity *dm, double readout, double *out)
+{
+    size_t size = (size_t)1 << dm->size;
+
+    //Diagonal entries r | r << n are spaced 2^n + 1 apart.
+    for (size_t r = 0; r < size; r++)
+    {
+        out[r] = AMP_RE(dm->vec->matrix[r * (size + 1)]);
+    }
+
+    //Each bit flips independently, one mixing pass per bit.
+    if (readout > 0)
+    {
+        for (unsigned int q = 0; q < dm->size; q++)
+        {
+            size_t bit = (size_t)1 << q;
+            for (size_t r = 0; r < size; r++)
+            {
+                if (!(r & bit))
+                {
+                    double p0 = out[r], p1 = out[r | bit];
+                    out[r] = (1 - readout) * p0 + readout * p1;
+                    out[r | bit] = (1 - readout) * p1 + readout * p0;
+                }
+            }
+        }
+    }
+}
+
+double density_purity(qdensity *dm)
+{
+    //tr(rho^2) is the squared norm of the vectorized Hermitian rho.
+    size_t size = reg_states(dm->vec);
+    amplitude *amp = dm->vec->matrix;
+    double purity = 0;
+
+    PARALLEL_SUM(dm->vec, size, 1, purity)
+    for (size_t i = 0; i < size; i++)
+    {
+        purity += amp_probability(amp[i]);
+    }
+    return purity;
+}
@@ -0,0 +1,425 @@
+#pragma once
+#include "measure.h"
+
+/*
+    Diagonal gates in one sweep.
+
+    Z, S, T, P, RZ, CZ, controlled phases, ZZ rotations and phase oracles
+    only multiply each amplitude by a factor depending on its basis index.
+    A diag_accumulator collects any number of them as diag_terms, plus
+    phase functions of the whole index, and apply_diagonal multiplies the
+    state by all of them in a single pass (kernel_diagonal) instead of one
+    pass per gate. The terms commute, so the order they were added in does
+    not matter.
+
+    The history, the circuit stream and reg->applied see every term as
+    gates: X on the qubits whose bit in the term is 0, a phase controlled
+    by the rest of the term, and the X gates again. Phase functions have
+    no such form, so registers that record or stream refuse them.
+    Deferred registers run their pending gates first.
+*/
+
+typedef struct diag_accumulator{
+    unsigned int qubits;
+    diag_term *terms;
+    size_t count;
+    size_t capacity;
+    phase_function *functions;
+    void **contexts;
+    size_t function_count;
+    size_t function_capacity;
+}diag_accumulator;
+
+/*
+    Empty accumulator for a register of the given number of qubits.
+*/
+diag_accumulator* new_diagonal(unsigned int qubits);
+
+/*
+    Release the accumulator.
+*/
+void free_diagonal(diag_accumulator *acc);
+
+/*
+    Drop everything accumulated so far.
+*/
+void clear_diagonal(diag_accumulator *acc);
+
+/*
+    Multiply the amplitudes whose bits in mask equal value by factor.
+*/
+void diagonal_term(diag_accumulator *acc, unsigned long long mask, unsigned long long value, double complex factor);
+
+/*
+    Add a diagonal 2x2 matrix on the target, controlled by ctrl_mask.
+    Returns false with a message on stderr when m is not diagonal.
+*/
+bool diagonal_gate(diag_accumulator *acc, unsigned long long ctrl_mask, int target, const double complex m[2][2]);
+
+/*
+    Common diagonal gates.
+*/
+void diagonal_Z(diag_accumulator *acc, int target);
+void diagonal_P(diag_accumulator *acc, int target, double lambda);
+void diagonal_RZ(diag_accumulator *acc, int target, double theta);
+void diagonal_CZ(diag_accumulator *acc, int control, int target);
+void diagonal_CP(diag_accumulator *acc, int control, int target, double lambda);
+
+/*
+    exp(-i theta/2 Z_a Z_b), the two qubit cost term of QAOA.
+*/
+void diagonal_RZZ(diag_accumulator *acc, int first, int second, double theta);
+
+/*
+    Multiply every amplitude by f(index, context).
+*/
+void diagonal_function(diag_accumulator *acc, phase_function f, void *context);
+
+/*
+    Apply everything accumulated to the register in one sweep. The
+    accumulator is left as it is and can be applied again. Returns false
+    with a message on stderr, the state untouched, when the register
+    records or streams its gates and the accumulator holds phase functions
+    or terms that are not a pure phase.
+*/
+bool apply_diagonal(qreg *reg, const diag_accumulator *acc);
+
+/*
+    Flip the sign of every basis state for which oracle(index, context) is
+    true, in one sweep. Returns false with a message on stderr, the state
+    untouched, when the register records or streams its gates.
+*/
+bool phase_oracle(qreg *reg, bool (*oracle)(unsigned long long index, void *context), void *context);
+
+/*
+    Flip the sign of every basis state whose bits on the k given qubits,
+    qubits[0] being bit 0, select a nonzero entry of the 2^k entry truth
+    table. Returns false with a message on stderr for invalid qubits.
+*/
+bool phase_oracle_table(qreg *reg, const unsigned char *table, const int *qubits, int k);
+
+diag_accumulator* new_diagonal(unsigned int qubits)
+{
+    diag_accumulator *acc = (diag_accumulator*) calloc(1, sizeof(diag_accumulator));
+    acc->qubits = qubits;
+    return acc;
+}
+
+void free_diagonal(diag_accumulator *acc)
+{
+    if (acc == NULL)
+    {
+        return;
+    }
+    free(acc->terms);
+    free(acc->functions);
+    free(acc->contexts);
+    free(acc);
+}
+
+void clear_diagonal(diag_accumulator *acc)
+{
+    acc->count = 0;
+    acc->function_count = 0;
+}
+
+void diagonal_term(diag_accumulator *acc, unsigned long long mask, unsigned long long value, double complex factor)
+{
+    if (factor == 1)
+    {
+        return;
+    }
+    if (acc->count == acc->capacity)
+    {
+        acc->capacity = acc->capacity ? 2 * acc->capacity : 64;
+        acc->terms = (diag_term*) realloc(acc->terms, acc->capacity * sizeof(diag_term));
+    }
+    acc->terms[acc->count++] = (diag_term){mask, value & mask, factor};
+}
+
+bool diagonal_gate(diag_accumulator *acc, unsigned long long ctrl_mask, int target, const double complex m[2][2])
+{
+    if (m[0][1] != 0 || m[1][0] != 0)
+    {
+        fprintf(stderr, "Only diagonal matrices can be accumulated.\n");
+        return false;
+    }
+
+    unsigned long long mask = ctrl_mask | ((unsigned long long)1 << target);
+    diagonal_term(acc, mask, ctrl_mask, m[0][0]);
+    diagonal_term(acc, mask, mask, m[1][1]);
+    return true;
+}
+
+void diagonal_Z(diag_accumulator *acc, int target)
+{
+    diagonal_gate(acc, 0, target, Z_matrix);
+}
+
+void diagonal_P(diag_accumulator *acc, int target, double lambda)
+{
+    double complex m[2][2];
+    phase_matrix(m, lambda);
+    diagonal_gate(acc, 0, target, m);
+}
+
+void diagonal_RZ(diag_accumulator *acc, int target, double theta)
+{
+    double complex m[2][2];
+    rotation_matrix(m, 2, theta);
+    diagonal_gate(acc, 0, target, m);
+}
+
+void diagonal_CZ(diag_accumulator *acc, int control, int target)
+{
+    diagonal_gate(acc, (unsigned long long)1 << control, target, Z_matrix);
+}
+
+void diagonal_CP(diag_accumulator *acc, int control, int target, double lambda)
+{
+    double complex m[2][2];
+    phase_matrix(m, lambda);
+    diagonal_gate(acc, (unsigned long long)1 << control, target, m);
+}
+
+void diagonal_RZZ(diag_accumulator *acc, int first, int second, double theta)
+{
+    unsigned long long a = (unsigned long long)1 << first, b = (unsigned long long)1 << second;
+
+    //Equal bits get e^(-i theta/2), differing bits e^(i theta/2).
+    diagonal_term(acc, a | b, 0, cexp(-theta / 2 * j));
+    diagonal_term(acc, a | b, a | b, cexp(-theta / 2 * j));
+    diagonal_term(acc, a | b, a, cexp(theta / 2 * j));
+    diagonal_term(acc, a | b, b, cexp(theta / 2 * j));
+}
+
+void diagonal_function(diag_accumulator *acc, phase_function f, void *context)
+{
+    if (acc->function_count == acc->function_capacity)
+    {
+        acc->function_capacity = acc->function_capacity ? 2 * acc->function_capacity : 4;
+        acc->functions = (phase_function*) realloc(acc->functions, acc->function_capacity * sizeof(phase_function));
+        acc->contexts = (void**) realloc(acc->contexts, acc->function_capacity * sizeof(void*));
+    }
+    acc->functions[acc->function_count] = f;
+    acc->contexts[acc->function_count] = context;
+    acc->function_count++;
+}
+
+/*
+    Product of every phase function of an accumulator, handed to
+    kernel_diagonal when there are several.
+*/
+double complex accumulated_phase(unsigned long long index, void *context)
+{
+    const diag_accumulator *acc = (const diag_accumulator*) context;
+    double complex factor = 1;
+    for (size_t f = 0; f < acc->function_count; f++)
+    {
+        factor *= acc->functions[f](index, acc->contexts[f]);
+    }
+    return factor;
+}
+
+/*
+    True when the gates of the register end up in its history or a circuit
+    stream, which only hold gates.
+*/
+bool records_gates(qreg *reg)
+{
+    return reg->recording || reg->stream != NULL;
+}
+
+/*
+    Record a term as the gates it stands for. A term over no qubit is a
+    global phase, recorded as P X P X on qubit 0.
+*/
+void record_term(qreg *reg, const diag_term *term)
+{
+    double lambda = carg(term->factor);
+    int first = 0;
+    if (term->mask == 0)
+    {
+        add_param_operation(reg, 'P', &first, 1, lambda, 0, 0);
+        add_operation(reg, 'X', &first, 1, 0, 0);
+        add_param_operation(reg, 'P', &first, 1, lambda, 0, 0);
+        add_operation(reg, 'X', &first, 1, 0, 0);
+        return;
+    }
+
+    int flip[64], flips = 0;
+    unsigned long long zeros = term->mask & ~term->value;
+    while (zeros)
+    {
+        flip[flips++] = __builtin_ctzll(zeros);
+        zeros &= zeros - 1;
+    }
+
+    int target = 63 - __builtin_clzll(term->mask);
+    if (flips > 0)
+    {
+        add_operation(reg, 'X', flip, flips, 0, 0);
+    }
+    add_controlled_operation(reg, 'P', &target, 1, term->mask & ~((unsigned long long)1 << target), lambda);
+    if (flips > 0)
+    {
+        add_operation(reg, 'X', flip, flips, 0, 0);
+    }
+}
+
+/*
+    Record the terms of a diagonal that already ran, as immediate gates
+    even on deferred registers.
+*/
+void record_terms(qreg *reg, const diag_term *terms, size_t count)
+{
+    bool deferred = reg->deferred;
+    reg->deferred = false;
+    for (size_t t = 0; t < count; t++)
+    {
+        record_term(reg, &terms[t]);
+    }
+    reg->deferred = deferred;
+}
+
+bool apply_diagonal(qreg *reg, const diag_accumulator *acc)
+{
+    if (records_gates(reg))
+    {
+        bool phases = acc->function_count == 0;
+        for (size_t t = 0; t < acc->count; t++)
+        {
+            phases = phases && fabs(cabs(acc->terms[t].factor) - 1) < 1e-12;
+        }
+        if (!phases)
+        {
+            fprintf(stderr, "Phase functions and terms that are not a phase cannot be recorded, turn recording off and close the circuit stream first.\n");
+            return false;
+        }
+    }
+
+    flush_pending(reg);
+    mark_dirty(reg);
+    if (acc->count == 0 && acc->function_count == 0)
+    {
+        return true;
+    }
+
+    switch (acc->function_count)
+    {
+        case 0:
+            kernel_diagonal(reg, acc->terms, acc->count, NULL, NULL);
+            break;
+        case 1:
+            kernel_diagonal(reg, acc->terms, acc->count, acc->functions[0], acc->contexts[0]);
+            break;
+        default:
+            kernel_diagonal(reg, acc->terms, acc->count, accumulated_phase, (void*) acc);
+            break;
+    }
+    record_terms(reg, acc->terms, acc->count);
+    return true;
+}
+
+/*
+    Oracle callback and its context, wrapped as a phase function.
+*/
+typedef struct oracle_context{
+    bool (*oracle)(unsigned long long index, void *context);
+    void *context;
+}oracle_context;
+
+double complex oracle_phase(unsigned long long index, void *context)
+{
+    const oracle_context *oc = (const oracle_context*) context;
+    return oc->oracle(index, oc->context) ? -1 : 1;
+}
+
+bool phase_oracle(qreg *reg, bool (*oracle)(unsigned long long index, void *context), void *context)
+{
+    if (records_gates(reg))
+    {
+        fprintf(stderr, "A phase oracle cannot be recorded, turn recording off and close the circuit stream first.\n");
+        return false;
+    }
+
+    flush_pending(reg);
+    mark_dirty(reg);
+    oracle_context oc = {oracle, context};
+    kernel_diagonal(reg, NULL, 0, oracle_phase, &oc);
+    return true;
+}
+
+/*
+    Truth table too wide for the tables of kernel_diagonal, looked up
+    directly for every index.
+*/
+typedef struct table_context{
+    const unsigned char *table;
+    const int *qubits;
+    int k;
+}table_context;
+
+double complex table_phase(unsigned long long index, void *context)
+{
+    const table_context *tc = (const table_context*) context;
+    size_t entry = 0;
+    for (int i = 0; i < tc->k; i++)
+    {
+        entry |= (size_t)((index >> tc->qubits[i]) & 1) << i;
+    }
+    return tc->table[entry] ? -1 : 1;
+}
+
+bool phase_oracle_table(qreg *reg, const unsigned char *table, const int *qubits, int k)
+{
+    unsigned long long mask = 0;
+    for (int i = 0; i < k; i++)
+    {
+        if (qubits[i] < 0 || qubits[i] >= (int)reg->size || ((mask >> qubits[i]) & 1))
+        {
+            fprintf(stderr, "Qubit %d of the oracle is out of range or repeated.\n", qubits[i]);
+            return false;
+        }
+        mask |= (unsigned long long)1 << qubits[i];
+    }
+
+    flush_pending(reg);
+    mark_dirty(reg);
+    if (k > DIAGONAL_TABLE_QUBITS)
+    {
+        table_context tc = {table, qubits, k};
+        kernel_diagonal(reg, NULL, 0, table_phase, &tc);
+    }
+
+    //One term per marked entry, kernel_diagonal folds them into a table.
+    //They are also what gets recorded, wider tables a table size at a time.
+    size_t entries = (size_t)1 << k;
+    size_t block = k <= DIAGONAL_TABLE_QUBITS ? entries : (size_t)1 << DIAGONAL_TABLE_QUBITS;
+    diag_term *terms = (diag_term*) malloc(block * sizeof(diag_term));
+    for (size_t first = 0; first < entries; first += block)
+    {
+        size_t count = 0;
+        for (size_t e = first; e < first + block; e++)
+        {
+            if (!table[e])
+            {
+                continue;
+            }
+            unsigned long long value = 0;
+            for (int i = 0; i < k; i++)
+            {
+                value |= (unsigned long long)((e >> i) & 1) << qubits[i];
+            }
+            terms[count++] = (diag_term){mask, value, -1};
+        }
+
+        if (k <= DIAGONAL_TABLE_QUBITS)
+        {
+            kernel_diagonal(reg, terms, count, NULL, NULL);
+        }
+        record_terms(reg, terms, count);
+    }
+    free(terms);
+    return true;
+}
@@ -0,0 +1,904 @@
+#pragma once
+#include "measure.h"
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+/*
+    Distributed registers.
+
+    The 2^n amplitudes are split over procs processes (a power of two):
+    the top log2(procs) qubit positions are "global" and pick the rank
+    holding an amplitude, the rest index its local qreg. Local gates run on
+    that qreg with the normal kernels.
+
+    initDistRegister forks the ranks, linked by Unix socket pairs, and
+    returns in every one of them like MPI_Init: the program after it runs
+    once per rank and each rank applies the same gates to its part of the
+    state. Calls marked collective have to be made by all ranks in the
+    same order. free_dist_reg ends the other ranks and waits for them in
+    rank 0.
+
+    Gates on global qubits are localized instead of being applied across
+    ranks: the register keeps a map from logical qubits to positions, and
+    a global qubit is swapped with a local position. run_distributed knows
+    the circuit ahead and evicts the local qubit used again last, gates
+    called one by one evict the least recently used one. A swap moves half
+    of the local amplitudes to the partner rank, the one differing in that
+    global bit, and every later gate on the qubit is local again. Diagonal
+    gates on global qubits need no data at all, each rank only scales its
+    amplitudes by its entry of the diagonal. SWAP is a relabelling of the
+    map.
+
+    bytes_sent counts the bytes this rank sent since dist_reset_comm,
+    dist_comm_bytes adds them up over the ranks.
+
+    The ranks are the parallelism: the OpenMP thread pool of the parent
+    does not survive fork, so every rank runs its kernels on one thread.
+*/
+
+#define DIST_MAX_PROCS 64
+
+//Amplitudes per message of an exchange, both buffers hold that many.
+#define DIST_CHUNK ((size_t)1 << 15)
+
+typedef struct dist_reg{
+    unsigned int size;
+    unsigned int local_qubits;
+    unsigned int global_qubits;
+    int rank;
+    int procs;
+    int *peers;
+    pid_t *children;
+    int position[64];
+    int qubit_at[64];
+    unsigned long long last_use[64];
+    unsigned long long clock;
+    const unsigned long long *next_use;
+    unsigned long long bytes_sent;
+    unsigned long long messages;
+    unsigned long long remaps;
+    amplitude *send_buffer;
+    amplitude *recv_buffer;
+    qreg *local;
+}dist_reg;
+
+/*
+    Fork procs - 1 ranks and initialize an n qubit register in state
+    |0...0> spread over them, returns in every rank. Collective from then
+    on. Returns NULL with a message on stderr when procs is not a power of
+    two, leaves less than one local qubit, or the ranks cannot be set up.
+*/
+dist_reg* initDistRegister(size_t n, int procs);
+
+/*
+    Release the register, collective. Every rank but 0 exits here, rank 0
+    returns once they have.
+*/
+void free_dist_reg(dist_reg *reg);
+
+/*
+    Apply a 2x2 unitary to a logical qubit, moving it into the local
+    positions first when it is global and m is not diagonal.
+*/
+void dist_apply_1q(dist_reg *reg, int target, const double complex m[2][2]);
+
+/*
+    Apply m to the target on the subspace where every logical qubit in
+    ctrl_mask is |1>. Global controls only decide whether a rank takes part.
+    A target in ctrl_mask or qubits out of range skip the gate with a
+    message on stderr.
+*/
+void dist_apply_controlled_1q(dist_reg *reg, unsigned long long ctrl_mask, int target, const double complex m[2][2]);
+
+/*
+    Common gates on logical qubits.
+*/
+void dist_X(dist_reg *reg, int target);
+void dist_H(dist_reg *reg, int target);
+void dist_Z(dist_reg *reg, int target);
+void dist_RX(dist_reg *reg, int target, double theta);
+void dist_RY(dist_reg *reg, int target, double theta);
+void dist_RZ(dist_reg *reg, int target, double theta);
+void dist_CNOT(dist_reg *reg, int control, int target);
+void dist_CZ(dist_reg *reg, int control, int target);
+void dist_SWAP(dist_reg *reg, int first, int second);
+
+/*
+    Apply a recorded operation of circuit.
+*/
+void dist_execute(dist_reg *reg, qreg *circuit, const stored_op *op);
+
+/*
+    Apply every operation recorded in the history of circuit, which must
+    have the same number of qubits. Global qubits are evicted looking ahead
+    in the circuit. Collective.
+*/
+void run_distributed(dist_reg *reg, qreg *circuit);
+
+/*
+    Sum of value over the ranks, returned in every rank. Collective.
+*/
+double dist_allreduce(dist_reg *reg, double value);
+
+/*
+    Probability of reading |1> on a logical qubit. Collective.
+*/
+double dist_probability_one(dist_reg *reg, int qubit);
+
+/*
+    Collect the whole state in rank 0, ordered by logical basis index.
+    out must hold 2^size amplitudes in rank 0 and is ignored elsewhere.
+    Collective, returns false with a message on stderr when a transfer fails.
+*/
+bool dist_gather(dist_reg *reg, amplitude *out);
+
+/*
+    Bytes sent by all ranks since the last dist_reset_comm. Collective.
+*/
+unsigned long long dist_comm_bytes(dist_reg *reg);
+
+/*
+    Zero the communication counters of this rank.
+*/
+void dist_reset_comm(dist_reg *reg);
+
+/*
+    Send and receive bytes with one peer at the same time, so that two
+    ranks exchanging more than a socket buffer do not both block in send.
+*/
+bool dist_exchange(dist_reg *reg, int peer, const void *out, void *in, size_t bytes)
+{
+    int fd = reg->peers[peer];
+    const unsigned char *src = (const unsigned char*) out;
+    unsigned char *dst = (unsigned char*) in;
+    size_t sent = 0, received = 0;
+
+    while (sent < bytes || received < bytes)
+    {
+        struct pollfd p = {fd, 0, 0};
+        p.events = (sent < bytes ? POLLOUT : 0) | (received < bytes ? POLLIN : 0);
+        if (poll(&p, 1, -1) < 0)
+        {
+            return false;
+        }
+        if ((p.revents & POLLOUT) && sent < bytes)
+        {
+            ssize_t done = send(fd, src + sent, bytes - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (done > 0)
+            {
+                sent += done;
+            }
+        }
+        if ((p.revents & (POLLIN | POLLHUP)) && received < bytes)
+        {
+            ssize_t done = recv(fd, dst + received, bytes - received, MSG_DONTWAIT);
+            if (done == 0)
+            {
+                return false;
+            }
+            if (done > 0)
+            {
+                received += done;
+            }
+        }
+        if (p.revents & (POLLERR | POLLNVAL))
+        {
+            return false;
+        }
+    }
+
+    reg->bytes_sent += bytes;
+    reg->messages++;
+    return true;
+}
+
+/*
+    Blocking one way transfers for the small messages of the collectives.
+*/
+bool dist_send(dist_reg *reg, int peer, const void *data, size_t bytes)
+{
+    const unsigned char *p = (const unsigned char*) data;
+    size_t left = bytes;
+    while (left > 0)
+    {
+        ssize_t done = send(reg->peers[peer], p, left, MSG_NOSIGNAL);
+        if (done <= 0)
+        {
+            return false;
+        }
+        p += done;
+        left -= done;
+    }
+    reg->bytes_sent += bytes;
+    reg->messages++;
+    return true;
+}
+
+bool dist_recv(dist_reg *reg, int peer, void *data, size_t bytes)
+{
+    unsigned char *p = (unsigned char*) data;
+    while (bytes > 0)
+    {
+        ssize_t done = recv(reg->peers[peer], p, bytes, 0);
+        if (done <= 0)
+        {
+            return false;
+        }
+        p += done;
+        bytes -= done;
+    }
+    return true;
+}
+
+double dist_allreduce(dist_reg *reg, double value)
+{
+    //Rank 0 adds the values in rank order, so every rank gets the same bits.
+    if (reg->rank == 0)
+    {
+        double sum = value;
+        for (int r = 1; r < reg->procs; r++)
+        {
+            double part = 0;
+            if (!dist_recv(reg, r, &part, sizeof(double)))
+            {
+                fprintf(stderr, "Rank %d did not answer.\n", r);
+            }
+            sum += part;
+        }
+        for (int r = 1; r < reg->procs; r++)
+        {
+            dist_send(reg, r, &sum, sizeof(double));
+        }
+        return sum;
+    }
+
+    dist_send(reg, 0, &value, sizeof(double));
+    if (!dist_recv(reg, 0, &value, sizeof(double)))
+    {
+        fprintf(stderr, "Rank 0 did not answer.\n");
+    }
+    return value;
+}
+
+/*
+    Close the sockets and free what the rank allocated.
+*/
+void release_dist_reg(dist_reg *reg)
+{
+    for (int r = 0; r < reg->procs; r++)
+    {
+        if (reg->peers[r] >= 0)
+        {
+            close(reg->peers[r]);
+        }
+    }
+    free_qreg(reg->local);
+    free(reg->send_buffer);
+    free(reg->recv_buffer);
+    free(reg->peers);
+}
+
+dist_reg* initDistRegister(size_t n, int procs)
+{
+    if (procs < 1 || procs > DIST_MAX_PROCS || (procs & (procs - 1)) != 0)
+    {
+        fprintf(stderr, "A distributed register needs a power of two up to %d ranks, %d requested.\n", DIST_MAX_PROCS, procs);
+        return NULL;
+    }
+    unsigned int global = __builtin_ctz(procs);
+    if (n > 63 || n <= global)
+    {
+        fprintf(stderr, "%zu qubits cannot be split over %d ranks.\n", n, procs);
+        return NULL;
+    }
+
+    //Every pair of ranks gets its own socket pair, made before the fork.
+    int pairs[DIST_MAX_PROCS][DIST_MAX_PROCS][2];
+    for (int a = 0; a < procs; a++)
+    {
+        for (int b = a + 1; b < procs; b++)
+        {
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, pairs[a][b]) != 0)
+            {
+                fprintf(stderr, "Failed to create the sockets of the distributed register.\n");
+                return NULL;
+            }
+        }
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    pid_t *children = (pid_t*) calloc(procs, sizeof(pid_t));
+    int rank = 0;
+    for (int r = 1; r < procs; r++)
+    {
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            //Entering a parallel region with the pool of the parent hangs.
+#ifdef _OPENMP
+            omp_set_num_threads(1);
+#endif
+            rank = r;
+            break;
+        }
+        if (pid < 0)
+        {
+            fprintf(stderr, "Failed to fork rank %d of the distributed register.\n", r);
+            for (int c = 1; c < r; c++)
+            {
+                kill(children[c], SIGKILL);
+                waitpid(children[c], NULL, 0);
+            }
+            free(children);
+            return NULL;
+        }
+        children[r] = pid;
+    }
+
+    dist_reg *reg = (dist_reg*) calloc(1, sizeof(dist_reg));
+    reg->size = n;
+    reg->global_qubits = global;
+    reg->local_qubits = n - global;
+    reg->rank = rank;
+    reg->procs = procs;
+    reg->children = rank == 0 ? children : NULL;
+    if (rank != 0)
+    {
+        free(children);
+    }
+
+    //Keep the sockets of this rank and close the ones of the other pairs.
+    reg->peers = (int*) malloc(procs * sizeof(int));
+    reg->peers[rank] = -1;
+    for (int a = 0; a < procs; a++)
+    {
+        for (int b = a + 1; b < procs; b++)
+        {
+            if (a == rank)
+            {
+                reg->peers[b] = pairs[a][b][0];
+                close(pairs[a][b][1]);
+            }
+            else if (b == rank)
+            {
+                reg->peers[a] = pairs[a][b][1];
+                close(pairs[a][b][0]);
+            }
+            else
+            {
+                close(pairs[a][b][0]);
+                close(pairs[a][b][1]);
+            }
+        }
+    }
+
+    for (unsigned int q = 0; q < n; q++)
+    {
+        reg->position[q] = q;
+        reg->qubit_at[q] = q;
+    }
+
+    //Each rank allocates its own part after the fork, nothing is shared.
+    reg->local = initQuRegister(reg->local_qubits);
+    reg->send_buffer = (amplitude*) malloc(DIST_CHUNK * sizeof(amplitude));
+    reg->recv_buffer = (amplitude*) malloc(DIST_CHUNK * sizeof(amplitude));
+    bool ok = reg->local != NULL && reg->send_buffer != NULL && reg->recv_buffer != NULL;
+    if (dist_allreduce(reg, ok ? 0 : 1) != 0)
+    {
+        if (reg->rank == 0)
+        {
+            fprintf(stderr, "Failed to allocate the parts of the distributed register.\n");
+        }
+        free_dist_reg(reg);
+        return NULL;
+    }
+
+    set_recording(reg->local, false);
+    set_threads(reg->local, 1);
+    if (rank != 0)
+    {
+        reg->local->matrix[0] = 0;
+    }
+    reg->bytes_sent = 0;
+    reg->messages = 0;
+    return reg;
+}
+
+void free_dist_reg(dist_reg *reg)
+{
+    if (reg == NULL)
+    {
+        return;
+    }
+    release_dist_reg(reg);
+
+    //The other ranks see their sockets close and exit after their own call.
+    if (reg->rank != 0)
+    {
+        free(reg);
+        exit(0);
+    }
+    for (int r = 1; r < reg->procs; r++)
+    {
+        waitpid(reg->children[r], NULL, 0);
+    }
+    free(reg->children);
+    free(reg);
+}
+
+void dist_reset_comm(dist_reg *reg)
+{
+    reg->bytes_sent = 0;
+    reg->messages = 0;
+    reg->remaps = 0;
+}
+
+unsigned long long dist_comm_bytes(dist_reg *reg)
+{
+    //The sum itself is not counted.
+    unsigned long long sent = reg->bytes_sent, messages = reg->messages;
+    double total = dist_allreduce(reg, (double) sent);
+    reg->bytes_sent = sent;
+    reg->messages = messages;
+    return (unsigned long long) total;
+}
+
+/*
+    Bit of the rank for a global position.
+*/
+int rank_bit(dist_reg *reg, int position)
+{
+    return (reg->rank >> (position - reg->local_qubits)) & 1;
+}
+
+/*
+    Swap a global position with a local one. Amplitudes whose local bit
+    differs from the global bit of their rank move to the partner rank,
+    which sends back the same number into the same slots.
+*/
+void swap_global_position(dist_reg *reg, int local, int global)
+{
+    int bit = rank_bit(reg, global);
+    int partner = reg->rank ^ (1 << (global - reg->local_qubits));
+    size_t low = ((size_t)1 << local) - 1;
+    size_t count = reg_states(reg->local) / 2;
+    size_t other = (size_t)(!bit) << local;
+    amplitude *amp = reg->local->matrix;
+
+    for (size_t start = 0; start < count; start += DIST_CHUNK)
+    {
+        size_t chunk = count - start < DIST_CHUNK ? count - start : DIST_CHUNK;
+        amplitude *out = reg->send_buffer, *in = reg->recv_buffer;
+
+        PARALLEL_FOR(reg->local, chunk, 1)
+        for (size_t k = 0; k < chunk; k++)
+        {
+            size_t m = start + k;
+            out[k] = amp[((m & ~low) << 1) | other | (m & low)];
+        }
+
+        if (!dist_exchange(reg, partner, out, in, chunk * sizeof(amplitude)))
+        {
+            fprintf(stderr, "Rank %d lost the connection to rank %d.\n", reg->rank, partner);
+            exit(EXIT_FAILURE);
+        }
+
+        PARALLEL_FOR(reg->local, chunk, 1)
+        for (size_t k = 0; k < chunk; k++)
+        {
+            size_t m = start + k;
+            amp[((m & ~low) << 1) | other | (m & low)] = in[k];
+        }
+    }
+
+    int a = reg->qubit_at[local], b = reg->qubit_at[global];
+    reg->qubit_at[local] = b;
+    reg->qubit_at[global] = a;
+    reg->position[a] = global;
+    reg->position[b] = local;
+    reg->remaps++;
+}
+
+/*
+    Whether the qubit at local position a should be evicted before the one
+    at b: the one needed later when the circuit is known, else the least
+    recently used.
+*/
+bool evict_before(dist_reg *reg, int a, int b)
+{
+    if (reg->next_use != NULL)
+    {
+        unsigned long long next_a = reg->next_use[reg->qubit_at[a]];
+        unsigned long long next_b = reg->next_use[reg->qubit_at[b]];
+        if (next_a != next_b)
+        {
+            return next_a > next_b;
+        }
+    }
+    return reg->last_use[a] < reg->last_use[b];
+}
+
+/*
+    Move a logical qubit into the local positions, evicting a local qubit
+    that is not in keep. Returns its position.
+*/
+int localize(dist_reg *reg, int qubit, unsigned long long keep)
+{
+    int position = reg->position[qubit];
+    if (position < (int)reg->local_qubits)
+    {
+        return position;
+    }
+
+    int victim = -1;
+    for (int p = 0; p < (int)reg->local_qubits; p++)
+    {
+        bool kept = (keep >> reg->qubit_at[p]) & 1;
+        if (!kept && (victim < 0 || evict_before(reg, p, victim)))
+        {
+            victim = p;
+        }
+    }
+    //Every local qubit is kept, evict one of them anyway.
+    if (victim < 0)
+    {
+        victim = 0;
+        for (int p = 1; p < (int)reg->local_qubits; p++)
+        {
+            victim = evict_before(reg, p, victim) ? p : victim;
+        }
+    }
+
+    swap_global_position(reg, victim, position);
+    return victim;
+}
+
+/*
+    Multiply the local amplitudes whose bits in mask are all set by c.
+*/
+void scale_local(dist_reg *reg, unsigned long long mask, double complex c)
+{
+    if (c == 1)
+    {
+        return;
+    }
+    size_t size = reg_states(reg->local);
+    amplitude *amp = reg->local->matrix;
+    amplitude factor = c;
+
+    PARALLEL_FOR(reg->local, size, 1)
+    for (size_t i = 0; i < size; i++)
+    {
+        if ((i & mask) == mask)
+        {
+            amp[i] *= factor;
+        }
+    }
+}
+
+void dist_apply_1q(dist_reg *reg, int target, const double complex m[2][2])
+{
+    dist_apply_controlled_1q(reg, 0, target, m);
+}
+
+void dist_apply_controlled_1q(dist_reg *reg, unsigned long long ctrl_mask, int target, const double complex m[2][2])
+{
+    //Every rank sees the same arguments, so all of them skip the gate.
+    if (target < 0 || target >= (int)reg->size || ((ctrl_mask >> target) & 1) || (ctrl_mask >> reg->size) != 0)
+    {
+        if (reg->rank == 0)
+        {
+            fprintf(stderr, "Gate on qubit %d with controls %llx is out of range or controls its own target.\n", target, ctrl_mask);
+        }
+        return;
+    }
+
+    bool diagonal = m[0][1] == 0 && m[1][0] == 0;
+    if (!diagonal)
+    {
+        localize(reg, target, ctrl_mask);
+    }
+
+    //Global controls decide for the whole rank, local ones form the mask.
+    //Ranks that sit the gate out still mark its qubits as used, so the
+    //maps of all ranks evict the same qubits later.
+    unsigned long long local_mask = 0;
+    bool active = true;
+    for (unsigned int q = 0; q < reg->size; q++)
+    {
+        if (!((ctrl_mask >> q) & 1))
+        {
+            continue;
+        }
+        int position = reg->position[q];
+        if (position >= (int)reg->local_qubits)
+        {
+            active = active && rank_bit(reg, position);
+        }
+        else
+        {
+            local_mask |= 1ULL << position;
+            reg->last_use[position] = ++reg->clock;
+        }
+    }
+
+    int position = reg->position[target];
+    if (position >= (int)reg->local_qubits)
+    {
+        int bit = rank_bit(reg, position);
+        if (active)
+        {
+            scale_local(reg, local_mask, m[bit][bit]);
+        }
+        return;
+    }
+
+    reg->last_use[position] = ++reg->clock;
+    if (!active)
+    {
+        return;
+    }
+    if (local_mask == 0)
+    {
+        apply_1q(reg->local, position, m);
+    }
+    else
+    {
+        apply_controlled_1q(reg->local, local_mask, position, m);
+    }
+}
+
+void dist_X(dist_reg *reg, int target)
+{
+    dist_apply_1q(reg, target, X_matrix);
+}
+
+void dist_H(dist_reg *reg, int target)
+{
+    const double complex h[2][2] = {{M_SQRT1_2, M_SQRT1_2}, {M_SQRT1_2, -M_SQRT1_2}};
+    dist_apply_1q(reg, target, h);
+}
+
+void dist_Z(dist_reg *reg, int target)
+{
+    dist_apply_1q(reg, target, Z_matrix);
+}
+
+void dist_RX(dist_reg *reg, int target, double theta)
+{
+    double complex m[2][2];
+    rotation_matrix(m, 0, theta);
+    dist_apply_1q(reg, target, m);
+}
+
+void dist_RY(dist_reg *reg, int target, double theta)
+{
+    double complex m[2][2];
+    rotation_matrix(m, 1, theta);
+    dist_apply_1q(reg, target, m);
+}
+
+void dist_RZ(dist_reg *reg, int target, double theta)
+{
+    double complex m[2][2];
+    rotation_matrix(m, 2, theta);
+    dist_apply_1q(reg, target, m);
+}
+
+void dist_CNOT(dist_reg *reg, int control, int target)
+{
+    if (control < 0 || control >= (int)reg->size)
+    {
+        if (reg->rank == 0)
+        {
+            fprintf(stderr, "Control qubit %d is out of range.\n", control);
+        }
+        return;
+    }
+    dist_apply_controlled_1q(reg, 1ULL << control, target, X_matrix);
+}
+
+void dist_CZ(dist_reg *reg, int control, int target)
+{
+    if (control < 0 || control >= (int)reg->size)
+    {
+        if (reg->rank == 0)
+        {
+            fprintf(stderr, "Control qubit %d is out of range.\n", control);
+        }
+        return;
+    }
+    dist_apply_controlled_1q(reg, 1ULL << control, target, Z_matrix);
+}
+
+void dist_SWAP(dist_reg *reg, int first, int second)
+{
+    int a = reg->position[first], b = reg->position[second];
+    reg->position[first] = b;
+    reg->position[second] = a;
+    reg->qubit_at[a] = second;
+    reg->qubit_at[b] = first;
+}
+
+/*
+    Mask of the qubits an operation uses. SWAP only relabels the map and
+    uses none.
+*/
+unsigned long long dist_op_qubits(qreg *circuit, const stored_op *op)
+{
+    if (op->operation == 'x')
+    {
+        return 0;
+    }
+    unsigned long long mask = op->ctrl_mask;
+    const int *indexes = op_indexes(circuit, op);
+    for (int t = 0; t < op->qbit_buffSize; t++)
+    {
+        mask |= 1ULL << indexes[t];
+    }
+    if (op->operation == '+')
+    {
+        mask |= 1ULL << op->control_idx;
+    }
+    return mask;
+}
+
+void dist_execute(dist_reg *reg, qreg *circuit, const stored_op *op)
+{
+    const int *indexes = op_indexes(circuit, op);
+    double complex m[2][2];
+
+    switch (op->operation)
+    {
+        case 'x':
+            dist_SWAP(reg, op->control_idx, op->target_idx);
+            return;
+        case '+':
+            for (int t = 0; t < op->qbit_buffSize; t++)
+            {
+                dist_CNOT(reg, op->control_idx, indexes[t]);
+            }
+            return;
+    }
+
+    operation_matrix(op, m);
+    for (int t = 0; t < op->qbit_buffSize; t++)
+    {
+        dist_apply_controlled_1q(reg, op->ctrl_mask, indexes[t], m);
+    }
+}
+
+void run_distributed(dist_reg *reg, qreg *circuit)
+{
+    unsigned int ops = circuit->history_size;
+    unsigned long long *masks = (unsigned long long*) malloc((ops + 1) * sizeof(unsigned long long));
+    size_t count[64] = {0}, start[65] = {0}, cursor[64];
+
+    //The operations using each qubit, in order, to look up its next use.
+    for (unsigned int i = 0; i < ops; i++)
+    {
+        masks[i] = dist_op_qubits(circuit, &circuit->history[i]);
+        for (unsigned int q = 0; q < reg->size; q++)
+        {
+            count[q] += (masks[i] >> q) & 1;
+        }
+    }
+    for (unsigned int q = 0; q < reg->size; q++)
+    {
+        start[q + 1] = start[q] + count[q];
+        cursor[q] = start[q];
+    }
+    unsigned int *uses = (unsigned int*) malloc((start[reg->size] + 1) * sizeof(unsigned int));
+    for (unsigned int i = 0; i < ops; i++)
+    {
+        for (unsigned int q = 0; q < reg->size; q++)
+        {
+            if ((masks[i] >> q) & 1)
+            {
+                uses[cursor[q]++] = i;
+            }
+        }
+    }
+
+    unsigned long long next_use[64];
+    for (unsigned int q = 0; q < reg->size; q++)
+    {
+        cursor[q] = start[q];
+        next_use[q] = count[q] > 0 ? uses[start[q]] : ULLONG_MAX;
+    }
+    reg->next_use = next_use;
+
+    for (unsigned int i = 0; i < ops; i++)
+    {
+        dist_execute(reg, circuit, &circuit->history[i]);
+
+        //Only once the whole operation ran, its other targets are needed now.
+        for (unsigned int q = 0; q < reg->size; q++)
+        {
+            if ((masks[i] >> q) & 1)
+            {
+                cursor[q]++;
+                next_use[q] = cursor[q] < start[q + 1] ? uses[cursor[q]] : ULLONG_MAX;
+            }
+        }
+    }
+
+    reg->next_use = NULL;
+    free(uses);
+    free(masks);
+}
+
+double dist_probability_one(dist_reg *reg, int qubit)
+{
+    int position = reg->position[qubit];
+    double p1 = 0;
+
+    if (position >= (int)reg->local_qubits)
+    {
+        if (rank_bit(reg, position))
+        {
+            size_t size = reg_states(reg->local);
+            amplitude *amp = reg->local->matrix;
+            PARALLEL_SUM(reg->local, size, 1, p1)
+            for (size_t i = 0; i < size; i++)
+            {
+                p1 += amp_probability(amp[i]);
+            }
+        }
+    }
+    else
+    {
+        p1 = probability_one(reg->local, position);
+    }
+    return dist_allreduce(reg, p1);
+}
+
+bool dist_gather(dist_reg *reg, amplitude *out)
+{
+    size_t size = reg_states(reg->local);
+    size_t bytes = size * sizeof(amplitude);
+
+    if (reg->rank != 0)
+    {
+        return dist_send(reg, 0, reg->local->matrix, bytes);
+    }
+
+    amplitude *part = (amplitude*) malloc(bytes);
+    bool ok = part != NULL;
+    for (int r = 0; r < reg->procs; r++)
+    {
+        //Drain every rank even after a failure, they are all sending.
+        const amplitude *src = reg->local->matrix;
+        if (r > 0)
+        {
+            ok = part != NULL && dist_recv(reg, r, part, bytes) && ok;
+            src = part;
+        }
+        if (!ok)
+        {
+            continue;
+        }
+
+        for (size_t i = 0; i < size; i++)
+        {
+            unsigned long long physical = ((unsigned long long)r << reg->local_qubits) | i;
+            unsigned long long logical = 0;
+            for (unsigned int p = 0; p < reg->size; p++)
+            {
+                logical |= ((physical >> p) & 1) << reg->qubit_at[p];
+            }
+            out[logical] = src[i];
+        }
+    }
+    free(part);
+
+    if (!ok)
+    {
+        fprintf(stderr, "Failed to gather the distributed register.\n");
+    }
+    return ok;
+}
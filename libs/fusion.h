@@ -0,0 +1,886 @@
+#pragma once
+#include "operations.h"
+
+/*
+    Gate fusion for deferred registers.
+
+    While a register is deferred (set_deferred) the gates are only recorded
+    in its history. flush_operations then runs everything recorded since the
+    last flush in two steps:
+
+    1. Single qubit gates are accumulated per qubit into one 2x2 matrix.
+       A qubit's matrix is only emitted once a multi-qubit gate touches that
+       qubit (or at the end), since it commutes with everything else. Products
+       that end up as the identity, like X.X or H.H, are dropped.
+    2. Consecutive gates whose qubits together fit in reg->fusion_qubits are
+       multiplied into one dense 2^k x 2^k matrix and applied in one sweep
+       with apply_kq. A dense sweep costs about 2^k times a single gate pass
+       in arithmetic, so a block is only kept when it replaces at least
+       2^k / FUSION_PASS_COST gates, otherwise its gates run one by one.
+
+    Groups holding a single gate still go through the dedicated kernels.
+    Runs of consecutive diagonal gates (Z, S, T, P, RZ, CZ and their
+    controlled forms) too wide for the current group are not split into
+    groups at all: they are applied together by one kernel_diagonal sweep.
+    Runs of Hadamards on distinct qubits go to kernel_walsh the same way.
+
+    Dense registers wider than reg->tile_qubits replace step 2 with a blocked
+    schedule (run_blocked). The state vector is cut into tiles of
+    2^tile_qubits amplitudes, and every gate of a chunk is applied to one tile
+    while it sits in cache before moving on to the next tile. Qubits above the
+    tile are first swapped into free low positions, and recorded SWAP gates
+    only relabel qubits. Runs of Hadamards run as kernel_walsh on their
+    current bits instead of being swapped in. The original qubit order is
+    restored at the end of the flush.
+*/
+
+#define FUSION_MAX_QUBITS 5
+
+/*
+    Cost of one sweep over the state vector, in dense block columns.
+    Raise it when the kernels are memory bound (many threads, registers far
+    beyond the last level cache) to fuse more aggressively.
+*/
+#ifndef FUSION_PASS_COST
+#define FUSION_PASS_COST 1
+#endif
+
+/*
+    Sweeps over the state vector a flush saved.
+    passes_before counts one pass per gate application (a gate recorded on
+    n qubits counts n times), passes_after the kernels actually run.
+*/
+typedef struct fusion_stats{
+    unsigned int gates;
+    unsigned int passes_before;
+    unsigned int passes_after;
+}fusion_stats;
+
+/*
+    Set the largest number of qubits a fused gate may act on,
+    between 1 (only single qubit fusion) and FUSION_MAX_QUBITS.
+*/
+void set_fusion_qubits(qreg *reg, int k);
+
+/*
+    Set the tile width of the blocked flush, a tile holds 2^k amplitudes.
+    Registers of at most k qubits are flushed without blocking.
+*/
+void set_tile_qubits(qreg *reg, int k);
+
+/*
+    Fuse and apply every operation recorded since the last flush.
+*/
+fusion_stats flush_operations(qreg *reg);
+
+typedef enum fusion_kind{
+    FUSION_1Q,
+    FUSION_CONTROLLED,
+    FUSION_SWAP
+}fusion_kind;
+
+/*
+    One kernel application lowered out of a recorded operation.
+    mask holds every qubit the item touches.
+*/
+typedef struct fusion_item{
+    fusion_kind kind;
+    char code;
+    int target;
+    int second;
+    unsigned long long ctrl_mask;
+    unsigned long long mask;
+    double complex m[2][2];
+}fusion_item;
+
+/*
+    Dense group under construction in step 2, covering the count items
+    starting at first.
+*/
+typedef struct fusion_block{
+    unsigned long long mask;
+    int count;
+    const fusion_item *first;
+    double complex matrix[1 << (2 * FUSION_MAX_QUBITS)];
+}fusion_block;
+
+void set_fusion_qubits(qreg *reg, int k)
+{
+    if (k < 1)
+    {
+        k = 1;
+    }
+    if (k > FUSION_MAX_QUBITS)
+    {
+        k = FUSION_MAX_QUBITS;
+    }
+    reg->fusion_qubits = k;
+}
+
+void set_tile_qubits(qreg *reg, int k)
+{
+    reg->tile_qubits = k > 1 ? k : 1;
+}
+
+/*
+    List the qubits of a mask in ascending order, returns how many there are.
+*/
+int mask_qubits(unsigned long long mask, int *qubits)
+{
+    int k = 0;
+    while (mask)
+    {
+        qubits[k++] = __builtin_ctzll(mask);
+        mask &= mask - 1;
+    }
+    return k;
+}
+
+/*
+    Run a single item with its dedicated kernel.
+*/
+void execute_item(qreg *reg, const fusion_item *it)
+{
+    switch (it->kind)
+    {
+        case FUSION_SWAP:
+            kernel_swap(reg, it->target, it->second);
+            return;
+        case FUSION_CONTROLLED:
+            apply_controlled_1q(reg, it->ctrl_mask, it->target, it->m);
+            return;
+        case FUSION_1Q:
+            switch (it->code)
+            {
+                case 'X': kernel_x(reg, it->target); break;
+                case 'Y': kernel_y(reg, it->target); break;
+                case 'Z': kernel_z(reg, it->target); break;
+                case 'H': kernel_h(reg, it->target); break;
+                default: apply_1q(reg, it->target, it->m); break;
+            }
+            return;
+    }
+}
+
+/*
+    Dense matrix of an item over the ascending qubit list sq.
+*/
+void item_matrix(const fusion_item *it, const int *sq, int sk, double complex *out)
+{
+    size_t dim = (size_t)1 << sk;
+    int pos[64];
+    size_t local_ctrl = 0;
+
+    for (int i = 0; i < sk; i++)
+    {
+        pos[sq[i]] = i;
+        if (it->ctrl_mask & ((unsigned long long)1 << sq[i]))
+        {
+            local_ctrl |= (size_t)1 << i;
+        }
+    }
+    memset(out, 0, dim * dim * sizeof(double complex));
+
+    for (size_t c = 0; c < dim; c++)
+    {
+        if (it->kind == FUSION_SWAP)
+        {
+            size_t a = (c >> pos[it->target]) & 1;
+            size_t b = (c >> pos[it->second]) & 1;
+            size_t r = c;
+            if (a != b)
+            {
+                r ^= ((size_t)1 << pos[it->target]) | ((size_t)1 << pos[it->second]);
+            }
+            out[r * dim + c] = 1;
+            continue;
+        }
+
+        if ((c & local_ctrl) != local_ctrl)
+        {
+            out[c * dim + c] = 1;
+            continue;
+        }
+
+        size_t t = (size_t)1 << pos[it->target];
+        size_t bit = (c & t) ? 1 : 0;
+        size_t c0 = c & ~t;
+        out[c0 * dim + c] = it->m[0][bit];
+        out[(c0 | t) * dim + c] = it->m[1][bit];
+    }
+}
+
+/*
+    Grow the block matrix from its qubits to the superset new_mask,
+    acting as the identity on the added qubits.
+*/
+void expand_block(fusion_block *block, unsigned long long new_mask)
+{
+    int old_q[FUSION_MAX_QUBITS], new_q[FUSION_MAX_QUBITS];
+    int old_k = mask_qubits(block->mask, old_q);
+    int new_k = mask_qubits(new_mask, new_q);
+
+    if (new_k == old_k)
+    {
+        return;
+    }
+
+    size_t old_dim = (size_t)1 << old_k;
+    size_t new_dim = (size_t)1 << new_k;
+    size_t old_bits = 0;
+    int old_pos[FUSION_MAX_QUBITS];
+    for (int i = 0, o = 0; i < new_k; i++)
+    {
+        if (o < old_k && new_q[i] == old_q[o])
+        {
+            old_bits |= (size_t)1 << i;
+            old_pos[o++] = i;
+        }
+    }
+
+    double complex old[old_dim * old_dim];
+    memcpy(old, block->matrix, sizeof(old));
+
+    for (size_t r = 0; r < new_dim; r++)
+    {
+        for (size_t c = 0; c < new_dim; c++)
+        {
+            double complex value = 0;
+
+            if ((r & ~old_bits) == (c & ~old_bits))
+            {
+                size_t ro = 0, co = 0;
+                for (int o = 0; o < old_k; o++)
+                {
+                    ro |= ((r >> old_pos[o]) & 1) << o;
+                    co |= ((c >> old_pos[o]) & 1) << o;
+                }
+                value = old[ro * old_dim + co];
+            }
+            block->matrix[r * new_dim + c] = value;
+        }
+    }
+    block->mask = new_mask;
+}
+
+/*
+    Multiply an item into the block, after whatever the block already holds.
+*/
+void block_push(fusion_block *block, const fusion_item *it)
+{
+    int sq[FUSION_MAX_QUBITS];
+
+    if (block->count == 0)
+    {
+        block->first = it;
+        block->mask = it->mask;
+        block->count = 1;
+        return;
+    }
+
+    if (block->count == 1)
+    {
+        int k = mask_qubits(block->mask, sq);
+        item_matrix(block->first, sq, k, block->matrix);
+    }
+
+    expand_block(block, block->mask | it->mask);
+
+    int k = mask_qubits(block->mask, sq);
+    size_t dim = (size_t)1 << k;
+    double complex gate[dim * dim];
+    double complex prod[dim * dim];
+    item_matrix(it, sq, k, gate);
+
+    for (size_t r = 0; r < dim; r++)
+    {
+        for (size_t c = 0; c < dim; c++)
+        {
+            double complex sum = 0;
+            for (size_t l = 0; l < dim; l++)
+            {
+                sum += gate[r * dim + l] * block->matrix[l * dim + c];
+            }
+            prod[r * dim + c] = sum;
+        }
+    }
+    memcpy(block->matrix, prod, sizeof(prod));
+    block->count++;
+}
+
+bool is_identity(const double complex *m, size_t dim)
+{
+    for (size_t r = 0; r < dim; r++)
+    {
+        for (size_t c = 0; c < dim; c++)
+        {
+            if (cabs(m[r * dim + c] - (r == c ? 1 : 0)) > 1e-12)
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/*
+    Apply the block to the register and empty it.
+*/
+void block_emit(qreg *reg, fusion_block *block, fusion_stats *stats)
+{
+    int sq[FUSION_MAX_QUBITS];
+
+    if (block->count == 1)
+    {
+        execute_item(reg, block->first);
+        stats->passes_after++;
+    }
+    else if (block->count > 1)
+    {
+        int k = mask_qubits(block->mask, sq);
+        size_t dim = (size_t)1 << k;
+
+        if (dim > (size_t)block->count * FUSION_PASS_COST)
+        {
+            //Cheaper to run the gates of the block on their own.
+            for (int i = 0; i < block->count; i++)
+            {
+                execute_item(reg, &block->first[i]);
+            }
+            stats->passes_after += block->count;
+        }
+        else if (!is_identity(block->matrix, dim))
+        {
+            if (k == 1)
+            {
+                double complex m[2][2] = {{block->matrix[0], block->matrix[1]}, {block->matrix[2], block->matrix[3]}};
+                apply_1q(reg, sq[0], m);
+            }
+            else
+            {
+                apply_kq(reg, sq, k, block->matrix);
+            }
+            stats->passes_after++;
+        }
+    }
+
+    block->count = 0;
+    block->mask = 0;
+}
+
+bool item_diagonal(const fusion_item *it)
+{
+    return it->kind != FUSION_SWAP && it->m[0][1] == 0 && it->m[1][0] == 0;
+}
+
+/*
+    Append the diag_terms of a diagonal item, returns how many there are.
+*/
+size_t item_terms(const fusion_item *it, diag_term *terms)
+{
+    unsigned long long bit = (unsigned long long)1 << it->target;
+    unsigned long long mask = it->ctrl_mask | bit;
+    size_t count = 0;
+
+    if (it->m[0][0] != 1)
+    {
+        terms[count++] = (diag_term){mask, it->ctrl_mask, it->m[0][0]};
+    }
+    if (it->m[1][1] != 1)
+    {
+        terms[count++] = (diag_term){mask, mask, it->m[1][1]};
+    }
+    return count;
+}
+
+/*
+    Apply the run of diagonal items in one sweep.
+*/
+void run_diagonal(qreg *reg, const fusion_item *items, size_t count, fusion_stats *stats)
+{
+    diag_term *terms = (diag_term*) malloc(2 * count * sizeof(diag_term));
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        total += item_terms(&items[i], terms + total);
+    }
+    kernel_diagonal(reg, terms, total, NULL, NULL);
+    stats->passes_after++;
+    free(terms);
+}
+
+/*
+    Step 2, greedy grouping of the items into dense blocks.
+*/
+void fuse_items(qreg *reg, fusion_item *items, size_t count, fusion_stats *stats)
+{
+    fusion_block *block = (fusion_block*) malloc(sizeof(fusion_block));
+    block->count = 0;
+    block->mask = 0;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        fusion_item *it = &items[i];
+
+        //A diagonal run that does not fit the block takes one sweep of its own.
+        if (item_diagonal(it))
+        {
+            size_t end = i;
+            unsigned long long run_mask = 0;
+            while (end < count && item_diagonal(&items[end]))
+            {
+                run_mask |= items[end++].mask;
+            }
+            if (end - i > 1 && __builtin_popcountll(block->mask | run_mask) > reg->fusion_qubits)
+            {
+                block_emit(reg, block, stats);
+                run_diagonal(reg, it, end - i, stats);
+                i = end - 1;
+                continue;
+            }
+        }
+
+        //So does a layer of Hadamards, as one Walsh-Hadamard transform.
+        if (it->kind == FUSION_1Q && it->code == 'H')
+        {
+            size_t end = i;
+            unsigned long long run_mask = 0;
+            int targets[64], k = 0;
+            while (end < count && items[end].kind == FUSION_1Q && items[end].code == 'H' && !(run_mask & items[end].mask))
+            {
+                run_mask |= items[end].mask;
+                targets[k++] = items[end++].target;
+            }
+            if (k > 1 && __builtin_popcountll(block->mask | run_mask) > reg->fusion_qubits)
+            {
+                block_emit(reg, block, stats);
+                kernel_walsh(reg, targets, k);
+                stats->passes_after++;
+                i = end - 1;
+                continue;
+            }
+        }
+
+        if (__builtin_popcountll(it->mask) > reg->fusion_qubits)
+        {
+            //Too wide to fuse, run it on its own.
+            block_emit(reg, block, stats);
+            execute_item(reg, it);
+            stats->passes_after++;
+            continue;
+        }
+
+        if (__builtin_popcountll(block->mask | it->mask) > reg->fusion_qubits)
+        {
+            block_emit(reg, block, stats);
+        }
+        block_push(block, it);
+    }
+
+    block_emit(reg, block, stats);
+    free(block);
+}
+
+/*
+    Move every bit of a qubit mask to the position given by map.
+*/
+unsigned long long map_mask(unsigned long long mask, const int *map)
+{
+    unsigned long long out = 0;
+    while (mask)
+    {
+        out |= (unsigned long long)1 << map[__builtin_ctzll(mask)];
+        mask &= mask - 1;
+    }
+    return out;
+}
+
+/*
+    Item with its qubits moved to their physical bit positions.
+*/
+fusion_item map_item(const fusion_item *it, const int *phys)
+{
+    fusion_item out = *it;
+    out.target = phys[it->target];
+    out.second = it->kind == FUSION_SWAP ? phys[it->second] : 0;
+    out.ctrl_mask = map_mask(it->ctrl_mask, phys);
+    out.mask = map_mask(it->mask, phys);
+    return out;
+}
+
+/*
+    Exchange the physical bit pairs (a[i], b[i]) in one sweep and keep the
+    wire -> physical map and its inverse in sync.
+*/
+void swap_physical(qreg *reg, int *phys, int *wire, const int *a, const int *b, int k, fusion_stats *stats)
+{
+    if (k == 0)
+    {
+        return;
+    }
+
+    kernel_swap_bits(reg, a, b, k);
+    for (int i = 0; i < k; i++)
+    {
+        int wa = wire[a[i]], wb = wire[b[i]];
+        wire[a[i]] = wb;
+        wire[b[i]] = wa;
+        phys[wa] = b[i];
+        phys[wb] = a[i];
+    }
+    stats->passes_after++;
+}
+
+/*
+    Apply the count items tile by tile. All of their physical qubits lie
+    below reg->tile_qubits, so each tile is a register of its own.
+*/
+void run_tiles(qreg *reg, const fusion_item *items, size_t count, const int *phys)
+{
+    int tile = reg->tile_qubits;
+    size_t tiles = reg_states(reg) >> tile;
+    fusion_item *local = (fusion_item*) malloc(count * sizeof(fusion_item));
+
+    for (size_t i = 0; i < count; i++)
+    {
+        local[i] = map_item(&items[i], phys);
+    }
+
+    PARALLEL_FOR(reg, reg_states(reg), 1)
+    for (size_t t = 0; t < tiles; t++)
+    {
+        qreg view = *reg;
+        view.size = tile;
+        view.num_threads = 1;
+        view.matrix = reg->matrix + (t << tile);
+
+        for (size_t i = 0; i < count; i++)
+        {
+            execute_item(&view, &local[i]);
+        }
+    }
+    free(local);
+}
+
+/*
+    Blocked replacement of step 2 for registers wider than a tile.
+
+    SWAP items are folded into a relabeling of the qubits (wires) first.
+    Each round then
+    1. takes every item whose wires sit below the tile and that commutes
+       with the items skipped before it, and runs them in one tiled sweep,
+    2. swaps the wires of the next items that still fit in a tile below it,
+       all in one sweep, evicting low wires those items do not use.
+    Items wider than a tile run on the whole vector. At the end the qubits
+    are put back in order with at most two more sweeps.
+*/
+void run_blocked(qreg *reg, fusion_item *items, size_t count, fusion_stats *stats)
+{
+    int n = reg->size;
+    int tile = reg->tile_qubits;
+    unsigned long long low = ((unsigned long long)1 << tile) - 1;
+    unsigned long long all = n == 64 ? ~0ULL : ((unsigned long long)1 << n) - 1;
+    int label[64], phys[64], wire[64];
+    int a[64], b[64];
+
+    //label[q] is the wire holding logical qubit q, phys/wire map wires to bits.
+    for (int q = 0; q < n; q++)
+    {
+        label[q] = q;
+        phys[q] = q;
+        wire[q] = q;
+    }
+
+    size_t left = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        fusion_item it = items[i];
+        if (it.kind == FUSION_SWAP)
+        {
+            int w = label[it.target];
+            label[it.target] = label[it.second];
+            label[it.second] = w;
+            continue;
+        }
+        it.target = label[it.target];
+        it.ctrl_mask = map_mask(it.ctrl_mask, label);
+        it.mask = map_mask(it.mask, label);
+        items[left++] = it;
+    }
+
+    fusion_item *chunk = (fusion_item*) malloc((left + 1) * sizeof(fusion_item));
+
+    while (left > 0)
+    {
+        //Step 1, pull out the local items, keeping the rest in order.
+        unsigned long long blocked = 0;
+        size_t taken = 0, kept = 0;
+        for (size_t i = 0; i < left; i++)
+        {
+            if (blocked != all && !(items[i].mask & blocked) && !(map_mask(items[i].mask, phys) & ~low))
+            {
+                chunk[taken++] = items[i];
+            }
+            else
+            {
+                blocked |= items[i].mask;
+                items[kept++] = items[i];
+            }
+        }
+        left = kept;
+
+        if (taken == 1)
+        {
+            fusion_item it = map_item(&chunk[0], phys);
+            execute_item(reg, &it);
+            stats->passes_after++;
+        }
+        else if (taken > 1)
+        {
+            run_tiles(reg, chunk, taken, phys);
+            stats->passes_after++;
+        }
+
+        if (left == 0)
+        {
+            break;
+        }
+
+        //A run of Hadamards costs fewer sweeps as one transform than swapped into a tile.
+        size_t run = 0;
+        unsigned long long run_mask = 0;
+        int targets[64];
+        while (run < left && items[run].kind == FUSION_1Q && items[run].code == 'H' && !(run_mask & items[run].mask))
+        {
+            run_mask |= items[run].mask;
+            targets[run] = phys[items[run].target];
+            run++;
+        }
+        if (run > 1)
+        {
+            kernel_walsh(reg, targets, run);
+            stats->passes_after++;
+            left -= run;
+            memmove(items, items + run, left * sizeof(fusion_item));
+            continue;
+        }
+
+        if (__builtin_popcountll(items[0].mask) > tile)
+        {
+            //Too wide for any tile.
+            fusion_item it = map_item(&items[0], phys);
+            execute_item(reg, &it);
+            stats->passes_after++;
+            memmove(items, items + 1, --left * sizeof(fusion_item));
+            continue;
+        }
+
+        //Step 2, gather the wires of the next items that fit in a tile.
+        unsigned long long wanted = 0;
+        for (size_t i = 0; i < left; i++)
+        {
+            if (__builtin_popcountll(wanted | items[i].mask) > tile)
+            {
+                break;
+            }
+            wanted |= items[i].mask;
+        }
+
+        int k = 0, victim = tile - 1;
+        for (int p = tile; p < n; p++)
+        {
+            if (!(wanted & ((unsigned long long)1 << wire[p])))
+            {
+                continue;
+            }
+            while (wanted & ((unsigned long long)1 << wire[victim]))
+            {
+                victim--;
+            }
+            a[k] = victim--;
+            b[k++] = p;
+        }
+        swap_physical(reg, phys, wire, a, b, k, stats);
+    }
+    free(chunk);
+
+    //Put logical qubit q back on bit q.
+    int dest[64];
+    for (int q = 0; q < n; q++)
+    {
+        dest[phys[label[q]]] = q;
+    }
+    for (int round = 0; round < 2; round++)
+    {
+        int k = cycle_reflection(dest, n, round, a, b);
+        swap_physical(reg, phys, wire, a, b, k, stats);
+    }
+}
+
+/*
+    Step 1 helper, move the accumulated matrix of a qubit into the item list.
+*/
+void emit_pending(fusion_item *pending, int *merged, int q, fusion_item *items, size_t *count)
+{
+    if (merged[q] == 0)
+    {
+        return;
+    }
+
+    if (merged[q] == 1)
+    {
+        items[(*count)++] = pending[q];
+    }
+    else if (!is_identity(&pending[q].m[0][0], 2))
+    {
+        //Merged matrices lose the dedicated kernel of their first gate.
+        pending[q].code = 0;
+        items[(*count)++] = pending[q];
+    }
+    merged[q] = 0;
+}
+
+fusion_stats flush_operations(qreg *reg)
+{
+    fusion_stats stats = {0, 0, 0};
+    unsigned int total = history_count(reg);
+    int n = reg->size;
+
+    //The queue names logical qubits, the kernels take bits.
+    mark_dirty(reg);
+    settle_layout(reg);
+
+    //Upper bound on the items, one per recorded qubit index plus swaps.
+    size_t capacity = 0;
+    for (unsigned int i = reg->executed; i < total; i++)
+    {
+        capacity += reg->history[i].qbit_buffSize + 1;
+    }
+
+    fusion_item *items = (fusion_item*) malloc((capacity + n) * sizeof(fusion_item));
+    fusion_item *pending = (fusion_item*) malloc(n * sizeof(fusion_item));
+    int *merged = (int*) calloc(n, sizeof(int));
+    size_t count = 0;
+
+    for (unsigned int i = reg->executed; i < total; i++)
+    {
+        const stored_op *op = &(reg->history[i]);
+        stats.gates++;
+
+        if (op->operation == 'x')
+        {
+            fusion_item it = {FUSION_SWAP, 'x', op->control_idx, op->target_idx, 0, 0, {{0}}};
+            it.mask = ((unsigned long long)1 << op->control_idx) | ((unsigned long long)1 << op->target_idx);
+            emit_pending(pending, merged, op->control_idx, items, &count);
+            emit_pending(pending, merged, op->target_idx, items, &count);
+            items[count++] = it;
+            stats.passes_before++;
+            continue;
+        }
+
+        double complex m[2][2];
+        unsigned long long ctrl_mask = op->ctrl_mask;
+        if (op->operation == '+')
+        {
+            memcpy(m, X_matrix, sizeof(m));
+            ctrl_mask = (unsigned long long)1 << op->control_idx;
+        }
+        else
+        {
+            operation_matrix(op, m);
+        }
+
+        for (int t = 0; t < op->qbit_buffSize; t++)
+        {
+            int target = op_indexes(reg, op)[t];
+            stats.passes_before++;
+
+            if (ctrl_mask != 0)
+            {
+                fusion_item it = {FUSION_CONTROLLED, op->operation, target, 0, ctrl_mask, 0, {{0}}};
+                memcpy(it.m, m, sizeof(m));
+                it.mask = ctrl_mask | ((unsigned long long)1 << target);
+
+                for (int q = 0; q < n; q++)
+                {
+                    if (it.mask & ((unsigned long long)1 << q))
+                    {
+                        emit_pending(pending, merged, q, items, &count);
+                    }
+                }
+                items[count++] = it;
+                continue;
+            }
+
+            //Single qubit gate, fold it into the pending matrix of the qubit.
+            if (merged[target] == 0)
+            {
+                fusion_item it = {FUSION_1Q, op->operation, target, 0, 0, (unsigned long long)1 << target, {{0}}};
+                memcpy(it.m, m, sizeof(m));
+                pending[target] = it;
+            }
+            else
+            {
+                double complex prev[2][2];
+                memcpy(prev, pending[target].m, sizeof(prev));
+                for (int r = 0; r < 2; r++)
+                {
+                    for (int c = 0; c < 2; c++)
+                    {
+                        pending[target].m[r][c] = m[r][0] * prev[0][c] + m[r][1] * prev[1][c];
+                    }
+                }
+            }
+            merged[target]++;
+        }
+    }
+
+    for (int q = 0; q < n; q++)
+    {
+        emit_pending(pending, merged, q, items, &count);
+    }
+
+    if (n > reg->tile_qubits && reg->sparse == NULL)
+    {
+        run_blocked(reg, items, count, &stats);
+    }
+    else
+    {
+        fuse_items(reg, items, count, &stats);
+    }
+    reg->executed = total;
+
+    free(items);
+    free(pending);
+    free(merged);
+    return stats;
+}
+
+void set_deferred(qreg *reg, bool deferred)
+{
+    //Gates recorded after the switch mark everything before them executed.
+    if (!deferred && reg->deferred && reg->executed < history_count(reg))
+    {
+        flush_operations(reg);
+    }
+    reg->deferred = deferred;
+}
+
+/*
+    Run the gates still waiting in a deferred register and put the qubits
+    relabeled by SWAP back on their bits.
+*/
+void flush_pending(qreg *reg)
+{
+    if (reg->executed < history_count(reg))
+    {
+        flush_operations(reg);
+    }
+    settle_layout(reg);
+}
+
+double complex get_amplitude(qreg *reg, unsigned long long i)
+{
+    flush_pending(reg);
+    return reg->sparse != NULL ? sparse_get(reg->sparse, i) : reg->matrix[i];
+}
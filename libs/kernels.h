@@ -0,0 +1,1204 @@
+#pragma once
+#include "sparse.h"
+#include <assert.h>
+
+/*
+    State vector kernels.
+
+    A single qubit gate on qubit idx only mixes amplitude pairs (k, k ^ 1<<idx).
+    Rather than scanning every basis index and remembering which ones were
+    already visited, the kernels enumerate the pairs directly: the outer loop
+    walks blocks of 2*stride amplitudes and the inner loop walks the lower half
+    of each block, where stride = 1<<idx. Every amplitude is touched exactly once
+    and nothing is allocated.
+
+    When built with OpenMP, both loops are collapsed and split statically over
+    reg->num_threads threads, so each thread works on the same contiguous slice
+    of the state vector it zeroed in initQuRegister.
+
+    Sparse registers (sparse.h) are handed to the sparse kernels instead.
+*/
+
+/*
+    Number of amplitudes stored in the register.
+*/
+size_t reg_states(qreg *reg);
+
+/*
+    Pauli-X kernel, swaps the amplitudes of every pair.
+*/
+void kernel_x(qreg *reg, int idx);
+
+/*
+    Pauli-Y kernel, maps the pair (a, b) to (-ib, ia).
+*/
+void kernel_y(qreg *reg, int idx);
+
+/*
+    Pauli-Z kernel, negates the amplitudes with bit idx set.
+    Only the upper half of each block is touched.
+*/
+void kernel_z(qreg *reg, int idx);
+
+/*
+    Hadamard kernel, maps the pair (a, b) to ((a+b)/sqrt(2), (a-b)/sqrt(2)).
+*/
+void kernel_h(qreg *reg, int idx);
+
+/*
+    Hadamard on each of the k distinct qubits at once, a Walsh-Hadamard
+    transform over them. The qubits below WALSH_BLOCK_QUBITS are transformed
+    one cache sized block at a time, the ones above take one pass over the
+    state per three qubits. Every pass is an unnormalized radix-8 (or
+    smaller) butterfly of additions and subtractions, the 2^(-k/2) scale is
+    applied once by the last one.
+*/
+void kernel_walsh(qreg *reg, const int *qubits, int k);
+
+/*
+    Apply an arbitrary 2x2 unitary m to the target qubit, where m[r][c] maps
+    the amplitude of basis state |c> to |r>.
+    Diagonal matrices only scale the amplitudes without pairing them, and only
+    the upper half is touched when m[0][0] is 1 (phase gates). Anti-diagonal
+    matrices swap the pair with a scale and skip the full 2x2 product.
+*/
+void apply_1q(qreg *reg, int target, const double complex m[2][2]);
+
+/*
+    Apply a 2x2 unitary m to the target qubit on the subspace where every
+    qubit in ctrl_mask is |1>. Only the 2^(n-k-1) pairs with all k controls
+    set are enumerated, the rest of the state vector is never read.
+    Diagonal and anti-diagonal matrices take the same shortcuts as apply_1q.
+    The target must not be one of the controls.
+*/
+void apply_controlled_1q(qreg *reg, unsigned long long ctrl_mask, int target, const double complex m[2][2]);
+
+/*
+    Apply a dense 2^k x 2^k unitary m (row-major) to k qubits in one sweep.
+    qubits must be ascending, bit i of a row/column index of m is qubits[i].
+    Each group of 2^k amplitudes is gathered, multiplied and scattered back,
+    diagonal matrices only scale the group.
+*/
+void apply_kq(qreg *reg, const int *qubits, int k, const double complex *m);
+
+/*
+    SWAP kernel, exchanges the amplitudes of |..0..1..> and |..1..0..>
+    for the two given qubits. Only the quarter of the state vector
+    with differing bits is touched.
+*/
+void kernel_swap(qreg *reg, int first_idx, int second_idx);
+
+/*
+    Exchange the bit pairs (a[i], b[i]) of every basis index, the pairs
+    must be disjoint. Equivalent to k kernel_swap calls: the pairs inside a
+    tile (reg->tile_qubits) are exchanged in one pass, one tile at a time,
+    the others SWAP_GROUP_PAIRS per pass.
+*/
+void kernel_swap_bits(qreg *reg, const int *a, const int *b, int k);
+
+/*
+    A factor multiplying the amplitudes whose bits in mask equal value.
+    Any diagonal gate is a short list of them, e.g. Z on qubit q is
+    {1 << q, 1 << q, -1} and an X sandwiched control is a 0 bit of value.
+*/
+typedef struct diag_term{
+    unsigned long long mask;
+    unsigned long long value;
+    double complex factor;
+}diag_term;
+
+/*
+    Phase of a basis index, for diagonals that are not a short term list.
+*/
+typedef double complex (*phase_function)(unsigned long long index, void *context);
+
+/*
+    Multiply every amplitude by the product of the terms it matches and by
+    f(index, context) when f is not NULL, in one sweep over the state.
+    The terms are folded into tables over at most DIAGONAL_TABLE_QUBITS
+    qubits each, so the cost per amplitude is one lookup per table rather
+    than one pass per gate.
+*/
+void kernel_diagonal(qreg *reg, const diag_term *terms, size_t count, phase_function f, void *context);
+
+size_t reg_states(qreg *reg)
+{
+    return (size_t)1 << reg->size;
+}
+
+/*
+    Complex product without the NaN/Inf recovery of the * operator, which
+    gcc compiles to a __muldc3 call unless -ffast-math is given.
+*/
+static inline amplitude cmul(amplitude a, amplitude b)
+{
+    return (AMP_RE(a) * AMP_RE(b) - AMP_IM(a) * AMP_IM(b)) + (AMP_RE(a) * AMP_IM(b) + AMP_IM(a) * AMP_RE(b)) * j;
+}
+
+void kernel_x(qreg *reg, int idx)
+{
+    if (reg->sparse != NULL)
+    {
+        sparse_apply_1q(reg, 0, idx, (const double complex[2][2]){{0, 1}, {1, 0}});
+        return;
+    }
+
+    size_t size = reg_states(reg);
+    size_t stride = (size_t)1 << idx;
+    size_t blocks = size >> (idx + 1);
+    amplitude *m = reg->matrix;
+
+    PARALLEL_FOR(reg, size, 2)
+    for (size_t b = 0; b < blocks; b++)
+    {
+        for (size_t r = 0; r < stride; r++)
+        {
+            size_t k = (b << (idx + 1)) + r;
+            amplitude temp = m[k];
+            m[k] = m[k + stride];
+            m[k + stride] = temp;
+        }
+    }
+}
+
+void kernel_y(qreg *reg, int idx)
+{
+    if (reg->sparse != NULL)
+    {
+        sparse_apply_1q(reg, 0, idx, (const double complex[2][2]){{0, -j}, {j, 0}});
+        return;
+    }
+
+    size_t size = reg_states(reg);
+    size_t stride = (size_t)1 << idx;
+    size_t blocks = size >> (idx + 1);
+    amplitude *m = reg->matrix;
+
+    PARALLEL_FOR(reg, size, 2)
+    for (size_t b = 0; b < blocks; b++)
+    {
+        for (size_t r = 0; r < stride; r++)
+        {
+            size_t k = (b << (idx + 1)) + r;
+            amplitude a = m[k];
+            amplitude c = m[k + stride];
+
+            //-i*c and i*a written out to avoid full complex multiplies.
+            m[k] = AMP_IM(c) - AMP_RE(c)*j;
+            m[k + stride] = -AMP_IM(a) + AMP_RE(a)*j;
+        }
+    }
+}
+
+void kernel_z(qreg *reg, int idx)
+{
+    if (reg->sparse != NULL)
+    {
+        sparse_apply_1q(reg, 0, idx, (const double complex[2][2]){{1, 0}, {0, -1}});
+        return;
+    }
+
+    size_t size = reg_states(reg);
+    size_t stride = (size_t)1 << idx;
+    size_t blocks = size >> (idx + 1);
+    amplitude *m = reg->matrix;
+
+    PARALLEL_FOR(reg, size, 2)
+    for (size_t b = 0; b < blocks; b++)
+    {
+        for (size_t r = 0; r < stride; r++)
+        {
+            size_t k = (b << (idx + 1)) + stride + r;
+            m[k] = -m[k];
+        }
+    }
+}
+
+void kernel_h(qreg *reg, int idx)
+{
+    if (reg->sparse != NULL)
+    {
+        sparse_apply_1q(reg, 0, idx, (const double complex[2][2]){{M_SQRT1_2, M_SQRT1_2}, {M_SQRT1_2, -M_SQRT1_2}});
+        return;
+    }
+
+    size_t size = reg_states(reg);
+    size_t stride = (size_t)1 << idx;
+    size_t blocks = size >> (idx + 1);
+    amplitude *m = reg->matrix;
+    const amp_real norm = M_SQRT1_2;
+
+    PARALLEL_FOR(reg, size, 2)
+    for (size_t b = 0; b < blocks; b++)
+    {
+        for (size_t r = 0; r < stride; r++)
+        {
+            size_t k = (b << (idx + 1)) + r;
+            amplitude a = m[k];
+            amplitude c = m[k + stride];
+
+            m[k] = (a + c) * norm;
+            m[k + stride] = (a - c) * norm;
+        }
+    }
+}
+
+void kernel_swap(qreg *reg, int first_idx, int second_idx)
+{
+    if (reg->sparse != NULL)
+    {
+        sparse_swap_bits(reg, &first_idx, &second_idx, first_idx != second_idx);
+        return;
+    }
+
+    if (first_idx == second_idx)
+    {
+        return;
+    }
+
+    //Walk the low qubit blocks inside the high qubit blocks.
+    int lo = first_idx < second_idx ? first_idx : second_idx;
+    int hi = first_idx < second_idx ? second_idx : first_idx;
+    size_t size = reg_states(reg);
+    size_t lo_stride = (size_t)1 << lo;
+    size_t hi_stride = (size_t)1 << hi;
+    size_t hi_blocks = size >> (hi + 1);
+    size_t lo_blocks = hi_stride >> (lo + 1);
+    amplitude *m = reg->matrix;
+
+    PARALLEL_FOR(reg, size, 3)
+    for (size_t hb = 0; hb < hi_blocks; hb++)
+    {
+        for (size_t lb = 0; lb < lo_blocks; lb++)
+        {
+            for (size_t r = 0; r < lo_stride; r++)
+            {
+                //k has lo bit set and hi bit clear, its partner the other way around.
+                size_t k = (hb << (hi + 1)) + (lb << (lo + 1)) + lo_stride + r;
+                size_t partner = k - lo_stride + hi_stride;
+                amplitude temp = m[k];
+                m[k] = m[partner];
+                m[partner] = temp;
+            }
+        }
+    }
+}
+
+void apply_1q(qreg *reg, int target, const double complex m[2][2])
+{
+    if (reg->sparse != NULL)
+    {
+        sparse_apply_1q(reg, 0, target, m);
+        return;
+    }
+
+    size_t size = reg_states(reg);
+    size_t stride = (size_t)1 << target;
+    size_t blocks = size >> (target + 1);
+    amplitude *amp = reg->matrix;
+    amplitude m00 = m[0][0], m01 = m[0][1];
+    amplitude m10 = m[1][0], m11 = m[1][1];
+
+    if (m01 == 0 && m10 == 0)
+    {
+        //Diagonal, each half is scaled independently and skipped when it is left unchanged.
+        if (m00 != 1)
+        {
+            PARALLEL_FOR(reg, size, 2)
+            for (size_t b = 0; b < blocks; b++)
+            {
+                for (size_t r = 0; r < stride; r++)
+                {
+                    amp[(b << (target + 1)) + r] = cmul(amp[(b << (target + 1)) + r], m00);
+                }
+            }
+        }
+
+        if (m11 != 1)
+        {
+            PARALLEL_FOR(reg, size, 2)
+            for (size_t b = 0; b < blocks; b++)
+            {
+                for (size_t r = 0; r < stride; r++)
+                {
+                    amp[(b << (target + 1)) + stride + r] = cmul(amp[(b << (target + 1)) + stride + r], m11);
+                }
+            }
+        }
+        return;
+    }
+
+    if (m00 == 0 && m11 == 0)
+    {
+        //Anti-diagonal, swap the pair and scale.
+        PARALLEL_FOR(reg, size, 2)
+        for (size_t b = 0; b < blocks; b++)
+        {
+            for (size_t r = 0; r < stride; r++)
+            {
+                size_t k = (b << (target + 1)) + r;
+                amplitude a = amp[k];
+                amp[k] = cmul(m01, amp[k + stride]);
+                amp[k + stride] = cmul(m10, a);
+            }
+        }
+        return;
+    }
+
+    PARALLEL_FOR(reg, size, 2)
+    for (size_t b = 0; b < blocks; b++)
+    {
+        for (size_t r = 0; r < stride; r++)
+        {
+            size_t k = (b << (target + 1)) + r;
+            amplitude a = amp[k];
+            amplitude c = amp[k + stride];
+
+            amp[k] = cmul(m00, a) + cmul(m01, c);
+            amp[k + stride] = cmul(m10, a) + cmul(m11, c);
+        }
+    }
+}
+
+/*
+    Spread the bits of t over the positions not listed in fixed (ascending),
+    leaving zeros at the fixed positions.
+*/
+size_t deposit_bits(size_t t, const int *fixed, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        size_t low = t & (((size_t)1 << fixed[i]) - 1);
+        t = ((t >> fixed[i]) << (fixed[i] + 1)) | low;
+    }
+    return t;
+}
+
+/*
+    Longest contiguous run handed out as one unit of work by
+    apply_controlled_1q, so that gates whose fixed qubits are all
+    high still split into enough chunks for every thread.
+*/
+#define CONTROLLED_RUN_LIMIT ((size_t)1 << 12)
+
+void apply_controlled_1q(qreg *reg, unsigned long long ctrl_mask, int target, const double complex m[2][2])
+{
+    //A target among the controls would pair indexes past the end of the state.
+    assert(!(ctrl_mask >> target & 1));
+
+    if (reg->sparse != NULL)
+    {
+        sparse_apply_1q(reg, ctrl_mask, target, m);
+        return;
+    }
+
+    size_t stride = (size_t)1 << target;
+    amplitude *amp = reg->matrix;
+    amplitude m00 = m[0][0], m01 = m[0][1];
+    amplitude m10 = m[1][0], m11 = m[1][1];
+    bool diagonal = (m01 == 0 && m10 == 0);
+    bool antidiagonal = (m00 == 0 && m11 == 0);
+
+    //Controls and target are fixed bits, the remaining ones are enumerated.
+    int fixed[64];
+    int count = 0;
+    unsigned long long mask = ctrl_mask | ((unsigned long long)1 << target);
+    for (int q = 0; q < (int)reg->size; q++)
+    {
+        if (mask & ((unsigned long long)1 << q))
+        {
+            fixed[count++] = q;
+        }
+    }
+
+    //Free bits below the lowest fixed bit form contiguous runs.
+    size_t run = (size_t)1 << __builtin_ctzll(mask);
+    size_t pairs = (size_t)1 << (reg->size - count);
+    run = run < CONTROLLED_RUN_LIMIT ? run : CONTROLLED_RUN_LIMIT;
+    size_t chunks = pairs / run;
+
+    PARALLEL_FOR(reg, reg_states(reg), 1)
+    for (size_t c = 0; c < chunks; c++)
+    {
+        size_t base = deposit_bits(c * run, fixed, count) | ctrl_mask;
+
+        if (diagonal)
+        {
+            //Phase gates leave the target |0> half alone.
+            if (m00 != 1)
+            {
+                for (size_t k = base; k < base + run; k++)
+                {
+                    amp[k] = cmul(amp[k], m00);
+                }
+            }
+            if (m11 != 1)
+            {
+                for (size_t k = base + stride; k < base + stride + run; k++)
+                {
+                    amp[k] = cmul(amp[k], m11);
+                }
+            }
+        }
+        else if (antidiagonal)
+        {
+            for (size_t k = base; k < base + run; k++)
+            {
+                amplitude a = amp[k];
+                amp[k] = cmul(m01, amp[k + stride]);
+                amp[k + stride] = cmul(m10, a);
+            }
+        }
+        else
+        {
+            for (size_t k = base; k < base + run; k++)
+            {
+                amplitude a = amp[k];
+                amplitude c = amp[k + stride];
+
+                amp[k] = cmul(m00, a) + cmul(m01, c);
+                amp[k + stride] = cmul(m10, a) + cmul(m11, c);
+            }
+        }
+    }
+}
+
+/*
+    Multiplies the dim amplitudes at amp + offsets[l] by a dense matrix
+    given as separate real and imaginary parts.
+*/
+static inline __attribute__((always_inline))
+void kq_dense(amplitude *amp, const size_t *offsets, const amp_real *m_re, const amp_real *m_im, size_t dim)
+{
+    amp_real in_re[dim], in_im[dim];
+
+    for (size_t l = 0; l < dim; l++)
+    {
+        in_re[l] = AMP_RE(amp[offsets[l]]);
+        in_im[l] = AMP_IM(amp[offsets[l]]);
+    }
+    for (size_t row = 0; row < dim; row++)
+    {
+        const amp_real *row_re = m_re + row * dim;
+        const amp_real *row_im = m_im + row * dim;
+        amp_real sum_re = 0, sum_im = 0;
+        for (size_t l = 0; l < dim; l++)
+        {
+            sum_re += row_re[l] * in_re[l] - row_im[l] * in_im[l];
+            sum_im += row_re[l] * in_im[l] + row_im[l] * in_re[l];
+        }
+        amp[offsets[row]] = sum_re + sum_im * j;
+    }
+}
+
+static inline __attribute__((always_inline))
+void kq_diagonal(amplitude *amp, const size_t *offsets, const amp_real *m_re, const amp_real *m_im, size_t dim)
+{
+    for (size_t l = 0; l < dim; l++)
+    {
+        amp[offsets[l]] = cmul(amp[offsets[l]], m_re[l * dim + l] + m_im[l * dim + l] * j);
+    }
+}
+
+void apply_kq(qreg *reg, const int *qubits, int k, const double complex *m)
+{
+    if (reg->sparse != NULL)
+    {
+        sparse_apply_kq(reg, qubits, k, m);
+        return;
+    }
+
+    size_t dim = (size_t)1 << k;
+    amplitude *amp = reg->matrix;
+    size_t offsets[dim];
+    bool diagonal = true;
+
+    //Offset of every local basis state from the group base.
+    for (size_t l = 0; l < dim; l++)
+    {
+        offsets[l] = 0;
+        for (int i = 0; i < k; i++)
+        {
+            if (l & ((size_t)1 << i))
+            {
+                offsets[l] |= (size_t)1 << qubits[i];
+            }
+        }
+    }
+
+    for (size_t r = 0; r < dim && diagonal; r++)
+    {
+        for (size_t c = 0; c < dim; c++)
+        {
+            if (r != c && m[r * dim + c] != 0)
+            {
+                diagonal = false;
+                break;
+            }
+        }
+    }
+
+    //Split copy of the matrix for kq_dense and kq_diagonal.
+    amp_real m_re[dim * dim], m_im[dim * dim];
+    for (size_t e = 0; e < dim * dim; e++)
+    {
+        m_re[e] = creal(m[e]);
+        m_im[e] = cimag(m[e]);
+    }
+
+    size_t run = (size_t)1 << qubits[0];
+    size_t groups = (size_t)1 << (reg->size - k);
+    run = run < CONTROLLED_RUN_LIMIT ? run : CONTROLLED_RUN_LIMIT;
+    size_t chunks = groups / run;
+
+    PARALLEL_FOR(reg, reg_states(reg), 1)
+    for (size_t c = 0; c < chunks; c++)
+    {
+        size_t base = deposit_bits(c * run, qubits, k);
+
+        for (size_t g = base; g < base + run; g++)
+        {
+            if (diagonal)
+            {
+                kq_diagonal(amp + g, offsets, m_re, m_im, dim);
+                continue;
+            }
+
+            //Constant sizes let the compiler unroll the common widths.
+            switch (k)
+            {
+                case 1: kq_dense(amp + g, offsets, m_re, m_im, 2); break;
+                case 2: kq_dense(amp + g, offsets, m_re, m_im, 4); break;
+                case 3: kq_dense(amp + g, offsets, m_re, m_im, 8); break;
+                default: kq_dense(amp + g, offsets, m_re, m_im, dim); break;
+            }
+        }
+    }
+}
+
+/*
+    Widest table of kernel_diagonal, 2^k factors that stay in L1.
+    Terms on more qubits are tested one by one for every amplitude.
+*/
+#define DIAGONAL_TABLE_QUBITS 10
+
+/*
+    The low DIAGONAL_BLOCK_QUBITS bits of an index are looked up in a
+    per table index, the high bits once per block.
+*/
+#define DIAGONAL_BLOCK_QUBITS 12
+
+/*
+    Tables of kernel_diagonal: table t covers the qubits of masks[t], entry
+    e holds the product of its terms at the index whose bits in the mask
+    read e.
+*/
+typedef struct diag_plan{
+    size_t tables;
+    unsigned long long *masks;
+    amplitude **factors;
+    const diag_term **wide;
+    size_t wide_count;
+}diag_plan;
+
+/*
+    The bits of index selected by mask, packed into the low bits.
+*/
+static inline size_t compress_bits(unsigned long long index, unsigned long long mask)
+{
+    size_t packed = 0;
+    for (int bit = 0; mask != 0; bit++)
+    {
+        int q = __builtin_ctzll(mask);
+        packed |= (size_t)((index >> q) & 1) << bit;
+        mask &= mask - 1;
+    }
+    return packed;
+}
+
+/*
+    Inverse of compress_bits.
+*/
+static inline unsigned long long expand_bits(size_t packed, unsigned long long mask)
+{
+    unsigned long long index = 0;
+    for (int bit = 0; mask != 0; bit++)
+    {
+        int q = __builtin_ctzll(mask);
+        index |= (unsigned long long)((packed >> bit) & 1) << q;
+        mask &= mask - 1;
+    }
+    return index;
+}
+
+/*
+    Group the terms greedily into tables and fill them.
+*/
+diag_plan plan_diagonal(const diag_term *terms, size_t count)
+{
+    diag_plan plan = {0, NULL, NULL, NULL, 0};
+    plan.masks = (unsigned long long*) malloc((count + 1) * sizeof(unsigned long long));
+    plan.factors = (amplitude**) malloc((count + 1) * sizeof(amplitude*));
+    plan.wide = (const diag_term**) malloc((count + 1) * sizeof(diag_term*));
+    size_t *table_of = (size_t*) malloc((count + 1) * sizeof(size_t));
+
+    for (size_t t = 0; t < count; t++)
+    {
+        if (__builtin_popcountll(terms[t].mask) > DIAGONAL_TABLE_QUBITS)
+        {
+            plan.wide[plan.wide_count++] = &terms[t];
+            table_of[t] = (size_t)-1;
+            continue;
+        }
+
+        //First table the term fits in, else a new one.
+        size_t g = 0;
+        while (g < plan.tables && __builtin_popcountll(plan.masks[g] | terms[t].mask) > DIAGONAL_TABLE_QUBITS)
+        {
+            g++;
+        }
+        if (g == plan.tables)
+        {
+            plan.masks[plan.tables++] = 0;
+        }
+        plan.masks[g] |= terms[t].mask;
+        table_of[t] = g;
+    }
+
+    for (size_t g = 0; g < plan.tables; g++)
+    {
+        size_t entries = (size_t)1 << __builtin_popcountll(plan.masks[g]);
+        plan.factors[g] = (amplitude*) malloc(entries * sizeof(amplitude));
+        for (size_t e = 0; e < entries; e++)
+        {
+            unsigned long long index = expand_bits(e, plan.masks[g]);
+            double complex factor = 1;
+            for (size_t t = 0; t < count; t++)
+            {
+                if (table_of[t] == g && (index & terms[t].mask) == terms[t].value)
+                {
+                    factor *= terms[t].factor;
+                }
+            }
+            plan.factors[g][e] = factor;
+        }
+    }
+
+    free(table_of);
+    return plan;
+}
+
+void free_diag_plan(diag_plan *plan)
+{
+    for (size_t g = 0; g < plan->tables; g++)
+    {
+        free(plan->factors[g]);
+    }
+    free(plan->masks);
+    free(plan->factors);
+    free(plan->wide);
+}
+
+/*
+    Factor of a single index, used by sparse registers.
+*/
+amplitude diagonal_factor(const diag_plan *plan, unsigned long long index, phase_function f, void *context)
+{
+    amplitude factor = 1;
+    for (size_t g = 0; g < plan->tables; g++)
+    {
+        factor = cmul(factor, plan->factors[g][compress_bits(index, plan->masks[g])]);
+    }
+    for (size_t w = 0; w < plan->wide_count; w++)
+    {
+        if ((index & plan->wide[w]->mask) == plan->wide[w]->value)
+        {
+            factor = cmul(factor, (amplitude) plan->wide[w]->factor);
+        }
+    }
+    if (f != NULL)
+    {
+        factor = cmul(factor, (amplitude) f(index, context));
+    }
+    return factor;
+}
+
+void kernel_diagonal(qreg *reg, const diag_term *terms, size_t count, phase_function f, void *context)
+{
+    diag_plan plan = plan_diagonal(terms, count);
+
+    if (reg->sparse != NULL)
+    {
+        sparse_map *map = reg->sparse;
+        for (size_t s = 0; s < map->capacity; s++)
+        {
+            if (map->keys[s] != SPARSE_EMPTY)
+            {
+                map->values[s] = cmul(map->values[s], diagonal_factor(&plan, map->keys[s], f, context));
+            }
+        }
+        free_diag_plan(&plan);
+        return;
+    }
+
+    int block_qubits = reg->size < DIAGONAL_BLOCK_QUBITS ? reg->size : DIAGONAL_BLOCK_QUBITS;
+    size_t block = (size_t)1 << block_qubits;
+    size_t blocks = reg_states(reg) >> block_qubits;
+    size_t tables = plan.tables;
+    amplitude *amp = reg->matrix;
+
+    //Packed low bits of every index of a block, per table. The high bits
+    //of a table mask land above its low ones.
+    unsigned short *low = (unsigned short*) malloc((tables * block + 1) * sizeof(unsigned short));
+    int low_bits[tables + 1];
+    for (size_t g = 0; g < tables; g++)
+    {
+        unsigned long long low_mask = plan.masks[g] & (block - 1);
+        low_bits[g] = __builtin_popcountll(low_mask);
+        for (size_t r = 0; r < block; r++)
+        {
+            low[g * block + r] = compress_bits(r, low_mask);
+        }
+    }
+
+    PARALLEL_FOR(reg, reg_states(reg), 1)
+    for (size_t b = 0; b < blocks; b++)
+    {
+        size_t base = b << block_qubits;
+        const amplitude *row[tables + 1];
+        for (size_t g = 0; g < tables; g++)
+        {
+            row[g] = plan.factors[g] + (compress_bits(base, plan.masks[g] & ~(unsigned long long)(block - 1)) << low_bits[g]);
+        }
+
+        for (size_t r = 0; r < block; r++)
+        {
+            size_t i = base + r;
+            amplitude factor = tables > 0 ? row[0][low[r]] : 1;
+            for (size_t g = 1; g < tables; g++)
+            {
+                factor = cmul(factor, row[g][low[g * block + r]]);
+            }
+            for (size_t w = 0; w < plan.wide_count; w++)
+            {
+                if ((i & plan.wide[w]->mask) == plan.wide[w]->value)
+                {
+                    factor = cmul(factor, (amplitude) plan.wide[w]->factor);
+                }
+            }
+            if (f != NULL)
+            {
+                factor = cmul(factor, (amplitude) f(i, context));
+            }
+            amp[i] = cmul(amp[i], factor);
+        }
+    }
+
+    free(low);
+    free_diag_plan(&plan);
+}
+
+/*
+    Blocks of 2^WALSH_BLOCK_QUBITS amplitudes stay in cache while every low
+    qubit of kernel_walsh is transformed.
+*/
+#define WALSH_BLOCK_QUBITS 14
+
+/*
+    Sum and difference of two amplitudes in place.
+*/
+#define WALSH_PAIR(a, b) { amplitude sum = a + b; b = a - b; a = sum; }
+
+/*
+    Butterflies of r qubits on run consecutive groups, the amplitudes of
+    group t sit at amp + offsets[l] + t. Written out per width, the
+    compiler keeps the whole group in registers.
+*/
+void walsh_chunk(amplitude *amp, const size_t *offsets, size_t run, int r, amp_real scale)
+{
+    amplitude *p0 = amp + offsets[0], *p1 = amp + offsets[1];
+
+    if (r == 1)
+    {
+        for (size_t t = 0; t < run; t++)
+        {
+            amplitude a0 = p0[t], a1 = p1[t];
+            WALSH_PAIR(a0, a1);
+            p0[t] = scale * a0;
+            p1[t] = scale * a1;
+        }
+        return;
+    }
+
+    amplitude *p2 = amp + offsets[2], *p3 = amp + offsets[3];
+    if (r == 2)
+    {
+        for (size_t t = 0; t < run; t++)
+        {
+            amplitude a0 = p0[t], a1 = p1[t], a2 = p2[t], a3 = p3[t];
+            WALSH_PAIR(a0, a1); WALSH_PAIR(a2, a3);
+            WALSH_PAIR(a0, a2); WALSH_PAIR(a1, a3);
+            p0[t] = scale * a0;
+            p1[t] = scale * a1;
+            p2[t] = scale * a2;
+            p3[t] = scale * a3;
+        }
+        return;
+    }
+
+    amplitude *p4 = amp + offsets[4], *p5 = amp + offsets[5];
+    amplitude *p6 = amp + offsets[6], *p7 = amp + offsets[7];
+    for (size_t t = 0; t < run; t++)
+    {
+        amplitude a0 = p0[t], a1 = p1[t], a2 = p2[t], a3 = p3[t];
+        amplitude a4 = p4[t], a5 = p5[t], a6 = p6[t], a7 = p7[t];
+        WALSH_PAIR(a0, a1); WALSH_PAIR(a2, a3); WALSH_PAIR(a4, a5); WALSH_PAIR(a6, a7);
+        WALSH_PAIR(a0, a2); WALSH_PAIR(a1, a3); WALSH_PAIR(a4, a6); WALSH_PAIR(a5, a7);
+        WALSH_PAIR(a0, a4); WALSH_PAIR(a1, a5); WALSH_PAIR(a2, a6); WALSH_PAIR(a3, a7);
+        p0[t] = scale * a0;
+        p1[t] = scale * a1;
+        p2[t] = scale * a2;
+        p3[t] = scale * a3;
+        p4[t] = scale * a4;
+        p5[t] = scale * a5;
+        p6[t] = scale * a6;
+        p7[t] = scale * a7;
+    }
+}
+
+/*
+    Offsets of the 2^r members of a butterfly from its base.
+*/
+void walsh_offsets(const int *group, int r, size_t *offsets)
+{
+    for (size_t l = 0; l < ((size_t)1 << r); l++)
+    {
+        offsets[l] = 0;
+        for (int i = 0; i < r; i++)
+        {
+            offsets[l] |= ((l >> i) & 1) << group[i];
+        }
+    }
+}
+
+void kernel_walsh(qreg *reg, const int *qubits, int k)
+{
+    if (reg->sparse != NULL)
+    {
+        for (int i = 0; i < k; i++)
+        {
+            kernel_h(reg, qubits[i]);
+        }
+        return;
+    }
+    if (k == 0)
+    {
+        return;
+    }
+
+    //Ascending order, butterfly groups are read as deposit_bits positions.
+    int sorted[64];
+    for (int i = 0; i < k; i++)
+    {
+        int q = qubits[i], p = i;
+        while (p > 0 && sorted[p - 1] > q)
+        {
+            sorted[p] = sorted[p - 1];
+            p--;
+        }
+        sorted[p] = q;
+    }
+
+    size_t size = reg_states(reg);
+    int block_qubits = reg->size < WALSH_BLOCK_QUBITS ? reg->size : WALSH_BLOCK_QUBITS;
+    size_t blocks = size >> block_qubits;
+    amp_real scale = pow(M_SQRT1_2, k);
+    amplitude *amp = reg->matrix;
+    int low = 0;
+    while (low < k && sorted[low] < block_qubits)
+    {
+        low++;
+    }
+
+    if (low > 0)
+    {
+        PARALLEL_FOR(reg, size, 1)
+        for (size_t b = 0; b < blocks; b++)
+        {
+            amplitude *block = amp + (b << block_qubits);
+            for (int g = 0; g < low; g += 3)
+            {
+                int r = low - g < 3 ? low - g : 3;
+                size_t offsets[8];
+                walsh_offsets(sorted + g, r, offsets);
+
+                size_t run = (size_t)1 << sorted[g];
+                size_t chunks = ((size_t)1 << (block_qubits - r)) / run;
+                for (size_t c = 0; c < chunks; c++)
+                {
+                    walsh_chunk(block + deposit_bits(c * run, sorted + g, r), offsets, run, r, g + r == k ? scale : 1);
+                }
+            }
+        }
+    }
+
+    for (int g = low; g < k; g += 3)
+    {
+        int r = k - g < 3 ? k - g : 3;
+        size_t offsets[8];
+        walsh_offsets(sorted + g, r, offsets);
+
+        size_t run = (size_t)1 << sorted[g];
+        run = run < CONTROLLED_RUN_LIMIT ? run : CONTROLLED_RUN_LIMIT;
+        size_t chunks = (size >> r) / run;
+        amp_real group_scale = g + r == k ? scale : 1;
+
+        PARALLEL_FOR(reg, size, 1)
+        for (size_t c = 0; c < chunks; c++)
+        {
+            walsh_chunk(amp + deposit_bits(c * run, sorted + g, r), offsets, run, r, group_scale);
+        }
+    }
+}
+
+/*
+    Pairs of kernel_swap_bits exchanged per pass when they leave the tile.
+    A group of them reads 2^SWAP_GROUP_PAIRS contiguous stretches at a
+    time, more pairs at once scatter the accesses over the whole state.
+*/
+#define SWAP_GROUP_PAIRS 3
+
+/*
+    Exchange r pairs lying below block_qubits, one block at a time, each
+    amplitude moving to its partner from a table of the block.
+*/
+void swap_pairs_blocked(qreg *reg, const int *a, const int *b, int r, int block_qubits)
+{
+    size_t block_size = (size_t)1 << block_qubits;
+    size_t blocks = reg_states(reg) >> block_qubits;
+    size_t *partner = (size_t*) malloc(block_size * sizeof(size_t));
+    amplitude *amp = reg->matrix;
+
+    for (size_t x = 0; x < block_size; x++)
+    {
+        partner[x] = x;
+        for (int t = 0; t < r; t++)
+        {
+            if (((x >> a[t]) ^ (x >> b[t])) & 1)
+            {
+                partner[x] ^= ((size_t)1 << a[t]) | ((size_t)1 << b[t]);
+            }
+        }
+    }
+
+    PARALLEL_FOR(reg, reg_states(reg), 1)
+    for (size_t blk = 0; blk < blocks; blk++)
+    {
+        amplitude *block = amp + (blk << block_qubits);
+        for (size_t x = 0; x < block_size; x++)
+        {
+            //Each exchange is done once, by the lower index of the two.
+            if (partner[x] > x)
+            {
+                amplitude temp = block[x];
+                block[x] = block[partner[x]];
+                block[partner[x]] = temp;
+            }
+        }
+    }
+    free(partner);
+}
+
+/*
+    Exchange up to SWAP_GROUP_PAIRS pairs in one pass. The 2r bits are
+    walked together: member l of a group sits at base + offsets[l] and
+    trades places with member moved[l], a run of bases at a time.
+*/
+void swap_pairs_grouped(qreg *reg, const int *a, const int *b, int r)
+{
+    int bits[2 * SWAP_GROUP_PAIRS], pos[64];
+    int count = 0;
+    for (int i = 0; i < r; i++)
+    {
+        bits[count++] = a[i];
+        bits[count++] = b[i];
+    }
+    for (int i = 1; i < count; i++)
+    {
+        for (int p = i; p > 0 && bits[p - 1] > bits[p]; p--)
+        {
+            int temp = bits[p];
+            bits[p] = bits[p - 1];
+            bits[p - 1] = temp;
+        }
+    }
+    for (int i = 0; i < count; i++)
+    {
+        pos[bits[i]] = i;
+    }
+
+    size_t members = (size_t)1 << count;
+    size_t offsets[1 << (2 * SWAP_GROUP_PAIRS)], moved[1 << (2 * SWAP_GROUP_PAIRS)];
+    for (size_t l = 0; l < members; l++)
+    {
+        offsets[l] = 0;
+        moved[l] = l;
+        for (int i = 0; i < count; i++)
+        {
+            offsets[l] |= ((l >> i) & 1) << bits[i];
+        }
+        for (int i = 0; i < r; i++)
+        {
+            if (((l >> pos[a[i]]) ^ (l >> pos[b[i]])) & 1)
+            {
+                moved[l] ^= ((size_t)1 << pos[a[i]]) | ((size_t)1 << pos[b[i]]);
+            }
+        }
+    }
+
+    size_t size = reg_states(reg);
+    size_t run = (size_t)1 << bits[0];
+    run = run < CONTROLLED_RUN_LIMIT ? run : CONTROLLED_RUN_LIMIT;
+    size_t chunks = (size >> count) / run;
+    amplitude *amp = reg->matrix;
+
+    PARALLEL_FOR(reg, size, 1)
+    for (size_t c = 0; c < chunks; c++)
+    {
+        amplitude *base = amp + deposit_bits(c * run, bits, count);
+        for (size_t l = 0; l < members; l++)
+        {
+            if (moved[l] <= l)
+            {
+                continue;
+            }
+            amplitude *first = base + offsets[l], *second = base + offsets[moved[l]];
+            for (size_t t = 0; t < run; t++)
+            {
+                amplitude temp = first[t];
+                first[t] = second[t];
+                second[t] = temp;
+            }
+        }
+    }
+}
+
+void kernel_swap_bits(qreg *reg, const int *a, const int *b, int k)
+{
+    if (reg->sparse != NULL)
+    {
+        sparse_swap_bits(reg, a, b, k);
+        return;
+    }
+
+    int block_qubits = (int)reg->size < reg->tile_qubits ? (int)reg->size : reg->tile_qubits;
+    int inner_a[64], inner_b[64], outer_a[64], outer_b[64];
+    int inner = 0, outer = 0;
+    for (int t = 0; t < k; t++)
+    {
+        if (a[t] == b[t])
+        {
+            continue;
+        }
+        if (a[t] < block_qubits && b[t] < block_qubits)
+        {
+            inner_a[inner] = a[t];
+            inner_b[inner++] = b[t];
+        }
+        else
+        {
+            outer_a[outer] = a[t];
+            outer_b[outer++] = b[t];
+        }
+    }
+
+    //A single pair is cheaper with the dedicated kernel, which skips half the state.
+    if (inner == 1)
+    {
+        outer_a[outer] = inner_a[0];
+        outer_b[outer++] = inner_b[0];
+    }
+    else if (inner > 1)
+    {
+        swap_pairs_blocked(reg, inner_a, inner_b, inner, block_qubits);
+    }
+
+    for (int t = 0; t < outer; t += SWAP_GROUP_PAIRS)
+    {
+        int r = outer - t < SWAP_GROUP_PAIRS ? outer - t : SWAP_GROUP_PAIRS;
+        if (r == 1)
+        {
+            kernel_swap(reg, outer_a[t], outer_b[t]);
+        }
+        else
+        {
+            swap_pairs_grouped(reg, outer_a + t, outer_b + t, r);
+        }
+    }
+}
+
+/*
+    Swaps moving the contents of bit p to bit dest[p] for the n bits, in
+    two rounds of disjoint pairs. Shifting a cycle by one is the product of
+    two reflections, i <-> -i and then i <-> 1 - i along the cycle. Writes
+    the pairs of the given round (0 or 1) to a and b, returns their count.
+*/
+int cycle_reflection(const int *dest, int n, int round, int *a, int *b)
+{
+    int seen[64] = {0}, cycle[64];
+    int k = 0;
+
+    for (int p = 0; p < n; p++)
+    {
+        int m = 0;
+        for (int c = p; !seen[c]; c = dest[c])
+        {
+            seen[c] = 1;
+            cycle[m++] = c;
+        }
+        for (int i = 0; i < m; i++)
+        {
+            int other = ((round - i) % m + m) % m;
+            if (i < other)
+            {
+                a[k] = cycle[i];
+                b[k++] = cycle[other];
+            }
+        }
+    }
+    return k;
+}
+
+void settle_layout(qreg *reg)
+{
+    if (!reg->permuted)
+    {
+        return;
+    }
+    mark_dirty(reg);
+
+    int dest[64], a[64], b[64];
+    for (int q = 0; q < (int)reg->size; q++)
+    {
+        dest[reg->position[q]] = q;
+    }
+    for (int round = 0; round < 2; round++)
+    {
+        int k = cycle_reflection(dest, reg->size, round, a, b);
+        kernel_swap_bits(reg, a, b, k);
+    }
+
+    for (int q = 0; q < (int)reg->size; q++)
+    {
+        reg->position[q] = q;
+    }
+    reg->permuted = false;
+}
+
+void swap_layout(qreg *reg, int first, int second)
+{
+    int bit = reg->position[first];
+    reg->position[first] = reg->position[second];
+    reg->position[second] = bit;
+    reg->permuted = true;
+}
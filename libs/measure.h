@@ -0,0 +1,463 @@
+#pragma once
+#include "fusion.h"
+
+/*
+    Measurement and sampling.
+
+    Outcomes are drawn from the splitmix64 generator stored in the register,
+    seeded with a fixed value by initQuRegister so runs are reproducible.
+    Qubit q of a basis index is bit q, as everywhere else in the library.
+    Deferred registers are flushed before they are measured. Sparse
+    registers only walk their stored amplitudes. The state of a single
+    qubit is read the same way, reduced_density traces out the rest of the
+    register on demand.
+*/
+
+#define SAMPLE_BLOCK_QUBITS 12
+
+/*
+    Reseed the random generator of the register.
+*/
+void set_seed(qreg *reg, unsigned long long seed);
+
+/*
+    Probability of reading |1> on the given qubit, the state is untouched.
+*/
+double probability_one(qreg *reg, int qubit);
+
+/*
+    Reduced density matrix of a single qubit, every other qubit traced
+    out, computed from the amplitudes in one pass. rho[0][1] is the sum of
+    psi[i] conj(psi[i | bit]) over the indexes with the qubit clear.
+*/
+void reduced_density(qreg *reg, int qubit, double complex rho[2][2]);
+
+/*
+    Bloch vector (<X>, <Y>, <Z>) of a single qubit, shorter than 1 when the
+    qubit is entangled with the rest of the register.
+*/
+void bloch_vector(qreg *reg, int qubit, double v[3]);
+
+/*
+    Measure a single qubit in the computational basis and return 0 or 1.
+    The state collapses onto the outcome and is renormalized, so the call
+    can be used for mid-circuit measurement.
+*/
+int measure(qreg *reg, int qubit);
+
+/*
+    Measure every qubit, returns the basis index of the outcome.
+    The register collapses onto that basis state.
+*/
+unsigned long long measure_all(qreg *reg);
+
+/*
+    Draw shots outcomes of measuring every qubit without collapsing.
+    out_counts must hold 2^size entries and receives the number of times
+    each basis index was drawn, on top of what it already holds.
+*/
+void sample(qreg *reg, unsigned long shots, unsigned int *out_counts);
+
+void set_seed(qreg *reg, unsigned long long seed)
+{
+    reg->rng_state = seed;
+}
+
+unsigned long long next_random(qreg *reg)
+{
+    unsigned long long z = (reg->rng_state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/*
+    Uniform double in [0, 1) from the top 53 bits.
+*/
+double random_uniform(qreg *reg)
+{
+    return (next_random(reg) >> 11) * 0x1.0p-53;
+}
+
+
+double amp_probability(double complex a)
+{
+    return creal(a) * creal(a) + cimag(a) * cimag(a);
+}
+
+/*
+    Probability of the stored amplitudes of a sparse register whose index
+    matches value on the bits of mask.
+*/
+double sparse_probability(qreg *reg, unsigned long long mask, unsigned long long value)
+{
+    sparse_map *map = reg->sparse;
+    double p = 0;
+
+    for (size_t s = 0; s < map->capacity; s++)
+    {
+        if (map->keys[s] != SPARSE_EMPTY && (map->keys[s] & mask) == value)
+        {
+            p += amp_probability(map->values[s]);
+        }
+    }
+    return p;
+}
+
+double probability_one(qreg *reg, int qubit)
+{
+    flush_pending(reg);
+    if (reg->sparse != NULL)
+    {
+        return sparse_probability(reg, 1ULL << qubit, 1ULL << qubit);
+    }
+
+    size_t size = reg_states(reg);
+    size_t stride = (size_t)1 << qubit;
+    size_t blocks = size >> (qubit + 1);
+    amplitude *amp = reg->matrix;
+    double p1 = 0;
+
+    PARALLEL_SUM(reg, size, 2, p1)
+    for (size_t b = 0; b < blocks; b++)
+    {
+        for (size_t r = 0; r < stride; r++)
+        {
+            p1 += amp_probability(amp[(b << (qubit + 1)) + stride + r]);
+        }
+    }
+    return p1;
+}
+
+void reduced_density(qreg *reg, int qubit, double complex rho[2][2])
+{
+    flush_pending(reg);
+    unsigned long long bit = 1ULL << qubit;
+    double p0 = 0, p1 = 0;
+    double complex c = 0;
+
+    if (reg->sparse != NULL)
+    {
+        sparse_map *map = reg->sparse;
+        for (size_t s = 0; s < map->capacity; s++)
+        {
+            unsigned long long i = map->keys[s];
+            if (i == SPARSE_EMPTY)
+            {
+                continue;
+            }
+            if (i & bit)
+            {
+                p1 += amp_probability(map->values[s]);
+            }
+            else
+            {
+                p0 += amp_probability(map->values[s]);
+                c += map->values[s] * conj(sparse_get(map, i | bit));
+            }
+        }
+    }
+    else
+    {
+        size_t size = reg_states(reg);
+        size_t stride = (size_t)1 << qubit;
+        size_t pairs = size / 2;
+        amplitude *amp = reg->matrix;
+        int chunks = reg->num_threads > 0 ? reg->num_threads : 1;
+        size_t chunk = (pairs + chunks - 1) / chunks;
+        double sums[chunks][4];
+
+        //Each thread sums its share of the pairs, the rows are added after.
+        PARALLEL_FOR(reg, size, 1)
+        for (int t = 0; t < chunks; t++)
+        {
+            double s0 = 0, s1 = 0, re = 0, im = 0;
+            size_t last = (t + 1) * chunk < pairs ? (t + 1) * chunk : pairs;
+            for (size_t m = t * chunk; m < last; m++)
+            {
+                size_t i = ((m >> qubit) << (qubit + 1)) | (m & (stride - 1));
+                double complex a = amp[i], b = amp[i + stride];
+                s0 += amp_probability(a);
+                s1 += amp_probability(b);
+                re += creal(a) * creal(b) + cimag(a) * cimag(b);
+                im += cimag(a) * creal(b) - creal(a) * cimag(b);
+            }
+            sums[t][0] = s0;
+            sums[t][1] = s1;
+            sums[t][2] = re;
+            sums[t][3] = im;
+        }
+
+        for (int t = 0; t < chunks; t++)
+        {
+            p0 += sums[t][0];
+            p1 += sums[t][1];
+            c += sums[t][2] + sums[t][3] * j;
+        }
+    }
+
+    rho[0][0] = p0;
+    rho[0][1] = c;
+    rho[1][0] = conj(c);
+    rho[1][1] = p1;
+}
+
+void bloch_vector(qreg *reg, int qubit, double v[3])
+{
+    double complex rho[2][2];
+    reduced_density(reg, qubit, rho);
+
+    //rho = (1 + xX + yY + zZ) / 2
+    v[0] = 2 * creal(rho[0][1]);
+    v[1] = -2 * cimag(rho[0][1]);
+    v[2] = creal(rho[0][0]) - creal(rho[1][1]);
+}
+
+int measure(qreg *reg, int qubit)
+{
+    flush_pending(reg);
+    mark_dirty(reg);
+
+    if (reg->sparse != NULL)
+    {
+        unsigned long long bit = 1ULL << qubit;
+        double p1 = sparse_probability(reg, bit, bit);
+        double p0 = sparse_probability(reg, bit, 0);
+        int outcome = random_uniform(reg) * (p0 + p1) < p1;
+        sparse_collapse(reg, bit, outcome ? bit : 0, 1 / sqrt(outcome ? p1 : p0));
+        return outcome;
+    }
+
+    size_t size = reg_states(reg);
+    size_t stride = (size_t)1 << qubit;
+    size_t blocks = size >> (qubit + 1);
+    amplitude *amp = reg->matrix;
+    double p0 = 0, p1;
+
+    //Each half is read once, the sum also covers slightly unnormalized states.
+    PARALLEL_SUM(reg, size, 2, p0)
+    for (size_t b = 0; b < blocks; b++)
+    {
+        for (size_t r = 0; r < stride; r++)
+        {
+            p0 += amp_probability(amp[(b << (qubit + 1)) + r]);
+        }
+    }
+    p1 = probability_one(reg, qubit);
+
+    int outcome = random_uniform(reg) * (p0 + p1) < p1;
+    double norm = 1 / sqrt(outcome ? p1 : p0);
+
+    //Zero the half that was not observed and renormalize the other one.
+    PARALLEL_FOR(reg, size, 2)
+    for (size_t b = 0; b < blocks; b++)
+    {
+        for (size_t r = 0; r < stride; r++)
+        {
+            size_t k = (b << (qubit + 1)) + r;
+            amp[k + (outcome ? 0 : stride)] = 0;
+            amp[k + (outcome ? stride : 0)] *= norm;
+        }
+    }
+    return outcome;
+}
+
+unsigned long long measure_all(qreg *reg)
+{
+    flush_pending(reg);
+    mark_dirty(reg);
+
+    if (reg->sparse != NULL)
+    {
+        sparse_map *map = reg->sparse;
+        double target = random_uniform(reg) * sparse_probability(reg, 0, 0);
+        double cum = 0;
+        size_t chosen = 0;
+
+        for (size_t s = 0; s < map->capacity; s++)
+        {
+            if (map->keys[s] != SPARSE_EMPTY)
+            {
+                chosen = s;
+                cum += amp_probability(map->values[s]);
+                if (target < cum)
+                {
+                    break;
+                }
+            }
+        }
+
+        unsigned long long outcome = map->keys[chosen];
+        sparse_collapse(reg, ~0ULL, outcome, 1 / cabs(map->values[chosen]));
+        return outcome;
+    }
+
+    size_t size = reg_states(reg);
+    amplitude *amp = reg->matrix;
+    double total = 0;
+
+    PARALLEL_SUM(reg, size, 1, total)
+    for (size_t i = 0; i < size; i++)
+    {
+        total += amp_probability(amp[i]);
+    }
+
+    //Walk the running sum up to the drawn point, skipping impossible states.
+    double target = random_uniform(reg) * total;
+    double cum = 0;
+    unsigned long long outcome = 0;
+    for (size_t i = 0; i < size; i++)
+    {
+        double p = amp_probability(amp[i]);
+        if (p > 0)
+        {
+            outcome = i;
+            cum += p;
+            if (target < cum)
+            {
+                break;
+            }
+        }
+    }
+
+    //Keep the global phase of the surviving amplitude.
+    amplitude kept = amp[outcome];
+    PARALLEL_FOR(reg, size, 1)
+    for (size_t i = 0; i < size; i++)
+    {
+        amp[i] = 0;
+    }
+    amp[outcome] = kept / cabs(kept);
+    return outcome;
+}
+
+/*
+    Ascending uniforms in [0, total) without sorting, the normalized running
+    sums of shots + 1 exponential variables are distributed as the order
+    statistics of shots uniform ones.
+*/
+double* sorted_uniforms(qreg *reg, unsigned long shots, double total)
+{
+    double *u = (double*) malloc(shots * sizeof(double));
+    double acc = 0;
+
+    for (unsigned long s = 0; s < shots; s++)
+    {
+        acc -= log1p(-random_uniform(reg));
+        u[s] = acc;
+    }
+    acc -= log1p(-random_uniform(reg));
+
+    double scale = total / acc;
+    for (unsigned long s = 0; s < shots; s++)
+    {
+        u[s] *= scale;
+    }
+    return u;
+}
+
+/*
+    sample for sparse registers, one walk over the stored amplitudes.
+*/
+void sparse_sample(qreg *reg, unsigned long shots, unsigned int *out_counts)
+{
+    sparse_map *map = reg->sparse;
+    double *u = sorted_uniforms(reg, shots, sparse_probability(reg, 0, 0));
+    double cum = 0;
+    unsigned long s = 0;
+    size_t last = 0;
+
+    for (size_t slot = 0; slot < map->capacity && s < shots; slot++)
+    {
+        if (map->keys[slot] == SPARSE_EMPTY)
+        {
+            continue;
+        }
+        last = slot;
+        cum += amp_probability(map->values[slot]);
+        while (s < shots && u[s] < cum)
+        {
+            out_counts[map->keys[slot]]++;
+            s++;
+        }
+    }
+
+    //Uniforms left over by rounding go to the last stored state.
+    out_counts[map->keys[last]] += shots - s;
+    free(u);
+}
+
+void sample(qreg *reg, unsigned long shots, unsigned int *out_counts)
+{
+    flush_pending(reg);
+    if (reg->sparse != NULL)
+    {
+        sparse_sample(reg, shots, out_counts);
+        return;
+    }
+
+    size_t size = reg_states(reg);
+    int block_qubits = reg->size < SAMPLE_BLOCK_QUBITS ? reg->size : SAMPLE_BLOCK_QUBITS;
+    size_t block = (size_t)1 << block_qubits;
+    size_t blocks = size >> block_qubits;
+    amplitude *amp = reg->matrix;
+    double *prefix = (double*) malloc((blocks + 1) * sizeof(double));
+
+    //Probability held by every block, then their running sum.
+    PARALLEL_FOR(reg, size, 1)
+    for (size_t b = 0; b < blocks; b++)
+    {
+        double sum = 0;
+        for (size_t i = b * block; i < (b + 1) * block; i++)
+        {
+            sum += amp_probability(amp[i]);
+        }
+        prefix[b + 1] = sum;
+    }
+    prefix[0] = 0;
+    for (size_t b = 0; b < blocks; b++)
+    {
+        prefix[b + 1] += prefix[b];
+    }
+
+    double *u = sorted_uniforms(reg, shots, prefix[blocks]);
+
+    //Every block walks its own amplitudes for the uniforms in its range.
+    PARALLEL_FOR(reg, size, 1)
+    for (size_t b = 0; b < blocks; b++)
+    {
+        //First uniform that falls in this block.
+        size_t lo = 0, hi = shots;
+        while (lo < hi)
+        {
+            size_t mid = (lo + hi) / 2;
+            if (u[mid] < prefix[b])
+            {
+                lo = mid + 1;
+            }
+            else
+            {
+                hi = mid;
+            }
+        }
+
+        size_t s = lo;
+        size_t i = b * block;
+        size_t last = (b + 1) * block - 1;
+        double cum = prefix[b] + amp_probability(amp[i]);
+
+        while (s < shots && (u[s] < prefix[b + 1] || b == blocks - 1))
+        {
+            //Rounding may leave a uniform past the block's own sum, it stays on the last index.
+            while (u[s] >= cum && i < last)
+            {
+                cum += amp_probability(amp[++i]);
+            }
+            out_counts[i]++;
+            s++;
+        }
+    }
+
+    free(prefix);
+    free(u);
+}
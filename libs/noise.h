@@ -0,0 +1,313 @@
+#pragma once
+#include "measure.h"
+
+/*
+    Noise channels as quantum trajectories.
+
+    Every channel is sampled instead of being averaged: with the register's
+    random generator a channel picks one of its Kraus operators, applies it
+    and renormalizes the state, so averaging the outcomes of many
+    trajectories reproduces the noisy channel. The Pauli channels only ever
+    apply X, Y or Z, which on a deferred register are recorded and fused
+    with the circuit like any other gate. Amplitude damping has to read the
+    state to pick its operator, so pending gates are flushed first.
+
+    run_trajectories runs a recorded circuit many times under a noise_model.
+    Each thread reuses one register that is reset between trajectories, and
+    trajectory t always draws from the generator seeded with
+    trajectory_seed(seed, t), so the outcomes do not depend on the number
+    of threads or the order the trajectories ran in.
+*/
+
+/*
+    Error rates applied after every gate to each qubit the gate touched,
+    and to every bit of the final readout. Rates of 0 are skipped.
+*/
+typedef struct noise_model{
+    double depolarizing;
+    double bit_flip;
+    double phase_flip;
+    double amplitude_damping;
+    double readout;
+}noise_model;
+
+/*
+    With probability p apply X, Y or Z to the qubit, each equally likely.
+*/
+void depolarize(qreg *reg, int qubit, double p);
+
+/*
+    With probability p apply X to the qubit.
+*/
+void bit_flip(qreg *reg, int qubit, double p);
+
+/*
+    With probability p apply Z to the qubit.
+*/
+void phase_flip(qreg *reg, int qubit, double p);
+
+/*
+    Amplitude damping with decay probability gamma: the qubit relaxes from
+    |1> to |0> with probability gamma times the probability of |1>, and is
+    otherwise left with its |1> amplitudes damped by sqrt(1 - gamma).
+*/
+void amplitude_damp(qreg *reg, int qubit, double gamma);
+
+/*
+    Flip every one of the first n bits of outcome with probability p.
+*/
+unsigned long long readout_error(qreg *reg, unsigned long long outcome, int n, double p);
+
+/*
+    Seed of trajectory t of a run seeded with seed.
+*/
+unsigned long long trajectory_seed(unsigned long long seed, unsigned long long t);
+
+/*
+    Run the operations recorded in the history of circuit once per
+    trajectory on a fresh |0..0> register, with the channels of noise
+    after every gate, then measure every qubit. outcomes receives one basis
+    index per trajectory. The threads of circuit (set_threads) split the
+    trajectories, or the kernels when there are fewer trajectories than
+    threads. Returns false with a message on stderr when the registers
+    cannot be allocated.
+*/
+bool run_trajectories(qreg *circuit, const noise_model *noise, unsigned long trajectories, unsigned long long seed, unsigned long long *outcomes);
+
+void depolarize(qreg *reg, int qubit, double p)
+{
+    double u = random_uniform(reg);
+    if (u >= p)
+    {
+        return;
+    }
+
+    //The draw itself picks the Pauli, each third of [0, p) is one of them.
+    switch ((int)(3 * u / p))
+    {
+        case 0: X(reg, &qubit, 1); break;
+        case 1: Y(reg, &qubit, 1); break;
+        default: Z(reg, &qubit, 1); break;
+    }
+}
+
+void bit_flip(qreg *reg, int qubit, double p)
+{
+    if (random_uniform(reg) < p)
+    {
+        X(reg, &qubit, 1);
+    }
+}
+
+void phase_flip(qreg *reg, int qubit, double p)
+{
+    if (random_uniform(reg) < p)
+    {
+        Z(reg, &qubit, 1);
+    }
+}
+
+void amplitude_damp(qreg *reg, int qubit, double gamma)
+{
+    double p1 = probability_one(reg, qubit);
+    double jump = gamma * p1;
+    double complex m[2][2] = {{0, 0}, {0, 0}};
+
+    //Kraus operators sqrt(gamma)|0><1| and diag(1, sqrt(1 - gamma)),
+    //each divided by the square root of its probability.
+    if (random_uniform(reg) < jump)
+    {
+        m[0][1] = 1 / sqrt(p1);
+    }
+    else
+    {
+        double norm = 1 / sqrt(1 - jump);
+        m[0][0] = norm;
+        m[1][1] = sqrt(1 - gamma) * norm;
+    }
+    mark_dirty(reg);
+    apply_1q(reg, qubit, m);
+}
+
+unsigned long long readout_error(qreg *reg, unsigned long long outcome, int n, double p)
+{
+    for (int q = 0; q < n; q++)
+    {
+        if (random_uniform(reg) < p)
+        {
+            outcome ^= 1ULL << q;
+        }
+    }
+    return outcome;
+}
+
+unsigned long long trajectory_seed(unsigned long long seed, unsigned long long t)
+{
+    //One splitmix64 step from a state spaced by the golden ratio per trajectory.
+    unsigned long long z = seed + (t + 1) * 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/*
+    Mask of every qubit an operation acts on, controls included.
+*/
+unsigned long long operation_qubits(qreg *reg, const stored_op *op)
+{
+    unsigned long long mask = op->ctrl_mask;
+    const int *indexes = op_indexes(reg, op);
+
+    for (int i = 0; i < op->qbit_buffSize; i++)
+    {
+        mask |= 1ULL << indexes[i];
+    }
+    if (op->operation == '+' || op->operation == 'x')
+    {
+        mask |= 1ULL << op->control_idx;
+    }
+    if (op->operation == 'x')
+    {
+        mask |= 1ULL << op->target_idx;
+    }
+    return mask;
+}
+
+/*
+    Apply the channels of the model to the qubits in mask.
+*/
+void apply_noise(qreg *reg, const noise_model *noise, unsigned long long mask)
+{
+    for (int q = 0; mask != 0; q++, mask >>= 1)
+    {
+        if (!(mask & 1))
+        {
+            continue;
+        }
+        if (noise->depolarizing > 0)
+        {
+            depolarize(reg, q, noise->depolarizing);
+        }
+        if (noise->bit_flip > 0)
+        {
+            bit_flip(reg, q, noise->bit_flip);
+        }
+        if (noise->phase_flip > 0)
+        {
+            phase_flip(reg, q, noise->phase_flip);
+        }
+        if (noise->amplitude_damping > 0)
+        {
+            amplitude_damp(reg, q, noise->amplitude_damping);
+        }
+    }
+}
+
+/*
+    Put a trajectory register back to |0..0> with an empty queue.
+*/
+void reset_trajectory(qreg *reg)
+{
+    mark_dirty(reg);
+    size_t size = reg_states(reg);
+    amplitude *amp = reg->matrix;
+
+    PARALLEL_FOR(reg, size, 1)
+    for (size_t i = 0; i < size; i++)
+    {
+        amp[i] = 0;
+    }
+    amp[0] = 1;
+
+    for (int q = 0; q < (int)reg->size; q++)
+    {
+        reg->position[q] = q;
+    }
+    reg->permuted = false;
+    reg->history_size = 0;
+    reg->pool_size = 0;
+    reg->executed = 0;
+}
+
+unsigned long long run_trajectory(qreg *reg, qreg *circuit, const noise_model *noise, unsigned long long seed)
+{
+    reset_trajectory(reg);
+    set_seed(reg, seed);
+
+    for (unsigned int i = 0; i < circuit->history_size; i++)
+    {
+        const stored_op *op = &(circuit->history[i]);
+        record_operation(reg, op->operation, op_indexes(circuit, op), op->qbit_buffSize,
+            op->control_idx, op->target_idx, op->params, op->ctrl_mask);
+        apply_noise(reg, noise, operation_qubits(circuit, op));
+    }
+
+    unsigned long long outcome = measure_all(reg);
+    if (noise->readout > 0)
+    {
+        outcome = readout_error(reg, outcome, reg->size, noise->readout);
+    }
+    return outcome;
+}
+
+bool run_trajectories(qreg *circuit, const noise_model *noise, unsigned long trajectories, unsigned long long seed, unsigned long long *outcomes)
+{
+    int threads = circuit->num_threads;
+    int workers = trajectories < (unsigned long)threads ? (int)trajectories : threads;
+    workers = workers > 0 ? workers : 1;
+
+    //One deferred register per worker, the leftover threads go to its kernels.
+    qreg **regs = (qreg**) calloc(workers, sizeof(qreg*));
+    bool ok = true;
+    for (int w = 0; w < workers && ok; w++)
+    {
+        regs[w] = initQuRegister(circuit->size);
+        ok = regs[w] != NULL;
+        if (ok)
+        {
+            set_threads(regs[w], threads / workers);
+            set_recording(regs[w], false);
+            set_deferred(regs[w], true);
+            regs[w]->fusion_qubits = circuit->fusion_qubits;
+            regs[w]->tile_qubits = circuit->tile_qubits;
+        }
+    }
+
+    if (ok)
+    {
+#ifdef _OPENMP
+        //The kernels of a worker are a team nested in the workers' one,
+        //which OpenMP only runs in parallel with a second active level.
+        int levels = omp_get_max_active_levels();
+        if (workers > 1 && threads / workers > 1 && levels < 2)
+        {
+            omp_set_max_active_levels(2);
+        }
+
+        #pragma omp parallel for schedule(dynamic) num_threads(workers) if(workers > 1)
+#endif
+        for (unsigned long t = 0; t < trajectories; t++)
+        {
+#ifdef _OPENMP
+            qreg *reg = regs[omp_get_thread_num()];
+#else
+            qreg *reg = regs[0];
+#endif
+            outcomes[t] = run_trajectory(reg, circuit, noise, trajectory_seed(seed, t));
+        }
+#ifdef _OPENMP
+        omp_set_max_active_levels(levels);
+#endif
+    }
+    else
+    {
+        fprintf(stderr, "Failed to allocate the trajectory registers.\n");
+    }
+
+    for (int w = 0; w < workers; w++)
+    {
+        free_qreg(regs[w]);
+    }
+    free(regs);
+    return ok;
+}
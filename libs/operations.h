@@ -1,8 +1,17 @@
-#include "qureg.h"
+#pragma once
+#include "circuit.h"
+
+//Precomputed matrices of the fixed single qubit gates.
+static const double complex X_matrix[2][2] = {{0, 1}, {1, 0}};
+static const double complex Y_matrix[2][2] = {{0, -j}, {j, 0}};
+static const double complex Z_matrix[2][2] = {{1, 0}, {0, -1}};
+static const double complex S_matrix[2][2] = {{1, 0}, {0, j}};
+static const double complex T_matrix[2][2] = {{1, 0}, {0, M_SQRT1_2 + M_SQRT1_2*j}};
 
 /*
     Operation to print all possible combinations of the qubits 
     that are in the register and their respective probabilities.
+    Sparse registers only print their nonzero amplitudes.
 */
 void PA(qreg *reg);
 
@@ -58,11 +67,6 @@ void H(qreg *reg, int *buff, int n);
 */
 void H_qbit(qbit *qubit);
 
-/*
-    Function to update the register state matrix after Hadamard operation.
-*/
-void Hadamard_mat(qreg *reg, int first, int second);
-
 /*
     CNOT gate that maps the basis states |a,b> to |a, a XOR b>
     in respect to the whole register.
@@ -81,7 +85,8 @@ void CNOT_qbit(qbit *control_qb, qbit *target_qbit);
 
 /*
     SWAP gate that swaps the states of two qubits in
-    respect to the whole register.
+    respect to the whole register. Only the qubit labels are exchanged,
+    the amplitudes stay where they are until the register is read.
 */
 void SWAP(qreg *reg, int first_idx, int second_idx);
 
@@ -91,6 +96,136 @@ void SWAP(qreg *reg, int first_idx, int second_idx);
 */
 void SWAP_qbit(qbit *first_qb, qbit *second_qb);
 
+/*
+    Apply an arbitrary 2x2 unitary to a single qubit.
+*/
+void apply_1q_qbit(qbit *qubit, const double complex m[2][2]);
+
+/*
+    Build the matrix of the U3 rotation
+    [cos(t/2), -e^(il)sin(t/2); e^(ip)sin(t/2), e^(i(p+l))cos(t/2)].
+*/
+void u3_matrix(double complex m[2][2], double theta, double phi, double lambda);
+
+/*
+    Build the matrix of a rotation by theta about the X (0), Y (1) or Z (2) axis,
+    exp(-i*theta/2*sigma).
+*/
+void rotation_matrix(double complex m[2][2], int axis, double theta);
+
+/*
+    Build the matrix of the phase shift diag(1, e^(i*lambda)).
+*/
+void phase_matrix(double complex m[2][2], double lambda);
+
+/*
+    U3 gate, the general single qubit rotation, applied to each
+    specified qubit in the register.
+    Specify buffer of indexes to be affected and the size of the buffer.
+*/
+void U3(qreg *reg, int *buff, int n, double theta, double phi, double lambda);
+
+/*
+    Rotation gates about the X, Y and Z axes of the Bloch sphere
+    by the angle theta in respect to the whole register.
+    Specify buffer of indexes to be affected and the size of the buffer.
+*/
+void RX(qreg *reg, int *buff, int n, double theta);
+void RY(qreg *reg, int *buff, int n, double theta);
+void RZ(qreg *reg, int *buff, int n, double theta);
+
+/*
+    Phase shift gate that leaves |0> unchanged and maps |1> to e^(i*lambda)|1>
+    in respect to the whole register.
+    Specify buffer of indexes to be affected and the size of the buffer.
+*/
+void P(qreg *reg, int *buff, int n, double lambda);
+
+/*
+    S and T gates, phase shifts by pi/2 and pi/4.
+    Specify buffer of indexes to be affected and the size of the buffer.
+*/
+void S(qreg *reg, int *buff, int n);
+void T(qreg *reg, int *buff, int n);
+
+/*
+    Build a control mask out of a buffer of control qubit indexes.
+*/
+unsigned long long control_mask(int *ctrl_buff, int k);
+
+/*
+    Check the qubits of a controlled gate: all in range, no repeated
+    target and no target among the controls. Returns false with a message
+    on stderr otherwise, and the gate is then neither applied nor recorded.
+*/
+bool valid_controlled(qreg *reg, const int *ctrl_buff, int k, const int *buff, int n);
+
+/*
+    Bits of the basis index holding the logical qubits of buff, written to
+    out and returned. The gates translate their qubits with it, and with
+    physical_mask for their controls, before running a kernel.
+*/
+int* physical_qubits(qreg *reg, const int *buff, int n, int *out);
+unsigned long long physical_mask(qreg *reg, unsigned long long mask);
+
+/*
+    Apply the same diagonal matrix, controlled by ctrl_mask, to each
+    specified qubit in a single sweep instead of one per qubit. Phase
+    kernels only touch half of the state, so the gates use it from three
+    targets on.
+*/
+void diagonal_buff(qreg *reg, unsigned long long ctrl_mask, int *buff, int n, const double complex m[2][2]);
+
+/*
+    Controlled-Z gate that flips the phase of |1,1>.
+    Specify the control qubit index and a buffer of target qubit indexes
+    as well as the size of the buffer.
+*/
+void CZ(qreg *reg, int control_idx, int *buff, int n);
+
+/*
+    Controlled-Y gate, applies Pauli-Y to each target when the control is |1>.
+    Specify the control qubit index and a buffer of target qubit indexes
+    as well as the size of the buffer.
+*/
+void CY(qreg *reg, int control_idx, int *buff, int n);
+
+/*
+    Controlled phase shift, maps |1,1> to e^(i*lambda)|1,1>.
+    Specify the control qubit index and a buffer of target qubit indexes
+    as well as the size of the buffer.
+*/
+void CP(qreg *reg, int control_idx, int *buff, int n, double lambda);
+
+/*
+    Toffoli/CCNOT gate that flips the target when both controls are |1>.
+*/
+void Toffoli(qreg *reg, int first_ctrl, int second_ctrl, int target_idx);
+
+/*
+    Multi-controlled X and Z gates. Specify a buffer of k control
+    qubit indexes and the target qubit index.
+*/
+void MCX(qreg *reg, int *ctrl_buff, int k, int target_idx);
+void MCZ(qreg *reg, int *ctrl_buff, int k, int target_idx);
+
+/*
+    Build the 2x2 matrix of a recorded single qubit operation
+    (X, Y, Z, H, U, R, P, S or T), ignoring its controls.
+*/
+void operation_matrix(const stored_op *op, double complex m[2][2]);
+
+/*
+    Apply a recorded operation to the register state without recording it again.
+*/
+void execute_operation(qreg *reg, const stored_op *op);
+
+/*
+    Same as execute_operation, with the qubit indexes of the operation given
+    instead of read from the index pool of the register.
+*/
+void execute_indexed(qreg *reg, const stored_op *op, const int *indexes);
+
 /*
     Displays the current circuit in ASCII for the register
 */
@@ -105,7 +240,7 @@ void print_reg(qreg *reg)
     //Each line takes 3 chars for the qubit display.
     int line_length = 3; //+ ((reg->history_size+1) * 5);
 
-    for (int i=0; i<=reg->history_size; i++)
+    for (int i=0; i<reg->history_size; i++)
     {
         //If it's a CNOT op, count each index as separate displayed op.
         if(reg->history[i].operation == '+')
@@ -144,18 +279,23 @@ void print_reg(qreg *reg)
     int line_idx = 3;
 
     //Draw the operations stored in the history buffer
-    for (int i=0; i<=reg->history_size; i++)
+    for (int i=0; i<reg->history_size; i++)
     {
         stored_op operation = reg->history[i];
 
         if (operation.operation == 'X' 
             || operation.operation == 'Y' 
             || operation.operation == 'Z' 
-            || operation.operation == 'H')
+            || operation.operation == 'H'
+            || operation.operation == 'U'
+            || operation.operation == 'R'
+            || operation.operation == 'P'
+            || operation.operation == 'S'
+            || operation.operation == 'T')
         {   
             for(int i=0; i<operation.qbit_buffSize; i++)
             {
-                int temp_idx = operation.qbit_indexes[i];
+                int temp_idx = op_indexes(reg, &operation)[i];
                 if (temp_idx > 0)
                 {
                     temp_idx = temp_idx * 2;
@@ -197,6 +337,47 @@ void print_reg(qreg *reg)
                     }
                 }
             }
+
+            if (operation.ctrl_mask != 0)
+            {
+                //Controlled gate, mark the controls and connect them to the targets.
+                int first_line = number_of_lines;
+                int last_line = 0;
+
+                for (int q=0; q<(int)reg->size; q++)
+                {
+                    bool is_target = false;
+                    for (int i=0; i<operation.qbit_buffSize; i++)
+                    {
+                        is_target = is_target || op_indexes(reg, &operation)[i] == q;
+                    }
+
+                    if (is_target || (operation.ctrl_mask & ((unsigned long long)1 << q)))
+                    {
+                        first_line = (q*2 < first_line) ? q*2 : first_line;
+                        last_line = (q*2 > last_line) ? q*2 : last_line;
+                    }
+
+                    if (operation.ctrl_mask & ((unsigned long long)1 << q))
+                    {
+                        lines[q*2][line_idx+1]= '[';
+                        lines[q*2][line_idx+2]= '+';
+                        lines[q*2][line_idx+3]= ']';
+                    }
+                }
+
+                for (int k=first_line+1; k<last_line; k++)
+                {
+                    if (k%2 > 0)
+                    {
+                        lines[k][line_idx+2]= '|';
+                    }
+                    else if (lines[k][line_idx+1] == '-')
+                    {
+                        lines[k][line_idx+2]= '+';
+                    }
+                }
+            }
         }
         else
         {
@@ -215,7 +396,7 @@ void print_reg(qreg *reg)
 
                 for (int i=0; i<operation.qbit_buffSize; i++)
                 {
-                    int temp_idx = operation.qbit_indexes[i];
+                    int temp_idx = op_indexes(reg, &operation)[i];
                     if (temp_idx > 0)
                     {
                         temp_idx = temp_idx * 2;
@@ -446,28 +627,10 @@ void SWAP_qbit(qbit *first_qb, qbit *second_qb)
 
 void SWAP(qreg *reg, int first_idx, int second_idx)
 {
-	SWAP_qbit(&(reg->qb[first_idx]), &(reg->qb[second_idx]));
-
-	int size = pow(2, reg->size);
-	bool *visited = (bool*) calloc(size, size * sizeof(bool));
-	int state1, state2;
-	int first, second;
-
-	for(int i = 0; i < size; i++) {
-		if(!visited[i]) {
-			state1 = (i & (1 << first_idx)) >> first_idx;
-			state2 = (i & (1 << second_idx)) >> second_idx;
-			first = i;
-			second = (i ^ (1 << first_idx)) ^ (1 << second_idx);
-			visited[first] = visited[second] = true;
-
-			if(state1 != state2) {
-				double complex temp = reg->matrix[first];
-				reg->matrix[first] = reg->matrix[second];
-				reg->matrix[second] = temp;
-			}
-		}
-	}
+    //Deferred registers only record the gate, it runs on flush_operations.
+    if (!reg->deferred){
+        swap_layout(reg, first_idx, second_idx);
+    }
 
     add_operation(reg, 'x', NULL, 0, first_idx, second_idx);
 }
@@ -480,84 +643,69 @@ void CNOT_qbit(qbit *control_qb, qbit *target_qbit){
 
 void CNOT(qreg *reg, int control_idx, int *buff, int n)
 {
-    int size = pow(2, reg->size);
-    bool *visited = (bool*)calloc(size, size*sizeof(bool));
-    bool invertStates = false;
-    int first, second, bitshift_part;
-
-    for(int k=0; k<n; k++)
-    {
-        int target_idx = buff[k];
-        //printf("Target index[%d]\n", target_idx);
+    if (!valid_controlled(reg, &control_idx, 1, buff, n)){
+        return;
+    }
+    unsigned long long ctrl_mask = (unsigned long long)1 << reg->position[control_idx];
 
-        for(int i=0; i<size; i++)
+    //Deferred registers only record the gate, it runs on flush_operations.
+    if (!reg->deferred){
+        mark_dirty(reg);
+        for(int k=0; k<n; k++)
         {
-            double amplitude = fabs(creal(reg->matrix[i])) + fabs(cimag(reg->matrix[i]));
-
-            //Invert only if control is in state |1>
-            if((i & (1 << control_idx)) && (amplitude > 0))
-            {
-                invertStates = true;
-            }
-
-            if(invertStates)
-            {
-                first = second = i;
-
-                if (amplitude > 0 && amplitude < 1)
-                {
-                    /*
-                        qubits are in superposition, that means
-                        the gate acts linearly with a control qubit, but will change
-                        the target only on the part involving a |1⟩
-                        in the control qubit.
-                    */
-                   bitshift_part = (1 << control_idx);
-                }
-                else
-                {
-                    bitshift_part = (1 << target_idx);
-                }
-                
+            int target_idx = reg->position[buff[k]];
+            apply_controlled_1q(reg, ctrl_mask, target_idx, X_matrix);
+        }
+    }
 
-                second = second ^ bitshift_part;
+    add_operation(reg, '+', buff, n, control_idx, 0);
+}
 
-                if(!visited[first] && !visited[second] && bitshift_part != first) 
-                {
-                    CNOT_qbit(&(reg->qb[control_idx]), &(reg->qb[target_idx]));
-                    visited[first] = visited[second] = true;
-                    double complex temp = reg->matrix[first];
-                    reg->matrix[first] = reg->matrix[second];
-                    reg->matrix[second] = temp;
-                }
+void print_amplitude(qreg *reg, unsigned long long i){
+    double complex a = get_amplitude(reg, i);
+    printf("\n[%llu]:\t[%.5f", i, creal(a));
+    if(cimag(a) >= 0){
+        printf("+");
+    }
+    printf("%.5fi] <", cimag(a));
 
-                invertStates = false;
-                //PA(reg);
-            }
-        }
-        for(int k=0; k<size; k++)
-        {
-            visited[k] = false;
-        }
+    for(int k=0; k<reg->size; k++){
+        int b = (i >> (reg->size - k - 1)) & 1;
+        printf("%d", b);
     }
+    printf("| ");
+    printf("%.1f %%", mag(reg, i));
+}
 
-    add_operation(reg, '+', buff, n, control_idx, 0);
+int compare_index(const void *a, const void *b){
+    unsigned long long x = *(const unsigned long long*)a, y = *(const unsigned long long*)b;
+    return (x > y) - (x < y);
 }
 
 void PA(qreg *reg){
-    for(int i=0; i< pow(2, reg->size); i++){
-        printf("\n[%d]:\t[%.5f", i, creal(reg->matrix[i]));
-        if(cimag(reg->matrix[i]) >= 0){
-            printf("+");
+    settle_layout(reg);
+
+    //Sparse registers only print the states they store, in ascending order.
+    if(reg->sparse != NULL){
+        sparse_map *map = reg->sparse;
+        unsigned long long *keys = (unsigned long long*) malloc(map->count * sizeof(unsigned long long));
+        size_t count = 0;
+        for(size_t s=0; s < map->capacity; s++){
+            if(map->keys[s] != SPARSE_EMPTY){
+                keys[count++] = map->keys[s];
+            }
         }
-        printf("%.5fi] <", cimag(reg->matrix[i]));
-
-        for(int k=0; k<reg->size; k++){
-            int b = (i & (1 << (reg->size - k - 1))) >> (reg->size - k - 1);
-            printf("%d", b);
+        qsort(keys, count, sizeof(unsigned long long), compare_index);
+        for(size_t i=0; i < count; i++){
+            print_amplitude(reg, keys[i]);
         }
-        printf("| ");
-        printf("%.1f %%", mag(reg, i));
+        free(keys);
+        printf("\n");
+        return;
+    }
+
+    for(size_t i=0; i < reg_states(reg); i++){
+        print_amplitude(reg, i);
     }
     printf("\n");
 }
@@ -570,35 +718,35 @@ void H_qbit(qbit *qubit){
     qubit->oCoeff = ((creal(temp_z) - creal(temp_o)) + (cimag(temp_z) - cimag(temp_o))) / sqrt(2);
 }
 
-void Hadamard_mat(qreg *reg, int first, int second){
-    double complex temp_ps = reg->matrix[first];
-    double complex temp_ns = reg->matrix[second];
-
-    reg->matrix[first] = ((creal(temp_ps) + creal(temp_ns)) + (cimag(temp_ps) + cimag(temp_ns))) / sqrt(2);
-    reg->matrix[second] = ((creal(temp_ps) - creal(temp_ns)) + (cimag(temp_ps) - cimag(temp_ns))) / sqrt(2);
+/*
+    Whether the buffer names every qubit at most once.
+*/
+bool distinct_qubits(int *buff, int n){
+    unsigned long long seen = 0;
+    for (int i=0; i<n; i++){
+        if (seen & ((unsigned long long)1 << buff[i])){
+            return false;
+        }
+        seen |= (unsigned long long)1 << buff[i];
+    }
+    return true;
 }
 
 void H(qreg *reg, int *buff, int n){
-    int size = pow(2, reg->size);
-    int first, second;
-
-    //Apply the Hadamard gate to the specified qubits.
-    for (int i=0; i<n; i++){
-        int idx = buff[i];
-        H_qbit(&(reg->qb[idx]));
-
-        bool *visited = (bool*) calloc(size, sizeof(bool));
-
-        //Update the matrix.
-        for (int k=0; k<size; k++){
-            if(!visited[k]){
-                first = k;
-                second = k ^ (1 << idx);
-                visited[first] = visited[second] = true;
-                Hadamard_mat(reg, first, second);
-            }
+    //Apply the Hadamard gate to the specified qubits, a layer of them as
+    //one Walsh-Hadamard transform.
+    //Deferred registers only record the gate, it runs on flush_operations.
+    int bits[n];
+    physical_qubits(reg, buff, n, bits);
+
+    mark_dirty(reg);
+    if (!reg->deferred && n > 1 && distinct_qubits(buff, n)){
+        kernel_walsh(reg, bits, n);
+    }
+    else if (!reg->deferred){
+        for (int i=0; i<n; i++){
+            kernel_h(reg, bits[i]);
         }
-        free(visited);
     }
 
     add_operation(reg, 'H', buff, n, 0, 0);
@@ -609,17 +757,18 @@ void Z_qbit(qbit *qubit){
 }
 
 void Z(qreg *reg, int *buff, int n){
-    int size = pow(2, reg->size);
-
     //Apply the Pauli-Z gate to each specified qubit and update the matrix.
-    for (int i=0; i<n; i++){
-        int idx = buff[i];
-        Z_qbit(&(reg->qb[idx]));
+    //Deferred registers only record the gate, it runs on flush_operations.
+    int bits[n];
+    physical_qubits(reg, buff, n, bits);
 
-        for(int k=0; k<size; k++){
-            if((k & (1 << idx)) > 0){
-                reg->matrix[k] = -1 * creal(reg->matrix[k]) - cimag(reg->matrix[k]);
-            }
+    mark_dirty(reg);
+    if (!reg->deferred && n > 2){
+        diagonal_buff(reg, 0, bits, n, Z_matrix);
+    }
+    else if (!reg->deferred){
+        for (int i=0; i<n; i++){
+            kernel_z(reg, bits[i]);
         }
     }
 
@@ -634,46 +783,24 @@ void Y_qbit(qbit *qubit){
 }
 
 void Y(qreg *reg, int* buff, int n){
-    int size = pow(2, reg->size);
-
     //Apply the Pauli-Y gate to each specified qubit and update the matrix.
-    for (int i=0; i<n; i++){
-        int idx = buff[i];
-        Y_qbit(&(reg->qb[idx]));
-
-        for(int k=0; k<size; k++){
-            if((k & (1 << idx)) == 0){
-                int prev_state = k;
-                int next_state = prev_state ^ (1 << idx);
-
-                double complex temp_ps = cimag(reg->matrix[next_state]) - creal(reg->matrix[next_state])*j;
-                double complex temp_ns = -1 * cimag(reg->matrix[prev_state]) + creal(reg->matrix[prev_state])*j;
-
-                reg->matrix[prev_state] = temp_ps;
-                reg->matrix[next_state] = temp_ns;
-            }
+    //Deferred registers only record the gate, it runs on flush_operations.
+    if (!reg->deferred){
+        mark_dirty(reg);
+        for (int i=0; i<n; i++){
+            kernel_y(reg, reg->position[buff[i]]);
         }
     }
     add_operation(reg, 'Y', buff, n, 0, 0);
 }
 
 void X(qreg *reg, int* buff, int n){
-    int size = pow(2, reg->size);
-
     //Apply the NOT gate to each specified qubit and update the matrix.
-    for (int i=0; i<n; i++){
-        int idx = buff[i];
-        X_qbit(&(reg->qb[idx]));
-        
-        for(int k=0; k<size; k++){
-            if((k & (1 << idx)) == 0){
-                int prev_state = k;
-                int next_state = prev_state ^ (1 << idx);
-
-                double complex temp = reg->matrix[prev_state];
-                reg->matrix[prev_state] = reg->matrix[next_state];
-                reg->matrix[next_state] = temp;
-            }
+    //Deferred registers only record the gate, it runs on flush_operations.
+    if (!reg->deferred){
+        mark_dirty(reg);
+        for (int i=0; i<n; i++){
+            kernel_x(reg, reg->position[buff[i]]);
         }
     }
 
@@ -687,4 +814,352 @@ void X_qbit(qbit *qubit){
 
     qubit->zCoeff = tempoCoeff;
     qubit->oCoeff = tempzCoeff;
-}
\ No newline at end of file
+}
+
+void apply_1q_qbit(qbit *qubit, const double complex m[2][2]){
+    double complex temp_z = qubit->zCoeff;
+    double complex temp_o = qubit->oCoeff;
+
+    qubit->zCoeff = m[0][0] * temp_z + m[0][1] * temp_o;
+    qubit->oCoeff = m[1][0] * temp_z + m[1][1] * temp_o;
+}
+
+void u3_matrix(double complex m[2][2], double theta, double phi, double lambda){
+    double c = cos(theta / 2);
+    double s = sin(theta / 2);
+
+    m[0][0] = c;
+    m[0][1] = -cexp(lambda*j) * s;
+    m[1][0] = cexp(phi*j) * s;
+    m[1][1] = cexp((phi + lambda)*j) * c;
+}
+
+void rotation_matrix(double complex m[2][2], int axis, double theta){
+    double c = cos(theta / 2);
+    double s = sin(theta / 2);
+
+    switch(axis){
+        case 0:
+            m[0][0] = c;        m[0][1] = -s*j;
+            m[1][0] = -s*j;     m[1][1] = c;
+            break;
+        case 1:
+            m[0][0] = c;        m[0][1] = -s;
+            m[1][0] = s;        m[1][1] = c;
+            break;
+        case 2:
+            m[0][0] = cexp(-theta/2*j); m[0][1] = 0;
+            m[1][0] = 0;                m[1][1] = cexp(theta/2*j);
+            break;
+        default:
+            fprintf(stderr, "Invalid rotation axis %d. It must be 0 (X), 1 (Y) or 2 (Z).\n", axis);
+            exit(0);
+    }
+}
+
+void phase_matrix(double complex m[2][2], double lambda){
+    m[0][0] = 1; m[0][1] = 0;
+    m[1][0] = 0; m[1][1] = cexp(lambda*j);
+}
+
+void diagonal_buff(qreg *reg, unsigned long long ctrl_mask, int *buff, int n, const double complex m[2][2]){
+    diag_term terms[2 * n];
+    size_t count = 0;
+
+    for (int i=0; i<n; i++){
+        unsigned long long mask = ctrl_mask | ((unsigned long long)1 << buff[i]);
+        if (m[0][0] != 1){
+            terms[count++] = (diag_term){mask, ctrl_mask, m[0][0]};
+        }
+        if (m[1][1] != 1){
+            terms[count++] = (diag_term){mask, mask, m[1][1]};
+        }
+    }
+    kernel_diagonal(reg, terms, count, NULL, NULL);
+}
+
+bool matrix_diagonal(const double complex m[2][2]){
+    return m[0][1] == 0 && m[1][0] == 0;
+}
+
+/*
+    Apply the same matrix to each specified qubit.
+    Nothing is applied on deferred registers.
+*/
+void apply_1q_buff(qreg *reg, int *buff, int n, const double complex m[2][2]){
+    if (reg->deferred){
+        return;
+    }
+    mark_dirty(reg);
+
+    int bits[n];
+    physical_qubits(reg, buff, n, bits);
+    if (n > 2 && matrix_diagonal(m)){
+        diagonal_buff(reg, 0, bits, n, m);
+        return;
+    }
+
+    for (int i=0; i<n; i++){
+        apply_1q(reg, bits[i], m);
+    }
+}
+
+void U3(qreg *reg, int *buff, int n, double theta, double phi, double lambda){
+    double complex m[2][2];
+    u3_matrix(m, theta, phi, lambda);
+    apply_1q_buff(reg, buff, n, m);
+
+    add_param_operation(reg, 'U', buff, n, theta, phi, lambda);
+}
+
+void RX(qreg *reg, int *buff, int n, double theta){
+    double complex m[2][2];
+    rotation_matrix(m, 0, theta);
+    apply_1q_buff(reg, buff, n, m);
+
+    add_param_operation(reg, 'R', buff, n, theta, 0, 0);
+}
+
+void RY(qreg *reg, int *buff, int n, double theta){
+    double complex m[2][2];
+    rotation_matrix(m, 1, theta);
+    apply_1q_buff(reg, buff, n, m);
+
+    add_param_operation(reg, 'R', buff, n, theta, 1, 0);
+}
+
+void RZ(qreg *reg, int *buff, int n, double theta){
+    double complex m[2][2];
+    rotation_matrix(m, 2, theta);
+    apply_1q_buff(reg, buff, n, m);
+
+    add_param_operation(reg, 'R', buff, n, theta, 2, 0);
+}
+
+void P(qreg *reg, int *buff, int n, double lambda){
+    double complex m[2][2];
+    phase_matrix(m, lambda);
+    apply_1q_buff(reg, buff, n, m);
+
+    add_param_operation(reg, 'P', buff, n, lambda, 0, 0);
+}
+
+
+void S(qreg *reg, int *buff, int n){
+    apply_1q_buff(reg, buff, n, S_matrix);
+
+    add_operation(reg, 'S', buff, n, 0, 0);
+}
+
+void T(qreg *reg, int *buff, int n){
+    apply_1q_buff(reg, buff, n, T_matrix);
+
+    add_operation(reg, 'T', buff, n, 0, 0);
+}
+
+unsigned long long control_mask(int *ctrl_buff, int k){
+    unsigned long long mask = 0;
+
+    for (int i=0; i<k; i++){
+        mask |= (unsigned long long)1 << ctrl_buff[i];
+    }
+    return mask;
+}
+
+bool valid_controlled(qreg *reg, const int *ctrl_buff, int k, const int *buff, int n){
+    for (int i=0; i<k; i++){
+        if (ctrl_buff[i] < 0 || ctrl_buff[i] >= (int)reg->size){
+            fprintf(stderr, "Control qubit %d is out of range.\n", ctrl_buff[i]);
+            return false;
+        }
+    }
+
+    for (int i=0; i<n; i++){
+        bool clash = buff[i] < 0 || buff[i] >= (int)reg->size;
+        for (int l=0; l<k; l++){
+            clash = clash || buff[i] == ctrl_buff[l];
+        }
+        for (int l=0; l<i; l++){
+            clash = clash || buff[i] == buff[l];
+        }
+
+        if (clash){
+            fprintf(stderr, "Target qubit %d is out of range, repeated or also a control.\n", buff[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+int* physical_qubits(qreg *reg, const int *buff, int n, int *out){
+    for (int i=0; i<n; i++){
+        out[i] = reg->position[buff[i]];
+    }
+    return out;
+}
+
+unsigned long long physical_mask(qreg *reg, unsigned long long mask){
+    if (!reg->permuted){
+        return mask;
+    }
+
+    unsigned long long bits = 0;
+    while (mask){
+        bits |= (unsigned long long)1 << reg->position[__builtin_ctzll(mask)];
+        mask &= mask - 1;
+    }
+    return bits;
+}
+
+/*
+    Apply the same controlled matrix to each target qubit.
+    Nothing is applied on deferred registers.
+*/
+void controlled_1q_buff(qreg *reg, unsigned long long ctrl_mask, int *buff, int n, const double complex m[2][2]){
+    if (reg->deferred){
+        return;
+    }
+    mark_dirty(reg);
+
+    int bits[n];
+    physical_qubits(reg, buff, n, bits);
+    ctrl_mask = physical_mask(reg, ctrl_mask);
+    if (n > 2 && matrix_diagonal(m)){
+        diagonal_buff(reg, ctrl_mask, bits, n, m);
+        return;
+    }
+
+    for (int i=0; i<n; i++){
+        apply_controlled_1q(reg, ctrl_mask, bits[i], m);
+    }
+}
+
+void CZ(qreg *reg, int control_idx, int *buff, int n){
+    if (!valid_controlled(reg, &control_idx, 1, buff, n)){
+        return;
+    }
+    unsigned long long ctrl_mask = (unsigned long long)1 << control_idx;
+    controlled_1q_buff(reg, ctrl_mask, buff, n, Z_matrix);
+
+    add_controlled_operation(reg, 'Z', buff, n, ctrl_mask, 0);
+}
+
+void CY(qreg *reg, int control_idx, int *buff, int n){
+    if (!valid_controlled(reg, &control_idx, 1, buff, n)){
+        return;
+    }
+    unsigned long long ctrl_mask = (unsigned long long)1 << control_idx;
+    controlled_1q_buff(reg, ctrl_mask, buff, n, Y_matrix);
+
+    add_controlled_operation(reg, 'Y', buff, n, ctrl_mask, 0);
+}
+
+void CP(qreg *reg, int control_idx, int *buff, int n, double lambda){
+    if (!valid_controlled(reg, &control_idx, 1, buff, n)){
+        return;
+    }
+    unsigned long long ctrl_mask = (unsigned long long)1 << control_idx;
+    double complex m[2][2];
+    phase_matrix(m, lambda);
+    controlled_1q_buff(reg, ctrl_mask, buff, n, m);
+
+    add_controlled_operation(reg, 'P', buff, n, ctrl_mask, lambda);
+}
+
+void Toffoli(qreg *reg, int first_ctrl, int second_ctrl, int target_idx){
+    int ctrl_buff[] = {first_ctrl, second_ctrl};
+    MCX(reg, ctrl_buff, 2, target_idx);
+}
+
+void MCX(qreg *reg, int *ctrl_buff, int k, int target_idx){
+    if (!valid_controlled(reg, ctrl_buff, k, &target_idx, 1)){
+        return;
+    }
+    unsigned long long ctrl_mask = control_mask(ctrl_buff, k);
+    controlled_1q_buff(reg, ctrl_mask, &target_idx, 1, X_matrix);
+
+    add_controlled_operation(reg, 'X', &target_idx, 1, ctrl_mask, 0);
+}
+
+void MCZ(qreg *reg, int *ctrl_buff, int k, int target_idx){
+    if (!valid_controlled(reg, ctrl_buff, k, &target_idx, 1)){
+        return;
+    }
+    unsigned long long ctrl_mask = control_mask(ctrl_buff, k);
+    controlled_1q_buff(reg, ctrl_mask, &target_idx, 1, Z_matrix);
+
+    add_controlled_operation(reg, 'Z', &target_idx, 1, ctrl_mask, 0);
+}
+
+void operation_matrix(const stored_op *op, double complex m[2][2]){
+    const double complex (*fixed)[2] = NULL;
+
+    switch(op->operation){
+        case 'X': fixed = X_matrix; break;
+        case 'Y': fixed = Y_matrix; break;
+        case 'Z': fixed = Z_matrix; break;
+        case 'S': fixed = S_matrix; break;
+        case 'T': fixed = T_matrix; break;
+        case 'H':
+            m[0][0] = M_SQRT1_2; m[0][1] = M_SQRT1_2;
+            m[1][0] = M_SQRT1_2; m[1][1] = -M_SQRT1_2;
+            return;
+        case 'U':
+            u3_matrix(m, op->params[0], op->params[1], op->params[2]);
+            return;
+        case 'R':
+            rotation_matrix(m, (int)op->params[1], op->params[0]);
+            return;
+        case 'P':
+            phase_matrix(m, op->params[0]);
+            return;
+        default:
+            fprintf(stderr, "Operation %c has no single qubit matrix.\n", op->operation);
+            exit(0);
+    }
+    memcpy(m, fixed, sizeof(double complex) * 4);
+}
+
+void execute_operation(qreg *reg, const stored_op *op){
+    execute_indexed(reg, op, op_indexes(reg, op));
+}
+
+void execute_indexed(qreg *reg, const stored_op *op, const int *indexes){
+    double complex m[2][2];
+    mark_dirty(reg);
+
+    switch(op->operation){
+        case 'x':
+            swap_layout(reg, op->control_idx, op->target_idx);
+            return;
+        case '+':
+            for (int i=0; i<op->qbit_buffSize; i++){
+                apply_controlled_1q(reg, (unsigned long long)1 << reg->position[op->control_idx], reg->position[indexes[i]], X_matrix);
+            }
+            return;
+    }
+
+    operation_matrix(op, m);
+    unsigned long long ctrl_mask = physical_mask(reg, op->ctrl_mask);
+    for (int i=0; i<op->qbit_buffSize; i++){
+        int idx = reg->position[indexes[i]];
+
+        if (ctrl_mask != 0){
+            apply_controlled_1q(reg, ctrl_mask, idx, m);
+            continue;
+        }
+
+        //Keep the dedicated kernels for the fixed gates.
+        switch(op->operation){
+            case 'X': kernel_x(reg, idx); break;
+            case 'Y': kernel_y(reg, idx); break;
+            case 'Z': kernel_z(reg, idx); break;
+            case 'H': kernel_h(reg, idx); break;
+            default: apply_1q(reg, idx, m); break;
+        }
+    }
+}
+
+//set_deferred and get_amplitude run the deferred gates, so their bodies
+//live in fusion.h, which a program including only this header gets here.
+#include "fusion.h"
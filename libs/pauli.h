@@ -0,0 +1,340 @@
+#pragma once
+#include "measure.h"
+
+/*
+    Pauli string observables.
+
+    A Pauli string is stored as two masks over the qubits: x_mask holds the
+    qubits carrying X or Y, z_mask the qubits carrying Z or Y. Applied to a
+    basis state it only flips the x_mask bits and multiplies by a sign and
+    a power of i:
+
+        P|i> = i^popcount(x & z) * (-1)^popcount(i & z) |i ^ x>
+
+    so <psi|P|psi> is a sum over the pairs (i, i ^ x) of the state vector,
+    read in place. Terms sharing an x_mask read the same pairs and only
+    differ in their signs, so expectation groups them and evaluates each
+    group in one read-only pass, each thread summing its own part of the
+    state into a row of partial sums.
+*/
+
+typedef struct pauli_term{
+    unsigned long long x_mask;
+    unsigned long long z_mask;
+    double coeff;
+}pauli_term;
+
+typedef struct pauli_sum{
+    unsigned int qubits;
+    pauli_term *terms;
+    size_t count;
+    size_t capacity;
+}pauli_sum;
+
+/*
+    Empty sum of Pauli strings over the given number of qubits.
+*/
+pauli_sum* new_pauli_sum(unsigned int qubits);
+
+/*
+    Release the sum.
+*/
+void free_pauli_sum(pauli_sum *sum);
+
+/*
+    Add coeff times a Pauli string written as space separated factors,
+    e.g. "X0 Y3 Z12", an empty string is the identity. Returns false with a
+    message on stderr for unknown factors, qubits out of range or repeated.
+*/
+bool add_pauli_term(pauli_sum *sum, double coeff, const char *string);
+
+/*
+    Add coeff times the Pauli string given by its masks, qubits in both
+    masks carry Y. Returns false with a message on stderr for qubits out
+    of range.
+*/
+bool add_pauli_masks(pauli_sum *sum, double coeff, unsigned long long x_mask, unsigned long long z_mask);
+
+/*
+    <psi|H|psi> for the Hermitian sum H, the state is left untouched.
+    Returns NaN with a message on stderr when the sum or one of its terms
+    reaches past the qubits of the register.
+*/
+double expectation(qreg *reg, const pauli_sum *sum);
+
+/*
+    <psi|P|psi> of a single Pauli string, NaN for qubits out of range.
+*/
+double pauli_expectation(qreg *reg, unsigned long long x_mask, unsigned long long z_mask);
+
+pauli_sum* new_pauli_sum(unsigned int qubits)
+{
+    pauli_sum *sum = (pauli_sum*) malloc(sizeof(pauli_sum));
+    sum->qubits = qubits;
+    sum->terms = NULL;
+    sum->count = 0;
+    sum->capacity = 0;
+    return sum;
+}
+
+void free_pauli_sum(pauli_sum *sum)
+{
+    if (sum == NULL)
+    {
+        return;
+    }
+    free(sum->terms);
+    free(sum);
+}
+
+bool add_pauli_masks(pauli_sum *sum, double coeff, unsigned long long x_mask, unsigned long long z_mask)
+{
+    if (sum->qubits < 64 && ((x_mask | z_mask) >> sum->qubits) != 0)
+    {
+        fprintf(stderr, "Pauli masks %llx/%llx act on qubits beyond the %u of the sum.\n", x_mask, z_mask, sum->qubits);
+        return false;
+    }
+
+    if (sum->count == sum->capacity)
+    {
+        sum->capacity = sum->capacity ? 2 * sum->capacity : 64;
+        sum->terms = (pauli_term*) realloc(sum->terms, sum->capacity * sizeof(pauli_term));
+    }
+
+    pauli_term *term = &sum->terms[sum->count++];
+    term->x_mask = x_mask;
+    term->z_mask = z_mask;
+    term->coeff = coeff;
+    return true;
+}
+
+bool add_pauli_term(pauli_sum *sum, double coeff, const char *string)
+{
+    unsigned long long x_mask = 0, z_mask = 0;
+    const char *p = string;
+
+    while (*p != '\0')
+    {
+        if (*p == ' ')
+        {
+            p++;
+            continue;
+        }
+
+        char pauli = *p++;
+        char *end;
+        long qubit = strtol(p, &end, 10);
+        unsigned long long bit = 1ULL << (qubit & 63);
+
+        if (end == p || (pauli != 'X' && pauli != 'Y' && pauli != 'Z'))
+        {
+            fprintf(stderr, "Malformed Pauli string \"%s\".\n", string);
+            return false;
+        }
+        if (qubit < 0 || qubit >= sum->qubits || ((x_mask | z_mask) & bit))
+        {
+            fprintf(stderr, "Qubit %ld of Pauli string \"%s\" is out of range or repeated.\n", qubit, string);
+            return false;
+        }
+
+        x_mask |= pauli != 'Z' ? bit : 0;
+        z_mask |= pauli != 'X' ? bit : 0;
+        p = end;
+    }
+
+    return add_pauli_masks(sum, coeff, x_mask, z_mask);
+}
+
+/*
+    Real factor turning the pair sums of a group into <P>: i^ny, with the
+    i of the odd case already taken by summing imaginary parts.
+*/
+double pauli_phase(const pauli_term *term)
+{
+    static const double phase[4] = {1, -1, -1, 1};
+    return phase[__builtin_popcountll(term->x_mask & term->z_mask) & 3];
+}
+
+/*
+    sum_i conj(psi[i ^ x]) psi[i] (-1)^popcount(i & z) for every term of a
+    group, stored amplitudes only.
+*/
+void sparse_pauli_group(qreg *reg, const pauli_term **group, size_t count, double *acc)
+{
+    sparse_map *map = reg->sparse;
+    unsigned long long x = group[0]->x_mask;
+
+    for (size_t s = 0; s < map->capacity; s++)
+    {
+        unsigned long long i = map->keys[s];
+        if (i == SPARSE_EMPTY)
+        {
+            continue;
+        }
+
+        double complex c = conj(sparse_get(map, i ^ x)) * map->values[s];
+        for (size_t t = 0; t < count; t++)
+        {
+            double v = (__builtin_popcountll(x & group[t]->z_mask) & 1) ? cimag(c) : creal(c);
+            acc[t] += __builtin_parityll(i & group[t]->z_mask) ? -v : v;
+        }
+    }
+}
+
+/*
+    Pair sums of a group of terms sharing x over a dense register, the
+    pair (i, i ^ x) is visited once from the index with the top bit of x
+    clear and counts for both.
+*/
+void dense_pauli_group(qreg *reg, const pauli_term **group, size_t count, double *acc)
+{
+    unsigned long long x = group[0]->x_mask;
+    size_t size = reg_states(reg);
+    amplitude *amp = reg->matrix;
+    int chunks = reg->num_threads > 0 ? reg->num_threads : 1;
+    double *partial = (double*) calloc(chunks * count, sizeof(double));
+
+    unsigned long long z[count];
+    bool odd[count];
+    for (size_t t = 0; t < count; t++)
+    {
+        z[t] = group[t]->z_mask;
+        odd[t] = __builtin_popcountll(x & z[t]) & 1;
+    }
+
+    //Diagonal group, every term weighs the probabilities by their signs.
+    if (x == 0)
+    {
+        size_t chunk = (size + chunks - 1) / chunks;
+        PARALLEL_FOR(reg, size, 1)
+        for (int c = 0; c < chunks; c++)
+        {
+            double *sums = partial + c * count;
+            size_t last = (c + 1) * chunk < size ? (c + 1) * chunk : size;
+            for (size_t i = c * chunk; i < last; i++)
+            {
+                double p = amp_probability(amp[i]);
+                for (size_t t = 0; t < count; t++)
+                {
+                    sums[t] += __builtin_parityll(i & z[t]) ? -p : p;
+                }
+            }
+        }
+    }
+    else
+    {
+        int top = 63 - __builtin_clzll(x);
+        size_t stride = (size_t)1 << top;
+        size_t pairs = size / 2;
+        size_t chunk = (pairs + chunks - 1) / chunks;
+
+        PARALLEL_FOR(reg, size, 1)
+        for (int c = 0; c < chunks; c++)
+        {
+            double *sums = partial + c * count;
+            size_t last = (c + 1) * chunk < pairs ? (c + 1) * chunk : pairs;
+            for (size_t m = c * chunk; m < last; m++)
+            {
+                size_t i = ((m >> top) << (top + 1)) | (m & (stride - 1));
+                double complex a = amp[i], b = amp[i ^ x];
+
+                //conj(b) a from i, plus its conjugate times the sign of x & z from i ^ x.
+                double re = 2 * (creal(b) * creal(a) + cimag(b) * cimag(a));
+                double im = 2 * (creal(b) * cimag(a) - cimag(b) * creal(a));
+                for (size_t t = 0; t < count; t++)
+                {
+                    double v = odd[t] ? im : re;
+                    sums[t] += __builtin_parityll(i & z[t]) ? -v : v;
+                }
+            }
+        }
+    }
+
+    for (int c = 0; c < chunks; c++)
+    {
+        for (size_t t = 0; t < count; t++)
+        {
+            acc[t] += partial[c * count + t];
+        }
+    }
+    free(partial);
+}
+
+int compare_x_mask(const void *a, const void *b)
+{
+    unsigned long long x = (*(const pauli_term**) a)->x_mask;
+    unsigned long long y = (*(const pauli_term**) b)->x_mask;
+    return (x > y) - (x < y);
+}
+
+double expectation(qreg *reg, const pauli_sum *sum)
+{
+    //The passes read amplitude i ^ x_mask, which has to be in the state.
+    if (sum->qubits > reg->size)
+    {
+        fprintf(stderr, "A Pauli sum over %u qubits does not fit a register of %u.\n", sum->qubits, reg->size);
+        return NAN;
+    }
+    for (size_t t = 0; t < sum->count; t++)
+    {
+        unsigned long long used = sum->terms[t].x_mask | sum->terms[t].z_mask;
+        if (reg->size < 64 && (used >> reg->size) != 0)
+        {
+            fprintf(stderr, "Pauli term %zu acts on qubits beyond the %u of the register.\n", t, reg->size);
+            return NAN;
+        }
+    }
+
+    flush_pending(reg);
+    if (sum->count == 0)
+    {
+        return 0;
+    }
+
+    //Terms ordered by x_mask, every run of equal masks is one pass.
+    const pauli_term **order = (const pauli_term**) malloc(sum->count * sizeof(pauli_term*));
+    for (size_t t = 0; t < sum->count; t++)
+    {
+        order[t] = &sum->terms[t];
+    }
+    qsort(order, sum->count, sizeof(pauli_term*), compare_x_mask);
+
+    double *acc = (double*) calloc(sum->count, sizeof(double));
+    double total = 0;
+    size_t first = 0;
+
+    while (first < sum->count)
+    {
+        size_t last = first + 1;
+        while (last < sum->count && order[last]->x_mask == order[first]->x_mask)
+        {
+            last++;
+        }
+
+        if (reg->sparse != NULL)
+        {
+            sparse_pauli_group(reg, order + first, last - first, acc + first);
+        }
+        else
+        {
+            dense_pauli_group(reg, order + first, last - first, acc + first);
+        }
+
+        for (size_t t = first; t < last; t++)
+        {
+            total += order[t]->coeff * pauli_phase(order[t]) * acc[t];
+        }
+        first = last;
+    }
+
+    free(acc);
+    free(order);
+    return total;
+}
+
+double pauli_expectation(qreg *reg, unsigned long long x_mask, unsigned long long z_mask)
+{
+    pauli_term term = {x_mask, z_mask, 1};
+    pauli_sum sum = {reg->size, &term, 1, 1};
+    return expectation(reg, &sum);
+}
@@ -0,0 +1,1205 @@
+#pragma once
+#include "measure.h"
+#include <stdarg.h>
+
+/*
+    OpenQASM 2.0 front end.
+
+    parse_qasm reads a program straight from memory and lowers every gate
+    into the history of a deferred register through the regular gate
+    functions, so the circuit ends up queued for flush_operations exactly as
+    if it was written in C. The source is tokenized in place: tokens are
+    pointers into the text, nothing is copied or allocated per statement.
+
+    Supported are qreg and creg declarations, include "qelib1.inc", the
+    builtin U and CX, the qelib1 gates (u3, u2, u1, cx, id, x, y, z, h, s,
+    sdg, t, tdg, rx, ry, rz, cz, cy, ch, ccx, crz, cu1, cu3) plus p, cp, crx,
+    cry, swap and cswap, gate definitions, barrier and measure, with register
+    broadcasting. Parameters are expressions of numbers, pi, + - * / ^ and
+    sin, cos, tan, exp, ln and sqrt.
+
+    As in the specification a gate body may only call builtins and gates
+    defined before it, so definitions cannot recurse.
+
+    Measurements are taken at the end of the circuit: a gate on a qubit that
+    was already measured is an error, as are reset, opaque and if, which need
+    the state of a single shot.
+*/
+
+//Registers and classical bits are addressed by 64-bit masks.
+#define QASM_MAX_BITS 63
+
+//Limits of a gate definition.
+#define QASM_MAX_GATE_PARAMS 8
+#define QASM_MAX_GATE_ARGS 16
+
+/*
+    Circuit parsed from OpenQASM. circuit is a deferred register without
+    amplitudes that only holds the gates, qasm_register makes a runnable
+    copy of it. clbit_qubit maps every classical bit to the qubit measured
+    into it, or -1.
+*/
+typedef struct qasm_program{
+    qreg *circuit;
+    int qubits;
+    int clbits;
+    int clbit_qubit[QASM_MAX_BITS];
+}qasm_program;
+
+/*
+    Parse length bytes of OpenQASM 2.0 source. Returns NULL with the line
+    and reason on stderr when the program is invalid or unsupported.
+*/
+qasm_program* parse_qasm(const char *text, size_t length);
+
+/*
+    Map a .qasm file into memory and parse it.
+*/
+qasm_program* load_qasm(const char *path);
+
+/*
+    New dense register of the program's width with all of its gates queued,
+    run them with flush_operations. Returns NULL if the register cannot be
+    allocated.
+*/
+qreg* qasm_register(const qasm_program *program);
+
+/*
+    Sample the measured classical bits of a register made by qasm_register.
+    out_counts must hold 2^clbits entries, bit c of an index is classical
+    bit c. Programs without measurements are sampled on every qubit, with
+    2^qubits entries.
+*/
+void qasm_sample(const qasm_program *program, qreg *reg, unsigned long shots, unsigned int *out_counts);
+
+/*
+    Release a parsed program.
+*/
+void free_qasm(qasm_program *program);
+
+enum qasm_token{
+    QASM_END,
+    QASM_ID,
+    QASM_NUMBER,
+    QASM_STRING,
+    QASM_ARROW,
+    QASM_EQUALS,
+    QASM_SYMBOL
+};
+
+typedef struct qasm_bits{
+    const char *name;
+    size_t length;
+    int offset;
+    int size;
+}qasm_bits;
+
+/*
+    Gate definition, the body is parsed again from its source on every call.
+    Its body may only call the visible definitions made before it.
+*/
+typedef struct qasm_gate{
+    const char *name;
+    size_t length;
+    int params;
+    int args;
+    const char *param_names[QASM_MAX_GATE_PARAMS];
+    size_t param_lengths[QASM_MAX_GATE_PARAMS];
+    const char *arg_names[QASM_MAX_GATE_ARGS];
+    size_t arg_lengths[QASM_MAX_GATE_ARGS];
+    const char *body;
+    int line;
+    int visible;
+}qasm_gate;
+
+/*
+    Parameter values and qubits bound while expanding a gate body.
+*/
+typedef struct qasm_scope{
+    const qasm_gate *gate;
+    double values[QASM_MAX_GATE_PARAMS];
+    int qubits[QASM_MAX_GATE_ARGS];
+}qasm_scope;
+
+/*
+    Qubit or bit operand of a statement, a whole register when size > 1
+    or when it was named without an index.
+*/
+typedef struct qasm_operand{
+    int offset;
+    int size;
+    bool whole;
+}qasm_operand;
+
+typedef struct qasm_parser{
+    const char *pos;
+    const char *end;
+    int line;
+    int statement_line;
+
+    enum qasm_token token;
+    const char *start;
+    size_t length;
+    double number;
+
+    qasm_bits qregs[QASM_MAX_BITS];
+    qasm_bits cregs[QASM_MAX_BITS];
+    int num_qregs;
+    int num_cregs;
+    qasm_gate *gates;
+    int num_gates;
+    int gate_capacity;
+    int visible;
+    int depth;
+    unsigned long long measured;
+
+    qasm_program *program;
+    bool failed;
+}qasm_parser;
+
+void qasm_error(qasm_parser *p, const char *format, ...)
+{
+    if (p->failed)
+    {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "QASM line %d: ", p->statement_line);
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    p->failed = true;
+}
+
+bool is_ident_char(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+bool is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+/*
+    Move to the next token, skipping white space and // comments.
+*/
+void qasm_next(qasm_parser *p)
+{
+    const char *s = p->pos;
+    const char *end = p->end;
+
+    for (;;)
+    {
+        while (s < end && (*s == ' ' || *s == '\t' || *s == '\r' || *s == '\n'))
+        {
+            p->line += *s == '\n';
+            s++;
+        }
+        if (s + 1 < end && s[0] == '/' && s[1] == '/')
+        {
+            while (s < end && *s != '\n')
+            {
+                s++;
+            }
+            continue;
+        }
+        break;
+    }
+
+    p->start = s;
+    if (s == end)
+    {
+        p->token = QASM_END;
+        p->length = 0;
+        p->pos = s;
+        return;
+    }
+
+    char c = *s;
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_')
+    {
+        while (s < end && is_ident_char(*s))
+        {
+            s++;
+        }
+        p->token = QASM_ID;
+    }
+    else if (is_digit(c) || (c == '.' && s + 1 < end && is_digit(s[1])))
+    {
+        while (s < end && (is_digit(*s) || *s == '.'))
+        {
+            s++;
+        }
+        if (s < end && (*s == 'e' || *s == 'E'))
+        {
+            s++;
+            if (s < end && (*s == '+' || *s == '-'))
+            {
+                s++;
+            }
+            while (s < end && is_digit(*s))
+            {
+                s++;
+            }
+        }
+
+        //Indexes and sizes are plain integers, anything else goes through strtod.
+        p->number = 0;
+        const char *d = p->start;
+        while (d < s && is_digit(*d))
+        {
+            p->number = p->number * 10 + (*d++ - '0');
+        }
+        if (d == s)
+        {
+            p->token = QASM_NUMBER;
+            p->length = s - p->start;
+            p->pos = s;
+            return;
+        }
+
+        //The text is not terminated, convert a bounded copy.
+        char digits[64];
+        size_t n = s - p->start;
+        if (n >= sizeof(digits))
+        {
+            qasm_error(p, "number too long");
+            n = sizeof(digits) - 1;
+        }
+        memcpy(digits, p->start, n);
+        digits[n] = 0;
+        p->number = strtod(digits, NULL);
+        p->token = QASM_NUMBER;
+    }
+    else if (c == '"')
+    {
+        s++;
+        while (s < end && *s != '"' && *s != '\n')
+        {
+            s++;
+        }
+        if (s == end || *s != '"')
+        {
+            qasm_error(p, "unterminated string");
+        }
+        else
+        {
+            s++;
+        }
+        p->token = QASM_STRING;
+    }
+    else if (c == '-' && s + 1 < end && s[1] == '>')
+    {
+        s += 2;
+        p->token = QASM_ARROW;
+    }
+    else if (c == '=' && s + 1 < end && s[1] == '=')
+    {
+        s += 2;
+        p->token = QASM_EQUALS;
+    }
+    else
+    {
+        s++;
+        p->token = QASM_SYMBOL;
+    }
+
+    p->length = s - p->start;
+    p->pos = s;
+}
+
+bool qasm_is(qasm_parser *p, const char *word)
+{
+    return p->token == QASM_ID && *p->start == *word && strncmp(p->start, word, p->length) == 0 && word[p->length] == 0;
+}
+
+bool qasm_is_symbol(qasm_parser *p, char symbol)
+{
+    return p->token == QASM_SYMBOL && *p->start == symbol;
+}
+
+/*
+    Consume the given symbol or fail.
+*/
+void qasm_expect(qasm_parser *p, char symbol)
+{
+    if (!qasm_is_symbol(p, symbol))
+    {
+        qasm_error(p, "expected '%c' before '%.*s'", symbol, (int)p->length, p->start);
+        return;
+    }
+    qasm_next(p);
+}
+
+bool same_name(const char *a, size_t a_length, const char *b, size_t b_length)
+{
+    return a_length == b_length && memcmp(a, b, a_length) == 0;
+}
+
+double qasm_expression(qasm_parser *p, const qasm_scope *scope);
+
+double qasm_primary(qasm_parser *p, const qasm_scope *scope)
+{
+    if (p->token == QASM_NUMBER)
+    {
+        double value = p->number;
+        qasm_next(p);
+        return value;
+    }
+    if (qasm_is_symbol(p, '('))
+    {
+        qasm_next(p);
+        double value = qasm_expression(p, scope);
+        qasm_expect(p, ')');
+        return value;
+    }
+    if (p->token != QASM_ID)
+    {
+        qasm_error(p, "expected an expression before '%.*s'", (int)p->length, p->start);
+        return 0;
+    }
+
+    if (qasm_is(p, "pi"))
+    {
+        qasm_next(p);
+        return M_PI;
+    }
+
+    static const char *names[] = {"sin", "cos", "tan", "exp", "ln", "sqrt"};
+    for (int f = 0; f < 6; f++)
+    {
+        if (qasm_is(p, names[f]))
+        {
+            qasm_next(p);
+            qasm_expect(p, '(');
+            double x = qasm_expression(p, scope);
+            qasm_expect(p, ')');
+            switch (f)
+            {
+                case 0: return sin(x);
+                case 1: return cos(x);
+                case 2: return tan(x);
+                case 3: return exp(x);
+                case 4: return log(x);
+                default: return sqrt(x);
+            }
+        }
+    }
+
+    if (scope != NULL)
+    {
+        for (int i = 0; i < scope->gate->params; i++)
+        {
+            if (same_name(p->start, p->length, scope->gate->param_names[i], scope->gate->param_lengths[i]))
+            {
+                qasm_next(p);
+                return scope->values[i];
+            }
+        }
+    }
+    qasm_error(p, "unknown parameter '%.*s'", (int)p->length, p->start);
+    return 0;
+}
+
+double qasm_unary(qasm_parser *p, const qasm_scope *scope)
+{
+    if (qasm_is_symbol(p, '-'))
+    {
+        qasm_next(p);
+        return -qasm_unary(p, scope);
+    }
+    if (qasm_is_symbol(p, '+'))
+    {
+        qasm_next(p);
+        return qasm_unary(p, scope);
+    }
+
+    double base = qasm_primary(p, scope);
+    if (qasm_is_symbol(p, '^'))
+    {
+        qasm_next(p);
+        return pow(base, qasm_unary(p, scope));
+    }
+    return base;
+}
+
+double qasm_term(qasm_parser *p, const qasm_scope *scope)
+{
+    double value = qasm_unary(p, scope);
+    while (!p->failed && (qasm_is_symbol(p, '*') || qasm_is_symbol(p, '/')))
+    {
+        char op = *p->start;
+        qasm_next(p);
+        double rhs = qasm_unary(p, scope);
+        value = op == '*' ? value * rhs : value / rhs;
+    }
+    return value;
+}
+
+double qasm_expression(qasm_parser *p, const qasm_scope *scope)
+{
+    double value = qasm_term(p, scope);
+    while (!p->failed && (qasm_is_symbol(p, '+') || qasm_is_symbol(p, '-')))
+    {
+        char op = *p->start;
+        qasm_next(p);
+        double rhs = qasm_term(p, scope);
+        value = op == '+' ? value + rhs : value - rhs;
+    }
+    return value;
+}
+
+/*
+    Parse a parenthesized parameter list, if any. Returns the count.
+*/
+int qasm_params(qasm_parser *p, const qasm_scope *scope, double *values)
+{
+    int count = 0;
+    if (!qasm_is_symbol(p, '('))
+    {
+        return 0;
+    }
+    qasm_next(p);
+    if (qasm_is_symbol(p, ')'))
+    {
+        qasm_next(p);
+        return 0;
+    }
+
+    while (!p->failed)
+    {
+        double value = qasm_expression(p, scope);
+        if (count == QASM_MAX_GATE_PARAMS)
+        {
+            qasm_error(p, "more than %d parameters", QASM_MAX_GATE_PARAMS);
+            return count;
+        }
+        values[count++] = value;
+        if (!qasm_is_symbol(p, ','))
+        {
+            break;
+        }
+        qasm_next(p);
+    }
+    qasm_expect(p, ')');
+    return count;
+}
+
+/*
+    Parse name or name[index] against a table of registers.
+*/
+qasm_operand qasm_bits_operand(qasm_parser *p, const qasm_bits *table, int count, const char *kind)
+{
+    qasm_operand operand = {0, 0, false};
+    if (p->token != QASM_ID)
+    {
+        qasm_error(p, "expected a %s register", kind);
+        return operand;
+    }
+
+    const qasm_bits *bits = NULL;
+    for (int r = 0; r < count; r++)
+    {
+        if (same_name(p->start, p->length, table[r].name, table[r].length))
+        {
+            bits = &table[r];
+            break;
+        }
+    }
+    if (bits == NULL)
+    {
+        qasm_error(p, "unknown %s register '%.*s'", kind, (int)p->length, p->start);
+        return operand;
+    }
+    qasm_next(p);
+
+    if (!qasm_is_symbol(p, '['))
+    {
+        operand.offset = bits->offset;
+        operand.size = bits->size;
+        operand.whole = true;
+        return operand;
+    }
+    qasm_next(p);
+    if (p->token != QASM_NUMBER || p->number < 0 || p->number >= bits->size || p->number != (int)p->number)
+    {
+        qasm_error(p, "index out of range for '%.*s'", (int)bits->length, bits->name);
+        return operand;
+    }
+    operand.offset = bits->offset + (int)p->number;
+    operand.size = 1;
+    qasm_next(p);
+    qasm_expect(p, ']');
+    return operand;
+}
+
+/*
+    Qubit operand of a statement. Inside a gate body only the gate's own
+    arguments can be named.
+*/
+qasm_operand qasm_qubit_operand(qasm_parser *p, const qasm_scope *scope)
+{
+    qasm_operand operand = {0, 1, false};
+    if (scope == NULL)
+    {
+        return qasm_bits_operand(p, p->qregs, p->num_qregs, "quantum");
+    }
+
+    for (int a = 0; p->token == QASM_ID && a < scope->gate->args; a++)
+    {
+        if (same_name(p->start, p->length, scope->gate->arg_names[a], scope->gate->arg_lengths[a]))
+        {
+            operand.offset = scope->qubits[a];
+            qasm_next(p);
+            return operand;
+        }
+    }
+    qasm_error(p, "unknown gate argument '%.*s'", (int)p->length, p->start);
+    return operand;
+}
+
+/*
+    Parse a comma separated operand list up to the closing ';'.
+    Returns the count, and in *repeat how many times the statement is
+    broadcast over whole registers, which must then be of equal size.
+    A barrier takes registers of any size and is not broadcast.
+*/
+int qasm_operands(qasm_parser *p, const qasm_scope *scope, qasm_operand *operands, int max, int *repeat, bool broadcast)
+{
+    int count = 0;
+    *repeat = 1;
+
+    while (!p->failed)
+    {
+        qasm_operand operand = qasm_qubit_operand(p, scope);
+        if (count == max)
+        {
+            qasm_error(p, "too many operands");
+            return count;
+        }
+        if (operand.whole && broadcast)
+        {
+            if (*repeat > 1 && operand.size != *repeat)
+            {
+                qasm_error(p, "registers of different sizes in one statement");
+            }
+            *repeat = operand.size;
+        }
+        operands[count++] = operand;
+        if (!qasm_is_symbol(p, ','))
+        {
+            break;
+        }
+        qasm_next(p);
+    }
+    qasm_expect(p, ';');
+    return count;
+}
+
+/*
+    Qubits of the r-th repetition of a broadcast statement.
+*/
+void qasm_select(const qasm_operand *operands, int count, int r, int *qubits)
+{
+    for (int i = 0; i < count; i++)
+    {
+        qubits[i] = operands[i].offset + (operands[i].whole ? r : 0);
+    }
+}
+
+/*
+    Gates lowered onto the library, with their parameter and qubit counts.
+*/
+typedef struct qasm_builtin{
+    const char *name;
+    int params;
+    int qubits;
+}qasm_builtin;
+
+static const qasm_builtin qasm_builtins[] = {
+    {"U", 3, 1}, {"CX", 0, 2}, {"u3", 3, 1}, {"u2", 2, 1}, {"u1", 1, 1},
+    {"p", 1, 1}, {"cx", 0, 2}, {"id", 0, 1}, {"x", 0, 1}, {"y", 0, 1},
+    {"z", 0, 1}, {"h", 0, 1}, {"s", 0, 1}, {"sdg", 0, 1}, {"t", 0, 1},
+    {"tdg", 0, 1}, {"rx", 1, 1}, {"ry", 1, 1}, {"rz", 1, 1}, {"cz", 0, 2},
+    {"cy", 0, 2}, {"ch", 0, 2}, {"ccx", 0, 3}, {"crx", 1, 2}, {"cry", 1, 2},
+    {"crz", 1, 2}, {"cu1", 1, 2}, {"cp", 1, 2}, {"cu3", 3, 2}, {"swap", 0, 2},
+    {"cswap", 0, 3}
+};
+
+#define QASM_BUILTINS ((int)(sizeof(qasm_builtins) / sizeof(qasm_builtins[0])))
+
+/*
+    Record one builtin gate on single qubits q in the deferred circuit.
+*/
+void qasm_lower(qreg *reg, int builtin, const double *v, int *q)
+{
+    const char *name = qasm_builtins[builtin].name;
+    unsigned long long ctrl = (unsigned long long)1 << q[0];
+    double params[3] = {0, 0, 0};
+
+    switch (builtin)
+    {
+        case 0: case 2: U3(reg, q, 1, v[0], v[1], v[2]); break;
+        case 1: case 6: CNOT(reg, q[0], &q[1], 1); break;
+        case 3: U3(reg, q, 1, M_PI / 2, v[0], v[1]); break;
+        case 4: case 5: P(reg, q, 1, v[0]); break;
+        case 7: break;
+        case 8: X(reg, q, 1); break;
+        case 9: Y(reg, q, 1); break;
+        case 10: Z(reg, q, 1); break;
+        case 11: H(reg, q, 1); break;
+        case 12: S(reg, q, 1); break;
+        case 13: P(reg, q, 1, -M_PI / 2); break;
+        case 14: T(reg, q, 1); break;
+        case 15: P(reg, q, 1, -M_PI / 4); break;
+        case 16: RX(reg, q, 1, v[0]); break;
+        case 17: RY(reg, q, 1, v[0]); break;
+        case 18: RZ(reg, q, 1, v[0]); break;
+        case 19: CZ(reg, q[0], &q[1], 1); break;
+        case 20: CY(reg, q[0], &q[1], 1); break;
+        case 21: add_controlled_operation(reg, 'H', &q[1], 1, ctrl, 0); break;
+        case 22: Toffoli(reg, q[0], q[1], q[2]); break;
+        case 23: case 24: case 25:
+            params[0] = v[0];
+            params[1] = name[2] - 'x';
+            record_operation(reg, 'R', &q[1], 1, 0, 0, params, ctrl);
+            break;
+        case 26: case 27: CP(reg, q[0], &q[1], 1, v[0]); break;
+        case 28:
+            memcpy(params, v, sizeof(params));
+            record_operation(reg, 'U', &q[1], 1, 0, 0, params, ctrl);
+            break;
+        case 29: SWAP(reg, q[0], q[1]); break;
+        case 30:
+            CNOT(reg, q[2], &q[1], 1);
+            Toffoli(reg, q[0], q[1], q[2]);
+            CNOT(reg, q[2], &q[1], 1);
+            break;
+    }
+}
+
+void qasm_statements(qasm_parser *p, const qasm_scope *scope);
+
+/*
+    Apply a gate by name to single qubits, expanding gate definitions.
+*/
+void qasm_apply(qasm_parser *p, const char *name, size_t length, const double *values, int params, int *qubits, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (p->measured & ((unsigned long long)1 << qubits[i]))
+        {
+            qasm_error(p, "gate on qubit %d after it was measured", qubits[i]);
+            return;
+        }
+        for (int k = 0; k < i; k++)
+        {
+            if (qubits[k] == qubits[i])
+            {
+                qasm_error(p, "qubit %d used twice in one gate", qubits[i]);
+                return;
+            }
+        }
+    }
+
+    //Definitions in the file take precedence over the builtins, inside a
+    //body only those made before its gate.
+    int visible = p->depth > 0 ? p->visible : p->num_gates;
+    for (int g = visible - 1; g >= 0; g--)
+    {
+        const qasm_gate *gate = &p->gates[g];
+        if (!same_name(name, length, gate->name, gate->length))
+        {
+            continue;
+        }
+        if (params != gate->params || count != gate->args)
+        {
+            qasm_error(p, "gate '%.*s' takes %d parameters and %d qubits", (int)length, name, gate->params, gate->args);
+            return;
+        }
+        if (p->depth > 64)
+        {
+            qasm_error(p, "gate '%.*s' nests too deep", (int)length, name);
+            return;
+        }
+
+        qasm_scope inner;
+        inner.gate = gate;
+        memcpy(inner.values, values, params * sizeof(double));
+        memcpy(inner.qubits, qubits, count * sizeof(int));
+
+        //Parse the body from its source, then come back to the call.
+        const char *pos = p->pos;
+        const char *start = p->start;
+        enum qasm_token token = p->token;
+        size_t token_length = p->length;
+        int line = p->line;
+        int statement_line = p->statement_line;
+
+        p->pos = gate->body;
+        p->line = gate->line;
+        p->visible = gate->visible;
+        p->depth++;
+        qasm_next(p);
+        qasm_statements(p, &inner);
+        p->depth--;
+        p->visible = visible;
+
+        if (!p->failed)
+        {
+            p->pos = pos;
+            p->start = start;
+            p->token = token;
+            p->length = token_length;
+            p->line = line;
+            p->statement_line = statement_line;
+        }
+        return;
+    }
+
+    for (int b = 0; b < QASM_BUILTINS; b++)
+    {
+        const qasm_builtin *builtin = &qasm_builtins[b];
+        if (builtin->name[0] != name[0] || strncmp(name, builtin->name, length) != 0 || builtin->name[length] != 0)
+        {
+            continue;
+        }
+        if (params != builtin->params || count != builtin->qubits)
+        {
+            qasm_error(p, "gate '%s' takes %d parameters and %d qubits", builtin->name, builtin->params, builtin->qubits);
+            return;
+        }
+        qasm_lower(p->program->circuit, b, values, qubits);
+        return;
+    }
+    qasm_error(p, "unknown gate '%.*s'", (int)length, name);
+}
+
+/*
+    Whether name is a builtin or one of the first count gate definitions.
+*/
+bool qasm_known_gate(const qasm_parser *p, const char *name, size_t length, int count)
+{
+    for (int g = 0; g < count; g++)
+    {
+        if (same_name(name, length, p->gates[g].name, p->gates[g].length))
+        {
+            return true;
+        }
+    }
+    for (int b = 0; b < QASM_BUILTINS; b++)
+    {
+        if (same_name(name, length, qasm_builtins[b].name, strlen(qasm_builtins[b].name)))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+    gate name(params) args { body }
+*/
+void qasm_gate_definition(qasm_parser *p)
+{
+    qasm_next(p);
+    if (p->token != QASM_ID)
+    {
+        qasm_error(p, "expected a gate name");
+        return;
+    }
+
+    if (p->num_gates == p->gate_capacity)
+    {
+        p->gate_capacity = p->gate_capacity ? 2 * p->gate_capacity : 16;
+        p->gates = (qasm_gate*) realloc(p->gates, p->gate_capacity * sizeof(qasm_gate));
+    }
+    qasm_gate *gate = &p->gates[p->num_gates];
+    gate->name = p->start;
+    gate->length = p->length;
+    gate->params = 0;
+    gate->args = 0;
+    qasm_next(p);
+
+    if (qasm_is_symbol(p, '('))
+    {
+        qasm_next(p);
+        while (p->token == QASM_ID && gate->params < QASM_MAX_GATE_PARAMS)
+        {
+            gate->param_names[gate->params] = p->start;
+            gate->param_lengths[gate->params++] = p->length;
+            qasm_next(p);
+            if (!qasm_is_symbol(p, ','))
+            {
+                break;
+            }
+            qasm_next(p);
+        }
+        qasm_expect(p, ')');
+    }
+
+    while (p->token == QASM_ID && gate->args < QASM_MAX_GATE_ARGS)
+    {
+        gate->arg_names[gate->args] = p->start;
+        gate->arg_lengths[gate->args++] = p->length;
+        qasm_next(p);
+        if (!qasm_is_symbol(p, ','))
+        {
+            break;
+        }
+        qasm_next(p);
+    }
+    if (gate->args == 0)
+    {
+        qasm_error(p, "gate without qubit arguments");
+    }
+    if (!qasm_is_symbol(p, '{'))
+    {
+        qasm_error(p, "expected '{' to open the gate body");
+        return;
+    }
+
+    //Only find the end of the body here, it is parsed when called. The
+    //gates it calls must already be defined, which rules out recursion.
+    gate->body = p->pos;
+    gate->line = p->line;
+    gate->visible = p->num_gates;
+    int braces = 1;
+    bool statement = true;
+    while (braces > 0 && !p->failed)
+    {
+        qasm_next(p);
+        if (p->token == QASM_END)
+        {
+            qasm_error(p, "unterminated gate body");
+            return;
+        }
+        if (statement && p->token == QASM_ID && !qasm_is(p, "barrier") &&
+            !qasm_known_gate(p, p->start, p->length, gate->visible))
+        {
+            bool self = same_name(p->start, p->length, gate->name, gate->length);
+            qasm_error(p, self ? "gate '%.*s' calls itself" : "gate '%.*s' must be defined before it is used", (int)p->length, p->start);
+            return;
+        }
+        statement = qasm_is_symbol(p, ';') || qasm_is_symbol(p, '{');
+        braces += qasm_is_symbol(p, '{') - qasm_is_symbol(p, '}');
+    }
+    qasm_next(p);
+    p->num_gates++;
+}
+
+/*
+    qreg name[size]; or creg name[size];
+*/
+void qasm_declaration(qasm_parser *p, bool quantum)
+{
+    qasm_bits *table = quantum ? p->qregs : p->cregs;
+    int *count = quantum ? &p->num_qregs : &p->num_cregs;
+    int *total = quantum ? &p->program->qubits : &p->program->clbits;
+
+    qasm_next(p);
+    if (p->token != QASM_ID)
+    {
+        qasm_error(p, "expected a register name");
+        return;
+    }
+    qasm_bits bits = {p->start, p->length, *total, 0};
+    qasm_next(p);
+    qasm_expect(p, '[');
+    if (p->token != QASM_NUMBER || p->number < 1 || p->number != (int)p->number)
+    {
+        qasm_error(p, "register size must be a positive integer");
+        return;
+    }
+    bits.size = (int)p->number;
+    qasm_next(p);
+    qasm_expect(p, ']');
+    qasm_expect(p, ';');
+
+    for (int r = 0; r < *count; r++)
+    {
+        if (same_name(bits.name, bits.length, table[r].name, table[r].length))
+        {
+            qasm_error(p, "register '%.*s' declared twice", (int)bits.length, bits.name);
+        }
+    }
+    if (*total + bits.size > QASM_MAX_BITS)
+    {
+        qasm_error(p, "more than %d %s bits", QASM_MAX_BITS, quantum ? "quantum" : "classical");
+    }
+    if (p->failed)
+    {
+        return;
+    }
+
+    table[(*count)++] = bits;
+    *total += bits.size;
+    if (quantum)
+    {
+        p->program->circuit->size = *total;
+    }
+}
+
+/*
+    measure qubits -> bits;
+*/
+void qasm_measure(qasm_parser *p)
+{
+    qasm_next(p);
+    qasm_operand qubits = qasm_bits_operand(p, p->qregs, p->num_qregs, "quantum");
+    if (p->token != QASM_ARROW)
+    {
+        qasm_error(p, "expected '->' in measure");
+        return;
+    }
+    qasm_next(p);
+    qasm_operand bits = qasm_bits_operand(p, p->cregs, p->num_cregs, "classical");
+    qasm_expect(p, ';');
+    if (p->failed)
+    {
+        return;
+    }
+    if (qubits.size != bits.size)
+    {
+        qasm_error(p, "measure between registers of different sizes");
+        return;
+    }
+
+    for (int i = 0; i < qubits.size; i++)
+    {
+        p->program->clbit_qubit[bits.offset + i] = qubits.offset + i;
+        p->measured |= (unsigned long long)1 << (qubits.offset + i);
+    }
+}
+
+/*
+    Parse statements until the end of the text, or the closing brace of a
+    gate body when scope is set.
+*/
+void qasm_statements(qasm_parser *p, const qasm_scope *scope)
+{
+    qasm_operand operands[QASM_MAX_GATE_ARGS];
+    double values[QASM_MAX_GATE_PARAMS];
+    int qubits[QASM_MAX_GATE_ARGS];
+
+    while (!p->failed)
+    {
+        p->statement_line = p->line;
+        if (p->token == QASM_END)
+        {
+            if (scope != NULL)
+            {
+                qasm_error(p, "unterminated gate body");
+            }
+            return;
+        }
+        if (scope != NULL && qasm_is_symbol(p, '}'))
+        {
+            return;
+        }
+        if (p->token != QASM_ID)
+        {
+            qasm_error(p, "unexpected '%.*s'", (int)p->length, p->start);
+            return;
+        }
+
+        if (scope == NULL)
+        {
+            if (qasm_is(p, "OPENQASM"))
+            {
+                qasm_next(p);
+                if (p->token != QASM_NUMBER || (int)p->number != 2)
+                {
+                    qasm_error(p, "only OpenQASM 2 is supported");
+                }
+                qasm_next(p);
+                qasm_expect(p, ';');
+                continue;
+            }
+            if (qasm_is(p, "include"))
+            {
+                qasm_next(p);
+                if (p->token != QASM_STRING || !same_name(p->start, p->length, "\"qelib1.inc\"", 12))
+                {
+                    qasm_error(p, "only qelib1.inc can be included");
+                }
+                qasm_next(p);
+                qasm_expect(p, ';');
+                continue;
+            }
+            if (qasm_is(p, "qreg") || qasm_is(p, "creg"))
+            {
+                qasm_declaration(p, *p->start == 'q');
+                continue;
+            }
+            if (qasm_is(p, "gate"))
+            {
+                qasm_gate_definition(p);
+                continue;
+            }
+            if (qasm_is(p, "measure"))
+            {
+                qasm_measure(p);
+                continue;
+            }
+            if (qasm_is(p, "reset") || qasm_is(p, "opaque") || qasm_is(p, "if"))
+            {
+                qasm_error(p, "'%.*s' is not supported", (int)p->length, p->start);
+                return;
+            }
+        }
+
+        if (qasm_is(p, "barrier"))
+        {
+            int repeat;
+            qasm_next(p);
+            qasm_operands(p, scope, operands, QASM_MAX_GATE_ARGS, &repeat, false);
+            continue;
+        }
+
+        //Gate call, broadcast over whole register operands.
+        const char *name = p->start;
+        size_t length = p->length;
+        qasm_next(p);
+        int params = qasm_params(p, scope, values);
+        int repeat;
+        int count = qasm_operands(p, scope, operands, QASM_MAX_GATE_ARGS, &repeat, true);
+
+        for (int r = 0; r < repeat && !p->failed; r++)
+        {
+            qasm_select(operands, count, r, qubits);
+            qasm_apply(p, name, length, values, params, qubits, count);
+        }
+    }
+}
+
+qasm_program* parse_qasm(const char *text, size_t length)
+{
+    qasm_program *program = (qasm_program*) malloc(sizeof(qasm_program));
+    program->qubits = 0;
+    program->clbits = 0;
+    for (int c = 0; c < QASM_MAX_BITS; c++)
+    {
+        program->clbit_qubit[c] = -1;
+    }
+
+    //The gates only need a history, the register grows with each qreg.
+    program->circuit = initRegisterFields(0);
+    set_deferred(program->circuit, true);
+
+    qasm_parser p;
+    memset(&p, 0, sizeof(p));
+    p.pos = text;
+    p.end = text + length;
+    p.line = 1;
+    p.statement_line = 1;
+    p.program = program;
+
+    qasm_next(&p);
+    qasm_statements(&p, NULL);
+    free(p.gates);
+
+    if (p.failed)
+    {
+        free_qasm(program);
+        return NULL;
+    }
+    return program;
+}
+
+qasm_program* load_qasm(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        fprintf(stderr, "Failed to open %s.\n", path);
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return NULL;
+    }
+    if (st.st_size == 0)
+    {
+        close(fd);
+        return parse_qasm("", 0);
+    }
+
+    void *text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (text == MAP_FAILED)
+    {
+        fprintf(stderr, "Failed to map %s.\n", path);
+        return NULL;
+    }
+    madvise(text, st.st_size, MADV_SEQUENTIAL);
+
+    qasm_program *program = parse_qasm((const char*) text, st.st_size);
+    munmap(text, st.st_size);
+    return program;
+}
+
+qreg* qasm_register(const qasm_program *program)
+{
+    qreg *reg = initQuRegister(program->qubits);
+    if (reg == NULL)
+    {
+        return NULL;
+    }
+    set_deferred(reg, true);
+
+    const qreg *circuit = program->circuit;
+    for (unsigned int i = 0; i < circuit->history_size; i++)
+    {
+        const stored_op *op = &(circuit->history[i]);
+        record_operation(reg, op->operation, circuit->index_pool + op->qbit_offset, op->qbit_buffSize,
+            op->control_idx, op->target_idx, op->params, op->ctrl_mask);
+    }
+    return reg;
+}
+
+void qasm_sample(const qasm_program *program, qreg *reg, unsigned long shots, unsigned int *out_counts)
+{
+    if (program->clbits == 0)
+    {
+        sample(reg, shots, out_counts);
+        return;
+    }
+
+    size_t states = (size_t)1 << reg->size;
+    unsigned int *counts = (unsigned int*) calloc(states, sizeof(unsigned int));
+    sample(reg, shots, counts);
+
+    //Gather the measured qubits of every drawn state into its classical bits.
+    for (size_t i = 0; i < states; i++)
+    {
+        if (counts[i] == 0)
+        {
+            continue;
+        }
+        size_t bits = 0;
+        for (int c = 0; c < program->clbits; c++)
+        {
+            int q = program->clbit_qubit[c];
+            if (q >= 0 && (i >> q) & 1)
+            {
+                bits |= (size_t)1 << c;
+            }
+        }
+        out_counts[bits] += counts[i];
+    }
+    free(counts);
+}
+
+void free_qasm(qasm_program *program)
+{
+    if (program == NULL)
+    {
+        return;
+    }
+    free_qreg(program->circuit);
+    free(program);
+}
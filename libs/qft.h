@@ -0,0 +1,343 @@
+#pragma once
+#include "measure.h"
+
+/*
+    Quantum Fourier transform as an FFT over a subset of the qubits.
+
+    The k selected qubits, qubits[0] being bit 0, hold an integer x and
+    QFT maps every |x> to 2^(-k/2) sum_y exp(2 pi i x y / 2^k) |y>, the
+    other qubits untouched. The textbook circuit factors it into one stage
+    per qubit, from the most significant down: a Hadamard on qubits[s]
+    followed by the controlled phases from the qubits below it, which only
+    multiply the |1> half by exp(i pi L / 2^s), L being the value of those
+    lower qubits. Each stage is a radix-2 butterfly with that twiddle, so
+    it costs one pass instead of s + 1 gates. Finally the qubit order is
+    reversed.
+
+    The stages whose qubits all sit below QFT_BLOCK_QUBITS run one cache
+    sized block at a time in a single pass, the others two stages (radix 4)
+    per pass. The reversal is an exchange of bit pairs rather than SWAP
+    gates: the pairs inside a block are exchanged by the blocked pass, the
+    others are relabeled like SWAP does (swap_layout) and only move when
+    the register is read. The inverse transform uses the conjugated
+    twiddles.
+
+    The history, the circuit stream and reg->applied see the gates of the
+    textbook circuit, so a replay runs them one by one and ends in the
+    same state. Deferred registers run their pending gates first. Sparse
+    registers go through the gates one by one.
+*/
+
+#define QFT_BLOCK_QUBITS 14
+
+/*
+    Apply the quantum Fourier transform, or its inverse, to the k given
+    qubits. Returns false with a message on stderr for invalid qubits.
+*/
+bool QFT(qreg *reg, const int *qubits, int k, bool inverse);
+
+/*
+    Value of the qubits[0..count-1] bits of index, qubits[m] being bit m.
+*/
+size_t qft_value(size_t index, const int *qubits, int count)
+{
+    size_t value = 0;
+    for (int m = 0; m < count; m++)
+    {
+        value |= ((index >> qubits[m]) & 1) << m;
+    }
+    return value;
+}
+
+/*
+    exp(i angle) in the precision of the register.
+*/
+amplitude qft_root(double angle)
+{
+    return cos(angle) + sin(angle) * j;
+}
+
+/*
+    Gate by gate transform for sparse registers.
+*/
+void sparse_qft(qreg *reg, const int *qubits, int k, double sign)
+{
+    const double complex h[2][2] = {{M_SQRT1_2, M_SQRT1_2}, {M_SQRT1_2, -M_SQRT1_2}};
+
+    for (int s = k - 1; s >= 0; s--)
+    {
+        apply_1q(reg, qubits[s], h);
+        for (int m = s - 1; m >= 0; m--)
+        {
+            const double complex phase[2][2] = {{1, 0}, {0, cexp(sign * M_PI / ((size_t)1 << (s - m)) * _Complex_I)}};
+            apply_controlled_1q(reg, (unsigned long long)1 << qubits[m], qubits[s], phase);
+        }
+    }
+
+    int a[32], b[32];
+    for (int s = 0; s < k / 2; s++)
+    {
+        a[s] = qubits[s];
+        b[s] = qubits[k - 1 - s];
+    }
+    kernel_swap_bits(reg, a, b, k / 2);
+}
+
+/*
+    Stages low - 1 down to 0, all on qubits below block_qubits, one block
+    at a time. Each block then exchanges the bit pairs (a[i], b[i]), which
+    lie below block_qubits too.
+*/
+void qft_blocked(qreg *reg, const int *qubits, int low, int block_qubits, const int *a, const int *b, int pairs, double sign, amp_real scale)
+{
+    size_t block_size = (size_t)1 << block_qubits;
+    size_t blocks = reg_states(reg) >> block_qubits;
+    amplitude *amp = reg->matrix;
+
+    //Value of the low qubits of every in-block index, and exp(i pi m / 2^(low - 1)).
+    size_t *value = (size_t*) malloc(block_size * sizeof(size_t));
+    size_t roots_count = low > 1 ? (size_t)1 << (low - 1) : 1;
+    amplitude *roots = (amplitude*) malloc(roots_count * sizeof(amplitude));
+    for (size_t x = 0; x < block_size; x++)
+    {
+        value[x] = qft_value(x, qubits, low);
+    }
+    for (size_t m = 0; m < roots_count; m++)
+    {
+        roots[m] = qft_root(sign * M_PI * m / roots_count);
+    }
+
+    //In-block index every amplitude is exchanged with.
+    size_t *partner = pairs > 0 ? (size_t*) malloc(block_size * sizeof(size_t)) : NULL;
+    for (size_t x = 0; x < block_size && pairs > 0; x++)
+    {
+        partner[x] = x;
+        for (int t = 0; t < pairs; t++)
+        {
+            if (((x >> a[t]) ^ (x >> b[t])) & 1)
+            {
+                partner[x] ^= ((size_t)1 << a[t]) | ((size_t)1 << b[t]);
+            }
+        }
+    }
+
+    PARALLEL_FOR(reg, reg_states(reg), 1)
+    for (size_t blk = 0; blk < blocks; blk++)
+    {
+        amplitude *block = amp + blk * block_size;
+
+        for (int s = low - 1; s >= 0; s--)
+        {
+            size_t stride = (size_t)1 << qubits[s];
+            size_t below = ((size_t)1 << s) - 1;
+            int shift = low - 1 - s;
+
+            //Stage 0 has no twiddle and applies the normalization.
+            for (size_t first = 0; first < block_size && s == 0; first += 2 * stride)
+            {
+                for (size_t x = first; x < first + stride; x++)
+                {
+                    amplitude u = block[x], v = block[x + stride];
+                    block[x] = scale * (u + v);
+                    block[x + stride] = scale * (u - v);
+                }
+            }
+            for (size_t first = 0; first < block_size && s > 0; first += 2 * stride)
+            {
+                for (size_t x = first; x < first + stride; x++)
+                {
+                    amplitude u = block[x], v = block[x + stride];
+                    block[x] = u + v;
+                    block[x + stride] = cmul(u - v, roots[(value[x] & below) << shift]);
+                }
+            }
+        }
+
+        for (size_t x = 0; x < block_size && pairs > 0; x++)
+        {
+            if (partner[x] > x)
+            {
+                amplitude temp = block[x];
+                block[x] = block[partner[x]];
+                block[partner[x]] = temp;
+            }
+        }
+    }
+
+    free(value);
+    free(roots);
+    free(partner);
+}
+
+/*
+    Stage s, followed by stage s - 1 when radix is 4, in one pass. The
+    twiddle of a butterfly is split between its base and its offset t
+    within a run of CONTROLLED_RUN_LIMIT butterflies, each looked up once.
+*/
+void qft_pass(qreg *reg, const int *qubits, int s, int radix, double sign, amp_real scale)
+{
+    int r = radix == 4 ? 2 : 1;
+    int below = s + 1 - r;
+    int group[2] = {qubits[s], qubits[s]};
+    if (r == 2)
+    {
+        group[0] = qubits[s] < qubits[s - 1] ? qubits[s] : qubits[s - 1];
+        group[1] = qubits[s] < qubits[s - 1] ? qubits[s - 1] : qubits[s];
+    }
+
+    size_t size = reg_states(reg);
+    size_t run = (size >> r) < CONTROLLED_RUN_LIMIT ? (size >> r) : CONTROLLED_RUN_LIMIT;
+    size_t chunks = (size >> r) / run;
+    double angle = sign * M_PI / ((size_t)1 << s);
+
+    size_t *offset = (size_t*) malloc(run * sizeof(size_t));
+    amplitude *twiddle = (amplitude*) malloc(run * sizeof(amplitude));
+    for (size_t t = 0; t < run; t++)
+    {
+        offset[t] = deposit_bits(t, group, r);
+        twiddle[t] = qft_root(angle * qft_value(offset[t], qubits, below));
+    }
+
+    size_t hi = (size_t)1 << qubits[s];
+    size_t lo = r == 2 ? (size_t)1 << qubits[s - 1] : 0;
+    amplitude quarter = sign * j;
+    amplitude *amp = reg->matrix;
+
+    PARALLEL_FOR(reg, size, 1)
+    for (size_t c = 0; c < chunks; c++)
+    {
+        size_t base = deposit_bits(c * run, group, r);
+        amplitude w_base = qft_root(angle * qft_value(base, qubits, below));
+
+        for (size_t t = 0; t < run; t++)
+        {
+            size_t i = base | offset[t];
+            amplitude w = cmul(w_base, twiddle[t]);
+
+            if (r == 1)
+            {
+                amplitude u = amp[i], v = amp[i | hi];
+                amp[i] = scale * (u + v);
+                amp[i | hi] = scale * cmul(u - v, w);
+                continue;
+            }
+
+            //Stage s pairs along hi, the lo = 1 half picks up a quarter turn.
+            amplitude a00 = amp[i], a01 = amp[i | lo], a10 = amp[i | hi], a11 = amp[i | hi | lo];
+            amplitude b10 = cmul(a00 - a10, w);
+            amplitude b11 = cmul(cmul(a01 - a11, w), quarter);
+            a00 = a00 + a10;
+            a01 = a01 + a11;
+
+            //Stage s - 1 pairs along lo with twiddle w^2.
+            amplitude w2 = cmul(w, w);
+            amp[i] = scale * (a00 + a01);
+            amp[i | lo] = scale * cmul(a00 - a01, w2);
+            amp[i | hi] = scale * (b10 + b11);
+            amp[i | hi | lo] = scale * cmul(b10 - b11, w2);
+        }
+    }
+
+    free(offset);
+    free(twiddle);
+}
+
+/*
+    Record the transform as the Hadamards, controlled phases and SWAPs of
+    the textbook circuit, in the order sparse_qft applies them.
+*/
+void record_qft(qreg *reg, const int *qubits, int k, double sign)
+{
+    //The transform ran already, its gates are recorded as immediate ones.
+    bool deferred = reg->deferred;
+    reg->deferred = false;
+
+    for (int s = k - 1; s >= 0; s--)
+    {
+        int target = qubits[s];
+        add_operation(reg, 'H', &target, 1, 0, 0);
+        for (int m = s - 1; m >= 0; m--)
+        {
+            add_controlled_operation(reg, 'P', &target, 1, (unsigned long long)1 << qubits[m], sign * M_PI / ((size_t)1 << (s - m)));
+        }
+    }
+    for (int s = 0; s < k / 2; s++)
+    {
+        add_operation(reg, 'x', NULL, 0, qubits[s], qubits[k - 1 - s]);
+    }
+    reg->deferred = deferred;
+}
+
+bool QFT(qreg *reg, const int *qubits, int k, bool inverse)
+{
+    unsigned long long mask = 0;
+    for (int i = 0; i < k; i++)
+    {
+        if (qubits[i] < 0 || qubits[i] >= (int)reg->size || ((mask >> qubits[i]) & 1))
+        {
+            fprintf(stderr, "Qubit %d of the QFT is out of range or repeated.\n", qubits[i]);
+            return false;
+        }
+        mask |= (unsigned long long)1 << qubits[i];
+    }
+
+    flush_pending(reg);
+    mark_dirty(reg);
+    double sign = inverse ? -1 : 1;
+    if (k == 0)
+    {
+        return true;
+    }
+    if (reg->sparse != NULL)
+    {
+        sparse_qft(reg, qubits, k, sign);
+        record_qft(reg, qubits, k, sign);
+        return true;
+    }
+
+    int block_qubits = reg->size < QFT_BLOCK_QUBITS ? reg->size : QFT_BLOCK_QUBITS;
+    int low = 0;
+    while (low < k && qubits[low] < block_qubits)
+    {
+        low++;
+    }
+    amp_real scale = pow(M_SQRT1_2, k);
+
+    //High stages from the top, two per pass.
+    for (int s = k - 1; s >= low; s -= 2)
+    {
+        int radix = s - 1 >= low ? 4 : 2;
+        bool last = s + 1 - radix / 2 == 0;
+        qft_pass(reg, qubits, s, radix, sign, last ? scale : 1);
+    }
+
+    //Reversal, the pairs inside the blocks go with the blocked pass and the
+    //others only relabel the qubits.
+    int inner_a[32], inner_b[32], outer_a[32], outer_b[32];
+    int inner = 0, outer = 0;
+    for (int s = 0; s < k / 2; s++)
+    {
+        int a = qubits[s], b = qubits[k - 1 - s];
+        if (low > 0 && a < block_qubits && b < block_qubits)
+        {
+            inner_a[inner] = a;
+            inner_b[inner++] = b;
+        }
+        else
+        {
+            outer_a[outer] = a;
+            outer_b[outer++] = b;
+        }
+    }
+
+    if (low > 0)
+    {
+        qft_blocked(reg, qubits, low, block_qubits, inner_a, inner_b, inner, sign, scale);
+    }
+    for (int p = 0; p < outer; p++)
+    {
+        swap_layout(reg, outer_a[p], outer_b[p]);
+    }
+    record_qft(reg, qubits, k, sign);
+    return true;
+}
@@ -1,25 +1,127 @@
+#pragma once
 #include "qubit.h"
+#include <unistd.h>
+#include <sys/mman.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+
+#define QSIM_PRAGMA(x) _Pragma(#x)
+
+/*
+    Split the following loop nest statically over the register threads.
+    Registers below PARALLEL_THRESHOLD amplitudes stay on the calling thread,
+    where fork/join costs more than the loop itself.
+*/
+#define PARALLEL_FOR(reg, size, depth) \
+    QSIM_PRAGMA(omp parallel for collapse(depth) schedule(static) num_threads((reg)->num_threads) if((reg)->num_threads > 1 && (size) >= PARALLEL_THRESHOLD))
+
+/*
+    Same split as PARALLEL_FOR, summing var over the threads.
+*/
+#define PARALLEL_SUM(reg, size, depth, var) \
+    QSIM_PRAGMA(omp parallel for collapse(depth) schedule(static) reduction(+:var) num_threads((reg)->num_threads) if((reg)->num_threads > 1 && (size) >= PARALLEL_THRESHOLD))
+#else
+#define PARALLEL_FOR(reg, size, depth)
+#define PARALLEL_SUM(reg, size, depth, var)
+#endif
+
+#define PARALLEL_THRESHOLD ((size_t)1 << 14)
+
+/*
+    State vectors of at least this many bytes are aligned to it and backed
+    by transparent huge pages.
+*/
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+/*
+    Largest dense register, 2^59 amplitudes of 16 bytes fill a 64-bit size.
+*/
+#define MAX_DENSE_QUBITS 59
+
+/*
+    Default tile of the blocked flush, 2^14 amplitudes (256 KiB) fit in L2.
+*/
+#define TILE_QUBITS 14
+
+/*
+    Precision of the state vector, picked at compile time. Building with
+    -DQSIM_FLOAT stores amplitudes as float complex, which halves memory and
+    bandwidth (one more qubit in the same memory). Gate matrices and
+    probability sums stay in double.
+*/
+#ifdef QSIM_FLOAT
+typedef float amp_real;
+typedef float complex amplitude;
+#define AMP_RE(a) crealf(a)
+#define AMP_IM(a) cimagf(a)
+#else
+typedef double amp_real;
+typedef double complex amplitude;
+#define AMP_RE(a) creal(a)
+#define AMP_IM(a) cimag(a)
+#endif
 
 /*
     Record of an operation performed on a register.
+    Its qubit indexes live in the index pool of the register, starting at
+    qbit_offset, read them through op_indexes.
 */
 typedef struct stored_op{
     char operation;
     int control_idx;
     int target_idx;
     unsigned short qbit_buffSize;
-    int *qbit_indexes;
+    size_t qbit_offset;
+    double params[3];
+    unsigned long long ctrl_mask;
 }stored_op;
 
 /*
-    Qubit register composed of arbitrary number of qubits
+    Hash map of the nonzero amplitudes of a sparse register, see sparse.h.
+*/
+typedef struct sparse_map sparse_map;
+
+/*
+    Binary circuit file being written as gates are applied, see circuit.h.
+*/
+typedef struct circuit_stream circuit_stream;
+
+/*
+    Qubit register composed of arbitrary number of qubits.
+    applied counts every operation applied or queued since the register was
+    created, or since the position it was restored from (checkpoint.h).
+    Registers backed by a file keep the whole mapping in mapping, with the
+    amplitudes inside it, and clean_flag points at the flag of the file
+    header that mark_dirty clears before the next write.
+    position[q] is the bit of the basis index holding logical qubit q. SWAP
+    only exchanges two entries and sets permuted, the gates translate their
+    qubits through it and settle_layout moves the amplitudes back in order.
 */
 typedef struct qreg{
     unsigned int size;
     unsigned int history_size;
-    double complex *matrix;
+    unsigned int history_capacity;
+    unsigned int executed;
+    unsigned long long applied;
+    bool recording;
+    bool deferred;
+    int fusion_qubits;
+    int tile_qubits;
+    int num_threads;
+    unsigned long long rng_state;
+    amplitude *matrix;
+    void *mapping;
+    size_t mapping_size;
+    unsigned int *clean_flag;
+    sparse_map *sparse;
+    circuit_stream *stream;
     stored_op *history;
-    qbit *qb;
+    int *index_pool;
+    size_t pool_size;
+    size_t pool_capacity;
+    int position[64];
+    bool permuted;
 }qreg;
 
 /*
@@ -27,14 +129,108 @@ typedef struct qreg{
 */
 qreg* initQuRegister(size_t n);
 
+/*
+    Allocate bytes of amplitude storage, aligned to 64 bytes for the vector
+    kernels. Allocations of at least HUGE_PAGE_SIZE are aligned to a huge page
+    and advised as huge page backed, which cuts TLB misses on big registers.
+    Returns NULL with a message on stderr when the request exceeds the
+    physical memory of the machine or cannot be allocated.
+    The memory is released with free.
+*/
+void* alloc_amplitudes(size_t bytes);
+
+/*
+    Release the dense amplitudes of the register, freed or unmapped
+    depending on how they were allocated.
+*/
+void release_amplitudes(qreg *reg);
+
+/*
+    Release the amplitudes, the history and the register itself.
+    An open circuit stream is closed first.
+*/
+void free_qreg(qreg *reg);
+
+/*
+    Number of operations stored in the history buffer.
+*/
+unsigned int history_count(qreg *reg);
+
+/*
+    Qubit indexes of a recorded operation.
+*/
+int* op_indexes(qreg *reg, const stored_op *op);
+
+/*
+    Turn recording of applied gates into the history on or off. Recording
+    is on by default, deferred registers record regardless since the
+    history is what they execute.
+*/
+void set_recording(qreg *reg, bool recording);
+
+/*
+    Switch the register between applying each gate as it is called and
+    deferring it. A deferred register only records gates in its history,
+    flush_operations in fusion.h then fuses and applies everything pending.
+    Switching back to immediate gates runs the pending ones first.
+*/
+void set_deferred(qreg *reg, bool deferred);
+
+/*
+    Set the number of threads used by the gate kernels of the register.
+    Has no effect unless the library is built with OpenMP.
+*/
+void set_threads(qreg *reg, int threads);
+
+/*
+    Clear the clean flag of the state file behind the register and sync it
+    to disk. Everything that writes amplitudes calls it before the first
+    write, so a run killed halfway never leaves a file that claims to match
+    its checkpoint. Registers without a clean file are left alone.
+*/
+void mark_dirty(qreg *reg);
+
+/*
+    Put every logical qubit back on its own bit after relabeling SWAPs,
+    one bulk permutation of the state. Anything reading the amplitudes by
+    index calls it first.
+*/
+void settle_layout(qreg *reg);
+
+/*
+    Exchange the bits holding logical qubits first and second, a SWAP that
+    moves no amplitude.
+*/
+void swap_layout(qreg *reg, int first, int second);
+
+/*
+    Amplitude of a basis state, for dense and sparse registers alike. The
+    gates still queued in a deferred register run first, fusion.h
+    implements it next to set_deferred.
+*/
+double complex get_amplitude(qreg *reg, unsigned long long i);
+
+void mark_dirty(qreg *reg)
+{
+    if (reg->clean_flag != NULL)
+    {
+        *reg->clean_flag = 0;
+        msync(reg->mapping, sysconf(_SC_PAGESIZE), MS_SYNC);
+        reg->clean_flag = NULL;
+    }
+}
+
 /*
     Calculate the magnitude of the qubit vector
 */
-double mag(qreg *reg, int i){
-    double mod = sqrt(pow(creal(reg->matrix[i]), 2) + pow(cimag(reg->matrix[i]), 2));
-    return (pow(mod, 2) * 100);
+double mag(qreg *reg, unsigned long long i){
+    double complex a = get_amplitude(reg, i);
+    double re = creal(a), im = cimag(a);
+    return (re * re + im * im) * 100;
 }
 
+void stream_operation(circuit_stream *stream, const stored_op *op, const int *indexes);
+
 /*
     Add an operation, performed on a register to the history buffer.
     X - Pauli-X
@@ -43,83 +239,286 @@ double mag(qreg *reg, int i){
     H - Hadamard
     + and o - CNOT (control and target markings)
     x - SWAP (swapped qbits will be marked with this char)
+    U - U3 rotation, params hold theta, phi and lambda
+    R - Rotation about a single axis, params hold theta and the axis (0 - X, 1 - Y, 2 - Z)
+    P - Phase shift, params hold lambda
+    S - S gate
+    T - T gate
+    Any of the gates above with a non-zero ctrl_mask is controlled by the qubits in the mask.
+
+    The operation is also written to the circuit stream of the register, if
+    one is open. The history and the index pool grow geometrically, so
+    recording costs amortized O(1) per gate. Returns the new record, or NULL
+    when the register does not record.
 */
-void add_operation(qreg *reg, char operation, int *indexes, int n, int ctrl, int target)
+stored_op* record_operation(qreg *reg, char operation, int *indexes, int n, int ctrl, int target, const double params[3], unsigned long long ctrl_mask)
 {
-    stored_op *new_op = (stored_op*) malloc(sizeof(stored_op));
-    new_op->qbit_indexes = (int*) malloc(n * sizeof(int));
+    stored_op op;
+    op.operation = operation;
+    op.control_idx = ctrl;
+    op.target_idx = target;
+    op.qbit_buffSize = n;
+    op.qbit_offset = reg->pool_size;
+    op.params[0] = params[0];
+    op.params[1] = params[1];
+    op.params[2] = params[2];
+    op.ctrl_mask = ctrl_mask;
 
-    //Copy the operation to the temporary struct
-    new_op->operation = operation;
-    new_op->qbit_buffSize = 0;
+    if (reg->stream != NULL)
+    {
+        stream_operation(reg->stream, &op, indexes);
+    }
 
-    //If the qbit index buffer is not empty, copy it
-    if (n > 0)
+    //Gates that ran already marked the file, this covers queued ones.
+    mark_dirty(reg);
+    reg->applied++;
+
+    if (!reg->recording && !reg->deferred)
     {
-        new_op->qbit_buffSize = n;
-        for (int i=0; i<n; i++)
-        {
-            new_op->qbit_indexes[i] = indexes[i];
-            printf("Copying index %d for operation %c ..\n", indexes[i], operation);
-        }
+        return NULL;
     }
-    
-    new_op->control_idx = ctrl;
-    new_op->target_idx = target;
 
-    //Init history buffer if empty
-    if (reg->history == NULL)
+    //Double the history and the index pool when they are full.
+    if (reg->history_size == reg->history_capacity)
     {
-        reg->history = (stored_op*) malloc(sizeof(stored_op));
-        reg->history = new_op;
-        reg->history_size = 0;
+        unsigned int capacity = reg->history_capacity ? 2 * reg->history_capacity : 64;
+        stored_op *history = (stored_op*) realloc(reg->history, capacity * sizeof(stored_op));
+        if (history == NULL)
+        {
+            fprintf(stderr, "Failed to grow the operation history to %u entries.\n", capacity);
+            exit(EXIT_FAILURE);
+        }
+        reg->history = history;
+        reg->history_capacity = capacity;
     }
-    else
+    if (reg->pool_size + n > reg->pool_capacity)
     {
-        //Reallocate memory with the added size of the new operation.
-        size_t new_size = (reg->history_size + 2) * sizeof(stored_op);
-        stored_op *temp_history = realloc(reg->history, new_size);
-        
-        if(temp_history != NULL)
+        size_t capacity = reg->pool_capacity ? 2 * reg->pool_capacity : 256;
+        while (capacity < reg->pool_size + n)
+        {
+            capacity *= 2;
+        }
+        int *pool = (int*) realloc(reg->index_pool, capacity * sizeof(int));
+        if (pool == NULL)
         {
-            reg->history = temp_history;
-            reg->history_size = reg->history_size+1;
-            memcpy((reg->history + reg->history_size), new_op, sizeof(stored_op));
-            //reg->history + reg->history_size = 
-            printf("Added new operation %c to the history buffer, index %d..\n", operation, reg->history_size);
+            fprintf(stderr, "Failed to grow the index pool to %zu entries.\n", capacity);
+            exit(EXIT_FAILURE);
         }
+        reg->index_pool = pool;
+        reg->pool_capacity = capacity;
+    }
+
+    stored_op *new_op = &(reg->history[reg->history_size++]);
+    *new_op = op;
+
+    if (n > 0)
+    {
+        memcpy(reg->index_pool + reg->pool_size, indexes, n * sizeof(int));
+        reg->pool_size += n;
+    }
 
-        
+    //Immediate gates are already applied by the time they are recorded.
+    if (!reg->deferred)
+    {
+        reg->executed = history_count(reg);
     }
+    return new_op;
 }
 
-qreg* initQuRegister(size_t n){
+/*
+    Add an operation without parameters or control mask to the history buffer.
+*/
+stored_op* add_operation(qreg *reg, char operation, int *indexes, int n, int ctrl, int target)
+{
+    const double params[3] = {0, 0, 0};
+    return record_operation(reg, operation, indexes, n, ctrl, target, params, 0);
+}
+
+/*
+    Add a parametrized operation to the history buffer.
+    Same as add_operation, with up to three gate parameters attached.
+*/
+stored_op* add_param_operation(qreg *reg, char operation, int *indexes, int n, double p0, double p1, double p2)
+{
+    const double params[3] = {p0, p1, p2};
+    return record_operation(reg, operation, indexes, n, 0, 0, params, 0);
+}
+
+/*
+    Add a controlled operation to the history buffer.
+    The qubits set in ctrl_mask control the gate applied to each of the indexes.
+*/
+void add_controlled_operation(qreg *reg, char operation, int *indexes, int n, unsigned long long ctrl_mask, double param)
+{
+    const double params[3] = {param, 0, 0};
+    record_operation(reg, operation, indexes, n, 0, 0, params, ctrl_mask);
+}
+
+/*
+    Register object with everything but the amplitudes set up,
+    shared by initQuRegister and initSparseRegister.
+*/
+qreg* initRegisterFields(size_t n){
     //Allocate memory for the register object.
     qreg *new_register = (qreg*) malloc(sizeof(qreg));
 
-    //Allocate memory for qubits inside the created register.
-    new_register->qb = (qbit*) malloc(n * sizeof(qbit));
-
     new_register->size = n;
 
-    //Initialize qubits with default state of 0.
-    for(int i=0; i<n; i++){
-        new_register->qb[i] = initQubit(0);
+    //Use every available core by default.
+#ifdef _OPENMP
+    new_register->num_threads = omp_get_max_threads();
+#else
+    new_register->num_threads = 1;
+#endif
+
+    //Empty operation history, the buffers are allocated by the first gate.
+    new_register->history = NULL;
+    new_register->history_size = 0;
+    new_register->history_capacity = 0;
+    new_register->executed = 0;
+    new_register->applied = 0;
+    new_register->recording = true;
+    new_register->index_pool = NULL;
+    new_register->pool_size = 0;
+    new_register->pool_capacity = 0;
+
+    //Gates are applied immediately, deferred gates are fused over two qubits.
+    new_register->deferred = false;
+    new_register->fusion_qubits = 2;
+    new_register->tile_qubits = TILE_QUBITS;
+
+    //Fixed seed, measurements are reproducible until set_seed is called.
+    new_register->rng_state = 0x853c49e6748fea9bULL;
+
+    new_register->matrix = NULL;
+    new_register->mapping = NULL;
+    new_register->mapping_size = 0;
+    new_register->clean_flag = NULL;
+    new_register->sparse = NULL;
+    new_register->stream = NULL;
+
+    //Every qubit on its own bit.
+    for (int q = 0; q < 64; q++){
+        new_register->position[q] = q;
+    }
+    new_register->permuted = false;
+    return new_register;
+}
+
+void* alloc_amplitudes(size_t bytes){
+    size_t align = bytes >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : 64;
+    size_t rounded = (bytes + align - 1) & ~(align - 1);
+
+#ifdef _SC_PHYS_PAGES
+    //Overcommit would let malloc succeed and the zero-fill get killed later.
+    double physical = (double)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+    if (physical > 0 && rounded > physical){
+        fprintf(stderr, "Register needs %.1f GiB, more than the %.1f GiB of physical memory.\n",
+            rounded / 1073741824.0, physical / 1073741824.0);
+        return NULL;
+    }
+#endif
+
+    void *data = aligned_alloc(align, rounded);
+    if (data == NULL){
+        fprintf(stderr, "Failed to allocate %.1f GiB for the register.\n", rounded / 1073741824.0);
+        return NULL;
+    }
+
+#ifdef MADV_HUGEPAGE
+    //Only a hint, the kernel falls back to normal pages without transparent huge pages.
+    if (align == HUGE_PAGE_SIZE){
+        madvise(data, rounded, MADV_HUGEPAGE);
+    }
+#endif
+    return data;
+}
+
+qreg* initQuRegister(size_t n){
+    if (n > MAX_DENSE_QUBITS){
+        fprintf(stderr, "A dense register holds at most %d qubits, %zu requested.\n", MAX_DENSE_QUBITS, n);
+        return NULL;
     }
 
     //Initialize the matrix of complex numbers to represent all states of qubits.
-    new_register->matrix = (complex*) malloc(pow(2, n) * sizeof(complex));
+    size_t size = (size_t)1 << n;
+    amplitude *amplitudes = (amplitude*) alloc_amplitudes(size * sizeof(amplitude));
+    if (amplitudes == NULL){
+        return NULL;
+    }
+
+    qreg *new_register = initRegisterFields(n);
+    new_register->matrix = amplitudes;
 
-    //Initialize the matrix with state 0
-    for(int i=0; i < pow(2,n); i++){
-        new_register->matrix[i] = 0.0f + 0.0f*j;
+    /*
+        Initialize the matrix with state 0. Pages are placed on the NUMA node
+        of the thread that first writes them, so the zero-fill uses the same
+        static partition the gate kernels use later on.
+    */
+    amplitude *matrix = new_register->matrix;
+    PARALLEL_FOR(new_register, size, 1)
+    for(size_t i=0; i < size; i++){
+        matrix[i] = 0.0f + 0.0f*j;
     }
 
     //Set the measured state to be the all-zero state.
     new_register->matrix[0] = 1.0f + 0.0f*j;
 
-    //Null the operation history
-    new_register->history = NULL;
-
     return new_register;
-}
\ No newline at end of file
+}
+
+void set_threads(qreg *reg, int threads)
+{
+    reg->num_threads = threads > 0 ? threads : 1;
+}
+
+unsigned int history_count(qreg *reg)
+{
+    return reg->history_size;
+}
+
+int* op_indexes(qreg *reg, const stored_op *op)
+{
+    return reg->index_pool + op->qbit_offset;
+}
+
+void set_recording(qreg *reg, bool recording)
+{
+    reg->recording = recording;
+}
+
+void sparse_free(sparse_map *map);
+void close_circuit_stream(qreg *reg);
+
+void release_amplitudes(qreg *reg)
+{
+    if (reg->mapping != NULL)
+    {
+        munmap(reg->mapping, reg->mapping_size);
+        reg->mapping = NULL;
+        reg->clean_flag = NULL;
+    }
+    else
+    {
+        free(reg->matrix);
+    }
+    reg->matrix = NULL;
+}
+
+void free_qreg(qreg *reg)
+{
+    if (reg == NULL)
+    {
+        return;
+    }
+    if (reg->sparse != NULL)
+    {
+        sparse_free(reg->sparse);
+    }
+    close_circuit_stream(reg);
+    release_amplitudes(reg);
+    free(reg->history);
+    free(reg->index_pool);
+    free(reg);
+}
+
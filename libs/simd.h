@@ -0,0 +1,501 @@
+#pragma once
+#include "operations.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_X86 1
+#endif
+
+/*
+    Split storage register.
+
+    The real and imaginary parts of the amplitudes live in two separate
+    arrays aligned to 64 bytes, so the gate kernels can load a full vector
+    of real parts and a full vector of imaginary parts and do the complex
+    arithmetic lane-wise. The kernels are compiled for AVX2 and AVX-512 and
+    the widest one supported by the CPU is picked on first use, with a plain
+    scalar loop as fallback. Qubit strides shorter than a vector are always
+    handled by the scalar loop.
+*/
+typedef struct qreg_soa{
+    unsigned int size;
+    int num_threads;
+    double *re;
+    double *im;
+}qreg_soa;
+
+typedef enum simd_isa{
+    SIMD_SCALAR,
+    SIMD_AVX2,
+    SIMD_AVX512
+}simd_isa;
+
+/*
+    Initialize a new split storage register with n qubits in state |0..0>.
+    Returns NULL with a message on stderr when the arrays cannot be
+    allocated.
+*/
+qreg_soa* initSoaRegister(size_t n);
+
+/*
+    Copy the amplitudes of a register into a new split storage register
+    and back. Both registers must have the same number of qubits,
+    a sparse register is made dense first. soa_from_qreg returns NULL like
+    initSoaRegister.
+*/
+qreg_soa* soa_from_qreg(qreg *reg);
+void soa_to_qreg(qreg_soa *soa, qreg *reg);
+
+/*
+    Release the amplitude arrays and the register.
+*/
+void free_soa(qreg_soa *soa);
+
+/*
+    Widest instruction set usable on this CPU.
+*/
+simd_isa soa_detect_isa(void);
+
+/*
+    Force the kernels to a given instruction set, e.g. to compare them.
+    Falls back to the detected one when the CPU does not support it.
+*/
+void soa_set_isa(simd_isa isa);
+
+/*
+    Name of the instruction set the kernels currently use.
+*/
+const char* soa_isa_name(void);
+
+/*
+    Apply a 2x2 unitary to the target qubit, same semantics as apply_1q.
+    Diagonal matrices go through the scaling path.
+*/
+void soa_apply_1q(qreg_soa *soa, int target, const double complex m[2][2]);
+
+/*
+    Apply a 2x2 unitary to the target qubit where all qubits in ctrl_mask
+    are |1>, same semantics as apply_controlled_1q. A target in ctrl_mask
+    or qubits out of range leave the state alone with a message on stderr.
+*/
+void soa_apply_controlled_1q(qreg_soa *soa, unsigned long long ctrl_mask, int target, const double complex m[2][2]);
+
+/*
+    Multiply the target |0> half by d0 and the |1> half by d1.
+*/
+void soa_apply_diagonal(qreg_soa *soa, int target, double complex d0, double complex d1);
+
+/*
+    Kernel signatures shared by every instruction set.
+    pair_run applies m to the pairs (k + r, k + r + stride) for r in [0, len),
+    scale_run multiplies the amplitudes k + r for r in [0, len) by c.
+*/
+typedef void (*soa_pair_run)(double *re, double *im, size_t k, size_t stride, size_t len, const double complex m[2][2]);
+typedef void (*soa_scale_run)(double *re, double *im, size_t k, size_t len, double complex c);
+
+void soa_pairs_scalar(double *re, double *im, size_t k, size_t stride, size_t len, const double complex m[2][2])
+{
+    double ar = creal(m[0][0]), ai = cimag(m[0][0]);
+    double br = creal(m[0][1]), bi = cimag(m[0][1]);
+    double cr = creal(m[1][0]), ci = cimag(m[1][0]);
+    double dr = creal(m[1][1]), di = cimag(m[1][1]);
+
+    for (size_t r = k; r < k + len; r++)
+    {
+        double xr = re[r], xi = im[r];
+        double yr = re[r + stride], yi = im[r + stride];
+
+        re[r] = ar*xr - ai*xi + br*yr - bi*yi;
+        im[r] = ar*xi + ai*xr + br*yi + bi*yr;
+        re[r + stride] = cr*xr - ci*xi + dr*yr - di*yi;
+        im[r + stride] = cr*xi + ci*xr + dr*yi + di*yr;
+    }
+}
+
+void soa_scale_scalar(double *re, double *im, size_t k, size_t len, double complex c)
+{
+    double cr = creal(c), ci = cimag(c);
+
+    for (size_t r = k; r < k + len; r++)
+    {
+        double xr = re[r], xi = im[r];
+        re[r] = cr*xr - ci*xi;
+        im[r] = cr*xi + ci*xr;
+    }
+}
+
+#ifdef SIMD_X86
+
+__attribute__((target("avx2,fma")))
+void soa_pairs_avx2(double *re, double *im, size_t k, size_t stride, size_t len, const double complex m[2][2])
+{
+    __m256d ar = _mm256_set1_pd(creal(m[0][0])), ai = _mm256_set1_pd(cimag(m[0][0]));
+    __m256d br = _mm256_set1_pd(creal(m[0][1])), bi = _mm256_set1_pd(cimag(m[0][1]));
+    __m256d cr = _mm256_set1_pd(creal(m[1][0])), ci = _mm256_set1_pd(cimag(m[1][0]));
+    __m256d dr = _mm256_set1_pd(creal(m[1][1])), di = _mm256_set1_pd(cimag(m[1][1]));
+
+    for (size_t r = k; r < k + len; r += 4)
+    {
+        __m256d xr = _mm256_load_pd(re + r), xi = _mm256_load_pd(im + r);
+        __m256d yr = _mm256_load_pd(re + r + stride), yi = _mm256_load_pd(im + r + stride);
+
+        __m256d ur = _mm256_fmsub_pd(ar, xr, _mm256_mul_pd(ai, xi));
+        ur = _mm256_fmadd_pd(br, yr, ur);
+        ur = _mm256_fnmadd_pd(bi, yi, ur);
+        __m256d ui = _mm256_fmadd_pd(ar, xi, _mm256_mul_pd(ai, xr));
+        ui = _mm256_fmadd_pd(br, yi, ui);
+        ui = _mm256_fmadd_pd(bi, yr, ui);
+
+        __m256d vr = _mm256_fmsub_pd(cr, xr, _mm256_mul_pd(ci, xi));
+        vr = _mm256_fmadd_pd(dr, yr, vr);
+        vr = _mm256_fnmadd_pd(di, yi, vr);
+        __m256d vi = _mm256_fmadd_pd(cr, xi, _mm256_mul_pd(ci, xr));
+        vi = _mm256_fmadd_pd(dr, yi, vi);
+        vi = _mm256_fmadd_pd(di, yr, vi);
+
+        _mm256_store_pd(re + r, ur);
+        _mm256_store_pd(im + r, ui);
+        _mm256_store_pd(re + r + stride, vr);
+        _mm256_store_pd(im + r + stride, vi);
+    }
+}
+
+__attribute__((target("avx2,fma")))
+void soa_scale_avx2(double *re, double *im, size_t k, size_t len, double complex c)
+{
+    __m256d cr = _mm256_set1_pd(creal(c)), ci = _mm256_set1_pd(cimag(c));
+
+    for (size_t r = k; r < k + len; r += 4)
+    {
+        __m256d xr = _mm256_load_pd(re + r), xi = _mm256_load_pd(im + r);
+        _mm256_store_pd(re + r, _mm256_fmsub_pd(cr, xr, _mm256_mul_pd(ci, xi)));
+        _mm256_store_pd(im + r, _mm256_fmadd_pd(cr, xi, _mm256_mul_pd(ci, xr)));
+    }
+}
+
+__attribute__((target("avx512f")))
+void soa_pairs_avx512(double *re, double *im, size_t k, size_t stride, size_t len, const double complex m[2][2])
+{
+    __m512d ar = _mm512_set1_pd(creal(m[0][0])), ai = _mm512_set1_pd(cimag(m[0][0]));
+    __m512d br = _mm512_set1_pd(creal(m[0][1])), bi = _mm512_set1_pd(cimag(m[0][1]));
+    __m512d cr = _mm512_set1_pd(creal(m[1][0])), ci = _mm512_set1_pd(cimag(m[1][0]));
+    __m512d dr = _mm512_set1_pd(creal(m[1][1])), di = _mm512_set1_pd(cimag(m[1][1]));
+
+    for (size_t r = k; r < k + len; r += 8)
+    {
+        __m512d xr = _mm512_load_pd(re + r), xi = _mm512_load_pd(im + r);
+        __m512d yr = _mm512_load_pd(re + r + stride), yi = _mm512_load_pd(im + r + stride);
+
+        __m512d ur = _mm512_fmsub_pd(ar, xr, _mm512_mul_pd(ai, xi));
+        ur = _mm512_fmadd_pd(br, yr, ur);
+        ur = _mm512_fnmadd_pd(bi, yi, ur);
+        __m512d ui = _mm512_fmadd_pd(ar, xi, _mm512_mul_pd(ai, xr));
+        ui = _mm512_fmadd_pd(br, yi, ui);
+        ui = _mm512_fmadd_pd(bi, yr, ui);
+
+        __m512d vr = _mm512_fmsub_pd(cr, xr, _mm512_mul_pd(ci, xi));
+        vr = _mm512_fmadd_pd(dr, yr, vr);
+        vr = _mm512_fnmadd_pd(di, yi, vr);
+        __m512d vi = _mm512_fmadd_pd(cr, xi, _mm512_mul_pd(ci, xr));
+        vi = _mm512_fmadd_pd(dr, yi, vi);
+        vi = _mm512_fmadd_pd(di, yr, vi);
+
+        _mm512_store_pd(re + r, ur);
+        _mm512_store_pd(im + r, ui);
+        _mm512_store_pd(re + r + stride, vr);
+        _mm512_store_pd(im + r + stride, vi);
+    }
+}
+
+__attribute__((target("avx512f")))
+void soa_scale_avx512(double *re, double *im, size_t k, size_t len, double complex c)
+{
+    __m512d cr = _mm512_set1_pd(creal(c)), ci = _mm512_set1_pd(cimag(c));
+
+    for (size_t r = k; r < k + len; r += 8)
+    {
+        __m512d xr = _mm512_load_pd(re + r), xi = _mm512_load_pd(im + r);
+        _mm512_store_pd(re + r, _mm512_fmsub_pd(cr, xr, _mm512_mul_pd(ci, xi)));
+        _mm512_store_pd(im + r, _mm512_fmadd_pd(cr, xi, _mm512_mul_pd(ci, xr)));
+    }
+}
+
+#endif
+
+//Kernels in use and the number of doubles they process per step.
+static simd_isa soa_isa = SIMD_SCALAR;
+static bool soa_isa_selected = false;
+static soa_pair_run soa_pairs = soa_pairs_scalar;
+static soa_scale_run soa_scale = soa_scale_scalar;
+static size_t soa_width = 1;
+
+simd_isa soa_detect_isa(void)
+{
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+    {
+        return SIMD_AVX512;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    {
+        return SIMD_AVX2;
+    }
+#endif
+    return SIMD_SCALAR;
+}
+
+void soa_set_isa(simd_isa isa)
+{
+    simd_isa supported = soa_detect_isa();
+    if (isa > supported)
+    {
+        isa = supported;
+    }
+
+    soa_isa = isa;
+    soa_isa_selected = true;
+    soa_pairs = soa_pairs_scalar;
+    soa_scale = soa_scale_scalar;
+    soa_width = 1;
+
+#ifdef SIMD_X86
+    if (isa == SIMD_AVX2)
+    {
+        soa_pairs = soa_pairs_avx2;
+        soa_scale = soa_scale_avx2;
+        soa_width = 4;
+    }
+    if (isa == SIMD_AVX512)
+    {
+        soa_pairs = soa_pairs_avx512;
+        soa_scale = soa_scale_avx512;
+        soa_width = 8;
+    }
+#endif
+}
+
+const char* soa_isa_name(void)
+{
+    static const char *names[] = {"scalar", "AVX2", "AVX-512"};
+    if (!soa_isa_selected)
+    {
+        soa_set_isa(soa_detect_isa());
+    }
+    return names[soa_isa];
+}
+
+/*
+    Kernels to use for runs of len amplitudes. Runs that are not a
+    multiple of the vector width take the scalar loop.
+*/
+soa_pair_run soa_pairs_for(size_t len)
+{
+    if (!soa_isa_selected)
+    {
+        soa_set_isa(soa_detect_isa());
+    }
+    return (len % soa_width == 0) ? soa_pairs : soa_pairs_scalar;
+}
+
+soa_scale_run soa_scale_for(size_t len)
+{
+    if (!soa_isa_selected)
+    {
+        soa_set_isa(soa_detect_isa());
+    }
+    return (len % soa_width == 0) ? soa_scale : soa_scale_scalar;
+}
+
+/*
+    Allocate an array of count doubles through alloc_amplitudes, NULL with
+    a message on stderr when it fails.
+*/
+double* soa_alloc(size_t count)
+{
+    return (double*) alloc_amplitudes(count * sizeof(double));
+}
+
+qreg_soa* initSoaRegister(size_t n)
+{
+    size_t size = (size_t)1 << n;
+    double *re = soa_alloc(size), *im = re != NULL ? soa_alloc(size) : NULL;
+    if (im == NULL)
+    {
+        free(re);
+        return NULL;
+    }
+
+    qreg_soa *soa = (qreg_soa*) malloc(sizeof(qreg_soa));
+
+    soa->size = n;
+#ifdef _OPENMP
+    soa->num_threads = omp_get_max_threads();
+#else
+    soa->num_threads = 1;
+#endif
+    soa->re = re;
+    soa->im = im;
+
+    //First touch with the kernel partition, like initQuRegister.
+    PARALLEL_FOR(soa, size, 1)
+    for (size_t i = 0; i < size; i++)
+    {
+        re[i] = 0;
+        im[i] = 0;
+    }
+    re[0] = 1;
+
+    return soa;
+}
+
+qreg_soa* soa_from_qreg(qreg *reg)
+{
+    make_dense(reg);
+    settle_layout(reg);
+    qreg_soa *soa = initSoaRegister(reg->size);
+    if (soa == NULL)
+    {
+        return NULL;
+    }
+    size_t size = reg_states(reg);
+    soa->num_threads = reg->num_threads;
+
+    for (size_t i = 0; i < size; i++)
+    {
+        soa->re[i] = creal(reg->matrix[i]);
+        soa->im[i] = cimag(reg->matrix[i]);
+    }
+    return soa;
+}
+
+void soa_to_qreg(qreg_soa *soa, qreg *reg)
+{
+    make_dense(reg);
+    settle_layout(reg);
+    mark_dirty(reg);
+    size_t size = reg_states(reg);
+
+    for (size_t i = 0; i < size; i++)
+    {
+        reg->matrix[i] = soa->re[i] + soa->im[i]*j;
+    }
+}
+
+void free_soa(qreg_soa *soa)
+{
+    free(soa->re);
+    free(soa->im);
+    free(soa);
+}
+
+void soa_apply_diagonal(qreg_soa *soa, int target, double complex d0, double complex d1)
+{
+    size_t size = (size_t)1 << soa->size;
+    size_t stride = (size_t)1 << target;
+    size_t blocks = size >> (target + 1);
+    size_t chunk = stride < CONTROLLED_RUN_LIMIT ? stride : CONTROLLED_RUN_LIMIT;
+    size_t chunks = stride / chunk;
+    soa_scale_run scale = soa_scale_for(chunk);
+    double *re = soa->re, *im = soa->im;
+
+    //Halves are cut into chunks so high targets still spread over the threads.
+    //A half with a factor of 1 is not touched at all.
+    PARALLEL_FOR(soa, size, 2)
+    for (size_t b = 0; b < blocks; b++)
+    {
+        for (size_t c = 0; c < chunks; c++)
+        {
+            size_t k = (b << (target + 1)) + c * chunk;
+            if (d0 != 1)
+            {
+                scale(re, im, k, chunk, d0);
+            }
+            if (d1 != 1)
+            {
+                scale(re, im, k + stride, chunk, d1);
+            }
+        }
+    }
+}
+
+void soa_apply_1q(qreg_soa *soa, int target, const double complex m[2][2])
+{
+    if (m[0][1] == 0 && m[1][0] == 0)
+    {
+        soa_apply_diagonal(soa, target, m[0][0], m[1][1]);
+        return;
+    }
+
+    size_t size = (size_t)1 << soa->size;
+    size_t stride = (size_t)1 << target;
+    size_t blocks = size >> (target + 1);
+    size_t chunk = stride < CONTROLLED_RUN_LIMIT ? stride : CONTROLLED_RUN_LIMIT;
+    size_t chunks = stride / chunk;
+    soa_pair_run pairs = soa_pairs_for(chunk);
+    double *re = soa->re, *im = soa->im;
+
+    PARALLEL_FOR(soa, size, 2)
+    for (size_t b = 0; b < blocks; b++)
+    {
+        for (size_t c = 0; c < chunks; c++)
+        {
+            pairs(re, im, (b << (target + 1)) + c * chunk, stride, chunk, m);
+        }
+    }
+}
+
+void soa_apply_controlled_1q(qreg_soa *soa, unsigned long long ctrl_mask, int target, const double complex m[2][2])
+{
+    if (target < 0 || target >= (int)soa->size || ((ctrl_mask >> target) & 1)
+        || (soa->size < 64 && (ctrl_mask >> soa->size) != 0))
+    {
+        fprintf(stderr, "Gate on qubit %d with controls %llx is out of range or controls its own target.\n", target, ctrl_mask);
+        return;
+    }
+
+    size_t stride = (size_t)1 << target;
+    bool diagonal = (m[0][1] == 0 && m[1][0] == 0);
+    double *re = soa->re, *im = soa->im;
+
+    int fixed[64];
+    int count = 0;
+    unsigned long long mask = ctrl_mask | ((unsigned long long)1 << target);
+    for (int q = 0; q < (int)soa->size; q++)
+    {
+        if (mask & ((unsigned long long)1 << q))
+        {
+            fixed[count++] = q;
+        }
+    }
+
+    //Same chunking as apply_controlled_1q.
+    size_t run = (size_t)1 << __builtin_ctzll(mask);
+    size_t pairs = (size_t)1 << (soa->size - count);
+    run = run < CONTROLLED_RUN_LIMIT ? run : CONTROLLED_RUN_LIMIT;
+    size_t chunks = pairs / run;
+    soa_pair_run pair_run = soa_pairs_for(run);
+    soa_scale_run scale_run = soa_scale_for(run);
+
+    PARALLEL_FOR(soa, (size_t)1 << soa->size, 1)
+    for (size_t c = 0; c < chunks; c++)
+    {
+        size_t base = deposit_bits(c * run, fixed, count) | ctrl_mask;
+
+        if (diagonal)
+        {
+            if (m[0][0] != 1)
+            {
+                scale_run(re, im, base, run, m[0][0]);
+            }
+            if (m[1][1] != 1)
+            {
+                scale_run(re, im, base + stride, run, m[1][1]);
+            }
+        }
+        else
+        {
+            pair_run(re, im, base, stride, run, m);
+        }
+    }
+}
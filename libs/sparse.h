@@ -0,0 +1,392 @@
+#pragma once
+#include "qureg.h"
+
+/*
+    Sparse amplitude storage.
+
+    A register made with initSparseRegister keeps only its nonzero amplitudes,
+    in an open addressing hash map keyed by basis index. Circuits that stay
+    on a handful of basis states (classical oracles, reversible arithmetic)
+    can then use up to 63 qubits, far past what a 2^n vector allows.
+
+    The gate kernels in kernels.h dispatch here while reg->sparse is set.
+    Every gate scatters the current map into a new one and drops amplitudes
+    that cancelled. Once more than 1/SPARSE_FILL_DIVISOR of the 2^n states
+    are nonzero the register turns dense, if it has at most
+    SPARSE_DENSE_QUBITS qubits.
+*/
+
+#define SPARSE_EMPTY (~0ULL)
+
+#ifndef SPARSE_FILL_DIVISOR
+#define SPARSE_FILL_DIVISOR 8
+#endif
+
+#ifndef SPARSE_DENSE_QUBITS
+#define SPARSE_DENSE_QUBITS 30
+#endif
+
+//Squared magnitude below which an amplitude counts as cancelled.
+#define SPARSE_EPSILON 1e-30
+
+struct sparse_map{
+    unsigned long long *keys;
+    double complex *values;
+    size_t capacity;
+    size_t count;
+};
+
+/*
+    Create a sparse register of n qubits (at most 63) in state |0...0>.
+*/
+qreg* initSparseRegister(size_t n);
+
+/*
+    Move a sparse register to the dense 2^n state vector.
+    The register stays sparse if the vector cannot be allocated.
+*/
+void make_dense(qreg *reg);
+
+/*
+    Move a dense register to sparse storage, keeping its nonzero amplitudes.
+*/
+void make_sparse(qreg *reg);
+
+/*
+    Sparse counterparts of apply_controlled_1q, apply_kq and kernel_swap_bits,
+    with the same arguments.
+*/
+void sparse_apply_1q(qreg *reg, unsigned long long ctrl_mask, int target, const double complex m[2][2]);
+void sparse_apply_kq(qreg *reg, const int *qubits, int k, const double complex *m);
+void sparse_swap_bits(qreg *reg, const int *a, const int *b, int k);
+
+/*
+    Keep the amplitudes whose index matches value on the bits of mask,
+    scaled by norm. Used by measurement.
+*/
+void sparse_collapse(qreg *reg, unsigned long long mask, unsigned long long value, double norm);
+
+sparse_map* sparse_new(size_t count)
+{
+    sparse_map *map = (sparse_map*) malloc(sizeof(sparse_map));
+    map->capacity = 16;
+    while (map->capacity < 2 * count)
+    {
+        map->capacity <<= 1;
+    }
+    map->count = 0;
+    map->keys = (unsigned long long*) malloc(map->capacity * sizeof(unsigned long long));
+    map->values = (double complex*) malloc(map->capacity * sizeof(double complex));
+    memset(map->keys, 0xff, map->capacity * sizeof(unsigned long long));
+    return map;
+}
+
+void sparse_free(sparse_map *map)
+{
+    free(map->keys);
+    free(map->values);
+    free(map);
+}
+
+/*
+    Slot holding key, or the empty slot where it would be inserted.
+*/
+size_t sparse_find(const sparse_map *map, unsigned long long key)
+{
+    size_t mask = map->capacity - 1;
+    size_t s = (key * 0x9e3779b97f4a7c15ULL) >> (64 - __builtin_ctzll(map->capacity));
+
+    while (map->keys[s] != SPARSE_EMPTY && map->keys[s] != key)
+    {
+        s = (s + 1) & mask;
+    }
+    return s;
+}
+
+void sparse_add(sparse_map *map, unsigned long long key, double complex value);
+
+void sparse_grow(sparse_map *map)
+{
+    sparse_map *bigger = sparse_new(map->capacity);
+
+    for (size_t s = 0; s < map->capacity; s++)
+    {
+        if (map->keys[s] != SPARSE_EMPTY)
+        {
+            sparse_add(bigger, map->keys[s], map->values[s]);
+        }
+    }
+    free(map->keys);
+    free(map->values);
+    *map = *bigger;
+    free(bigger);
+}
+
+/*
+    Add value to the amplitude of key, inserting it if needed.
+    The load factor is kept at one half.
+*/
+void sparse_add(sparse_map *map, unsigned long long key, double complex value)
+{
+    if (2 * (map->count + 1) > map->capacity)
+    {
+        sparse_grow(map);
+    }
+
+    size_t s = sparse_find(map, key);
+    if (map->keys[s] == SPARSE_EMPTY)
+    {
+        map->keys[s] = key;
+        map->values[s] = value;
+        map->count++;
+    }
+    else
+    {
+        map->values[s] += value;
+    }
+}
+
+double complex sparse_get(const sparse_map *map, unsigned long long key)
+{
+    size_t s = sparse_find(map, key);
+    return map->keys[s] == SPARSE_EMPTY ? 0 : map->values[s];
+}
+
+qreg* initSparseRegister(size_t n)
+{
+    if (n > 63)
+    {
+        fprintf(stderr, "Sparse registers hold at most 63 qubits, %zu requested.\n", n);
+        return NULL;
+    }
+
+    qreg *new_register = initRegisterFields(n);
+    new_register->sparse = sparse_new(1);
+    sparse_add(new_register->sparse, 0, 1);
+    return new_register;
+}
+
+void make_dense(qreg *reg)
+{
+    if (reg->sparse == NULL)
+    {
+        return;
+    }
+
+    size_t size = (size_t)1 << reg->size;
+    amplitude *matrix = (amplitude*) alloc_amplitudes(size * sizeof(amplitude));
+    if (matrix == NULL)
+    {
+        fprintf(stderr, "The register stays sparse.\n");
+        return;
+    }
+
+    //First touch with the kernel partition, like initQuRegister.
+    PARALLEL_FOR(reg, size, 1)
+    for (size_t i = 0; i < size; i++)
+    {
+        matrix[i] = 0;
+    }
+
+    sparse_map *map = reg->sparse;
+    for (size_t s = 0; s < map->capacity; s++)
+    {
+        if (map->keys[s] != SPARSE_EMPTY)
+        {
+            matrix[map->keys[s]] = map->values[s];
+        }
+    }
+    sparse_free(map);
+    reg->sparse = NULL;
+    reg->matrix = matrix;
+}
+
+void make_sparse(qreg *reg)
+{
+    if (reg->sparse != NULL)
+    {
+        return;
+    }
+
+    size_t size = (size_t)1 << reg->size;
+    size_t count = 0;
+    for (size_t i = 0; i < size; i++)
+    {
+        count += reg->matrix[i] != 0;
+    }
+
+    sparse_map *map = sparse_new(count);
+    for (size_t i = 0; i < size; i++)
+    {
+        if (reg->matrix[i] != 0)
+        {
+            sparse_add(map, i, reg->matrix[i]);
+        }
+    }
+    release_amplitudes(reg);
+    reg->sparse = map;
+}
+
+/*
+    Install the map a gate produced. Cancelled amplitudes are dropped, and the
+    register turns dense once the map is too full to pay for itself.
+*/
+void sparse_commit(qreg *reg, sparse_map *out)
+{
+    size_t cancelled = 0;
+    for (size_t s = 0; s < out->capacity; s++)
+    {
+        if (out->keys[s] != SPARSE_EMPTY)
+        {
+            double complex a = out->values[s];
+            cancelled += creal(a) * creal(a) + cimag(a) * cimag(a) < SPARSE_EPSILON;
+        }
+    }
+
+    if (cancelled > 0)
+    {
+        sparse_map *kept = sparse_new(out->count - cancelled);
+        for (size_t s = 0; s < out->capacity; s++)
+        {
+            double complex a = out->values[s];
+            if (out->keys[s] != SPARSE_EMPTY && creal(a) * creal(a) + cimag(a) * cimag(a) >= SPARSE_EPSILON)
+            {
+                sparse_add(kept, out->keys[s], a);
+            }
+        }
+        sparse_free(out);
+        out = kept;
+    }
+
+    sparse_free(reg->sparse);
+    reg->sparse = out;
+
+    if (reg->size <= SPARSE_DENSE_QUBITS && out->count * SPARSE_FILL_DIVISOR > ((size_t)1 << reg->size))
+    {
+        make_dense(reg);
+    }
+}
+
+void sparse_apply_1q(qreg *reg, unsigned long long ctrl_mask, int target, const double complex m[2][2])
+{
+    sparse_map *map = reg->sparse;
+    sparse_map *out = sparse_new(map->count);
+    unsigned long long t = 1ULL << target;
+
+    for (size_t s = 0; s < map->capacity; s++)
+    {
+        unsigned long long key = map->keys[s];
+        if (key == SPARSE_EMPTY)
+        {
+            continue;
+        }
+
+        double complex a = map->values[s];
+        if ((key & ctrl_mask) != ctrl_mask)
+        {
+            sparse_add(out, key, a);
+            continue;
+        }
+
+        //Column bit of the input, each nonzero row entry feeds one output.
+        int bit = (key & t) != 0;
+        if (m[0][bit] != 0)
+        {
+            sparse_add(out, key & ~t, m[0][bit] * a);
+        }
+        if (m[1][bit] != 0)
+        {
+            sparse_add(out, key | t, m[1][bit] * a);
+        }
+    }
+    sparse_commit(reg, out);
+}
+
+void sparse_apply_kq(qreg *reg, const int *qubits, int k, const double complex *m)
+{
+    size_t dim = (size_t)1 << k;
+    unsigned long long offsets[dim];
+    unsigned long long qmask = 0;
+    sparse_map *map = reg->sparse;
+    sparse_map *out = sparse_new(map->count);
+
+    for (size_t l = 0; l < dim; l++)
+    {
+        offsets[l] = 0;
+        for (int i = 0; i < k; i++)
+        {
+            if (l & ((size_t)1 << i))
+            {
+                offsets[l] |= 1ULL << qubits[i];
+            }
+        }
+    }
+    qmask = offsets[dim - 1];
+
+    for (size_t s = 0; s < map->capacity; s++)
+    {
+        unsigned long long key = map->keys[s];
+        if (key == SPARSE_EMPTY)
+        {
+            continue;
+        }
+
+        size_t col = 0;
+        for (int i = 0; i < k; i++)
+        {
+            col |= (size_t)((key >> qubits[i]) & 1) << i;
+        }
+
+        unsigned long long base = key & ~qmask;
+        for (size_t row = 0; row < dim; row++)
+        {
+            if (m[row * dim + col] != 0)
+            {
+                sparse_add(out, base | offsets[row], m[row * dim + col] * map->values[s]);
+            }
+        }
+    }
+    sparse_commit(reg, out);
+}
+
+void sparse_swap_bits(qreg *reg, const int *a, const int *b, int k)
+{
+    sparse_map *map = reg->sparse;
+    sparse_map *out = sparse_new(map->count);
+
+    for (size_t s = 0; s < map->capacity; s++)
+    {
+        unsigned long long key = map->keys[s];
+        if (key == SPARSE_EMPTY)
+        {
+            continue;
+        }
+
+        for (int t = 0; t < k; t++)
+        {
+            if (((key >> a[t]) ^ (key >> b[t])) & 1)
+            {
+                key ^= (1ULL << a[t]) | (1ULL << b[t]);
+            }
+        }
+        sparse_add(out, key, map->values[s]);
+    }
+    sparse_free(map);
+    reg->sparse = out;
+}
+
+void sparse_collapse(qreg *reg, unsigned long long mask, unsigned long long value, double norm)
+{
+    sparse_map *map = reg->sparse;
+    sparse_map *out = sparse_new(1);
+
+    for (size_t s = 0; s < map->capacity; s++)
+    {
+        if (map->keys[s] != SPARSE_EMPTY && (map->keys[s] & mask) == value)
+        {
+            sparse_add(out, map->keys[s], map->values[s] * norm);
+        }
+    }
+    sparse_free(map);
+    reg->sparse = out;
+}
@@ -0,0 +1,65 @@
+#include "../libs/checkpoint.h"
+
+/*
+    Checkpoint clean flag test.
+
+    A mapped register is checkpointed, then changed by one operation, and
+    restore_register must refuse the state file it leaves behind. Each
+    operation gets a fresh file, the register is not closed first, as if
+    the run was killed there. Exits with 1 on failure.
+
+    Build: gcc -O2 -o test_checkpoint tests/test_checkpoint.c -lm
+    Usage: ./test_checkpoint
+*/
+
+#define TEST_STATE "test_checkpoint.state"
+
+/*
+    Checkpoint a 4 qubit register, run operation on it and report whether
+    the file could still be restored.
+*/
+bool restorable_after(int operation)
+{
+    qreg *reg = initMappedRegister(4, TEST_STATE);
+    int qubits[] = {0, 1, 2, 3};
+    H(reg, qubits, 4);
+    checkpoint(reg);
+
+    switch (operation)
+    {
+        case 1: X(reg, qubits, 1); break;
+        case 2: measure(reg, 2); break;
+        case 3: measure_all(reg); break;
+        case 4: SWAP(reg, 0, 3); get_amplitude(reg, 1); break;
+    }
+
+    qreg *restored = restore_register(TEST_STATE);
+    bool ok = restored != NULL;
+    if (restored != NULL)
+    {
+        free_qreg(restored);
+    }
+    free_qreg(reg);
+    remove(TEST_STATE);
+    return ok;
+}
+
+int main(void)
+{
+    const char *names[] = {"nothing", "X", "measure", "measure_all", "SWAP then a read"};
+    int failed = 0;
+
+    //Only the untouched checkpoint may be restored.
+    for (int operation = 0; operation < 5; operation++)
+    {
+        bool expected = operation == 0;
+        if (restorable_after(operation) != expected)
+        {
+            printf("FAIL: restore after %s %s\n", names[operation], expected ? "refused" : "accepted");
+            failed++;
+        }
+    }
+
+    printf("%s\n", failed ? "FAILED" : "passed");
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,67 @@
+#include "../libs/operations.h"
+
+/*
+    Malformed circuit file test.
+
+    A CNOT and a controlled Z are saved, then each record is patched so
+    that its target is also its control. replay_circuit must reject both
+    files instead of running the gate. Exits with 1 on failure.
+
+    Build: gcc -O2 -o test_circuit tests/test_circuit.c -lm
+    Usage: ./test_circuit
+*/
+
+/*
+    Save a two qubit circuit holding the single controlled gate of gate,
+    set its last target byte to qubit 0 and replay it.
+*/
+bool replay_patched(const char *path, char gate)
+{
+    qreg *reg = initQuRegister(2);
+    int target = 1;
+    if (gate == '+')
+    {
+        CNOT(reg, 0, &target, 1);
+    }
+    else
+    {
+        CZ(reg, 0, &target, 1);
+    }
+    save_circuit(reg, path);
+    free_qreg(reg);
+
+    //The target is the last byte of either record.
+    FILE *file = fopen(path, "r+b");
+    fseek(file, -1, SEEK_END);
+    fputc(0, file);
+    fclose(file);
+
+    circuit_file *circuit = load_circuit(path);
+    qreg *replay = initQuRegister(2);
+    bool ok = circuit != NULL && replay_circuit(replay, circuit);
+    if (circuit != NULL)
+    {
+        free_circuit(circuit);
+    }
+    free_qreg(replay);
+    remove(path);
+    return ok;
+}
+
+int main(void)
+{
+    int failed = 0;
+    const char gates[] = {'+', 'Z'};
+
+    for (int g = 0; g < 2; g++)
+    {
+        if (replay_patched("test_circuit.qc", gates[g]))
+        {
+            printf("FAIL: replayed a %c record whose target is its control\n", gates[g]);
+            failed++;
+        }
+    }
+
+    printf("%s\n", failed ? "FAILED" : "passed");
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,65 @@
+#include "../libs/qubit.h"
+#include "../libs/qureg.h"
+#include "../libs/sparse.h"
+#include "../libs/kernels.h"
+#include "../libs/circuit.h"
+#include "../libs/operations.h"
+#include "../libs/fusion.h"
+#include "../libs/measure.h"
+#include "../libs/simd.h"
+#include "../libs/batch.h"
+#include "../libs/checkpoint.h"
+#include "../libs/qasm.h"
+#include "../libs/noise.h"
+#include "../libs/density.h"
+#include "../libs/pauli.h"
+#include "../libs/distributed.h"
+#include "../libs/diagonal.h"
+#include "../libs/qft.h"
+
+/*
+    Header combination test.
+
+    Every header of the library is included into this one translation
+    unit, which only compiles when each of them is guarded. A few of the
+    features are then used together: a QFT, a Z gate through diagonal.h and
+    the inverse QFT, after a phase flip channel of probability zero, and
+    the Pauli expectation of the result. Exits with 1 on failure.
+
+    Build: gcc -O2 -o test_headers tests/test_headers.c -lm
+    Usage: ./test_headers
+*/
+
+int main(void)
+{
+    int qubits[] = {0, 1, 2};
+    qreg *reg = initQuRegister(3);
+    set_seed(reg, 7);
+
+    //Z on qubit 0 multiplies the transform of |0> by exp(2 pi i 4 y / 8),
+    //which makes it the transform of |4>.
+    phase_flip(reg, 0, 0);
+    QFT(reg, qubits, 3, false);
+    diag_accumulator *acc = new_diagonal(3);
+    diagonal_Z(acc, 0);
+    apply_diagonal(reg, acc);
+    free_diagonal(acc);
+    QFT(reg, qubits, 3, true);
+
+    bool ok = true;
+    for (size_t i = 0; i < reg_states(reg); i++)
+    {
+        ok = ok && fabs(cabs(get_amplitude(reg, i)) - (i == 4)) < 1e-6;
+    }
+
+    //Qubit 2 is |1> and qubit 0 is |0>.
+    pauli_sum *sum = new_pauli_sum(3);
+    add_pauli_term(sum, 1, "Z2");
+    add_pauli_term(sum, 0.5, "Z0");
+    ok = ok && fabs(expectation(reg, sum) + 0.5) < 1e-6;
+    free_pauli_sum(sum);
+    free_qreg(reg);
+
+    printf("%s\n", ok ? "passed" : "FAILED");
+    return ok ? 0 : 1;
+}
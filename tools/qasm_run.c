@@ -0,0 +1,80 @@
+#include "../libs/qasm.h"
+
+/*
+    OpenQASM 2.0 runner.
+
+    Parses a .qasm file, runs it on a dense register with gate fusion and
+    prints the sampled counts of its classical bits, highest bit first,
+    one outcome per line.
+
+    Build: gcc -O2 -o qasm_run tools/qasm_run.c -lm
+    Usage: ./qasm_run file.qasm [shots] [seed]
+*/
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s file.qasm [shots] [seed]\n", argv[0]);
+        return 1;
+    }
+    unsigned long shots = argc > 2 ? strtoul(argv[2], NULL, 10) : 1024;
+
+    qasm_program *program = load_qasm(argv[1]);
+    if (program == NULL)
+    {
+        return 1;
+    }
+
+    qreg *reg = qasm_register(program);
+    if (reg == NULL)
+    {
+        free_qasm(program);
+        return 1;
+    }
+    if (argc > 3)
+    {
+        set_seed(reg, strtoull(argv[3], NULL, 10));
+    }
+    flush_operations(reg);
+
+    //Without measurements every qubit is read out.
+    int bits = program->clbits > 0 ? program->clbits : program->qubits;
+    if (bits > MAX_DENSE_QUBITS)
+    {
+        fprintf(stderr, "The counts of %d classical bits do not fit in memory, at most %d are supported.\n", bits, MAX_DENSE_QUBITS);
+        free_qreg(reg);
+        free_qasm(program);
+        return 1;
+    }
+    size_t outcomes = (size_t)1 << bits;
+    unsigned int *counts = (unsigned int*) calloc(outcomes, sizeof(unsigned int));
+    if (counts == NULL)
+    {
+        fprintf(stderr, "Not enough memory for the counts of %zu outcomes.\n", outcomes);
+        free_qreg(reg);
+        free_qasm(program);
+        return 1;
+    }
+    qasm_sample(program, reg, shots, counts);
+
+    char line[QASM_MAX_BITS + 1];
+    for (size_t i = 0; i < outcomes; i++)
+    {
+        if (counts[i] == 0)
+        {
+            continue;
+        }
+        for (int b = 0; b < bits; b++)
+        {
+            line[b] = (i >> (bits - 1 - b)) & 1 ? '1' : '0';
+        }
+        line[bits] = 0;
+        printf("%s %u\n", line, counts[i]);
+    }
+
+    free(counts);
+    free_qreg(reg);
+    free_qasm(program);
+    return 0;
+}